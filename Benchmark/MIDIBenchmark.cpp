@@ -0,0 +1,1291 @@
+/*********************************************************************
+ * MIDIBenchmark.cpp - Benchmarks for the hot paths of the MIDI
+ *                     classes.
+ *
+ * Usage: MIDIBenchmark [OutDeviceId [InDeviceId]]
+ *
+ * With no arguments only the benchmarks that need no MIDI devices
+ * are run, so the program can be used on a machine with no MIDI
+ * hardware at all. Given an output device, long messages are sent
+ * to it with and without a header pool, and its pacing queue is
+ * filled through the classes that send to it for their callers, to
+ * check that none of them lets the failure escape, and the order
+ * the thinner sends held values in is checked; the software
+ * synthesizer that comes with Windows will do. Given an input
+ * device as well, messages sent to the output are timed until they
+ * reach a receiver on the input, so the two must be connected by a
+ * cable or by a virtual loopback driver.
+ *
+ * Build it with the library's .cpp files and link to winmm.lib.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include <windows.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <exception>
+#include "../midi.h"
+#include "../SPSCRing.h"
+#include "../MIDIInDevice.h"
+#include "../MIDIOutDevice.h"
+#include "../MIDIParser.h"
+#include "../MIDIRouter.h"
+#include "../MIDISequencer.h"
+#include "../MIDIThinner.h"
+#include "../MIDIFile.h"
+#include "../MIDIStats.h"
+#include "../MIDICapture.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CSPSCRing;
+using midi::CShortMsg;
+using midi::CTimedMsg;
+using midi::CMIDIInDevice;
+using midi::CMIDIOutDevice;
+using midi::CMIDIOutQueueFull;
+using midi::CMIDIReceiver;
+using midi::CMIDITimeStamp;
+using midi::CMIDIParser;
+using midi::CMIDIRouteNode;
+using midi::CMIDIInputNode;
+using midi::CMIDIFilterNode;
+using midi::CMIDITransposeNode;
+using midi::CMIDIChannelMapNode;
+using midi::CMIDIOutputNode;
+using midi::CMIDISequencer;
+using midi::CMIDIThinner;
+using midi::CMIDIFile;
+using midi::CMIDIFileCursor;
+using midi::CMIDIFileEvent;
+using midi::CMIDIStats;
+using midi::CMIDIStatsSnapshot;
+using midi::CMIDICapture;
+using midi::CMIDICaptureEvent;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Number of messages for the throughput benchmarks
+const DWORD MSG_COUNT = 4000000;
+
+// Number of messages handled at a time by the throughput benchmarks
+const std::size_t BLOCK_SIZE = 4096;
+
+// Capacity of the ring in the queue benchmarks, the same as the
+// default header queue of a device
+const std::size_t RING_CAPACITY = 64;
+
+// Number of bytes parsed
+const DWORD STREAM_SIZE = 1 << 20;
+
+// Size of the pieces the stream is parsed in, the size of a typical
+// system exclusive buffer
+const DWORD PIECE_SIZE = 256;
+
+// Number of tracks and notes per track in the Standard MIDI File
+const std::size_t FILE_TRACK_COUNT = 16;
+const DWORD FILE_NOTE_COUNT = 50000;
+
+// Number of long messages sent to the output device
+const DWORD LONG_MSG_COUNT = 5000;
+
+// Number of headers in the pool for the long message benchmark
+const DWORD POOL_HEADER_COUNT = 64;
+
+// Number of messages timed through the loopback
+const DWORD LOOPBACK_MSG_COUNT = 2000;
+
+// Milliseconds to wait for a message to come back
+const DWORD LOOPBACK_TIMEOUT = 1000;
+
+// Pacing rate and queue capacity that fill up straight away
+const DWORD QUEUE_FULL_RATE = 10;
+const std::size_t QUEUE_FULL_CAPACITY = 4;
+
+// Number of messages sent to the full queue by each class
+const DWORD QUEUE_FULL_MSG_COUNT = 64;
+
+// Milliseconds given to the sequencer, and the thinner's window
+const DWORD QUEUE_FULL_WAIT = 200;
+
+
+//--------------------------------------------------------------------
+// Benchmark helpers
+//--------------------------------------------------------------------
+
+
+namespace
+{
+    // Results are added here so that the work is not optimised away
+    volatile DWORD Sink = 0;
+
+
+    // Gets seconds from counter ticks
+    double ToSeconds(LONGLONG Ticks)
+    {
+        return static_cast<double>(Ticks) /
+               static_cast<double>(CMIDIInDevice::GetCounterFrequency());
+    }
+
+
+    // Prints the cost of Count operations that took Ticks
+    void PrintRate(const char *Name, DWORD Count, LONGLONG Ticks)
+    {
+        double Seconds = ToSeconds(Ticks);
+
+        std::printf("  %-36s %9.1f ns/op %9.2f M/s\n", Name,
+                    Seconds * 1e9 / Count, Count / Seconds / 1e6);
+    }
+
+
+    // Prints the median, the 99th percentile and the largest of a
+    // histogram of times, as the upper bounds of their buckets
+    void PrintTimes(const char *Name, const DWORD *Times)
+    {
+        DWORD Total = 0;
+
+        for(int i = 0; i < CMIDIStats::BUCKET_COUNT; i++)
+        {
+            Total += Times[i];
+        }
+
+        if(Total == 0)
+        {
+            std::printf("  %-36s no samples\n", Name);
+            return;
+        }
+
+        // Upper bounds of the median, 99th percentile and largest
+        const double Fractions[] = { 0.5, 0.99, 1.0 };
+        DWORD Bounds[3] = { 0, 0, 0 };
+        DWORD Seen = 0;
+        int Next = 0;
+
+        for(int i = 0; i < CMIDIStats::BUCKET_COUNT && Next < 3; i++)
+        {
+            Seen += Times[i];
+
+            while(Next < 3 && Seen >= Fractions[Next] * Total)
+            {
+                Bounds[Next] = 1UL << i;
+                Next++;
+            }
+        }
+
+        std::printf("  %-36s 50%% <%lu us, 99%% <%lu us, "
+                    "max <%lu us\n", Name, Bounds[0], Bounds[1],
+                    Bounds[2]);
+    }
+
+
+    // Writes big-endian numbers
+    unsigned char *PutWord(unsigned char *Data, WORD Number)
+    {
+        *Data++ = static_cast<unsigned char>(Number >> 8);
+        *Data++ = static_cast<unsigned char>(Number);
+
+        return Data;
+    }
+
+    unsigned char *PutDWord(unsigned char *Data, DWORD Number)
+    {
+        Data = PutWord(Data, static_cast<WORD>(Number >> 16));
+
+        return PutWord(Data, static_cast<WORD>(Number));
+    }
+
+
+    //----------------------------------------------------------------
+    // CCountingReceiver
+    //
+    // Counts what it receives, the least a receiver can do.
+    //----------------------------------------------------------------
+
+
+    class CCountingReceiver : public CMIDIReceiver
+    {
+    public:
+        CCountingReceiver() :
+        MsgCount(0),
+        ByteCount(0),
+        ErrorCount(0)
+        {}
+
+        void ReceiveMsg(DWORD Msg, DWORD)
+        {
+            MsgCount++;
+            Sink += Msg;
+        }
+
+        void ReceiveMsg(LPSTR, DWORD BytesRecorded, DWORD)
+        {
+            MsgCount++;
+            ByteCount += BytesRecorded;
+        }
+
+        void OnError(DWORD, DWORD)
+        { ErrorCount++; }
+
+        void OnError(LPSTR, DWORD, DWORD)
+        { ErrorCount++; }
+
+        using CMIDIReceiver::ReceiveMsg;
+
+        DWORD MsgCount;
+        DWORD ByteCount;
+        DWORD ErrorCount;
+    };
+
+
+    //----------------------------------------------------------------
+    // CCountingNode
+    //
+    // The end of a routing graph. Counts what reaches it.
+    //----------------------------------------------------------------
+
+
+    class CCountingNode : public CMIDIRouteNode
+    {
+    public:
+        CCountingNode() : MsgCount(0) {}
+
+        void RouteMsg(DWORD Msg, DWORD)
+        {
+            MsgCount++;
+            Sink += Msg;
+        }
+
+        using CMIDIRouteNode::RouteMsg;
+
+        DWORD MsgCount;
+    };
+
+
+    //----------------------------------------------------------------
+    // CInjectedReceiver
+    //
+    // Counts short messages dispatched by an input device, so that 
+    // another thread can see when they have all arrived.
+    //----------------------------------------------------------------
+
+
+    class CInjectedReceiver : public CMIDIReceiver
+    {
+    public:
+        CInjectedReceiver() : m_MsgCount(0) {}
+
+        void ReceiveMsg(DWORD Msg, DWORD)
+        {
+            // Only the dispatching thread writes the count
+            m_MsgCount.store(m_MsgCount.load(std::memory_order_relaxed)
+                             + 1, std::memory_order_release);
+            Sink += Msg;
+        }
+
+        void ReceiveMsg(LPSTR, DWORD, DWORD) {}
+        void OnError(DWORD, DWORD) {}
+        void OnError(LPSTR, DWORD, DWORD) {}
+
+        using CMIDIReceiver::ReceiveMsg;
+
+        DWORD GetMsgCount() const
+        { return m_MsgCount.load(std::memory_order_acquire); }
+
+    private:
+        std::atomic<DWORD> m_MsgCount;
+    };
+
+
+    //----------------------------------------------------------------
+    // CLoopbackReceiver
+    //
+    // Times messages sent to an output device until they come back
+    // on an input device: from the send to the driver's callback,
+    // and from the callback to the receiver.
+    //----------------------------------------------------------------
+
+
+    class CLoopbackReceiver : public CMIDIReceiver
+    {
+    public:
+        explicit CLoopbackReceiver(HANDLE Event) :
+        m_Event(Event),
+        m_Expected(0),
+        m_SentAt(0)
+        {
+            m_Arrival.Enable(true);
+            m_Dispatch.Enable(true);
+        }
+
+        // Notes the message about to be sent
+        void Expect(DWORD Msg)
+        {
+            m_Expected.store(Msg, std::memory_order_relaxed);
+            m_SentAt.store(CMIDIStats::GetCounter(),
+                           std::memory_order_release);
+        }
+
+        void ReceiveMsg(DWORD, DWORD) {}
+
+        void ReceiveMsg(DWORD Msg, const CMIDITimeStamp &TimeStamp)
+        {
+            LONGLONG Now = CMIDIStats::GetCounter();
+
+            // Ignore anything the loopback adds, such as active
+            // sensing
+            if(Msg == m_Expected.load(std::memory_order_relaxed))
+            {
+                LONGLONG SentAt =
+                    m_SentAt.load(std::memory_order_acquire);
+
+                m_Arrival.AddShortMsgTime(TimeStamp.Counter - SentAt);
+                m_Dispatch.AddShortMsgTime(Now - TimeStamp.Counter);
+                ::SetEvent(m_Event);
+            }
+        }
+
+        void ReceiveMsg(LPSTR, DWORD, DWORD) {}
+        void OnError(DWORD, DWORD) {}
+        void OnError(LPSTR, DWORD, DWORD) {}
+
+        // Prints the times
+        void Print(const char *Name) const
+        {
+            CMIDIStatsSnapshot Snapshot;
+
+            m_Arrival.GetSnapshot(Snapshot);
+            std::printf("  %s\n", Name);
+            PrintTimes("send to callback", Snapshot.ShortMsgTimes);
+
+            m_Dispatch.GetSnapshot(Snapshot);
+            PrintTimes("callback to receiver", Snapshot.ShortMsgTimes);
+        }
+
+    private:
+        HANDLE                m_Event;
+        std::atomic<DWORD>    m_Expected;
+        std::atomic<LONGLONG> m_SentAt;
+        CMIDIStats            m_Arrival;
+        CMIDIStats            m_Dispatch;
+    };
+
+
+    // Producer thread for the queue benchmark
+    DWORD WINAPI ProducerProc(LPVOID Parameter)
+    {
+        CSPSCRing<DWORD> &Ring =
+            *static_cast<CSPSCRing<DWORD> *>(Parameter);
+
+        for(DWORD i = 0; i < MSG_COUNT; i++)
+        {
+            while(!Ring.Push(i))
+            {
+                ::SwitchToThread();
+            }
+        }
+
+        return 0;
+    }
+}
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIInDeviceInjector
+    //
+    // Passes short messages through an input device's callback in
+    // place of a driver, so that the filters, the dispatch queue and
+    // the dispatch thread can be timed without MIDI hardware. The
+    // device must be closed, and is closed again once the injector
+    // is destroyed.
+    //----------------------------------------------------------------
+
+
+    class CMIDIInDeviceInjector
+    {
+    public:
+        // Has the device take messages as if it were recording
+        explicit CMIDIInDeviceInjector(CMIDIInDevice &Device) :
+        m_Device(Device)
+        {
+            // Change state before the dispatch thread starts
+            // checking it
+            m_Device.m_State = CMIDIInDevice::RECORDING;
+
+            try
+            {
+                m_Device.StartDispatching();
+            }
+            catch(...)
+            {
+                m_Device.m_State = CMIDIInDevice::CLOSED;
+                throw;
+            }
+        }
+
+        // Stops dispatching and throws away any messages that were
+        // not dispatched
+        ~CMIDIInDeviceInjector()
+        {
+            m_Device.m_State = CMIDIInDevice::CLOSED;
+            m_Device.StopDispatching();
+
+            delete m_Device.m_DispatchQueue;
+            m_Device.m_DispatchQueue = NULL;
+        }
+
+        // Passes a short message through the callback, as if the
+        // device had received it. Only from one thread at a time.
+        void InjectMsg(DWORD Msg, DWORD TimeStamp)
+        {
+            CMIDIInDevice::MidiInProc(NULL, MIM_DATA,
+                                reinterpret_cast<DWORD>(&m_Device),
+                                Msg, TimeStamp);
+        }
+
+    private:
+        // Copying and assignment not allowed
+        CMIDIInDeviceInjector(const CMIDIInDeviceInjector &);
+        CMIDIInDeviceInjector &operator = (
+                                    const CMIDIInDeviceInjector &);
+
+    private:
+        CMIDIInDevice &m_Device;
+    };
+}
+
+
+//--------------------------------------------------------------------
+// Benchmarks
+//--------------------------------------------------------------------
+
+
+// Pushes and pops the ring that the header queues and the dispatch
+// queue are built on
+void BenchQueue()
+{
+    std::printf("Queue\n");
+
+    CSPSCRing<DWORD> Ring(RING_CAPACITY);
+    DWORD Item;
+
+    // One thread, filling and emptying the ring in turn
+    LONGLONG Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < MSG_COUNT; i += RING_CAPACITY)
+    {
+        for(std::size_t j = 0; j < RING_CAPACITY; j++)
+        {
+            Ring.Push(i);
+        }
+
+        while(Ring.Pop(Item))
+        {
+            Sink += Item;
+        }
+    }
+
+    PrintRate("push/pop, one thread", MSG_COUNT,
+              CMIDIStats::GetCounter() - Start);
+
+    // A producer thread against this thread as the consumer
+    DWORD Expected = 0;
+    DWORD OutOfOrder = 0;
+
+    Start = CMIDIStats::GetCounter();
+
+    HANDLE Producer = ::CreateThread(NULL, 0, ProducerProc, &Ring, 0,
+                                     NULL);
+
+    if(Producer == NULL)
+    {
+        std::printf("  unable to create producer thread\n");
+        return;
+    }
+
+    while(Expected < MSG_COUNT)
+    {
+        if(Ring.Pop(Item))
+        {
+            if(Item != Expected)
+            {
+                OutOfOrder++;
+            }
+
+            Expected++;
+        }
+        else
+        {
+            ::SwitchToThread();
+        }
+    }
+
+    PrintRate("push/pop, two threads", MSG_COUNT,
+              CMIDIStats::GetCounter() - Start);
+
+    ::WaitForSingleObject(Producer, INFINITE);
+    ::CloseHandle(Producer);
+
+    if(OutOfOrder > 0)
+    {
+        std::printf("  %lu items out of order\n", OutOfOrder);
+    }
+}
+
+
+// Packs and unpacks short messages
+void BenchShortMsgs()
+{
+    std::printf("Short messages\n");
+
+    DWORD *Msgs = new DWORD[BLOCK_SIZE];
+    unsigned char *Planes = new unsigned char[BLOCK_SIZE * 5];
+    CMIDIInDevice::CShortMsgPlanes Unpacked =
+    {
+        Planes,
+        Planes + BLOCK_SIZE,
+        Planes + BLOCK_SIZE * 2,
+        Planes + BLOCK_SIZE * 3
+    };
+    unsigned char *Mask = Planes + BLOCK_SIZE * 4;
+
+    // Packing with CMIDIOutDevice
+    LONGLONG Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < MSG_COUNT; i += BLOCK_SIZE)
+    {
+        for(std::size_t j = 0; j < BLOCK_SIZE; j++)
+        {
+            CMIDIOutDevice::PackShortMsg(Msgs[j], midi::NOTE_ON,
+                static_cast<unsigned char>(j & 15),
+                static_cast<unsigned char>(j & 127),
+                static_cast<unsigned char>(i & 127));
+        }
+
+        Sink += Msgs[i & (BLOCK_SIZE - 1)];
+    }
+
+    PrintRate("PackShortMsg", MSG_COUNT,
+              CMIDIStats::GetCounter() - Start);
+
+    // Packing with CShortMsg
+    Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < MSG_COUNT; i += BLOCK_SIZE)
+    {
+        for(std::size_t j = 0; j < BLOCK_SIZE; j++)
+        {
+            Msgs[j] = CShortMsg::NoteOn(
+                static_cast<unsigned char>(j & 15),
+                static_cast<unsigned char>(j & 127),
+                static_cast<unsigned char>(i & 127)).GetMsg();
+        }
+
+        Sink += Msgs[i & (BLOCK_SIZE - 1)];
+    }
+
+    PrintRate("CShortMsg::NoteOn", MSG_COUNT,
+              CMIDIStats::GetCounter() - Start);
+
+    // Unpacking one message at a time
+    unsigned char Command, Channel, Data1, Data2;
+
+    Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < MSG_COUNT; i += BLOCK_SIZE)
+    {
+        for(std::size_t j = 0; j < BLOCK_SIZE; j++)
+        {
+            CMIDIInDevice::UnpackShortMsg(Msgs[j], Command, Channel,
+                                          Data1, Data2);
+            Mask[j] = Command ^ Channel ^ Data1 ^ Data2;
+        }
+
+        Sink += Mask[i & (BLOCK_SIZE - 1)];
+    }
+
+    PrintRate("UnpackShortMsg", MSG_COUNT,
+              CMIDIStats::GetCounter() - Start);
+
+    // Unpacking a block at a time
+    Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < MSG_COUNT; i += BLOCK_SIZE)
+    {
+        CMIDIInDevice::UnpackShortMsgs(Msgs, BLOCK_SIZE, Unpacked);
+        Sink += Unpacked.DataByte2[i & (BLOCK_SIZE - 1)];
+    }
+
+    PrintRate("UnpackShortMsgs", MSG_COUNT,
+              CMIDIStats::GetCounter() - Start);
+
+    // Matching commands a block at a time
+    Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < MSG_COUNT; i += BLOCK_SIZE)
+    {
+        Sink += static_cast<DWORD>(CMIDIInDevice::MatchCommand(
+            Unpacked.Status, BLOCK_SIZE, midi::NOTE_ON, Mask));
+    }
+
+    PrintRate("MatchCommand", MSG_COUNT,
+              CMIDIStats::GetCounter() - Start);
+
+    delete [] Planes;
+    delete [] Msgs;
+}
+
+
+// Parses a stream of bytes such as an input device delivers
+void BenchParser()
+{
+    std::printf("Parser\n");
+
+    char *Stream = new char[STREAM_SIZE];
+    DWORD Length = 0;
+    DWORD Count = 0;
+
+    // Notes with running status, interrupted by clocks, and now and
+    // then a system exclusive message
+    while(Length + 64 < STREAM_SIZE)
+    {
+        if(Count % 256 == 0)
+        {
+            Stream[Length++] = static_cast<char>(midi::SYSTEM_EXCLUSIVE);
+
+            for(int i = 0; i < 30; i++)
+            {
+                Stream[Length++] = static_cast<char>(i);
+            }
+
+            Stream[Length++] = static_cast<char>(midi::END_OF_EXCLUSIVE);
+        }
+
+        if(Count % 16 == 0)
+        {
+            Stream[Length++] = static_cast<char>(midi::NOTE_ON);
+        }
+
+        if(Count % 24 == 0)
+        {
+            Stream[Length++] = static_cast<char>(midi::TIMING_CLOCK);
+        }
+
+        Stream[Length++] = static_cast<char>(Count & 127);
+        Stream[Length++] = static_cast<char>(Count & 1 ? 0 : 100);
+        Count++;
+    }
+
+    CCountingReceiver Receiver;
+    CMIDIParser Parser(Receiver);
+    DWORD Repeats = 16;
+
+    LONGLONG Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < Repeats; i++)
+    {
+        for(DWORD Offset = 0; Offset < Length; Offset += PIECE_SIZE)
+        {
+            DWORD Piece = Length - Offset < PIECE_SIZE ?
+                          Length - Offset : PIECE_SIZE;
+
+            Parser.Parse(Stream + Offset, Piece, i);
+        }
+    }
+
+    LONGLONG Ticks = CMIDIStats::GetCounter() - Start;
+
+    PrintRate("bytes", Length * Repeats, Ticks);
+    PrintRate("messages and segments", Receiver.MsgCount, Ticks);
+
+    if(Receiver.ErrorCount > 0)
+    {
+        std::printf("  %lu errors\n", Receiver.ErrorCount);
+    }
+
+    delete [] Stream;
+}
+
+
+// Passes messages to a receiver the way the input device passes
+// them on from its callback, through a routing graph, and through 
+// an input device's own callback in each dispatch mode
+void BenchDispatch()
+{
+    std::printf("Dispatch\n");
+
+    CMIDIInputNode Input;
+    CMIDIFilterNode Filter;
+    CMIDITransposeNode Transpose(12);
+    CMIDIChannelMapNode ChannelMap;
+    CCountingNode Output;
+
+    Input.Connect(Filter);
+    Filter.Connect(Transpose);
+    Transpose.Connect(ChannelMap);
+    ChannelMap.Connect(Output);
+
+    Filter.SetStatus(midi::ACTIVE_SENSING, false);
+    ChannelMap.SetChannel(0, 9);
+
+    CCountingReceiver Counter;
+    CMIDIReceiver *Receivers[] = { &Counter, &Input };
+    const char *Names[] = { "to receiver", "through routing graph" };
+
+    for(int r = 0; r < 2; r++)
+    {
+        CMIDIReceiver &Receiver = *Receivers[r];
+
+        // Throughput
+        LONGLONG Start = CMIDIStats::GetCounter();
+
+        for(DWORD i = 0; i < MSG_COUNT; i++)
+        {
+            Receiver.ReceiveMsg(CShortMsg::NoteOn(
+                static_cast<unsigned char>(i & 15),
+                static_cast<unsigned char>(i & 127), 100).GetMsg(), i);
+        }
+
+        PrintRate(Names[r], MSG_COUNT, CMIDIStats::GetCounter() - Start);
+
+        // Time of each call, as the device's statistics measure it
+        CMIDIStats Stats;
+        CMIDIStatsSnapshot Snapshot;
+
+        Stats.Enable(true);
+
+        for(DWORD i = 0; i < MSG_COUNT / 16; i++)
+        {
+            Start = CMIDIStats::GetCounter();
+            Receiver.ReceiveMsg(CShortMsg::NoteOn(0,
+                static_cast<unsigned char>(i & 127), 100).GetMsg(), i);
+            Stats.AddShortMsgTime(CMIDIStats::GetCounter() - Start);
+        }
+
+        Stats.GetSnapshot(Snapshot);
+        PrintTimes(Names[r], Snapshot.ShortMsgTimes);
+    }
+
+    // The messages are injected in place of a driver, so they take 
+    // the same path through the callback, the filters, the dispatch
+    // queue and the dispatch thread as received ones
+    CMIDIInDevice::DispatchMode Modes[] =
+    {
+        CMIDIInDevice::DISPATCH_DIRECT,
+        CMIDIInDevice::DISPATCH_THREAD,
+        CMIDIInDevice::DISPATCH_MANUAL
+    };
+    const char *ModeNames[] =
+    {
+        "device, direct", "device, dispatch thread", "device, manual"
+    };
+
+    for(int m = 0; m < 3; m++)
+    {
+        CInjectedReceiver Injected;
+        CMIDIInDevice Device(Injected);
+        LONGLONG Ticks;
+
+        Device.SetDispatchMode(Modes[m]);
+
+        {
+            midi::CMIDIInDeviceInjector Injector(Device);
+
+            LONGLONG Start = CMIDIStats::GetCounter();
+
+            for(DWORD i = 0; i < MSG_COUNT; i++)
+            {
+                Injector.InjectMsg(CShortMsg::NoteOn(
+                    static_cast<unsigned char>(i & 15),
+                    static_cast<unsigned char>(i & 127), 100).GetMsg(),
+                    i);
+
+                // Empty the queue before it fills up. The default
+                // queue holds a block.
+                if((i + 1) % BLOCK_SIZE == 0 || i + 1 == MSG_COUNT)
+                {
+                    if(Modes[m] == CMIDIInDevice::DISPATCH_MANUAL)
+                    {
+                        Device.DispatchMsgs();
+                    }
+
+                    // Wait for the dispatch thread to catch up
+                    while(Injected.GetMsgCount() +
+                          Device.GetDroppedCount() < i + 1)
+                    {
+                        ::Sleep(0);
+                    }
+                }
+            }
+
+            Ticks = CMIDIStats::GetCounter() - Start;
+        }
+
+        PrintRate(ModeNames[m], MSG_COUNT, Ticks);
+
+        if(Device.GetDroppedCount() > 0)
+        {
+            std::printf("  %lu dropped\n", Device.GetDroppedCount());
+        }
+    }
+}
+
+
+// Reads a Standard MIDI File written to the temporary directory
+void BenchFile()
+{
+    std::printf("Standard MIDI File\n");
+
+    // Header, a tempo track and the note tracks. Each note is a note
+    // on and a note off with running status, three bytes each.
+    DWORD NoteTrackSize = 8 + 4 + (FILE_NOTE_COUNT * 2 - 1) * 3 + 4;
+    DWORD Size = 14 + 8 + 11 + NoteTrackSize * FILE_TRACK_COUNT;
+    unsigned char *Data = new unsigned char[Size];
+    unsigned char *p = Data;
+
+    std::memcpy(p, "MThd", 4);
+    p = PutDWord(p + 4, 6);
+    p = PutWord(p, 1);
+    p = PutWord(p, static_cast<WORD>(FILE_TRACK_COUNT + 1));
+    p = PutWord(p, 480);
+
+    const unsigned char TempoTrack[] =
+    {
+        0x00, midi::META_EVENT, midi::META_TEMPO, 0x03, 0x07, 0xA1, 0x20,
+        0x00, midi::META_EVENT, midi::META_END_OF_TRACK, 0x00
+    };
+
+    std::memcpy(p, "MTrk", 4);
+    p = PutDWord(p + 4, sizeof TempoTrack);
+    std::memcpy(p, TempoTrack, sizeof TempoTrack);
+    p += sizeof TempoTrack;
+
+    for(std::size_t Track = 0; Track < FILE_TRACK_COUNT; Track++)
+    {
+        std::memcpy(p, "MTrk", 4);
+        p = PutDWord(p + 4, NoteTrackSize - 8);
+
+        *p++ = 0x00;
+        *p++ = midi::NOTE_ON | static_cast<unsigned char>(Track);
+        *p++ = 0;
+        *p++ = 100;
+
+        for(DWORD i = 0; i < FILE_NOTE_COUNT * 2 - 1; i++)
+        {
+            *p++ = 0x0F;
+            *p++ = static_cast<unsigned char>((i + 1) / 2 % 128);
+            *p++ = i % 2 == 0 ? 0 : 100;
+        }
+
+        *p++ = 0x00;
+        *p++ = midi::META_EVENT;
+        *p++ = midi::META_END_OF_TRACK;
+        *p++ = 0x00;
+    }
+
+    char Path[MAX_PATH];
+    char FileName[MAX_PATH];
+
+    if(::GetTempPath(sizeof Path, Path) == 0 ||
+       ::GetTempFileName(Path, "mid", 0, FileName) == 0)
+    {
+        std::printf("  unable to name a temporary file\n");
+        delete [] Data;
+        return;
+    }
+
+    HANDLE File = ::CreateFile(FileName, GENERIC_WRITE, 0, NULL,
+                               CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                               NULL);
+    DWORD Written = 0;
+
+    if(File != INVALID_HANDLE_VALUE)
+    {
+        ::WriteFile(File, Data, Size, &Written, NULL);
+        ::CloseHandle(File);
+    }
+
+    delete [] Data;
+
+    if(Written != Size)
+    {
+        std::printf("  unable to write %s\n", FileName);
+        ::DeleteFile(FileName);
+        return;
+    }
+
+    try
+    {
+        CMIDIFile MIDIFile;
+        CMIDIFileEvent Event;
+        DWORD Count = 0;
+        DWORD Repeats = 4;
+
+        LONGLONG Start = CMIDIStats::GetCounter();
+
+        for(DWORD i = 0; i < Repeats; i++)
+        {
+            MIDIFile.Open(FileName);
+            MIDIFile.Close();
+        }
+
+        PrintRate("open", Repeats, CMIDIStats::GetCounter() - Start);
+
+        MIDIFile.Open(FileName);
+
+        // One track on its own
+        CMIDIFileCursor TrackCursor(MIDIFile, 1);
+
+        Start = CMIDIStats::GetCounter();
+
+        for(DWORD i = 0; i < Repeats; i++)
+        {
+            TrackCursor.Reset();
+
+            while(TrackCursor.Next(Event))
+            {
+                Sink += Event.Msg;
+                Count++;
+            }
+        }
+
+        PrintRate("events, one track", Count,
+                  CMIDIStats::GetCounter() - Start);
+
+        // Every track merged in time order
+        CMIDIFileCursor Cursor(MIDIFile);
+
+        Count = 0;
+        Start = CMIDIStats::GetCounter();
+
+        for(DWORD i = 0; i < Repeats; i++)
+        {
+            Cursor.Reset();
+
+            while(Cursor.Next(Event))
+            {
+                Sink += Event.Msg;
+                Count++;
+            }
+        }
+
+        PrintRate("events, all tracks merged", Count,
+                  CMIDIStats::GetCounter() - Start);
+    }
+    catch(const std::exception &Ex)
+    {
+        std::printf("  %s\n", Ex.what());
+    }
+
+    ::DeleteFile(FileName);
+}
+
+
+// Sends long messages to an output device, with the given number of
+// headers in its pool
+void BenchLongMsgs(UINT DeviceId, DWORD HeaderCount)
+{
+    std::printf("Long messages, %lu pooled headers\n", HeaderCount);
+
+    // Identity request, which every device may safely ignore
+    char Msg[] =
+    {
+        static_cast<char>(midi::SYSTEM_EXCLUSIVE), 0x7E, 0x7F, 0x06, 0x01,
+        static_cast<char>(midi::END_OF_EXCLUSIVE)
+    };
+
+    CMIDIOutDevice Device;
+    CMIDIStatsSnapshot Stats;
+    DWORD QueueFullCount = 0;
+
+    Device.SetHeaderPool(HeaderCount, sizeof Msg);
+    Device.Open(DeviceId);
+    Device.EnableStats(true);
+
+    LONGLONG Start = CMIDIStats::GetCounter();
+
+    for(DWORD i = 0; i < LONG_MSG_COUNT; i++)
+    {
+        // If the device falls behind, give it time to catch up
+        for(;;)
+        {
+            try
+            {
+                Device.SendMsg(Msg, sizeof Msg);
+                break;
+            }
+            catch(const CMIDIOutQueueFull &)
+            {
+                QueueFullCount++;
+                ::Sleep(0);
+            }
+        }
+    }
+
+    LONGLONG Ticks = CMIDIStats::GetCounter() - Start;
+
+    Device.GetStats(Stats);
+    Device.Close();
+
+    PrintRate("send", LONG_MSG_COUNT, Ticks);
+    PrintTimes("midiOutLongMsg", Stats.LongMsgTimes);
+    std::printf("  %lu headers allocated, %lu pooled, %lu errors, "
+                "%lu times the queue was full\n", Stats.HeaderAllocCount,
+                Stats.PooledHeaderCount, Stats.LongErrorCount,
+                QueueFullCount);
+}
+
+
+// Sends messages to an output device and times them until they come
+// back on an input device, in each dispatch mode
+void BenchLoopback(UINT OutDeviceId, UINT InDeviceId)
+{
+    std::printf("Loopback\n");
+
+    HANDLE Event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if(Event == NULL)
+    {
+        std::printf("  unable to create event\n");
+        return;
+    }
+
+    const CMIDIInDevice::DispatchMode Modes[] =
+    {
+        CMIDIInDevice::DISPATCH_DIRECT,
+        CMIDIInDevice::DISPATCH_THREAD,
+        CMIDIInDevice::DISPATCH_MANUAL
+    };
+    const char *Names[] = { "direct", "thread", "manual" };
+
+    CMIDIOutDevice OutDevice(OutDeviceId);
+
+    for(int m = 0; m < 3; m++)
+    {
+        CLoopbackReceiver Receiver(Event);
+        CMIDIInDevice InDevice(Receiver);
+        DWORD LostCount = 0;
+
+        InDevice.SetHighResTimeStamps(true);
+        InDevice.SetDispatchMode(Modes[m]);
+        InDevice.Open(InDeviceId);
+        InDevice.StartRecording();
+
+        for(DWORD i = 0; i < LOOPBACK_MSG_COUNT; i++)
+        {
+            // Note offs, so nothing is left sounding
+            DWORD Msg = CShortMsg::NoteOn(0,
+                static_cast<unsigned char>(i & 127), 0).GetMsg();
+
+            Receiver.Expect(Msg);
+            OutDevice.SendMsg(Msg);
+
+            if(Modes[m] == CMIDIInDevice::DISPATCH_MANUAL)
+            {
+                if(InDevice.WaitForMsgs(LOOPBACK_TIMEOUT))
+                {
+                    InDevice.DispatchMsgs();
+                }
+            }
+
+            if(::WaitForSingleObject(Event, LOOPBACK_TIMEOUT) !=
+               WAIT_OBJECT_0)
+            {
+                LostCount++;
+            }
+        }
+
+        InDevice.StopRecording();
+        InDevice.Close();
+
+        Receiver.Print(Names[m]);
+
+        if(LostCount > 0)
+        {
+            std::printf("  %lu messages did not come back\n", LostCount);
+        }
+    }
+
+    ::CloseHandle(Event);
+}
+
+
+//--------------------------------------------------------------------
+// Main
+//--------------------------------------------------------------------
+
+
+// Fills a paced device's queue through the classes that send to it
+// for their callers. Each of them must count the failures rather 
+// than let them escape.
+void CheckQueueFull(UINT DeviceId)
+{
+    std::printf("Full pacing queue\n");
+
+    CMIDIOutDevice Device;
+
+    Device.SetPacing(QUEUE_FULL_RATE, QUEUE_FULL_CAPACITY);
+    Device.Open(DeviceId);
+
+    // Fill the queue with the first value of each channel's pitch 
+    // bend, so that the second one is held back until Flush
+    CMIDIThinner Thinner(Device, QUEUE_FULL_WAIT);
+
+    for(unsigned char Channel = 0; Channel < QUEUE_FULL_CAPACITY; 
+        Channel++)
+    {
+        Thinner.SendMsg(CShortMsg::PitchBend(Channel, 0).GetMsg());
+    }
+
+    for(unsigned char Channel = 0; Channel < QUEUE_FULL_CAPACITY; 
+        Channel++)
+    {
+        Thinner.SendMsg(CShortMsg::PitchBend(Channel, 1).GetMsg());
+    }
+
+    Thinner.Flush();
+
+    // A routing graph's output
+    CMIDIOutputNode Output(Device);
+
+    for(DWORD i = 0; i < QUEUE_FULL_MSG_COUNT; i++)
+    {
+        Output.RouteMsg(CShortMsg::NoteOn(0,
+            static_cast<unsigned char>(i & 127), 100).GetMsg(), i);
+    }
+
+    // The sequencer's own thread
+    CMIDISequencer Sequencer;
+
+    Sequencer.AddOutput(Device);
+
+    for(DWORD i = 0; i < QUEUE_FULL_MSG_COUNT; i++)
+    {
+        Sequencer.ScheduleMsg(0, CShortMsg::NoteOff(0,
+            static_cast<unsigned char>(i & 127)).GetMsg());
+    }
+
+    Sequencer.Start();
+    ::Sleep(QUEUE_FULL_WAIT);
+    Sequencer.Stop();
+
+    // Sends what is still queued straight away
+    Device.Close();
+
+    std::printf("  %-36s %lu held values failed\n", "thinner",
+                Thinner.GetErrorCount());
+    std::printf("  %-36s %lu messages failed\n", "output node",
+                Output.GetErrorCount());
+    std::printf("  %-36s %lu messages failed\n", "sequencer",
+                Sequencer.GetErrorCount());
+
+    if(Thinner.GetErrorCount() == 0 || Output.GetErrorCount() == 0 ||
+       Sequencer.GetErrorCount() == 0)
+    {
+        std::printf("  The queue did not fill up\n");
+    }
+}
+
+
+// Checks that the thinner sends the values it holds on a channel
+// before any other message on that channel, including controllers
+// it thins but does not hold
+void CheckThinnerOrder(UINT DeviceId)
+{
+    std::printf("Thinner order\n");
+
+    CMIDIOutDevice Device;
+    CMIDICapture Capture;
+
+    Device.SetCapture(&Capture);
+    Device.Open(DeviceId);
+
+    CMIDIThinner Thinner(Device, QUEUE_FULL_WAIT);
+
+    // The second pitch bend is held back, then a controller that
+    // only loses its duplicates and one sent for the first time
+    // must each follow the value held before it
+    const DWORD Msgs[] =
+    {
+        CShortMsg::PitchBend(0, 0).GetMsg(),
+        CShortMsg::PitchBend(0, 1).GetMsg(),
+        CShortMsg::ControlChange(0, midi::CC_SUSTAIN, 127).GetMsg(),
+        CShortMsg::PitchBend(0, 2).GetMsg(),
+        CShortMsg::ControlChange(0, midi::CC_EXPRESSION, 100).GetMsg()
+    };
+
+    const std::size_t Count = sizeof Msgs / sizeof Msgs[0];
+
+    Thinner.SetControllerMode(midi::CC_SUSTAIN,
+                              CMIDIThinner::THIN_DUPLICATES);
+    Thinner.SetControllerMode(midi::CC_EXPRESSION,
+                              CMIDIThinner::THIN_BURSTS);
+    Thinner.SendMsgs(Msgs, Count);
+    Thinner.Flush();
+
+    Device.SetCapture(NULL);
+    Device.Close();
+
+    std::vector<CMIDICaptureEvent> Events;
+    std::size_t Sent = Capture.Snapshot(Events);
+    bool InOrder = (Sent == Count);
+
+    for(std::size_t i = 0; i < Sent && InOrder; i++)
+    {
+        InOrder = (Events[i].Msg == Msgs[i]);
+    }
+
+    std::printf("  %-36s %s\n", "held values first",
+                InOrder ? "yes" : "no");
+}
+
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        BenchQueue();
+        BenchShortMsgs();
+        BenchParser();
+        BenchDispatch();
+        BenchFile();
+
+        if(argc > 1)
+        {
+            UINT OutDeviceId = std::atoi(argv[1]);
+
+            BenchLongMsgs(OutDeviceId, 0);
+            BenchLongMsgs(OutDeviceId, POOL_HEADER_COUNT);
+            CheckQueueFull(OutDeviceId);
+            CheckThinnerOrder(OutDeviceId);
+
+            if(argc > 2)
+            {
+                BenchLoopback(OutDeviceId, std::atoi(argv[2]));
+            }
+        }
+    }
+    catch(const std::exception &Ex)
+    {
+        std::printf("%s\n", Ex.what());
+        return 1;
+    }
+
+    return 0;
+}
\ No newline at end of file
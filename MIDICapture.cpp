@@ -0,0 +1,395 @@
+/*********************************************************************
+ * MIDICapture.cpp - Implementation for CMIDICapture.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDICapture.h"
+#include "MIDIFile.h"
+#include "midi.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDICapture;
+using midi::CMIDICaptureEvent;
+using midi::CMIDICaptureMemFailure;
+using midi::CMIDICaptureWriteFailure;
+using midi::CMIDITrackWriter;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Where the direction and the long flag go in a slot's info
+const DWORD DIRECTION_SHIFT = 16;
+const DWORD LONG_MSG_FLAG = 0x01000000;
+
+// Version of the binary format
+const DWORD CAPTURE_FORMAT_VERSION = 1;
+
+
+namespace
+{
+    //----------------------------------------------------------------
+    // File helpers
+    //----------------------------------------------------------------
+
+
+    // Adds a number, least significant byte first
+    void PutLittle(std::vector<unsigned char> &Data, LONGLONG Number,
+                   int Size)
+    {
+        for(int i = 0; i < Size; i++)
+        {
+            Data.push_back(
+                static_cast<unsigned char>(Number >> (i * 8)));
+        }
+    }
+
+
+    // Writes data to a file, replacing any file already there
+    void WriteData(LPCSTR FileName,
+                   const std::vector<unsigned char> &Data)
+    {
+        HANDLE File = ::CreateFile(FileName, GENERIC_WRITE, 0, NULL,
+                                   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                                   NULL);
+
+        // If we are unable to create the file, throw exception
+        if(File == INVALID_HANDLE_VALUE)
+        {
+            throw CMIDICaptureWriteFailure();
+        }
+
+        DWORD Written = 0;
+        BOOL Result = ::WriteFile(File, Data.empty() ? NULL : &Data[0],
+                                  static_cast<DWORD>(Data.size()),
+                                  &Written, NULL);
+
+        ::CloseHandle(File);
+
+        // If not everything was written, throw exception
+        if(!Result || Written != Data.size())
+        {
+            throw CMIDICaptureWriteFailure();
+        }
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDICapture implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDICapture::CMIDICapture(std::size_t Capacity) :
+m_Slots(NULL),
+m_Mask(0),
+m_Next(0),
+m_First(0)
+{
+    std::size_t Size = 1;
+
+    while(Size < Capacity)
+    {
+        Size <<= 1;
+    }
+
+    try
+    {
+        m_Slots = new CSlot[Size];
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDICaptureMemFailure();
+    }
+
+    m_Mask = Size - 1;
+
+    // No slot holds a message yet
+    for(std::size_t i = 0; i < Size; i++)
+    {
+        m_Slots[i].Sequence.store(0, std::memory_order_relaxed);
+    }
+}
+
+
+// Destructor
+CMIDICapture::~CMIDICapture()
+{
+    delete [] m_Slots;
+}
+
+
+// Records a short message
+void CMIDICapture::RecordMsg(Direction Dir, WORD Port, DWORD Msg)
+{
+    LONGLONG Index = m_Next.fetch_add(1, std::memory_order_relaxed);
+
+    Store(Index, GetCounter(), Msg, Port | (Dir << DIRECTION_SHIFT));
+}
+
+
+// Records several short messages
+void CMIDICapture::RecordMsgs(Direction Dir, WORD Port,
+                              const DWORD *Msgs, std::size_t Count)
+{
+    if(Count == 0)
+    {
+        return;
+    }
+
+    // The messages take consecutive slots, so they stay together
+    LONGLONG Index = m_Next.fetch_add(static_cast<LONGLONG>(Count),
+                                      std::memory_order_relaxed);
+    LONGLONG Time = GetCounter();
+    DWORD Info = Port | (Dir << DIRECTION_SHIFT);
+
+    for(std::size_t i = 0; i < Count; i++)
+    {
+        Store(Index + i, Time, Msgs[i], Info);
+    }
+}
+
+
+// Records a long message
+void CMIDICapture::RecordLongMsg(Direction Dir, WORD Port,
+                                 DWORD MsgLength)
+{
+    LONGLONG Index = m_Next.fetch_add(1, std::memory_order_relaxed);
+
+    Store(Index, GetCounter(), MsgLength,
+          Port | (Dir << DIRECTION_SHIFT) | LONG_MSG_FLAG);
+}
+
+
+// Forgets everything recorded so far
+void CMIDICapture::Clear()
+{
+    m_First.store(m_Next.load());
+}
+
+
+// Takes a copy of the messages kept
+std::size_t CMIDICapture::Snapshot(
+                           std::vector<CMIDICaptureEvent> &Events) const
+{
+    LONGLONG Next = m_Next.load(std::memory_order_acquire);
+    LONGLONG First = Next - static_cast<LONGLONG>(m_Mask + 1);
+
+    if(First < m_First.load())
+    {
+        First = m_First.load();
+    }
+
+    if(First < 0)
+    {
+        First = 0;
+    }
+
+    Events.clear();
+
+    try
+    {
+        Events.reserve(static_cast<std::size_t>(Next - First));
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDICaptureMemFailure();
+    }
+
+    for(LONGLONG i = First; i < Next; i++)
+    {
+        const CSlot &Slot = 
+            m_Slots[static_cast<std::size_t>(i) & m_Mask];
+        LONGLONG Sequence = i * 2 + 2;
+
+        // Leave out messages still being written or already
+        // overwritten
+        if(Slot.Sequence.load(std::memory_order_acquire) != Sequence)
+        {
+            continue;
+        }
+
+        CMIDICaptureEvent Event;
+        DWORD Info = Slot.Info.load(std::memory_order_relaxed);
+
+        Event.Time = Slot.Time.load(std::memory_order_relaxed);
+        Event.Msg = Slot.Msg.load(std::memory_order_relaxed);
+        Event.Port = static_cast<WORD>(Info);
+        Event.Direction = static_cast<unsigned char>(
+                                        (Info >> DIRECTION_SHIFT) & 1);
+        Event.IsLong = (Info & LONG_MSG_FLAG) != 0;
+
+        // Make sure the slot was not written while it was copied
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if(Slot.Sequence.load(std::memory_order_relaxed) == Sequence)
+        {
+            Events.push_back(Event);
+        }
+    }
+
+    return Events.size();
+}
+
+
+// Writes the messages kept in the binary format
+void CMIDICapture::WriteBinary(LPCSTR FileName) const
+{
+    std::vector<CMIDICaptureEvent> Events;
+    std::vector<unsigned char> Data;
+    LARGE_INTEGER Frequency;
+
+    Snapshot(Events);
+
+    ::QueryPerformanceFrequency(&Frequency);
+
+    try
+    {
+        Data.reserve(20 + Events.size() * 16);
+
+        Data.push_back('M');
+        Data.push_back('C');
+        Data.push_back('A');
+        Data.push_back('P');
+        PutLittle(Data, CAPTURE_FORMAT_VERSION, 4);
+        PutLittle(Data, Frequency.QuadPart, 8);
+        PutLittle(Data, static_cast<LONGLONG>(Events.size()), 4);
+
+        for(std::size_t i = 0; i < Events.size(); i++)
+        {
+            PutLittle(Data, Events[i].Time, 8);
+            PutLittle(Data, Events[i].Msg, 4);
+            PutLittle(Data, Events[i].Port, 2);
+            PutLittle(Data, Events[i].Direction, 1);
+            PutLittle(Data, Events[i].IsLong ? 1 : 0, 1);
+        }
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDICaptureMemFailure();
+    }
+
+    WriteData(FileName, Data);
+}
+
+
+// Writes the messages kept as a Standard MIDI File
+void CMIDICapture::WriteMIDIFile(LPCSTR FileName, Direction Dir,
+                                 WORD Port) const
+{
+    std::vector<CMIDICaptureEvent> Events;
+    std::vector<unsigned char> Data;
+    LARGE_INTEGER Frequency;
+
+    Snapshot(Events);
+
+    ::QueryPerformanceFrequency(&Frequency);
+
+    try
+    {
+        Data.assign(CMIDITrackWriter::FILE_HEADER, 
+                    CMIDITrackWriter::FILE_HEADER + 
+                    CMIDITrackWriter::FILE_HEADER_SIZE);
+
+        // Threads take their slots before reading the counter, so an
+        // event can be stamped earlier than the one before it. The 
+        // writer never lets the ticks go backwards.
+        CMIDITrackWriter Writer;
+        unsigned char Bytes[CMIDITrackWriter::MAX_NUMBER_SIZE + 
+                            CMIDITrackWriter::MAX_SHORT_MSG_SIZE];
+        LONGLONG StartTime = 0;
+        bool HasEvent = false;
+
+        for(std::size_t i = 0; i < Events.size(); i++)
+        {
+            const CMIDICaptureEvent &Event = Events[i];
+
+            if(Event.IsLong || Event.Direction != Dir ||
+               Event.Port != Port)
+            {
+                continue;
+            }
+
+            // The track starts at the first event, and one tick is a
+            // millisecond
+            if(!HasEvent)
+            {
+                StartTime = Event.Time;
+                HasEvent = true;
+            }
+
+            DWORD Tick = static_cast<DWORD>(
+                (Event.Time - StartTime) * 1000 / Frequency.QuadPart);
+
+            DWORD Count = Writer.PutDelta(Bytes, Tick);
+
+            Count += Writer.PutShortMsg(Bytes + Count, Event.Msg);
+            Data.insert(Data.end(), Bytes, Bytes + Count);
+        }
+
+        Data.insert(Data.end(), CMIDITrackWriter::END_OF_TRACK,
+                    CMIDITrackWriter::END_OF_TRACK + 
+                    CMIDITrackWriter::END_OF_TRACK_SIZE);
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDICaptureMemFailure();
+    }
+
+    // Fill in the track length
+    DWORD TrackLength = static_cast<DWORD>(Data.size() - 
+                                       CMIDITrackWriter::TRACK_OFFSET);
+
+    CMIDITrackWriter::PutLength(
+        &Data[CMIDITrackWriter::TRACK_LENGTH_OFFSET], TrackLength);
+
+    WriteData(FileName, Data);
+}
+
+
+// Writes a slot
+void CMIDICapture::Store(LONGLONG Index, LONGLONG Time, DWORD Msg,
+                         DWORD Info)
+{
+    CSlot &Slot = m_Slots[static_cast<std::size_t>(Index) & m_Mask];
+
+    // Readers leave the slot out while it is odd. A writer stalled
+    // for a whole ring could still mix its message with a newer one,
+    // which is accepted to keep recording free of waiting.
+    Slot.Sequence.store(Index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    Slot.Time.store(Time, std::memory_order_relaxed);
+    Slot.Msg.store(Msg, std::memory_order_relaxed);
+    Slot.Info.store(Info, std::memory_order_relaxed);
+
+    Slot.Sequence.store(Index * 2 + 2, std::memory_order_release);
+}
+
+
+// Gets the current time
+LONGLONG CMIDICapture::GetCounter()
+{
+    LARGE_INTEGER Counter;
+
+    ::QueryPerformanceCounter(&Counter);
+
+    return Counter.QuadPart;
+}
\ No newline at end of file
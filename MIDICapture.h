@@ -0,0 +1,195 @@
+#ifndef MIDI_CAPTURE_H
+#define MIDI_CAPTURE_H
+
+
+/*********************************************************************
+ * MIDICapture.h - Interface for CMIDICapture and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+#include <new>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for snapshots
+#include <vector>
+
+// Necessary for the ring shared by every thread recording
+#include <atomic>
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDICapture exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when memory allocation fails within a CMIDICapture
+    // object
+    class CMIDICaptureMemFailure : public std::bad_alloc
+    {
+    public:
+        const char *what() const throw()
+        { return "Memory allocation within a CMIDICapture object "
+                 "failed."; }
+    };
+
+
+    // Thrown when a CMIDICapture is unable to create or write a file
+    class CMIDICaptureWriteFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to write file for CMIDICapture object."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDICaptureEvent
+    //
+    // A message taken from a CMIDICapture.
+    //----------------------------------------------------------------
+
+
+    struct CMIDICaptureEvent
+    {
+        // QueryPerformanceCounter value when the message was recorded
+        LONGLONG      Time;
+
+        // The packed short message, or the length of a long message
+        DWORD         Msg;
+
+        // Port given to the device the message went through
+        WORD          Port;
+
+        // CMIDICapture::CAPTURE_IN or CMIDICapture::CAPTURE_OUT
+        unsigned char Direction;
+
+        // True if Msg is the length of a long message
+        bool          IsLong;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDICapture
+    //
+    // Keeps the last messages received and sent by the devices
+    // given it with SetCapture, for finding out what happened after
+    // the fact. The ring has a fixed size and the oldest messages are
+    // overwritten, so it can be left on all the time. Recording a
+    // message takes no lock and does not allocate: it is one atomic
+    // add, one QueryPerformanceCounter call and a slot written.
+    //
+    // Input is recorded in the driver's callback, before filtering.
+    // Output is recorded once the device has taken it, which, when
+    // pacing, is before it reaches the wire. Messages the device 
+    // fails to send or has no room for are not recorded. Long 
+    // messages are recorded by length only.
+    //
+    // Snapshot, WriteBinary and WriteMIDIFile take a copy while the
+    // devices keep recording; messages being overwritten as they are
+    // copied are left out.
+    //----------------------------------------------------------------
+
+
+    class CMIDICapture
+    {
+    public:
+        // Which way a message went
+        enum Direction { CAPTURE_IN, CAPTURE_OUT };
+
+        // Default number of messages kept
+        enum { DEFAULT_CAPACITY = 65536 };
+
+        // Construction. Capacity is rounded up to a power of two.
+        explicit CMIDICapture(std::size_t Capacity = DEFAULT_CAPACITY);
+
+        // Destruction
+        ~CMIDICapture();
+
+        // Records a short message
+        void RecordMsg(Direction Dir, WORD Port, DWORD Msg);
+
+        // Records several short messages with one time
+        void RecordMsgs(Direction Dir, WORD Port, const DWORD *Msgs,
+                        std::size_t Count);
+
+        // Records that a long message went through
+        void RecordLongMsg(Direction Dir, WORD Port, DWORD MsgLength);
+
+        // Forgets everything recorded so far
+        void Clear();
+
+        // Gets the number of messages kept
+        std::size_t GetCapacity() const { return m_Mask + 1; }
+
+        // Replaces the contents of Events with the messages still
+        // kept, oldest first. Returns the number of messages.
+        std::size_t Snapshot(
+                        std::vector<CMIDICaptureEvent> &Events) const;
+
+        // Writes the messages kept to a file: "MCAP", the format
+        // version, the QueryPerformanceFrequency value and the number
+        // of events, then each event's time, message, port, direction
+        // and long flag, all little endian. Replaces any file already
+        // there.
+        void WriteBinary(LPCSTR FileName) const;
+
+        // Writes the short messages kept that went one way through one
+        // port as a format 0 Standard MIDI File, timed like
+        // CMIDIRecorder files. Replaces any file already there.
+        void WriteMIDIFile(LPCSTR FileName, Direction Dir,
+                           WORD Port) const;
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDICapture(const CMIDICapture &);
+        CMIDICapture &operator = (const CMIDICapture &);
+
+        // Writes a slot
+        void Store(LONGLONG Index, LONGLONG Time, DWORD Msg,
+                   DWORD Info);
+
+        // Gets the current time
+        static LONGLONG GetCounter();
+
+    // Private class declarations
+    private:
+        // A recorded message. Sequence is odd while the slot is being
+        // written and two more than twice the message's index once it
+        // has been.
+        struct CSlot
+        {
+            std::atomic<LONGLONG> Sequence;
+            std::atomic<LONGLONG> Time;
+            std::atomic<DWORD>    Msg;
+            std::atomic<DWORD>    Info;
+        };
+
+    // Private attributes and constants
+    private:
+        CSlot                *m_Slots;
+        std::size_t           m_Mask;
+
+        // Index of the next message, and of the first one not
+        // cleared
+        std::atomic<LONGLONG> m_Next;
+        std::atomic<LONGLONG> m_First;
+    };
+}
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,90 @@
+/*********************************************************************
+ * MIDIDeviceManager.cpp - Implementation for CMIDIDeviceManager.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIDeviceManager.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIDeviceManager;
+using midi::CMIDIWorker;
+
+
+//--------------------------------------------------------------------
+// CMIDIDeviceManager implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIDeviceManager::CMIDIDeviceManager(std::size_t ThreadCount) :
+m_Workers(NULL),
+m_WorkerCount((ThreadCount > 0) ? ThreadCount : 1),
+m_NextWorker(0)
+{
+    // The workers only start their threads once a device is opened
+    m_Workers = new CMIDIWorker[m_WorkerCount];
+}
+
+
+// Destructor
+CMIDIDeviceManager::~CMIDIDeviceManager()
+{
+    delete [] m_Workers;
+}
+
+
+// Manages an input device
+void CMIDIDeviceManager::Manage(midi::CMIDIInDevice &Device)
+{
+    Device.SetWorker(NextWorker());
+}
+
+
+// Manages an output device
+void CMIDIDeviceManager::Manage(midi::CMIDIOutDevice &Device)
+{
+    Device.SetWorker(NextWorker());
+}
+
+
+// Manages a stream output device
+void CMIDIDeviceManager::Manage(midi::CMIDIStreamOutDevice &Device)
+{
+    Device.SetWorker(NextWorker());
+}
+
+
+// Gets the number of devices being serviced
+std::size_t CMIDIDeviceManager::GetActiveCount() const
+{
+    std::size_t Count = 0;
+
+    for(std::size_t i = 0; i < m_WorkerCount; i++)
+    {
+        Count += m_Workers[i].GetEventCount();
+    }
+
+    return Count;
+}
+
+
+// Gets the worker for the next device
+CMIDIWorker *CMIDIDeviceManager::NextWorker()
+{
+    // Hand out the workers in turn to spread devices evenly
+    CMIDIWorker *Worker = &m_Workers[m_NextWorker];
+
+    m_NextWorker = (m_NextWorker + 1) % m_WorkerCount;
+
+    return Worker;
+}
\ No newline at end of file
@@ -0,0 +1,93 @@
+#ifndef MIDI_DEVICE_MANAGER_H
+#define MIDI_DEVICE_MANAGER_H
+
+
+/*********************************************************************
+ * MIDIDeviceManager.h - Interface for CMIDIDeviceManager.
+ *
+ * Note: You must link to the winmm.lib to use these classes.
+ ********************************************************************/
+
+
+#pragma warning(disable:4786) // Disable annoying template warnings
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the devices being managed
+#include "MIDIInDevice.h"
+#include "MIDIOutDevice.h"
+#include "MIDIStreamOutDevice.h"
+
+// Necessary for the worker threads
+#include "MIDIWorker.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIDeviceManager
+    //
+    // Services the headers of many MIDI devices from a small, fixed
+    // number of threads. Each device handed to Manage is given one
+    // of the manager's workers in turn, so that with many ports open
+    // there are only ThreadCount threads managing headers rather than
+    // one per device.
+    //
+    // Devices must be managed before they are opened (or before
+    // recording starts, for input devices), and must be closed
+    // before the manager is destroyed.
+    //----------------------------------------------------------------
+
+
+    class CMIDIDeviceManager
+    {
+    public:
+        // Default number of worker threads
+        enum { DEFAULT_THREAD_COUNT = 2 };
+
+        // Construction. ThreadCount is the number of worker threads;
+        // at least one is used.
+        explicit CMIDIDeviceManager(std::size_t ThreadCount =
+                                                 DEFAULT_THREAD_COUNT);
+
+        // Destruction
+        ~CMIDIDeviceManager();
+
+        // Has one of the manager's threads manage the device's
+        // headers
+        void Manage(CMIDIInDevice &Device);
+        void Manage(CMIDIOutDevice &Device);
+        void Manage(CMIDIStreamOutDevice &Device);
+
+        // Gets the number of worker threads
+        std::size_t GetThreadCount() const { return m_WorkerCount; }
+
+        // Gets the number of devices being serviced right now
+        std::size_t GetActiveCount() const;
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIDeviceManager(const CMIDIDeviceManager &);
+        CMIDIDeviceManager &operator = (const CMIDIDeviceManager &);
+
+        // Gets the worker for the next device
+        CMIDIWorker *NextWorker();
+
+    // Private attributes and constants
+    private:
+        CMIDIWorker *m_Workers;
+        std::size_t  m_WorkerCount;
+        std::size_t  m_NextWorker;
+    };
+}
+
+
+#endif
\ No newline at end of file
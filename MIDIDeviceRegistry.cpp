@@ -0,0 +1,415 @@
+/*********************************************************************
+ * MIDIDeviceRegistry.cpp - Implementation for CMIDIDeviceRegistry.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIDeviceRegistry.h"
+#include "MIDIInDevice.h"
+#include "MIDIOutDevice.h"
+#include <algorithm>
+
+// Necessary for the WM_DEVICECHANGE events
+#include <dbt.h>
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIDeviceRegistry;
+using midi::CMIDIDeviceListener;
+using midi::CMIDIInDevice;
+using midi::CMIDIOutDevice;
+using midi::CMIDIInException;
+using midi::CMIDIOutException;
+
+
+namespace
+{
+    //----------------------------------------------------------------
+    // Device matching helpers
+    //----------------------------------------------------------------
+
+
+    // Determines if two devices look like the same device
+    template<class Info>
+    bool IsSameDevice(const Info &Device1, const Info &Device2)
+    {
+        return Device1.Caps.wMid == Device2.Caps.wMid &&
+               Device1.Caps.wPid == Device2.Caps.wPid &&
+               ::lstrcmp(Device1.Caps.szPname,
+                         Device2.Caps.szPname) == 0;
+    }
+
+
+    // Gives the devices just read the IDs they had before, and new
+    // IDs to those that were not there. Returns true if any device
+    // came, went or was renumbered.
+    template<class Info>
+    bool MatchDevices(std::vector<Info> &Devices,
+                      const std::vector<Info> &OldDevices,
+                      DWORD &NextId)
+    {
+        bool Changed = Devices.size() != OldDevices.size();
+        std::vector<bool> Matched(OldDevices.size(), false);
+
+        for(std::size_t i = 0; i < Devices.size(); i++)
+        {
+            std::size_t j = 0;
+
+            // Devices that look alike are matched in order
+            while(j < OldDevices.size() &&
+                  (Matched[j] || !IsSameDevice(Devices[i],
+                                               OldDevices[j])))
+            {
+                j++;
+            }
+
+            if(j < OldDevices.size())
+            {
+                Matched[j] = true;
+                Devices[i].Id = OldDevices[j].Id;
+
+                if(Devices[i].DeviceId != OldDevices[j].DeviceId)
+                {
+                    Changed = true;
+                }
+            }
+            else
+            {
+                if(NextId == CMIDIDeviceRegistry::INVALID_ID)
+                {
+                    NextId++;
+                }
+
+                Devices[i].Id = NextId;
+                NextId++;
+                Changed = true;
+            }
+        }
+
+        return Changed;
+    }
+
+
+    // Finds a device by its ID
+    template<class Info>
+    bool FindDevice(const std::vector<Info> &Devices, DWORD Id,
+                    Info &Device)
+    {
+        for(std::size_t i = 0; i < Devices.size(); i++)
+        {
+            if(Devices[i].Id == Id)
+            {
+                Device = Devices[i];
+                return true;
+            }
+        }
+
+        return false;
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIDeviceRegistry implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIDeviceRegistry::CMIDIDeviceRegistry() :
+m_NextId(INVALID_ID + 1),
+m_ChangeCount(0)
+{
+    ::InitializeCriticalSection(&m_RefreshLock);
+    ::InitializeCriticalSection(&m_Lock);
+
+    try
+    {
+        Refresh();
+
+        // Reading the devices for the first time is not a change
+        m_ChangeCount.store(0);
+    }
+    // If the devices could not be read, the destructor will not run,
+    // so clean up here and rethrow exception
+    catch(...)
+    {
+        ::DeleteCriticalSection(&m_Lock);
+        ::DeleteCriticalSection(&m_RefreshLock);
+        throw;
+    }
+}
+
+
+// Destructor
+CMIDIDeviceRegistry::~CMIDIDeviceRegistry()
+{
+    ::DeleteCriticalSection(&m_Lock);
+    ::DeleteCriticalSection(&m_RefreshLock);
+}
+
+
+// Reads the devices again
+void CMIDIDeviceRegistry::Refresh()
+{
+    ::EnterCriticalSection(&m_RefreshLock);
+
+    try
+    {
+        std::vector<CInDeviceInfo> InDevices;
+        std::vector<COutDeviceInfo> OutDevices;
+
+        // Asking the drivers is the slow part, so the cached lists
+        // can still be read meanwhile
+        bool InChanged = ReadInDevices(InDevices);
+        bool OutChanged = ReadOutDevices(OutDevices);
+
+        if(InChanged || OutChanged)
+        {
+            ::EnterCriticalSection(&m_Lock);
+
+            m_InDevices.swap(InDevices);
+            m_OutDevices.swap(OutDevices);
+
+            ::LeaveCriticalSection(&m_Lock);
+
+            m_ChangeCount.fetch_add(1);
+
+            for(std::size_t i = 0; i < m_Listeners.size(); i++)
+            {
+                m_Listeners[i]->OnDevicesChanged(*this);
+            }
+        }
+    }
+    // If reading the devices or a listener failed, release the lock
+    // and rethrow exception
+    catch(...)
+    {
+        ::LeaveCriticalSection(&m_RefreshLock);
+        throw;
+    }
+
+    ::LeaveCriticalSection(&m_RefreshLock);
+}
+
+
+// Refreshes if devices could have come or gone
+void CMIDIDeviceRegistry::OnDeviceChange(WPARAM Event)
+{
+    if(Event == DBT_DEVNODES_CHANGED || Event == DBT_DEVICEARRIVAL ||
+       Event == DBT_DEVICEREMOVECOMPLETE)
+    {
+        Refresh();
+    }
+}
+
+
+// Gets the number of input devices
+std::size_t CMIDIDeviceRegistry::GetInDeviceCount() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    std::size_t Count = m_InDevices.size();
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Count;
+}
+
+
+// Gets the number of output devices
+std::size_t CMIDIDeviceRegistry::GetOutDeviceCount() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    std::size_t Count = m_OutDevices.size();
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Count;
+}
+
+
+// Gets a copy of every input device
+void CMIDIDeviceRegistry::GetInDevices(
+                            std::vector<CInDeviceInfo> &Devices) const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    try
+    {
+        Devices = m_InDevices;
+    }
+    // If copying failed, release the lock and rethrow exception
+    catch(...)
+    {
+        ::LeaveCriticalSection(&m_Lock);
+        throw;
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Gets a copy of every output device
+void CMIDIDeviceRegistry::GetOutDevices(
+                           std::vector<COutDeviceInfo> &Devices) const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    try
+    {
+        Devices = m_OutDevices;
+    }
+    // If copying failed, release the lock and rethrow exception
+    catch(...)
+    {
+        ::LeaveCriticalSection(&m_Lock);
+        throw;
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Finds an input device by its ID
+bool CMIDIDeviceRegistry::FindInDevice(DWORD Id,
+                                       CInDeviceInfo &Info) const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    bool Found = FindDevice(m_InDevices, Id, Info);
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Found;
+}
+
+
+// Finds an output device by its ID
+bool CMIDIDeviceRegistry::FindOutDevice(DWORD Id,
+                                        COutDeviceInfo &Info) const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    bool Found = FindDevice(m_OutDevices, Id, Info);
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Found;
+}
+
+
+// Gets the number of times the list has changed
+DWORD CMIDIDeviceRegistry::GetChangeCount() const
+{
+    return m_ChangeCount.load();
+}
+
+
+// Adds a listener
+void CMIDIDeviceRegistry::Subscribe(CMIDIDeviceListener &Listener)
+{
+    ::EnterCriticalSection(&m_RefreshLock);
+
+    try
+    {
+        m_Listeners.push_back(&Listener);
+    }
+    // If memory allocation failed, release the lock and rethrow
+    // exception
+    catch(...)
+    {
+        ::LeaveCriticalSection(&m_RefreshLock);
+        throw;
+    }
+
+    ::LeaveCriticalSection(&m_RefreshLock);
+}
+
+
+// Removes a listener
+void CMIDIDeviceRegistry::Unsubscribe(CMIDIDeviceListener &Listener)
+{
+    // Waits for any refresh telling the listeners to finish
+    ::EnterCriticalSection(&m_RefreshLock);
+
+    m_Listeners.erase(std::remove(m_Listeners.begin(),
+                                  m_Listeners.end(), &Listener),
+                      m_Listeners.end());
+
+    ::LeaveCriticalSection(&m_RefreshLock);
+}
+
+
+// Reads the input devices
+bool CMIDIDeviceRegistry::ReadInDevices(
+                                  std::vector<CInDeviceInfo> &Devices)
+{
+    UINT Count = CMIDIInDevice::GetNumDevs();
+
+    Devices.reserve(Count);
+
+    for(UINT i = 0; i < Count; i++)
+    {
+        CInDeviceInfo Info;
+
+        Info.Id = INVALID_ID;
+        Info.DeviceId = i;
+
+        // A device removed while reading is left out. The next
+        // refresh will catch up.
+        try
+        {
+            CMIDIInDevice::GetDevCaps(i, Info.Caps);
+        }
+        catch(const CMIDIInException &)
+        {
+            continue;
+        }
+
+        Devices.push_back(Info);
+    }
+
+    return MatchDevices(Devices, m_InDevices, m_NextId);
+}
+
+
+// Reads the output devices
+bool CMIDIDeviceRegistry::ReadOutDevices(
+                                 std::vector<COutDeviceInfo> &Devices)
+{
+    UINT Count = CMIDIOutDevice::GetNumDevs();
+
+    Devices.reserve(Count);
+
+    for(UINT i = 0; i < Count; i++)
+    {
+        COutDeviceInfo Info;
+
+        Info.Id = INVALID_ID;
+        Info.DeviceId = i;
+
+        // A device removed while reading is left out. The next
+        // refresh will catch up.
+        try
+        {
+            CMIDIOutDevice::GetDevCaps(i, Info.Caps);
+        }
+        catch(const CMIDIOutException &)
+        {
+            continue;
+        }
+
+        Devices.push_back(Info);
+    }
+
+    return MatchDevices(Devices, m_OutDevices, m_NextId);
+}
\ No newline at end of file
@@ -0,0 +1,181 @@
+#ifndef MIDI_DEVICE_REGISTRY_H
+#define MIDI_DEVICE_REGISTRY_H
+
+
+/*********************************************************************
+ * MIDIDeviceRegistry.h - Interface for CMIDIDeviceRegistry and
+ *                        related classes.
+ *
+ * Note: You must link to the winmm.lib to use these classes.
+ ********************************************************************/
+
+
+#pragma warning(disable:4786) // Disable annoying template warnings
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for MIDIINCAPS and MIDIOUTCAPS
+#include <mmsystem.h>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the cached devices and the listeners
+#include <vector>
+
+// Necessary for the change count read from any thread
+#include <atomic>
+
+
+namespace midi
+{
+    class CMIDIDeviceRegistry;
+
+
+    //----------------------------------------------------------------
+    // CMIDIDeviceListener
+    //
+    // Told by a CMIDIDeviceRegistry when devices come or go.
+    //----------------------------------------------------------------
+
+
+    class CMIDIDeviceListener
+    {
+    public:
+        virtual ~CMIDIDeviceListener() {}
+
+        // Called after a refresh found devices added, removed or
+        // renumbered. It is called on the thread that refreshed, and
+        // may read the registry but not refresh it, subscribe or
+        // unsubscribe.
+        virtual void OnDevicesChanged(CMIDIDeviceRegistry &Registry) = 0;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIDeviceRegistry
+    //
+    // Keeps the list of MIDI input and output devices and their
+    // capabilities, so that asking for them does not go to the
+    // drivers each time. The list is only read again by Refresh,
+    // which the window procedure of the application triggers by
+    // passing WM_DEVICECHANGE on to OnDeviceChange.
+    //
+    // Each device is given an ID that stays the same when devices
+    // before it come or go and the device IDs used to open them
+    // change. A device is known again by its manufacturer, product and
+    // name, and, for devices that share all three, by their order.
+    // Use FindInDevice and FindOutDevice to get the current device ID
+    // for opening.
+    //
+    // Listeners subscribed to the registry are told when a refresh
+    // changes the list, so there is no need to poll. The registry may
+    // be read from any thread, including while it is refreshing.
+    //----------------------------------------------------------------
+
+
+    class CMIDIDeviceRegistry
+    {
+    public:
+        // ID that no device is given
+        enum { INVALID_ID = 0 };
+
+        // A MIDI input device
+        struct CInDeviceInfo
+        {
+            // ID that stays the same while the device is attached
+            DWORD      Id;
+
+            // ID to open the device with until the next change
+            UINT       DeviceId;
+
+            MIDIINCAPS Caps;
+        };
+
+        // A MIDI output device
+        struct COutDeviceInfo
+        {
+            // ID that stays the same while the device is attached
+            DWORD       Id;
+
+            // ID to open the device with until the next change
+            UINT        DeviceId;
+
+            MIDIOUTCAPS Caps;
+        };
+
+        // Construction. Reads the devices for the first time.
+        CMIDIDeviceRegistry();
+
+        // Destruction
+        ~CMIDIDeviceRegistry();
+
+        // Reads the devices again and tells the listeners if anything
+        // changed
+        void Refresh();
+
+        // Refreshes if a WM_DEVICECHANGE message with this WPARAM
+        // could mean devices came or went
+        void OnDeviceChange(WPARAM Event);
+
+        // Gets the number of devices
+        std::size_t GetInDeviceCount() const;
+        std::size_t GetOutDeviceCount() const;
+
+        // Gets a copy of every device
+        void GetInDevices(std::vector<CInDeviceInfo> &Devices) const;
+        void GetOutDevices(std::vector<COutDeviceInfo> &Devices) const;
+
+        // Finds a device by its ID. Returns false if the device is no
+        // longer attached.
+        bool FindInDevice(DWORD Id, CInDeviceInfo &Info) const;
+        bool FindOutDevice(DWORD Id, COutDeviceInfo &Info) const;
+
+        // Gets the number of times the list has changed, for those
+        // that would rather check than subscribe
+        DWORD GetChangeCount() const;
+
+        // Adds a listener. It must be unsubscribed before it is
+        // destroyed.
+        void Subscribe(CMIDIDeviceListener &Listener);
+
+        // Removes a listener. Once this returns, the listener is no
+        // longer being called.
+        void Unsubscribe(CMIDIDeviceListener &Listener);
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIDeviceRegistry(const CMIDIDeviceRegistry &);
+        CMIDIDeviceRegistry &operator = (const CMIDIDeviceRegistry &);
+
+        // Reads the devices and gives them IDs. Returns true if the
+        // list changed.
+        bool ReadInDevices(std::vector<CInDeviceInfo> &Devices);
+        bool ReadOutDevices(std::vector<COutDeviceInfo> &Devices);
+
+    // Private attributes and constants
+    private:
+        std::vector<CInDeviceInfo>         m_InDevices;
+        std::vector<COutDeviceInfo>        m_OutDevices;
+        std::vector<CMIDIDeviceListener *> m_Listeners;
+        DWORD                              m_NextId;
+        std::atomic<DWORD>                 m_ChangeCount;
+
+        // Held while reading the devices and telling the listeners
+        CRITICAL_SECTION         m_RefreshLock;
+
+        // Held while the cached lists are read or replaced
+        mutable CRITICAL_SECTION m_Lock;
+    };
+}
+
+
+#endif
\ No newline at end of file
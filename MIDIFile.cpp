@@ -0,0 +1,928 @@
+/*********************************************************************
+ * MIDIFile.cpp - Implementation for CMIDIFile and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIFile.h"
+#include "MIDIParser.h"
+#include "midi.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIFile;
+using midi::CMIDIFileCursor;
+using midi::CMIDIFileEvent;
+using midi::CMIDITrackReader;
+using midi::CMIDITrackWriter;
+using midi::CMIDIFileBadFormat;
+using midi::CMIDIFileMemFailure;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Size of a chunk header: four byte type and four byte length
+const DWORD CHUNK_HEADER_SIZE = 8;
+
+// Smallest header chunk length
+const DWORD HEADER_LENGTH = 6;
+
+// Tempo used until the file sets one, in microseconds per quarter
+// note
+const DWORD DEFAULT_TEMPO = 500000;
+
+// Bit set in the time division for SMPTE timing
+const WORD SMPTE_DIVISION = 0x8000;
+
+// Number of messages CMIDIFileCursor::Schedule gathers before
+// passing them to the sequencer
+const std::size_t SCHEDULE_BATCH_SIZE = 256;
+
+// Largest number that fits in a variable length quantity
+const DWORD MAX_NUMBER = 0x0FFFFFFF;
+
+
+namespace
+{
+    //----------------------------------------------------------------
+    // Big endian helpers
+    //----------------------------------------------------------------
+
+
+    // Reads a 16 bit number
+    WORD ReadWord(const unsigned char *Data)
+    {
+        return static_cast<WORD>((Data[0] << 8) | Data[1]);
+    }
+
+
+    // Reads a 32 bit number
+    DWORD ReadDWord(const unsigned char *Data)
+    {
+        return (static_cast<DWORD>(Data[0]) << 24) |
+               (static_cast<DWORD>(Data[1]) << 16) |
+               (static_cast<DWORD>(Data[2]) << 8) |
+                static_cast<DWORD>(Data[3]);
+    }
+
+
+    // Determines if a chunk has the given type
+    bool IsChunk(const unsigned char *Data, const char *Type)
+    {
+        return Data[0] == Type[0] && Data[1] == Type[1] &&
+               Data[2] == Type[2] && Data[3] == Type[3];
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDITrackReader implementation
+//--------------------------------------------------------------------
+
+
+// Constructs an empty reader
+CMIDITrackReader::CMIDITrackReader() :
+m_Begin(NULL),
+m_End(NULL),
+m_Pos(NULL),
+m_Track(0),
+m_Tick(0),
+m_RunningStatus(0)
+{}
+
+
+// Constructor
+CMIDITrackReader::CMIDITrackReader(const unsigned char *Begin,
+                                   const unsigned char *End,
+                                   std::size_t Track) :
+m_Begin(Begin),
+m_End(End),
+m_Pos(Begin),
+m_Track(Track),
+m_Tick(0),
+m_RunningStatus(0)
+{}
+
+
+// Reads the next event
+bool CMIDITrackReader::Next(CMIDIFileEvent &Event)
+{
+    if(IsAtEnd())
+    {
+        return false;
+    }
+
+    m_Tick += ReadNumber();
+
+    Event.Tick = m_Tick;
+    Event.Time = 0;
+    Event.Track = m_Track;
+    Event.Msg = 0;
+    Event.MetaType = 0;
+    Event.Data = NULL;
+    Event.Length = 0;
+
+    unsigned char Status = ReadByte();
+    unsigned char DataByte1 = 0;
+    bool Running = false;
+
+    // A data byte means the status of the last channel message is
+    // carried over
+    if(Status < midi::NOTE_OFF)
+    {
+        if(m_RunningStatus == 0)
+        {
+            throw CMIDIFileBadFormat();
+        }
+
+        DataByte1 = Status;
+        Status = m_RunningStatus;
+        Running = true;
+    }
+
+    Event.Status = Status;
+
+    if(Status == midi::META_EVENT ||
+       Status == midi::SYSTEM_EXCLUSIVE ||
+       Status == midi::END_OF_EXCLUSIVE)
+    {
+        // Meta events and system exclusive data cancel running status
+        m_RunningStatus = 0;
+
+        if(Status == midi::META_EVENT)
+        {
+            Event.EventType = CMIDIFileEvent::META;
+            Event.MetaType = ReadByte();
+        }
+        else
+        {
+            Event.EventType = CMIDIFileEvent::SYSEX;
+        }
+
+        Event.Length = ReadNumber();
+
+        // If the data runs past the end of the track, the file is
+        // damaged
+        if(Event.Length > static_cast<DWORD>(m_End - m_Pos))
+        {
+            throw CMIDIFileBadFormat();
+        }
+
+        Event.Data = m_Pos;
+        m_Pos += Event.Length;
+
+        // Anything after the end of the track is ignored
+        if(Event.EventType == CMIDIFileEvent::META &&
+           Event.MetaType == midi::META_END_OF_TRACK)
+        {
+            m_Pos = m_End;
+        }
+    }
+    // Other system messages cannot appear in a file
+    else if(Status >= midi::SYSTEM_EXCLUSIVE)
+    {
+        throw CMIDIFileBadFormat();
+    }
+    else
+    {
+        m_RunningStatus = Status;
+
+        DWORD DataLength = CMIDIParser::GetDataLength(Status);
+        unsigned char Data[2] = { 0, 0 };
+
+        for(DWORD i = 0; i < DataLength; i++)
+        {
+            if(i == 0 && Running)
+            {
+                Data[i] = DataByte1;
+            }
+            else
+            {
+                Data[i] = ReadByte();
+
+                if(Data[i] >= midi::NOTE_OFF)
+                {
+                    throw CMIDIFileBadFormat();
+                }
+            }
+        }
+
+        Event.EventType = CMIDIFileEvent::SHORT_MSG;
+        Event.Msg = midi::CShortMsg(Status, Data[0], Data[1]).GetMsg();
+    }
+
+    return true;
+}
+
+
+// Goes back to the start of the track
+void CMIDITrackReader::Reset()
+{
+    m_Pos = m_Begin;
+    m_Tick = 0;
+    m_RunningStatus = 0;
+}
+
+
+// Determines if there are no more events
+bool CMIDITrackReader::IsAtEnd() const
+{
+    return m_Pos >= m_End;
+}
+
+
+// Reads a variable length quantity
+DWORD CMIDITrackReader::ReadNumber()
+{
+    DWORD Number = 0;
+
+    // Seven bits per byte, most significant first, at most four bytes
+    for(int i = 0; i < 4; i++)
+    {
+        unsigned char Byte = ReadByte();
+
+        Number = (Number << 7) | (Byte & midi::DATA_BYTE_MASK);
+
+        if(Byte < midi::NOTE_OFF)
+        {
+            return Number;
+        }
+    }
+
+    throw CMIDIFileBadFormat();
+}
+
+
+// Reads a byte
+unsigned char CMIDITrackReader::ReadByte()
+{
+    // If the track ends part way through an event, the file is damaged
+    if(m_Pos >= m_End)
+    {
+        throw CMIDIFileBadFormat();
+    }
+
+    unsigned char Byte = *m_Pos;
+
+    m_Pos++;
+
+    return Byte;
+}
+
+
+//--------------------------------------------------------------------
+// CMIDITrackWriter implementation
+//--------------------------------------------------------------------
+
+
+// The file header, the track chunk header and a tempo of 500000
+// microseconds per quarter note
+const unsigned char CMIDITrackWriter::FILE_HEADER[FILE_HEADER_SIZE] =
+{
+    'M', 'T', 'h', 'd', 0, 0, 0, 6,
+    0, 0,           // Format 0
+    0, 1,           // One track
+    0x01, 0xF4,     // 500 ticks per quarter note
+    'M', 'T', 'r', 'k', 0, 0, 0, 0,
+    0, midi::META_EVENT, midi::META_TEMPO, 3, 0x07, 0xA1, 0x20
+};
+
+// The end of the track
+const unsigned char 
+CMIDITrackWriter::END_OF_TRACK[END_OF_TRACK_SIZE] =
+{
+    0, midi::META_EVENT, midi::META_END_OF_TRACK, 0
+};
+
+
+// Constructor
+CMIDITrackWriter::CMIDITrackWriter() :
+m_LastTime(0),
+m_HasEvent(false),
+m_RunningStatus(0)
+{}
+
+
+// Starts a new track
+void CMIDITrackWriter::Reset()
+{
+    m_HasEvent = false;
+    m_RunningStatus = 0;
+}
+
+
+// Encodes the time since the last event
+DWORD CMIDITrackWriter::PutDelta(unsigned char *Data, DWORD Time)
+{
+    // The track starts at the first event
+    if(!m_HasEvent)
+    {
+        m_LastTime = Time;
+        m_HasEvent = true;
+    }
+
+    DWORD Delta = 0;
+
+    // Times that go backwards are treated as simultaneous, and only
+    // a later time moves the track on
+    if(static_cast<LONG>(Time - m_LastTime) > 0)
+    {
+        Delta = Time - m_LastTime;
+        m_LastTime = Time;
+    }
+
+    return PutNumber(Data, Delta);
+}
+
+
+// Encodes a short message
+DWORD CMIDITrackWriter::PutShortMsg(unsigned char *Data, DWORD Msg)
+{
+    midi::CShortMsg ShortMsg(Msg);
+    unsigned char Status = ShortMsg.GetStatus();
+    unsigned char Bytes[2] = { ShortMsg.GetData1(), 
+                               ShortMsg.GetData2() };
+    DWORD DataLength = CMIDIParser::GetDataLength(Status);
+    DWORD Count = 0;
+
+    if(ShortMsg.IsChannelMsg())
+    {
+        // Leave out the status when it is the same as last time
+        if(Status != m_RunningStatus)
+        {
+            Data[Count] = Status;
+            Count++;
+            m_RunningStatus = Status;
+        }
+    }
+    // Other messages have no place in a file of their own, so they are
+    // escaped
+    else
+    {
+        Data[Count] = midi::END_OF_EXCLUSIVE;
+        Count++;
+        Count += PutNumber(Data + Count, 1 + DataLength);
+        Data[Count] = Status;
+        Count++;
+
+        m_RunningStatus = 0;
+    }
+
+    for(DWORD i = 0; i < DataLength; i++)
+    {
+        Data[Count] = Bytes[i];
+        Count++;
+    }
+
+    return Count;
+}
+
+
+// Makes the next channel message write its status
+void CMIDITrackWriter::CancelRunningStatus()
+{
+    m_RunningStatus = 0;
+}
+
+
+// Encodes a variable length quantity
+DWORD CMIDITrackWriter::PutNumber(unsigned char *Data, DWORD Number)
+{
+    DWORD Count = 0;
+
+    if(Number > MAX_NUMBER)
+    {
+        Number = MAX_NUMBER;
+    }
+
+    // Seven bits per byte, most significant first, with the top bit
+    // set on all but the last
+    for(int Shift = 21; Shift > 0; Shift -= 7)
+    {
+        if(Number >> Shift)
+        {
+            Data[Count] = static_cast<unsigned char>(
+                ((Number >> Shift) & midi::DATA_BYTE_MASK) | 
+                midi::NOTE_OFF);
+            Count++;
+        }
+    }
+
+    Data[Count] = 
+            static_cast<unsigned char>(Number & midi::DATA_BYTE_MASK);
+
+    return Count + 1;
+}
+
+
+// Encodes a track length
+void CMIDITrackWriter::PutLength(unsigned char *Data, DWORD Length)
+{
+    for(int i = 0; i < 4; i++)
+    {
+        Data[i] = static_cast<unsigned char>(Length >> ((3 - i) * 8));
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIFile implementation
+//--------------------------------------------------------------------
+
+
+// Constructs an object with no file
+CMIDIFile::CMIDIFile() :
+m_File(INVALID_HANDLE_VALUE),
+m_Mapping(NULL),
+m_View(NULL),
+m_Size(0),
+m_Format(0),
+m_Division(0),
+m_Tracks(NULL),
+m_TrackCount(0)
+{}
+
+
+// Constructs an object and opens a file
+CMIDIFile::CMIDIFile(LPCSTR FileName) :
+m_File(INVALID_HANDLE_VALUE),
+m_Mapping(NULL),
+m_View(NULL),
+m_Size(0),
+m_Format(0),
+m_Division(0),
+m_Tracks(NULL),
+m_TrackCount(0)
+{
+    Open(FileName);
+}
+
+
+// Destruction
+CMIDIFile::~CMIDIFile()
+{
+    Close();
+}
+
+
+// Opens a file
+void CMIDIFile::Open(LPCSTR FileName)
+{
+    Close();
+
+    // The file is read from beginning to end, so let the system read
+    // ahead
+    m_File = ::CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ,
+                          NULL, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL |
+                          FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+    // If we are unable to open the file, throw exception
+    if(m_File == INVALID_HANDLE_VALUE)
+    {
+        throw CMIDIFileOpenFailure();
+    }
+
+    m_Size = ::GetFileSize(m_File, NULL);
+
+    // An empty file cannot be mapped, and is not a MIDI file anyway
+    if(m_Size == INVALID_FILE_SIZE || m_Size == 0)
+    {
+        Close();
+        throw CMIDIFileBadFormat();
+    }
+
+    m_Mapping = ::CreateFileMapping(m_File, NULL, PAGE_READONLY, 0, 0,
+                                    NULL);
+
+    if(m_Mapping != NULL)
+    {
+        m_View = static_cast<const unsigned char *>(
+                    ::MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+    }
+
+    // If we are unable to map the file, throw exception
+    if(m_View == NULL)
+    {
+        Close();
+        throw CMIDIFileOpenFailure();
+    }
+
+    try
+    {
+        ReadChunks();
+    }
+    catch(...)
+    {
+        Close();
+        throw;
+    }
+}
+
+
+// Closes the file
+void CMIDIFile::Close()
+{
+    delete [] m_Tracks;
+    m_Tracks = NULL;
+    m_TrackCount = 0;
+
+    if(m_View != NULL)
+    {
+        ::UnmapViewOfFile(m_View);
+        m_View = NULL;
+    }
+
+    if(m_Mapping != NULL)
+    {
+        ::CloseHandle(m_Mapping);
+        m_Mapping = NULL;
+    }
+
+    if(m_File != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_File);
+        m_File = INVALID_HANDLE_VALUE;
+    }
+
+    m_Size = 0;
+    m_Format = 0;
+    m_Division = 0;
+}
+
+
+// Determines if a file is open
+bool CMIDIFile::IsOpen() const
+{
+    return m_View != NULL;
+}
+
+
+// Gets the file format
+WORD CMIDIFile::GetFormat() const
+{
+    return m_Format;
+}
+
+
+// Gets the number of tracks
+std::size_t CMIDIFile::GetTrackCount() const
+{
+    return m_TrackCount;
+}
+
+
+// Gets the time division
+WORD CMIDIFile::GetDivision() const
+{
+    return m_Division;
+}
+
+
+// Gets a reader for a track
+CMIDITrackReader CMIDIFile::GetTrack(std::size_t Track) const
+{
+    // A track that does not exist has no events
+    if(Track >= m_TrackCount)
+    {
+        return CMIDITrackReader();
+    }
+
+    return CMIDITrackReader(m_Tracks[Track].Begin, m_Tracks[Track].End,
+                            Track);
+}
+
+
+// Reads the header and finds the tracks
+void CMIDIFile::ReadChunks()
+{
+    // If there is no header, this is not a MIDI file
+    if(m_Size < CHUNK_HEADER_SIZE + HEADER_LENGTH ||
+       !IsChunk(m_View, "MThd"))
+    {
+        throw CMIDIFileBadFormat();
+    }
+
+    DWORD HeaderLength = ReadDWord(m_View + 4);
+
+    if(HeaderLength < HEADER_LENGTH ||
+       HeaderLength > m_Size - CHUNK_HEADER_SIZE)
+    {
+        throw CMIDIFileBadFormat();
+    }
+
+    m_Format = ReadWord(m_View + CHUNK_HEADER_SIZE);
+    m_Division = ReadWord(m_View + CHUNK_HEADER_SIZE + 4);
+
+    WORD TrackCount = ReadWord(m_View + CHUNK_HEADER_SIZE + 2);
+
+    // Without a time division, ticks cannot be turned into time
+    if(m_Format > 2 || (m_Division & ~SMPTE_DIVISION) == 0 ||
+       ((m_Division & SMPTE_DIVISION) && (m_Division & 0xFF) == 0))
+    {
+        throw CMIDIFileBadFormat();
+    }
+
+    try
+    {
+        m_Tracks = new CTrack[TrackCount];
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDIFileMemFailure();
+    }
+
+    // Only the chunk headers are read here; the tracks themselves are
+    // not touched until they are played
+    DWORD Pos = CHUNK_HEADER_SIZE + HeaderLength;
+
+    while(m_TrackCount < TrackCount &&
+          m_Size - Pos >= CHUNK_HEADER_SIZE)
+    {
+        const unsigned char *Chunk = m_View + Pos;
+        DWORD Length = ReadDWord(Chunk + 4);
+
+        Pos += CHUNK_HEADER_SIZE;
+
+        // If the chunk runs past the end of the file, the file is
+        // damaged
+        if(Length > m_Size - Pos)
+        {
+            throw CMIDIFileBadFormat();
+        }
+
+        // Chunks of other types are skipped
+        if(IsChunk(Chunk, "MTrk"))
+        {
+            m_Tracks[m_TrackCount].Begin = m_View + Pos;
+            m_Tracks[m_TrackCount].End = m_View + Pos + Length;
+            m_TrackCount++;
+        }
+
+        Pos += Length;
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIFileCursor implementation
+//--------------------------------------------------------------------
+
+
+// Constructs a cursor for every track
+CMIDIFileCursor::CMIDIFileCursor(const CMIDIFile &File) :
+m_Readers(NULL),
+m_Pending(NULL),
+m_HasPending(NULL),
+m_Count(0)
+{
+    Init(File, 0, File.GetTrackCount());
+}
+
+
+// Constructs a cursor for one track
+CMIDIFileCursor::CMIDIFileCursor(const CMIDIFile &File,
+                                 std::size_t Track) :
+m_Readers(NULL),
+m_Pending(NULL),
+m_HasPending(NULL),
+m_Count(0)
+{
+    Init(File, Track, 1);
+}
+
+
+// Destruction
+CMIDIFileCursor::~CMIDIFileCursor()
+{
+    delete [] m_Readers;
+    delete [] m_Pending;
+    delete [] m_HasPending;
+}
+
+
+// Reads the next event
+bool CMIDIFileCursor::Next(midi::CMIDIFileEvent &Event)
+{
+    std::size_t Track;
+
+    if(!Peek(Track))
+    {
+        return false;
+    }
+
+    Take(Track, Event);
+
+    return true;
+}
+
+
+// Schedules the short messages due before a time
+std::size_t CMIDIFileCursor::Schedule(midi::CMIDISequencer &Sequencer,
+                                      DWORD Until, std::size_t Output)
+{
+    midi::CTimedMsg Batch[SCHEDULE_BATCH_SIZE];
+    std::size_t BatchCount = 0;
+    std::size_t Count = 0;
+    std::size_t Room = Sequencer.GetFreeCount();
+    std::size_t Track;
+
+    while(Peek(Track) && m_Pending[Track].Time < Until)
+    {
+        // A short message the sequencer has no room for is left 
+        // waiting for the next call
+        if(m_Pending[Track].EventType == CMIDIFileEvent::SHORT_MSG &&
+           Count + BatchCount == Room)
+        {
+            break;
+        }
+
+        CMIDIFileEvent Event;
+
+        Take(Track, Event);
+
+        // Only short messages can be sequenced
+        if(Event.EventType == CMIDIFileEvent::SHORT_MSG)
+        {
+            Batch[BatchCount].Msg = Event.Msg;
+            Batch[BatchCount].TimeStamp = Event.Time;
+            BatchCount++;
+
+            if(BatchCount == SCHEDULE_BATCH_SIZE)
+            {
+                Sequencer.ScheduleMsgs(Batch, BatchCount, Output);
+                Count += BatchCount;
+                BatchCount = 0;
+            }
+        }
+    }
+
+    if(BatchCount > 0)
+    {
+        Sequencer.ScheduleMsgs(Batch, BatchCount, Output);
+        Count += BatchCount;
+    }
+
+    return Count;
+}
+
+
+// Goes back to the start
+void CMIDIFileCursor::Reset()
+{
+    for(std::size_t i = 0; i < m_Count; i++)
+    {
+        m_Readers[i].Reset();
+        m_HasPending[i] = false;
+    }
+
+    m_Tempo = DEFAULT_TEMPO;
+    m_TempoTick = 0;
+    m_TempoTime = 0;
+}
+
+
+// Determines if there are no more events
+bool CMIDIFileCursor::IsAtEnd() const
+{
+    for(std::size_t i = 0; i < m_Count; i++)
+    {
+        if(m_HasPending[i] || !m_Readers[i].IsAtEnd())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Sets up the readers
+void CMIDIFileCursor::Init(const midi::CMIDIFile &File,
+                           std::size_t First, std::size_t Count)
+{
+    m_Count = Count;
+    m_Division = File.GetDivision();
+
+    try
+    {
+        m_Readers = new CMIDITrackReader[m_Count];
+        m_Pending = new CMIDIFileEvent[m_Count];
+        m_HasPending = new bool[m_Count];
+    }
+    // If memory allocation failed, the destructor will not run, so 
+    // clean up here and throw exception
+    catch(const std::bad_alloc &)
+    {
+        delete [] m_Readers;
+        delete [] m_Pending;
+        throw CMIDIFileMemFailure();
+    }
+
+    for(std::size_t i = 0; i < m_Count; i++)
+    {
+        m_Readers[i] = File.GetTrack(First + i);
+    }
+
+    Reset();
+}
+
+
+// Finds the track with the earliest waiting event
+bool CMIDIFileCursor::Peek(std::size_t &Track)
+{
+    bool Found = false;
+
+    for(std::size_t i = 0; i < m_Count; i++)
+    {
+        // Read ahead one event on each track
+        if(!m_HasPending[i])
+        {
+            m_HasPending[i] = m_Readers[i].Next(m_Pending[i]);
+        }
+
+        // Earlier tracks go first when events are at the same tick
+        if(m_HasPending[i] &&
+           (!Found || m_Pending[i].Tick < m_Pending[Track].Tick))
+        {
+            Track = i;
+            Found = true;
+        }
+    }
+
+    // Every event before this one has been taken, so the tempo in
+    // effect is known
+    if(Found)
+    {
+        m_Pending[Track].Time = static_cast<DWORD>(
+                            TickToMicros(m_Pending[Track].Tick) / 1000);
+    }
+
+    return Found;
+}
+
+
+// Takes the waiting event of a track
+void CMIDIFileCursor::Take(std::size_t Track,
+                           midi::CMIDIFileEvent &Event)
+{
+    Event = m_Pending[Track];
+    m_HasPending[Track] = false;
+
+    // Tempo changes take effect from their own tick
+    if(Event.EventType == CMIDIFileEvent::META &&
+       Event.MetaType == midi::META_TEMPO && Event.Length == 3)
+    {
+        m_TempoTime = TickToMicros(Event.Tick);
+        m_TempoTick = Event.Tick;
+        m_Tempo = (static_cast<DWORD>(Event.Data[0]) << 16) |
+                  (static_cast<DWORD>(Event.Data[1]) << 8) |
+                   static_cast<DWORD>(Event.Data[2]);
+    }
+}
+
+
+// Converts a tick to microseconds
+ULONGLONG CMIDIFileCursor::TickToMicros(DWORD Tick) const
+{
+    ULONGLONG Micros;
+
+    // SMPTE timing is fixed: the high byte is minus the frame rate
+    // and the low byte is ticks per frame. Tempo changes are ignored.
+    if(m_Division & SMPTE_DIVISION)
+    {
+        int FrameRate = -static_cast<signed char>(m_Division >> 8);
+        ULONGLONG TicksPerFrame = m_Division & 0xFF;
+
+        // 29 stands for 29.97 frames per second
+        if(FrameRate == 29)
+        {
+            Micros = Tick * ULONGLONG(1001000000) /
+                     (30000 * TicksPerFrame);
+        }
+        else
+        {
+            Micros = Tick * ULONGLONG(1000000) /
+                     (FrameRate * TicksPerFrame);
+        }
+    }
+    else
+    {
+        Micros = m_TempoTime +
+                 ULONGLONG(Tick - m_TempoTick) * m_Tempo / m_Division;
+    }
+
+    return Micros;
+}
\ No newline at end of file
@@ -0,0 +1,410 @@
+#ifndef MIDI_FILE_H
+#define MIDI_FILE_H
+
+
+/*********************************************************************
+ * MIDIFile.h - Interface for CMIDIFile and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+
+// Necessary for std::bad_alloc
+#include <new>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for CMIDISequencer
+#include "MIDISequencer.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // Constants
+    //----------------------------------------------------------------
+
+
+    // Status byte introducing a meta event in a Standard MIDI File
+    const unsigned char META_EVENT = 0xFF;
+
+    // Meta event types
+    const unsigned char META_END_OF_TRACK = 0x2F;
+    const unsigned char META_TEMPO = 0x51;
+
+
+    //----------------------------------------------------------------
+    // CMIDIFile exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when memory allocation fails within a CMIDIFile or
+    // CMIDIFileCursor object
+    class CMIDIFileMemFailure : public std::bad_alloc
+    {
+    public:
+        const char *what() const throw()
+        { return "Memory allocation within a CMIDIFile object "
+                 "failed."; }
+    };
+
+
+    // Thrown when a Standard MIDI File cannot be opened
+    class CMIDIFileOpenFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to open or map the Standard MIDI File."; }
+    };
+
+
+    // Thrown when a Standard MIDI File is damaged or is not a
+    // Standard MIDI File
+    class CMIDIFileBadFormat : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Standard MIDI File is damaged or has an unknown "
+                 "format."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIFileEvent
+    //
+    // An event read from a track. Data points straight into the
+    // mapped file, so it stays valid only while the CMIDIFile is
+    // open.
+    //----------------------------------------------------------------
+
+
+    struct CMIDIFileEvent
+    {
+        enum Type { SHORT_MSG, SYSEX, META };
+
+        Type        EventType;
+
+        // Time in ticks from the start of the track
+        DWORD       Tick;
+
+        // Time in milliseconds from the start of the sequence; only
+        // filled in by CMIDIFileCursor
+        DWORD       Time;
+
+        // Track the event came from
+        std::size_t Track;
+
+        // Status byte. For SYSEX events, SYSTEM_EXCLUSIVE starts a
+        // message and END_OF_EXCLUSIVE continues one or escapes raw
+        // bytes.
+        unsigned char Status;
+
+        // Packed short message, for SHORT_MSG events
+        DWORD       Msg;
+
+        // Meta event type, for META events
+        unsigned char MetaType;
+
+        // System exclusive or meta event data, not including the
+        // status byte
+        const unsigned char *Data;
+        DWORD                Length;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDITrackReader
+    //
+    // Decodes the events of one track as they are asked for. Nothing
+    // is copied or allocated.
+    //----------------------------------------------------------------
+
+
+    class CMIDITrackReader
+    {
+    public:
+        // Construction
+        CMIDITrackReader();
+        CMIDITrackReader(const unsigned char *Begin,
+                         const unsigned char *End,
+                         std::size_t Track = 0);
+
+        // Reads the next event. Returns false at the end of the
+        // track. Throws CMIDIFileBadFormat if the track is damaged.
+        bool Next(CMIDIFileEvent &Event);
+
+        // Goes back to the start of the track
+        void Reset();
+
+        // Returns true if there are no more events
+        bool IsAtEnd() const;
+
+    // Private methods
+    private:
+        // Reads a variable length quantity
+        DWORD ReadNumber();
+
+        // Reads a byte
+        unsigned char ReadByte();
+
+    // Private attributes and constants
+    private:
+        const unsigned char *m_Begin;
+        const unsigned char *m_End;
+        const unsigned char *m_Pos;
+        std::size_t          m_Track;
+        DWORD                m_Tick;
+        unsigned char        m_RunningStatus;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDITrackWriter
+    //
+    // Encodes the format 0 files that CMIDIRecorder and CMIDICapture
+    // write: one track at 500 ticks per quarter note and a tempo of
+    // 500000 microseconds per quarter note, so that a tick is a
+    // millisecond. Events are encoded into the caller's buffer, so
+    // nothing is allocated.
+    //
+    // Channel messages use running status. Other short messages have
+    // no place in a file of their own, so they are escaped.
+    //----------------------------------------------------------------
+
+
+    class CMIDITrackWriter
+    {
+    public:
+        // Bytes in the file header, which ends with the track chunk
+        // header and the tempo
+        enum { FILE_HEADER_SIZE = 29 };
+
+        // Where the track length goes in the file header
+        enum { TRACK_LENGTH_OFFSET = 18 };
+
+        // Where the track data starts
+        enum { TRACK_OFFSET = 22 };
+
+        // Bytes in the end of the track
+        enum { END_OF_TRACK_SIZE = 4 };
+
+        // Most bytes a variable length quantity takes
+        enum { MAX_NUMBER_SIZE = 4 };
+
+        // Most bytes a short message takes, not counting its time: 
+        // an escape byte, a length and the message itself
+        enum { MAX_SHORT_MSG_SIZE = 5 };
+
+        // The file header, with a track length of zero, and the end
+        // of the track
+        static const unsigned char FILE_HEADER[FILE_HEADER_SIZE];
+        static const unsigned char END_OF_TRACK[END_OF_TRACK_SIZE];
+
+        // Construction
+        CMIDITrackWriter();
+
+        // Starts a new track
+        void Reset();
+
+        // Encodes the time since the last event. The first time 
+        // starts the track, and times that go backwards count as
+        // simultaneous. Returns the number of bytes written.
+        DWORD PutDelta(unsigned char *Data, DWORD Time);
+
+        // Encodes a short message. Returns the number of bytes
+        // written.
+        DWORD PutShortMsg(unsigned char *Data, DWORD Msg);
+
+        // Makes the next channel message write its status, such as 
+        // after system exclusive data
+        void CancelRunningStatus();
+
+        // Encodes a variable length quantity. Returns the number of 
+        // bytes written.
+        static DWORD PutNumber(unsigned char *Data, DWORD Number);
+
+        // Encodes a track length, most significant byte first
+        static void PutLength(unsigned char *Data, DWORD Length);
+
+    // Private attributes and constants
+    private:
+        DWORD         m_LastTime;
+        bool          m_HasEvent;
+        unsigned char m_RunningStatus;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIFile
+    //
+    // Reads a Standard MIDI File by mapping it into memory. Opening
+    // only reads the header and finds the tracks; events are decoded
+    // by CMIDITrackReader or CMIDIFileCursor as they are needed.
+    //----------------------------------------------------------------
+
+
+    class CMIDIFile
+    {
+    public:
+        // Construction
+        CMIDIFile();
+        explicit CMIDIFile(LPCSTR FileName);
+
+        // Destruction
+        ~CMIDIFile();
+
+        // Opens a file
+        void Open(LPCSTR FileName);
+
+        // Closes the file. Event data read from it is no longer valid.
+        void Close();
+
+        // Returns true if a file is open
+        bool IsOpen() const;
+
+        // Gets the file format: 0, 1 or 2
+        WORD GetFormat() const;
+
+        // Gets the number of tracks
+        std::size_t GetTrackCount() const;
+
+        // Gets the time division as stored in the file: ticks per
+        // quarter note, or SMPTE frames and ticks per frame if the top
+        // bit is set
+        WORD GetDivision() const;
+
+        // Gets a reader for a track
+        CMIDITrackReader GetTrack(std::size_t Track) const;
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIFile(const CMIDIFile &);
+        CMIDIFile &operator = (const CMIDIFile &);
+
+        // Reads the header and finds the tracks
+        void ReadChunks();
+
+    // Private class declarations
+    private:
+        // Where a track is in the file
+        struct CTrack
+        {
+            const unsigned char *Begin;
+            const unsigned char *End;
+        };
+
+    // Private attributes and constants
+    private:
+        HANDLE               m_File;
+        HANDLE               m_Mapping;
+        const unsigned char *m_View;
+        DWORD                m_Size;
+
+        WORD                 m_Format;
+        WORD                 m_Division;
+        CTrack              *m_Tracks;
+        std::size_t          m_TrackCount;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIFileCursor
+    //
+    // Walks the events of a file in time order, merging the tracks
+    // and following tempo changes to give each event its time in
+    // milliseconds. Use one cursor per track for format 2 files,
+    // whose tracks are separate sequences.
+    //
+    // The cursor takes the place of an event index. An index would
+    // have to decode every track when the file is opened and keep
+    // an entry per event, which is the startup cost and the memory
+    // the mapped file is there to avoid. The cursor decodes each
+    // track only as far as playback has got, holds one waiting
+    // event per track, and hands events to the sequencer straight
+    // from the mapped file. Seeking means walking from the start,
+    // which Reset and Next make cheap enough for files that play
+    // for minutes.
+    //----------------------------------------------------------------
+
+
+    class CMIDIFileCursor
+    {
+    public:
+        // Construction. Walks every track of the file.
+        explicit CMIDIFileCursor(const CMIDIFile &File);
+
+        // Construction. Walks one track.
+        CMIDIFileCursor(const CMIDIFile &File, std::size_t Track);
+
+        // Destruction
+        ~CMIDIFileCursor();
+
+        // Reads the next event. Returns false at the end.
+        bool Next(CMIDIFileEvent &Event);
+
+        // Schedules the short messages in the file that are due
+        // before Until milliseconds. Playing a large file a few
+        // seconds ahead keeps the number of waiting events small.
+        // Returns the number of messages scheduled. Only as many 
+        // messages as the sequencer has room for are taken; the rest
+        // wait for the next call. Nothing else should schedule into 
+        // the sequencer while this runs.
+        std::size_t Schedule(CMIDISequencer &Sequencer, DWORD Until,
+                             std::size_t Output = 0);
+
+        // Goes back to the start
+        void Reset();
+
+        // Returns true if there are no more events
+        bool IsAtEnd() const;
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIFileCursor(const CMIDIFileCursor &);
+        CMIDIFileCursor &operator = (const CMIDIFileCursor &);
+
+        // Sets up the readers
+        void Init(const CMIDIFile &File, std::size_t First,
+                  std::size_t Count);
+
+        // Finds the track with the earliest waiting event and works
+        // out its time. Returns false if there are none.
+        bool Peek(std::size_t &Track);
+
+        // Takes the waiting event of a track
+        void Take(std::size_t Track, CMIDIFileEvent &Event);
+
+        // Converts a tick to microseconds
+        ULONGLONG TickToMicros(DWORD Tick) const;
+
+    // Private attributes and constants
+    private:
+        CMIDITrackReader *m_Readers;
+        CMIDIFileEvent   *m_Pending;
+        bool             *m_HasPending;
+        std::size_t       m_Count;
+
+        WORD              m_Division;
+
+        // Tempo in microseconds per quarter note, and the tick and
+        // time in microseconds at which it took effect
+        DWORD             m_Tempo;
+        DWORD             m_TempoTick;
+        ULONGLONG         m_TempoTime;
+    };
+}
+
+
+#endif
\ No newline at end of file
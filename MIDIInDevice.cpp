@@ -14,6 +14,7 @@
 
 
 #include "MIDIInDevice.h"
+#include "MIDICapture.h"
 #include "midi.h"
 #include "pch.h"
 
@@ -25,7 +26,349 @@
 
 using midi::CMIDIInDevice;
 using midi::CMIDIReceiver;
+using midi::CMIDICapture;
 using midi::CMIDIInException;
+using midi::CSPSCRing;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Channel mask letting every channel through
+const DWORD ALL_CHANNELS = 0xFFFF;
+
+
+//--------------------------------------------------------------------
+// Bulk unpacking helpers
+//
+// UnpackShortMsgs and MatchCommand use the widest instruction set
+// the processor supports, found the first time either is called. 
+// AVX2 code is marked per function, so the rest of the file does not
+// need to be compiled for AVX2.
+//--------------------------------------------------------------------
+
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || \
+    defined(__x86_64__)
+#define MIDI_USE_SIMD
+#endif
+
+
+#ifdef MIDI_USE_SIMD
+
+// Necessary for SSE2 and AVX2 intrinsics
+#include <immintrin.h>
+
+// Necessary for CPUID
+#ifdef _MSC_VER
+#include <intrin.h>
+#define MIDI_SSE2_FUNCTION
+#define MIDI_AVX2_FUNCTION
+#else
+#include <cpuid.h>
+#define MIDI_SSE2_FUNCTION __attribute__((target("sse2")))
+#define MIDI_AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+
+namespace
+{
+    // The vector code loads packed messages as 32 bit lanes
+    static_assert(sizeof(DWORD) == 4, "DWORD must be 32 bits");
+
+
+    // Instruction sets used for bulk unpacking
+    enum SimdLevel { SIMD_NONE, SIMD_SSE2, SIMD_AVX2 };
+
+
+    // Asks the processor, and for AVX2 the operating system, what is
+    // supported
+    SimdLevel DetectSimdLevel()
+    {
+        unsigned int Leaf1Ecx = 0;
+        unsigned int Leaf1Edx = 0;
+        unsigned int Leaf7Ebx = 0;
+        unsigned long long Xcr0 = 0;
+
+#ifdef _MSC_VER
+        int Info[4];
+
+        __cpuid(Info, 0);
+        int MaxLeaf = Info[0];
+
+        __cpuid(Info, 1);
+        Leaf1Ecx = Info[2];
+        Leaf1Edx = Info[3];
+
+        if(MaxLeaf >= 7)
+        {
+            __cpuidex(Info, 7, 0);
+            Leaf7Ebx = Info[1];
+        }
+
+        // XGETBV may only be used once the OS has enabled it
+        if((Leaf1Ecx & (1 << 27)) != 0)
+        {
+            Xcr0 = _xgetbv(0);
+        }
+#else
+        unsigned int Eax, Ebx, Ecx, Edx;
+
+        if(__get_cpuid(1, &Eax, &Ebx, &Ecx, &Edx))
+        {
+            Leaf1Ecx = Ecx;
+            Leaf1Edx = Edx;
+        }
+
+        if(__get_cpuid_count(7, 0, &Eax, &Ebx, &Ecx, &Edx))
+        {
+            Leaf7Ebx = Ebx;
+        }
+
+        // XGETBV may only be used once the OS has enabled it
+        if((Leaf1Ecx & (1 << 27)) != 0)
+        {
+            unsigned int Low, High;
+
+            __asm__("xgetbv" : "=a"(Low), "=d"(High) : "c"(0));
+            Xcr0 = (static_cast<unsigned long long>(High) << 32) | Low;
+        }
+#endif
+
+        // AVX2 also needs the OS to save the upper halves of the YMM
+        // registers on a context switch
+        bool HasAVX2 = ((Leaf7Ebx & (1 << 5)) != 0 && 
+                        (Leaf1Ecx & (1 << 28)) != 0 &&
+                        (Xcr0 & 6) == 6);
+
+        bool HasSSE2 = ((Leaf1Edx & (1 << 26)) != 0);
+
+        return HasAVX2 ? SIMD_AVX2 : (HasSSE2 ? SIMD_SSE2 : SIMD_NONE);
+    }
+
+
+    // Gets the instruction set to use
+    SimdLevel GetSimdLevel()
+    {
+        static const SimdLevel Level = DetectSimdLevel();
+
+        return Level;
+    }
+
+
+    // Counts the bits set
+    std::size_t CountBits(unsigned int Bits)
+    {
+        Bits = Bits - ((Bits >> 1) & 0x55555555);
+        Bits = (Bits & 0x33333333) + ((Bits >> 2) & 0x33333333);
+        Bits = (Bits + (Bits >> 4)) & 0x0F0F0F0F;
+
+        return (Bits * 0x01010101) >> 24;
+    }
+
+
+    //----------------------------------------------------------------
+    // SSE2, sixteen messages at a time
+    //----------------------------------------------------------------
+
+
+    MIDI_SSE2_FUNCTION inline __m128i Load128(const void *Src)
+    {
+        return _mm_loadu_si128(static_cast<const __m128i *>(Src));
+    }
+
+
+    MIDI_SSE2_FUNCTION inline void Store128(void *Dest, __m128i Value)
+    {
+        _mm_storeu_si128(static_cast<__m128i *>(Dest), Value);
+    }
+
+
+    // Gathers the byte at bit Shift of four registers of messages 
+    // into one register, in order
+    template<int Shift>
+    MIDI_SSE2_FUNCTION inline __m128i Gather128(const __m128i *Msgs)
+    {
+        const __m128i ByteMask = _mm_set1_epi32(0xFF);
+
+        __m128i Bytes[4];
+
+        for(int i = 0; i < 4; i++)
+        {
+            Bytes[i] = _mm_and_si128(_mm_srli_epi32(Msgs[i], Shift), 
+                                     ByteMask);
+        }
+
+        return _mm_packus_epi16(_mm_packs_epi32(Bytes[0], Bytes[1]),
+                                _mm_packs_epi32(Bytes[2], Bytes[3]));
+    }
+
+
+    // Unpacks messages from Start on. Returns where it stopped.
+    MIDI_SSE2_FUNCTION 
+    std::size_t UnpackSSE2(const DWORD *Msgs, std::size_t Count,
+                           const CMIDIInDevice::CShortMsgPlanes &Planes,
+                           std::size_t Start)
+    {
+        const __m128i ChannelMask = 
+                                 _mm_set1_epi8(midi::SHORT_MSG_MASK);
+
+        std::size_t i = Start;
+
+        for(; i + 16 <= Count; i += 16)
+        {
+            __m128i Group[4];
+
+            for(int j = 0; j < 4; j++)
+            {
+                Group[j] = Load128(Msgs + i + j * 4);
+            }
+
+            __m128i Status = Gather128<0>(Group);
+
+            Store128(Planes.Status + i, Status);
+            Store128(Planes.Channel + i, 
+                     _mm_and_si128(Status, ChannelMask));
+            Store128(Planes.DataByte1 + i, Gather128<8>(Group));
+            Store128(Planes.DataByte2 + i, Gather128<16>(Group));
+        }
+
+        return i;
+    }
+
+
+    // Matches status bytes from Start on. Returns where it stopped.
+    MIDI_SSE2_FUNCTION 
+    std::size_t MatchSSE2(const unsigned char *Status, std::size_t Count,
+                          unsigned char Command, unsigned char *Mask,
+                          std::size_t Start, std::size_t &Matches)
+    {
+        const __m128i CommandMask = _mm_set1_epi8(
+                       static_cast<char>(~midi::SHORT_MSG_MASK));
+        const __m128i Wanted = _mm_set1_epi8(static_cast<char>(Command));
+
+        std::size_t i = Start;
+
+        for(; i + 16 <= Count; i += 16)
+        {
+            __m128i Commands = _mm_and_si128(Load128(Status + i), 
+                                             CommandMask);
+            __m128i Result = _mm_cmpeq_epi8(Commands, Wanted);
+
+            Store128(Mask + i, Result);
+            Matches += CountBits(_mm_movemask_epi8(Result));
+        }
+
+        return i;
+    }
+
+
+    //----------------------------------------------------------------
+    // AVX2, thirty-two messages at a time
+    //----------------------------------------------------------------
+
+
+    MIDI_AVX2_FUNCTION inline __m256i Load256(const void *Src)
+    {
+        return _mm256_loadu_si256(static_cast<const __m256i *>(Src));
+    }
+
+
+    MIDI_AVX2_FUNCTION inline void Store256(void *Dest, __m256i Value)
+    {
+        _mm256_storeu_si256(static_cast<__m256i *>(Dest), Value);
+    }
+
+
+    // Gathers the byte at bit Shift of four registers of messages 
+    // into one register, in order
+    template<int Shift>
+    MIDI_AVX2_FUNCTION inline __m256i Gather256(const __m256i *Msgs)
+    {
+        const __m256i ByteMask = _mm256_set1_epi32(0xFF);
+
+        __m256i Bytes[4];
+
+        for(int i = 0; i < 4; i++)
+        {
+            Bytes[i] = _mm256_and_si256(
+                           _mm256_srli_epi32(Msgs[i], Shift), ByteMask);
+        }
+
+        __m256i Packed = _mm256_packus_epi16(
+                                _mm256_packs_epi32(Bytes[0], Bytes[1]),
+                                _mm256_packs_epi32(Bytes[2], Bytes[3]));
+
+        // Packing works within each 128 bit lane, which leaves groups
+        // of four messages interleaved between the lanes
+        return _mm256_permutevar8x32_epi32(Packed, 
+                              _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+    }
+
+
+    // Unpacks messages from Start on. Returns where it stopped.
+    MIDI_AVX2_FUNCTION 
+    std::size_t UnpackAVX2(const DWORD *Msgs, std::size_t Count,
+                           const CMIDIInDevice::CShortMsgPlanes &Planes,
+                           std::size_t Start)
+    {
+        const __m256i ChannelMask = 
+                              _mm256_set1_epi8(midi::SHORT_MSG_MASK);
+
+        std::size_t i = Start;
+
+        for(; i + 32 <= Count; i += 32)
+        {
+            __m256i Group[4];
+
+            for(int j = 0; j < 4; j++)
+            {
+                Group[j] = Load256(Msgs + i + j * 8);
+            }
+
+            __m256i Status = Gather256<0>(Group);
+
+            Store256(Planes.Status + i, Status);
+            Store256(Planes.Channel + i, 
+                     _mm256_and_si256(Status, ChannelMask));
+            Store256(Planes.DataByte1 + i, Gather256<8>(Group));
+            Store256(Planes.DataByte2 + i, Gather256<16>(Group));
+        }
+
+        return i;
+    }
+
+
+    // Matches status bytes from Start on. Returns where it stopped.
+    MIDI_AVX2_FUNCTION 
+    std::size_t MatchAVX2(const unsigned char *Status, std::size_t Count,
+                          unsigned char Command, unsigned char *Mask,
+                          std::size_t Start, std::size_t &Matches)
+    {
+        const __m256i CommandMask = _mm256_set1_epi8(
+                       static_cast<char>(~midi::SHORT_MSG_MASK));
+        const __m256i Wanted = 
+                       _mm256_set1_epi8(static_cast<char>(Command));
+
+        std::size_t i = Start;
+
+        for(; i + 32 <= Count; i += 32)
+        {
+            __m256i Commands = _mm256_and_si256(Load256(Status + i), 
+                                                CommandMask);
+            __m256i Result = _mm256_cmpeq_epi8(Commands, Wanted);
+
+            Store256(Mask + i, Result);
+            Matches += CountBits(_mm256_movemask_epi8(Result));
+        }
+
+        return i;
+    }
+}
+
+#endif
 
 
 //--------------------------------------------------------------------
@@ -33,19 +376,83 @@ using midi::CMIDIInException;
 //--------------------------------------------------------------------
 
 
-// Constructor
+// Constructor for headers pointing at the caller's buffer
 CMIDIInDevice::CMIDIInHeader::CMIDIInHeader(HMIDIIN DevHandle,
                                             LPSTR Buffer, 
                                             DWORD BufferLength) :
-m_DevHandle(DevHandle)
+m_DevHandle(DevHandle),
+m_Buffer(NULL),
+m_Reserve(NULL),
+m_Done(false)
 {
     // Initialize header
     m_MIDIHdr.lpData         = Buffer;
     m_MIDIHdr.dwBufferLength = BufferLength;
     m_MIDIHdr.dwFlags        = 0;
+    m_MIDIHdr.dwUser         = reinterpret_cast<DWORD_PTR>(this);
+
+    Prepare();
+}
+
+
+// Constructor for headers owning their buffer
+CMIDIInDevice::CMIDIInHeader::CMIDIInHeader(HMIDIIN DevHandle,
+                                            DWORD BufferLength) :
+m_DevHandle(DevHandle),
+m_Buffer(new char[BufferLength]),
+m_Reserve(NULL),
+m_Done(false)
+{
+    // Initialize header
+    m_MIDIHdr.lpData         = m_Buffer;
+    m_MIDIHdr.dwBufferLength = BufferLength;
+    m_MIDIHdr.dwFlags        = 0;
+    m_MIDIHdr.dwUser         = reinterpret_cast<DWORD_PTR>(this);
+
+    try
+    {
+        Prepare();
+    }
+    // If preparing the header failed, release the buffer and 
+    // rethrow exception
+    catch(const CMIDIInException &)
+    {
+        delete [] m_Buffer;
+        throw;
+    }
+}
+
+
+// Constructor for headers belonging to a reserve
+CMIDIInDevice::CMIDIInHeader::CMIDIInHeader(HMIDIIN DevHandle,
+                                            CHeaderReserve *Reserve) :
+m_DevHandle(DevHandle),
+m_Buffer(NULL),
+m_Reserve(Reserve),
+m_Done(false)
+{
+    // Initialize header. It is prepared when it is attached.
+    m_MIDIHdr.lpData         = NULL;
+    m_MIDIHdr.dwBufferLength = 0;
+    m_MIDIHdr.dwFlags        = 0;
+    m_MIDIHdr.dwUser         = reinterpret_cast<DWORD_PTR>(this);
+}
+
+
+// Destructor. Unpreparing a header that is not prepared does nothing.
+CMIDIInDevice::CMIDIInHeader::~CMIDIInHeader()
+{
+    ::midiInUnprepareHeader(m_DevHandle, &m_MIDIHdr, 
+                            sizeof m_MIDIHdr);
+
+    delete [] m_Buffer;
+}
+
 
-    // Prepare header
-    MMRESULT Result = ::midiInPrepareHeader(DevHandle, &m_MIDIHdr,
+// Prepares header
+void CMIDIInDevice::CMIDIInHeader::Prepare()
+{
+    MMRESULT Result = ::midiInPrepareHeader(m_DevHandle, &m_MIDIHdr,
                                             sizeof m_MIDIHdr);
 
     // If an error occurred, throw exception
@@ -56,8 +463,21 @@ m_DevHandle(DevHandle)
 }
 
 
-// Destructor
-CMIDIInDevice::CMIDIInHeader::~CMIDIInHeader()
+// Points header at the caller's buffer and prepares it
+MMRESULT CMIDIInDevice::CMIDIInHeader::Attach(LPSTR Buffer, 
+                                              DWORD BufferLength)
+{
+    m_MIDIHdr.lpData         = Buffer;
+    m_MIDIHdr.dwBufferLength = BufferLength;
+    m_MIDIHdr.dwFlags        = 0;
+
+    return ::midiInPrepareHeader(m_DevHandle, &m_MIDIHdr, 
+                                 sizeof m_MIDIHdr);
+}
+
+
+// Unprepares header
+void CMIDIInDevice::CMIDIInHeader::Detach()
 {
     ::midiInUnprepareHeader(m_DevHandle, &m_MIDIHdr, 
                             sizeof m_MIDIHdr);
@@ -67,8 +487,7 @@ CMIDIInDevice::CMIDIInHeader::~CMIDIInHeader()
 // Add system exclusive buffer to queue
 void CMIDIInDevice::CMIDIInHeader::AddSysExBuffer()
 {
-    MMRESULT Result = ::midiInAddBuffer(m_DevHandle, &m_MIDIHdr,
-                                        sizeof m_MIDIHdr);
+    MMRESULT Result = TryAddSysExBuffer();
 
     // If an error occurred, throw exception
     if(Result != MMSYSERR_NOERROR)
@@ -78,15 +497,47 @@ void CMIDIInDevice::CMIDIInHeader::AddSysExBuffer()
 }
 
 
+// Add system exclusive buffer to queue without throwing
+MMRESULT CMIDIInDevice::CMIDIInHeader::TryAddSysExBuffer()
+{
+    m_Done.store(false, std::memory_order_relaxed);
+
+    return ::midiInAddBuffer(m_DevHandle, &m_MIDIHdr, 
+                             sizeof m_MIDIHdr);
+}
+
+
+// Marks the header as finished
+void CMIDIInDevice::CMIDIInHeader::SetDone()
+{
+    m_Done.store(true, std::memory_order_release);
+}
+
+
+// Determines if the header is finished
+bool CMIDIInDevice::CMIDIInHeader::IsDone() const
+{
+    return m_Done.load(std::memory_order_acquire);
+}
+
+
+// Gets the header object that owns a MIDIHDR structure
+CMIDIInDevice::CMIDIInHeader *
+CMIDIInDevice::CMIDIInHeader::FromMIDIHdr(MIDIHDR *MidiHdr)
+{
+    return reinterpret_cast<CMIDIInHeader *>(MidiHdr->dwUser);
+}
+
+
 //--------------------------------------------------------------------
 // CHeaderQueue implementation
 //--------------------------------------------------------------------
 
 
 // Constructor
-CMIDIInDevice::CHeaderQueue::CHeaderQueue()
+CMIDIInDevice::CHeaderQueue::CHeaderQueue(std::size_t Capacity) :
+m_HdrQueue(Capacity)
 {
-    ::InitializeCriticalSection(&m_CriticalSection);
 }
 
 
@@ -94,346 +545,1481 @@ CMIDIInDevice::CHeaderQueue::CHeaderQueue()
 CMIDIInDevice::CHeaderQueue::~CHeaderQueue()
 {
     RemoveAll();
-
-    ::DeleteCriticalSection(&m_CriticalSection);
 }
 
 
-// Add header to queue
+// Add header to queue. The caller must make sure the queue is not 
+// full.
 void CMIDIInDevice::CHeaderQueue::AddHeader(
                                  CMIDIInDevice::CMIDIInHeader *Header)
 {
-    ::EnterCriticalSection(&m_CriticalSection);
-
-    m_HdrQueue.push(Header);
-
-    ::LeaveCriticalSection(&m_CriticalSection);
+    m_HdrQueue.Push(Header);
 }
 
 
 // Remove header from queue
 void CMIDIInDevice::CHeaderQueue::RemoveHeader()
 {
-    ::EnterCriticalSection(&m_CriticalSection);
+    CMIDIInHeader *Header;
 
-    if(!m_HdrQueue.empty())
+    if(m_HdrQueue.Pop(Header))
     {
-        delete m_HdrQueue.front();
-        m_HdrQueue.pop();
+        ReleaseHeader(Header);
     }
+}
+
+
+// Remove finished headers from the front of the queue
+void CMIDIInDevice::CHeaderQueue::RemoveDone()
+{
+    CMIDIInHeader **Header = m_HdrQueue.Front();
 
-    ::LeaveCriticalSection(&m_CriticalSection);
+    // Several headers may have finished for a single wake up of the 
+    // header thread, so keep going until we reach one that is still
+    // in use
+    while(Header != NULL && (*Header)->IsDone())
+    {
+        ReleaseHeader(*Header);
+        m_HdrQueue.PopFront();
+
+        Header = m_HdrQueue.Front();
+    }
 }
 
 
 // Empty header queue
 void CMIDIInDevice::CHeaderQueue::RemoveAll()
 {
-    ::EnterCriticalSection(&m_CriticalSection);
+    CMIDIInHeader *Header;
 
-    while(!m_HdrQueue.empty())
+    while(m_HdrQueue.Pop(Header))
     {
-        delete m_HdrQueue.front();
-        m_HdrQueue.pop();
+        ReleaseHeader(Header);
     }
-
-    ::LeaveCriticalSection(&m_CriticalSection);
 }
 
 
 // Determines if the header queue is empty
 bool CMIDIInDevice::CHeaderQueue::IsEmpty()
 {
-    bool Result;
+    return m_HdrQueue.IsEmpty();
+}
 
-    ::EnterCriticalSection(&m_CriticalSection);
 
-    Result = m_HdrQueue.empty();
+// Determines if the header queue is full
+bool CMIDIInDevice::CHeaderQueue::IsFull()
+{
+    return m_HdrQueue.IsFull();
+}
 
-    ::LeaveCriticalSection(&m_CriticalSection);
 
-    return Result;
+// Deletes header or gives it back to its reserve
+void CMIDIInDevice::CHeaderQueue::ReleaseHeader(
+                                 CMIDIInDevice::CMIDIInHeader *Header)
+{
+    if(Header->GetReserve() != NULL)
+    {
+        Header->Detach();
+        Header->GetReserve()->ReturnHeader(Header);
+    }
+    else
+    {
+        delete Header;
+    }
 }
 
 
 //--------------------------------------------------------------------
-// CMIDIInDevice implementation
+// CHeaderPool implementation
 //--------------------------------------------------------------------
 
 
-// Constructs CMIDIInDevice object in an closed state
-CMIDIInDevice::CMIDIInDevice(CMIDIReceiver &Receiver) :
-m_Receiver(&Receiver),
-m_State(CLOSED)
+// Constructor
+CMIDIInDevice::CHeaderPool::CHeaderPool() :
+m_Headers(NULL),
+m_HeaderCount(0),
+m_AddedHeaders(NULL)
 {
-    // If we are unable to create signalling event, throw exception
-    if(!CreateEvent())
-    {
-        throw CMIDIInEventFailure();
-    }
 }
 
 
-// Constructs CMIDIInDevice object in an opened state
-CMIDIInDevice::CMIDIInDevice(UINT DeviceId, CMIDIReceiver &Receiver) :
-m_Receiver(&Receiver),
-m_State(CLOSED)
+// Destructor
+CMIDIInDevice::CHeaderPool::~CHeaderPool()
 {
-    // Open device
-    Open(DeviceId);
-
-    // If we are unable to create signalling event, throw exception
-    if(!CreateEvent())
-    {
-        Close();
-        throw CMIDIInEventFailure();
-    }
+    Destroy();
 }
 
 
-// Destruction
-CMIDIInDevice::~CMIDIInDevice()
+// Creates and prepares the pool's headers
+void CMIDIInDevice::CHeaderPool::Create(HMIDIIN DevHandle,
+                                        DWORD HeaderCount,
+                                        DWORD BufferSize)
 {
-    // Close device
-    Close();
+    // Get rid of any previous headers
+    Destroy();
+
+    try
+    {
+        m_AddedHeaders = new CSPSCRing<CMIDIInHeader *>(HeaderCount);
+        m_Headers = new CMIDIInHeader *[HeaderCount];
+
+        // Create headers, counting them as we go so that Destroy can
+        // clean up after a failure
+        for(m_HeaderCount = 0; m_HeaderCount < HeaderCount; 
+            m_HeaderCount++)
+        {
+            m_Headers[m_HeaderCount] = new CMIDIInHeader(DevHandle,
+                                                         BufferSize);
+        }
+    }
+    // If memory allocation failed, clean up and throw exception
+    catch(const std::bad_alloc &)
+    {
+        Destroy();
+        throw CMIDIInMemFailure();
+    }
+    // If preparing a header failed, clean up and rethrow exception
+    catch(const CMIDIInException &)
+    {
+        Destroy();
+        throw;
+    }
+}
+
+
+// Destroys the pool's headers. The device must have returned all of 
+// them.
+void CMIDIInDevice::CHeaderPool::Destroy()
+{
+    for(DWORD i = 0; i < m_HeaderCount; i++)
+    {
+        delete m_Headers[i];
+    }
+
+    delete [] m_Headers;
+    delete m_AddedHeaders;
+
+    m_Headers = NULL;
+    m_HeaderCount = 0;
+    m_AddedHeaders = NULL;
+}
+
+
+// Adds every buffer in the pool to the device
+void CMIDIInDevice::CHeaderPool::AddAll()
+{
+    CMIDIInHeader *Header;
+
+    // Forget the buffers added the last time we were recording - the
+    // device has returned them all by now
+    while(m_AddedHeaders != NULL && m_AddedHeaders->Pop(Header))
+    {
+    }
+
+    for(DWORD i = 0; i < m_HeaderCount; i++)
+    {
+        m_Headers[i]->AddSysExBuffer();
+        m_AddedHeaders->Push(m_Headers[i]);
+    }
+}
+
+
+// Adds finished buffers to the device again
+DWORD CMIDIInDevice::CHeaderPool::Recycle()
+{
+    DWORD Count = 0;
+
+    if(m_AddedHeaders == NULL)
+    {
+        return Count;
+    }
+
+    CMIDIInHeader **Header = m_AddedHeaders->Front();
+
+    // Buffers are filled in the order they were added, so keep going
+    // until we reach one that is still in use
+    while(Header != NULL && (*Header)->IsDone())
+    {
+        CMIDIInHeader *Finished = *Header;
+
+        m_AddedHeaders->PopFront();
+
+        try
+        {
+            Finished->AddSysExBuffer();
+            m_AddedHeaders->Push(Finished);
+            Count++;
+        }
+        // If the buffer could not be added again, leave it out of 
+        // the rotation until the pool is destroyed
+        catch(const CMIDIInException &)
+        {
+        }
+
+        Header = m_AddedHeaders->Front();
+    }
+
+    return Count;
+}
+
+
+//--------------------------------------------------------------------
+// CHeaderReserve implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIInDevice::CHeaderReserve::CHeaderReserve() :
+m_Headers(NULL),
+m_HeaderCount(0),
+m_FreeHeaders(NULL),
+m_Spare(NULL)
+{
+}
+
+
+// Destructor
+CMIDIInDevice::CHeaderReserve::~CHeaderReserve()
+{
+    Destroy();
+}
+
+
+// Creates the reserve's headers
+void CMIDIInDevice::CHeaderReserve::Create(HMIDIIN DevHandle,
+                                           DWORD HeaderCount)
+{
+    // Get rid of any previous headers
+    Destroy();
+
+    try
+    {
+        m_FreeHeaders = new CSPSCRing<CMIDIInHeader *>(HeaderCount);
+        m_Headers = new CMIDIInHeader *[HeaderCount];
+
+        // Create headers, counting them as we go so that Destroy can
+        // clean up after a failure
+        for(m_HeaderCount = 0; m_HeaderCount < HeaderCount; 
+            m_HeaderCount++)
+        {
+            m_Headers[m_HeaderCount] = new CMIDIInHeader(DevHandle,
+                                                         this);
+            m_FreeHeaders->Push(m_Headers[m_HeaderCount]);
+        }
+    }
+    // If memory allocation failed, clean up and throw exception
+    catch(const std::bad_alloc &)
+    {
+        Destroy();
+        throw CMIDIInMemFailure();
+    }
+}
+
+
+// Destroys the reserve's headers. The device must have returned all
+// of them.
+void CMIDIInDevice::CHeaderReserve::Destroy()
+{
+    for(DWORD i = 0; i < m_HeaderCount; i++)
+    {
+        delete m_Headers[i];
+    }
+
+    delete [] m_Headers;
+    delete m_FreeHeaders;
+
+    m_Headers = NULL;
+    m_HeaderCount = 0;
+    m_FreeHeaders = NULL;
+    m_Spare = NULL;
+}
+
+
+// Gets a free header
+CMIDIInDevice::CMIDIInHeader *
+CMIDIInDevice::CHeaderReserve::AcquireHeader()
+{
+    CMIDIInHeader *Header = NULL;
+
+    if(m_FreeHeaders != NULL)
+    {
+        // A header that could not be added earlier comes first
+        if(m_Spare != NULL)
+        {
+            Header = m_Spare;
+            m_Spare = NULL;
+        }
+        else
+        {
+            m_FreeHeaders->Pop(Header);
+        }
+    }
+
+    return Header;
+}
+
+
+// Gives back a header the device is finished with
+void CMIDIInDevice::CHeaderReserve::ReturnHeader(CMIDIInHeader *Header)
+{
+    m_FreeHeaders->Push(Header);
+}
+
+
+// Gives back a header that could not be added. The thread adding 
+// buffers is the one taking headers from the ring, so it cannot 
+// push; the header is kept aside until it is taken again.
+void CMIDIInDevice::CHeaderReserve::CancelHeader(CMIDIInHeader *Header)
+{
+    m_Spare = Header;
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIInDevice implementation
+//--------------------------------------------------------------------
+
+
+// Constructs CMIDIInDevice object in an closed state
+CMIDIInDevice::CMIDIInDevice(CMIDIReceiver &Receiver,
+                             std::size_t HdrQueueCapacity) :
+m_Worker(NULL),
+m_ActiveWorker(NULL),
+m_Receiver(&Receiver),
+m_ReceiverEpoch(0),
+m_HighResTimeStamps(false),
+m_HdrQueue(HdrQueueCapacity),
+m_PoolHeaderCount(0),
+m_PoolBufferSize(0),
+m_ReserveHeaderCount(0),
+m_DispatchMode(DISPATCH_DIRECT),
+m_DispatchQueueCapacity(DEFAULT_DISPATCH_QUEUE_CAPACITY),
+m_DispatchEvent(NULL),
+m_DispatchThread(NULL),
+m_DispatchQueue(NULL),
+m_DispatchWaiting(false),
+m_DroppedCount(0),
+m_StatusFilter(0),
+m_ChannelMask(ALL_CHANNELS),
+m_ClockCount(0),
+m_ClockBase(0),
+m_ClockProc(NULL),
+m_ClockContext(NULL),
+m_Capture(NULL),
+m_CapturePort(0),
+m_State(CLOSED)
+{
+    m_ReceiverUsers[0] = 0;
+    m_ReceiverUsers[1] = 0;
+
+    // If we are unable to create signalling event, throw exception
+    if(!CreateEvent())
+    {
+        throw CMIDIInEventFailure();
+    }
+}
+
+
+// Constructs CMIDIInDevice object in an opened state
+CMIDIInDevice::CMIDIInDevice(UINT DeviceId, CMIDIReceiver &Receiver,
+                             std::size_t HdrQueueCapacity) :
+m_Worker(NULL),
+m_ActiveWorker(NULL),
+m_Receiver(&Receiver),
+m_ReceiverEpoch(0),
+m_HighResTimeStamps(false),
+m_HdrQueue(HdrQueueCapacity),
+m_PoolHeaderCount(0),
+m_PoolBufferSize(0),
+m_ReserveHeaderCount(0),
+m_DispatchMode(DISPATCH_DIRECT),
+m_DispatchQueueCapacity(DEFAULT_DISPATCH_QUEUE_CAPACITY),
+m_DispatchEvent(NULL),
+m_DispatchThread(NULL),
+m_DispatchQueue(NULL),
+m_DispatchWaiting(false),
+m_DroppedCount(0),
+m_StatusFilter(0),
+m_ChannelMask(ALL_CHANNELS),
+m_ClockCount(0),
+m_ClockBase(0),
+m_ClockProc(NULL),
+m_ClockContext(NULL),
+m_Capture(NULL),
+m_CapturePort(0),
+m_State(CLOSED)
+{
+    m_ReceiverUsers[0] = 0;
+    m_ReceiverUsers[1] = 0;
+
+    // If we are unable to create signalling events, throw exception.
+    // The events have to exist before the device is opened.
+    if(!CreateEvent())
+    {
+        throw CMIDIInEventFailure();
+    }
+
+    try
+    {
+        // Open device
+        Open(DeviceId);
+    }
+    // If the device could not be opened, the destructor will not 
+    // run, so close the events here and rethrow exception
+    catch(...)
+    {
+        ::CloseHandle(m_Event);
+        ::CloseHandle(m_DispatchEvent);
+        throw;
+    }
+}
+
+
+// Destruction
+CMIDIInDevice::~CMIDIInDevice()
+{
+    // Close device
+    Close();
+
+    // Close handles to signalling events
+    ::CloseHandle(m_Event);
+    ::CloseHandle(m_DispatchEvent);
+}
+
+
+// Opens the MIDI input device
+void CMIDIInDevice::Open(UINT DeviceId)
+{
+    // Makes sure the previous device, if any, is closed before 
+    // opening another one
+    Close();
+
+    // Open MIDI input device
+    MMRESULT Result = ::midiInOpen(&m_DevHandle, DeviceId, 
+                                  reinterpret_cast<DWORD>(MidiInProc),
+                                  reinterpret_cast<DWORD>(this),
+                                  CALLBACK_FUNCTION);
+
+    // If opening failed, throw exception
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIInException(Result);
+    }
+
+    // Prepare the buffer pool, if one has been set up
+    if(m_PoolHeaderCount > 0)
+    {
+        try
+        {
+            m_HdrPool.Create(m_DevHandle, m_PoolHeaderCount, 
+                             m_PoolBufferSize);
+        }
+        // If the pool could not be created, close the device and 
+        // rethrow exception
+        catch(...)
+        {
+            ::midiInClose(m_DevHandle);
+            throw;
+        }
+    }
+
+    // Create the header reserve, if one has been set up
+    if(m_ReserveHeaderCount > 0)
+    {
+        try
+        {
+            m_HdrReserve.Create(m_DevHandle, m_ReserveHeaderCount);
+        }
+        // If the reserve could not be created, close the device and
+        // rethrow exception
+        catch(...)
+        {
+            m_HdrPool.Destroy();
+            ::midiInClose(m_DevHandle);
+            throw;
+        }
+    }
+
+    // Change state
+    m_State = OPENED;
+}
+
+
+// Closes the MIDI input device
+void CMIDIInDevice::Close()
+{
+    // If the device is recording, stop recording before closing the 
+    // device
+    if(m_State == RECORDING)
+    {
+        StopRecording();
+    }
+
+    // If the device is opened...
+    if(m_State == OPENED)
+    {
+        // Return any buffers that were added but never filled, and
+        // release their headers
+        ::midiInReset(m_DevHandle);
+        m_HdrQueue.RemoveAll();
+        m_HdrPool.Destroy();
+        m_HdrReserve.Destroy();
+
+        // Close the device
+        MMRESULT Result = ::midiInClose(m_DevHandle);
+
+        // If a failure occurred, throw exception
+        if(Result != MMSYSERR_NOERROR)
+        {
+            throw CMIDIInException(Result);
+        }
+
+        // There are no more callbacks, so the dispatch queue can go
+        delete m_DispatchQueue;
+        m_DispatchQueue = NULL;
+
+        // Change state
+        m_State = CLOSED;
+    }
+}
+
+
+// Adds a buffer for receiving system exclusive messages
+void CMIDIInDevice::AddSysExBuffer(LPSTR Buffer, DWORD BufferLength)
+{
+    // If too many buffers have been added, throw exception
+    if(m_HdrQueue.IsFull())
+    {
+        throw CMIDIInQueueFull();
+    }
+
+    CMIDIInHeader *Header;
+
+    m_Stats.AddHeaderAlloc();
+
+    try
+    {
+        // Create new header
+        Header = new CMIDIInHeader(m_DevHandle, Buffer, BufferLength);
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDIInMemFailure();
+    }
+    // If preparation for the header failed, rethrow exception
+    catch(const CMIDIInException &)
+    {
+        throw;
+    }
+
+    try
+    {
+        // Add header to queue
+        Header->AddSysExBuffer();
+        m_HdrQueue.AddHeader(Header);
+
+        // If the buffer was filled before it was queued, make sure 
+        // the header thread gets to it
+        if(Header->IsDone())
+        {
+            ::SetEvent(m_Event);
+        }
+    }
+    // If we are unable to add the buffer to the queue, delete header
+    // and throw exception
+    catch(const CMIDIInException &)
+    {
+        delete Header;
+        throw;
+    }
+}
+
+
+// Adds a buffer for receiving system exclusive messages without 
+// throwing or allocating
+MMRESULT CMIDIInDevice::TryAddSysExBuffer(LPSTR Buffer, 
+                                          DWORD BufferLength) noexcept
+{
+    if(m_State == CLOSED)
+    {
+        return MMSYSERR_INVALHANDLE;
+    }
+
+    if(m_HdrQueue.IsFull())
+    {
+        return MIDIERR_NOTREADY;
+    }
+
+    CMIDIInHeader *Header = m_HdrReserve.AcquireHeader();
+
+    if(Header == NULL)
+    {
+        return MMSYSERR_NOMEM;
+    }
+
+    MMRESULT Result = Header->Attach(Buffer, BufferLength);
+
+    if(Result == MMSYSERR_NOERROR)
+    {
+        Result = Header->TryAddSysExBuffer();
+    }
+
+    // If the buffer could not be added, give the header back
+    if(Result != MMSYSERR_NOERROR)
+    {
+        Header->Detach();
+        m_HdrReserve.CancelHeader(Header);
+        return Result;
+    }
+
+    m_Stats.AddPooledHeaders(1);
+
+    // Add header to queue
+    m_HdrQueue.AddHeader(Header);
+
+    // If the buffer was filled before it was queued, make sure the 
+    // header thread gets to it
+    if(Header->IsDone())
+    {
+        ::SetEvent(m_Event);
+    }
+
+    return MMSYSERR_NOERROR;
+}
+
+
+// Sets up the buffer pool used for system exclusive messages
+void CMIDIInDevice::SetSysExBufferPool(DWORD BufferCount, 
+                                       DWORD BufferSize)
+{
+    m_PoolHeaderCount = BufferCount;
+    m_PoolBufferSize = BufferSize;
+}
+
+
+// Sets up the header reserve used by TryAddSysExBuffer
+void CMIDIInDevice::SetSysExHeaderReserve(DWORD HeaderCount)
+{
+    m_ReserveHeaderCount = HeaderCount;
+}
+
+
+// Sets the worker used for managing headers
+void CMIDIInDevice::SetWorker(midi::CMIDIWorker *Worker)
+{
+    m_Worker = Worker;
+}
+
+
+// Starts the recording process
+void CMIDIInDevice::StartRecording()
+{
+    // Only begin recording if the MIDI input device has been opened
+    if(m_State == OPENED)
+    {
+        try
+        {
+            // Add the pool's buffers, if any
+            m_HdrPool.AddAll();
+        }
+        // If a buffer could not be added, take back the ones that 
+        // were and rethrow exception
+        catch(const CMIDIInException &)
+        {
+            ::midiInReset(m_DevHandle);
+            throw;
+        }
+
+        m_ActiveWorker = (m_Worker != NULL) ? m_Worker : &m_OwnWorker;
+
+        try
+        {
+            // Have the worker thread manage our headers
+            m_ActiveWorker->Add(m_Event, HeaderProc, this);
+        }
+        // If the worker could not take the device, take back the 
+        // buffers and rethrow exception
+        catch(...)
+        {
+            m_ActiveWorker = NULL;
+            ::midiInReset(m_DevHandle);
+            throw;
+        }
+
+        // Change state before the dispatch thread starts checking it
+        m_State = RECORDING;
+
+        try
+        {
+            // Set up the dispatch queue and thread, if needed
+            StartDispatching();
+        }
+        // If that failed, undo what we have done so far and rethrow
+        // exception
+        catch(...)
+        {
+            StopRecording();
+            throw;
+        }
+
+        // Start recording
+        MMRESULT Result = ::midiInStart(m_DevHandle);
+
+        // If recording attempt failed, revert back to opened state 
+        // and throw exception
+        if(Result != MMSYSERR_NOERROR)
+        {
+            StopRecording();
+            throw CMIDIInException(Result);
+        }
+    }
+}
+
+
+// Stops the recording process
+void CMIDIInDevice::StopRecording()
+{
+    // If the device is in fact recording...
+    if(m_State == RECORDING)
+    {
+        // Change state
+        m_State = OPENED;
+
+        // Take the device away from the worker thread. Once this 
+        // returns, the worker is finished with the header queue, 
+        // which may only be emptied by one thread at a time.
+        m_ActiveWorker->Remove(m_Event);
+        m_ActiveWorker = NULL;
+
+        // Reset the MIDI input device. This returns all of the 
+        // buffers; the pool's buffers stay prepared until the device
+        // is closed.
+        ::midiInReset(m_DevHandle);
+
+        // Stop dispatching and throw away any messages that were not
+        // dispatched; their headers are about to be released
+        StopDispatching();
+
+        // Empty header queue
+        m_HdrQueue.RemoveAll();
+    }
+}
+
+
+// Registers the MIDI receiver. Returns the previous receiver.
+CMIDIReceiver *CMIDIInDevice::SetReceiver(CMIDIReceiver &Receiver)
+{
+    CMIDIReceiver *PrevReceiver = m_Receiver.exchange(&Receiver);
+
+    // Dispatchers that got the previous receiver counted themselves
+    // before the exchange, in the slot of the epoch they read. Move 
+    // the epoch on and wait for the old slot to empty, twice, so 
+    // that both slots are covered while new dispatchers count 
+    // themselves in the slot not being waited for.
+    for(int i = 0; i < 2; i++)
+    {
+        DWORD Epoch = m_ReceiverEpoch.fetch_add(1);
+
+        while(m_ReceiverUsers[Epoch & 1].load() != 0)
+        {
+            ::SwitchToThread();
+        }
+    }
+
+    return PrevReceiver;
+}
+
+
+// Sets the capture recording messages received
+void CMIDIInDevice::SetCapture(midi::CMIDICapture *Capture, WORD Port)
+{
+    // The port is set first so that it goes with the new capture
+    m_CapturePort.store(Port, std::memory_order_relaxed);
+    m_Capture.store(Capture, std::memory_order_release);
+}
+
+
+// Determines if the MIDI input device is opened
+bool CMIDIInDevice::IsOpen() const
+{
+    return ((m_State == OPENED) || (m_State == RECORDING));
+}
+
+
+// Determines if the MIDI input device is recording
+bool CMIDIInDevice::IsRecording() const
+{
+    return (m_State == RECORDING);
+}
+
+
+// Turns high resolution time stamps on or off
+void CMIDIInDevice::SetHighResTimeStamps(bool Enable)
+{
+    m_HighResTimeStamps.store(Enable, std::memory_order_relaxed);
+}
+
+
+// Gets the frequency of the high resolution time stamp counter
+LONGLONG CMIDIInDevice::GetCounterFrequency()
+{
+    LARGE_INTEGER Frequency;
+
+    ::QueryPerformanceFrequency(&Frequency);
+
+    return Frequency.QuadPart;
+}
+
+
+// Sets how received messages are passed on to the receiver
+void CMIDIInDevice::SetDispatchMode(DispatchMode Mode, 
+                                    std::size_t QueueCapacity)
+{
+    m_DispatchMode = Mode;
+    m_DispatchQueueCapacity = QueueCapacity;
+}
+
+
+// Dispatches queued messages
+std::size_t CMIDIInDevice::DispatchMsgs()
+{
+    std::size_t Count = 0;
+
+    if(m_DispatchQueue != NULL)
+    {
+        // Only dispatch what is queued now, so that a steady stream
+        // of messages cannot keep us here forever
+        std::size_t Available = m_DispatchQueue->GetSize();
+
+        // The receiver is only changed between calls
+        DWORD Slot;
+        CMIDIReceiver *Receiver = AcquireReceiver(Slot);
+        midi::CMIDIBatchReceiver *BatchReceiver = NULL;
+
+        // Batches only carry millisecond time stamps
+        if(!m_HighResTimeStamps.load(std::memory_order_relaxed))
+        {
+            BatchReceiver = Receiver->GetBatchReceiver();
+        }
+
+        midi::CTimedMsg Batch[MAX_BATCH_SIZE];
+        std::size_t BatchSize = 0;
+
+        for(; Count < Available; Count++)
+        {
+            CQueuedMsg *Queued = m_DispatchQueue->Front();
+
+            // Gather short messages for a batch receiver
+            if(BatchReceiver != NULL && Queued->Msg == MIM_DATA)
+            {
+                Batch[BatchSize].Msg = 
+                                  static_cast<DWORD>(Queued->Param1);
+                Batch[BatchSize].TimeStamp = Queued->Param2;
+                BatchSize++;
+
+                m_DispatchQueue->PopFront();
+
+                if(BatchSize == MAX_BATCH_SIZE)
+                {
+                    DispatchBatch(BatchReceiver, Batch, BatchSize);
+                    BatchSize = 0;
+                }
+
+                continue;
+            }
+
+            // Anything else ends the batch, to keep messages in order
+            if(BatchSize > 0)
+            {
+                DispatchBatch(BatchReceiver, Batch, BatchSize);
+                BatchSize = 0;
+            }
+
+            DispatchMsg(Receiver, Queued->Msg, Queued->Param1, 
+                        Queued->Param2, Queued->Counter);
+
+            m_DispatchQueue->PopFront();
+        }
+
+        if(BatchSize > 0)
+        {
+            DispatchBatch(BatchReceiver, Batch, BatchSize);
+        }
+
+        ReleaseReceiver(Slot);
+    }
+
+    return Count;
+}
+
+
+// Waits for messages to be queued
+bool CMIDIInDevice::WaitForMsgs(DWORD Timeout)
+{
+    bool Result = false;
+
+    if(m_DispatchQueue != NULL)
+    {
+        Result = WaitForQueue(Timeout);
+    }
+
+    return Result;
+}
+
+
+// Gets the number of messages dropped because the queue was full
+DWORD CMIDIInDevice::GetDroppedCount() const
+{
+    return m_DroppedCount.load(std::memory_order_relaxed);
+}
+
+
+// Turns statistics on or off
+void CMIDIInDevice::EnableStats(bool Enable)
+{
+    m_Stats.Enable(Enable);
+}
+
+
+// Takes a snapshot of the statistics
+void CMIDIInDevice::GetStats(midi::CMIDIStatsSnapshot &Stats) const
+{
+    m_Stats.GetSnapshot(Stats);
+}
+
+
+// Sets the statistics back to zero
+void CMIDIInDevice::ResetStats()
+{
+    m_Stats.Reset();
+}
+
+
+// Filters messages by status
+void CMIDIInDevice::SetStatusFilter(unsigned char Status, bool Filter)
+{
+    DWORD Bit = GetFilterBit(Status);
+
+    if(Filter)
+    {
+        m_StatusFilter.fetch_or(1UL << Bit, std::memory_order_relaxed);
+    }
+    else
+    {
+        m_StatusFilter.fetch_and(~(1UL << Bit), 
+                                 std::memory_order_relaxed);
+    }
+}
+
+
+// Filters channel messages by channel
+void CMIDIInDevice::SetChannelMask(WORD Mask)
+{
+    m_ChannelMask.store(Mask, std::memory_order_relaxed);
+}
+
+
+// Sets the function called for every TIMING_CLOCK message
+void CMIDIInDevice::SetClockProc(ClockProc Proc, void *Context)
+{
+    // The callback reads these without any synchronization
+    if(m_State != RECORDING)
+    {
+        m_ClockProc = Proc;
+        m_ClockContext = Context;
+    }
+}
+
+
+// Gets the number of TIMING_CLOCK messages received
+DWORD CMIDIInDevice::GetClockCount() const
+{
+    return m_ClockCount.load(std::memory_order_relaxed) -
+           m_ClockBase.load(std::memory_order_relaxed);
+}
+
+
+// Resets the TIMING_CLOCK count
+void CMIDIInDevice::ResetClockCount()
+{
+    // The count itself is only written by the driver's callback, so
+    // remember where it was instead
+    m_ClockBase.store(m_ClockCount.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+}
+
+
+// Gets the capabilities of a particular MIDI input device
+void CMIDIInDevice::GetDevCaps(UINT DeviceId, MIDIINCAPS &Caps)
+{
+    MMRESULT Result = ::midiInGetDevCaps(DeviceId, &Caps, 
+                                         sizeof Caps);
+
+    // If we are not able to retrieve device capabilities, throw 
+    // exception
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIInException(Result);
+    }
+}
+
+
+// Unpacks short message
+void CMIDIInDevice::UnpackShortMsg(DWORD Msg, unsigned char &Status,
+                                   unsigned char &DataByte1,
+                                   unsigned char &DataByte2)
+{
+    midi::CShortMsg ShortMsg(Msg);
+
+    Status = ShortMsg.GetStatus();
+    DataByte1 = ShortMsg.GetData1();
+    DataByte2 = ShortMsg.GetData2();
+}
+
+
+// Unpacks short channel message
+void CMIDIInDevice::UnpackShortMsg(DWORD Msg, unsigned char &Command,
+                                   unsigned char &Channel,
+                                   unsigned char &DataByte1,
+                                   unsigned char &DataByte2)
+{
+    midi::CShortMsg ShortMsg(Msg);
+
+    Command = ShortMsg.GetCommand();
+    Channel = ShortMsg.GetChannel();
+    DataByte1 = ShortMsg.GetData1();
+    DataByte2 = ShortMsg.GetData2();
+}
+
+// Unpacks many short messages into planes
+void CMIDIInDevice::UnpackShortMsgs(const DWORD *Msgs, 
+                                    std::size_t Count,
+                                    const CShortMsgPlanes &Planes)
+{
+    std::size_t i = 0;
+
+#ifdef MIDI_USE_SIMD
+    // Use the widest registers first, then SSE2 for what is left
+    switch(GetSimdLevel())
+    {
+    case SIMD_AVX2:
+        i = UnpackAVX2(Msgs, Count, Planes, i);
+        i = UnpackSSE2(Msgs, Count, Planes, i);
+        break;
+
+    case SIMD_SSE2:
+        i = UnpackSSE2(Msgs, Count, Planes, i);
+        break;
+
+    default:
+        break;
+    }
+#endif
 
-    // Close handle to signalling event
-    ::CloseHandle(m_Event);
+    // Unpack the rest one at a time
+    for(; i < Count; i++)
+    {
+        midi::CShortMsg ShortMsg(Msgs[i]);
+
+        Planes.Status[i] = ShortMsg.GetStatus();
+        Planes.Channel[i] = ShortMsg.GetChannel();
+        Planes.DataByte1[i] = ShortMsg.GetData1();
+        Planes.DataByte2[i] = ShortMsg.GetData2();
+    }
 }
 
 
-// Opens the MIDI input device
-void CMIDIInDevice::Open(UINT DeviceId)
+// Builds a mask of the status bytes with a particular command value
+std::size_t CMIDIInDevice::MatchCommand(const unsigned char *Status,
+                                        std::size_t Count,
+                                        unsigned char Command,
+                                        unsigned char *Mask)
 {
-    // Makes sure the previous device, if any, is closed before 
-    // opening another one
-    Close();
+    std::size_t i = 0;
+    std::size_t Matches = 0;
 
-    // Open MIDI input device
-    MMRESULT Result = ::midiInOpen(&m_DevHandle, DeviceId, 
-                                  reinterpret_cast<DWORD>(MidiInProc),
-                                  reinterpret_cast<DWORD>(this),
-                                  CALLBACK_FUNCTION);
+    // Only the command part of the status byte is compared
+    Command &= ~midi::SHORT_MSG_MASK;
 
-    // If we are able to open the device, change state
-    if(Result == MMSYSERR_NOERROR)
+#ifdef MIDI_USE_SIMD
+    // Use the widest registers first, then SSE2 for what is left
+    switch(GetSimdLevel())
     {
-        m_State = OPENED;
+    case SIMD_AVX2:
+        i = MatchAVX2(Status, Count, Command, Mask, i, Matches);
+        i = MatchSSE2(Status, Count, Command, Mask, i, Matches);
+        break;
+
+    case SIMD_SSE2:
+        i = MatchSSE2(Status, Count, Command, Mask, i, Matches);
+        break;
+
+    default:
+        break;
     }
-    // Else opening failed, throw exception
-    else
+#endif
+
+    // Match the rest one at a time, without branching
+    for(; i < Count; i++)
     {
-        throw CMIDIInException(Result);
+        unsigned char IsMatch = static_cast<unsigned char>(
+                      (Status[i] & ~midi::SHORT_MSG_MASK) == Command);
+
+        Mask[i] = static_cast<unsigned char>(0 - IsMatch);
+        Matches += IsMatch;
     }
+
+    return Matches;
 }
 
 
-// Closes the MIDI input device
-void CMIDIInDevice::Close()
+// Creates events for signalling header thread and dispatch thread
+bool CMIDIInDevice::CreateEvent()
 {
-    // If the device is recording, stop recording before closing the 
-    // device
-    if(m_State == RECORDING)
-    {
-        StopRecording();
-    }
+    bool Result = true;
 
-    // If the device is opened...
-    if(m_State == OPENED)
+    m_Event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_DispatchEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    // If event creation failed, close whichever event was created 
+    // and record failure
+    if(m_Event == NULL || m_DispatchEvent == NULL)
     {
-        // Close the device
-        MMRESULT Result = ::midiInClose(m_DevHandle);
+        if(m_Event != NULL)
+        {
+            ::CloseHandle(m_Event);
+        }
 
-        // If a failure occurred, throw exception
-        if(Result != MMSYSERR_NOERROR)
+        if(m_DispatchEvent != NULL)
         {
-            throw CMIDIInException(Result);
+            ::CloseHandle(m_DispatchEvent);
         }
 
-        // Change state
-        m_State = CLOSED;
+        Result = false;
     }
+
+    return Result;
 }
 
 
-// Adds a buffer for receiving system exclusive messages
-void CMIDIInDevice::AddSysExBuffer(LPSTR Buffer, DWORD BufferLength)
+// Counts clocks and filters short messages
+bool CMIDIInDevice::PassMsg(DWORD Msg, DWORD TimeStamp)
 {
-    CMIDIInHeader *Header;
+    unsigned char Status = static_cast<unsigned char>(Msg);
 
-    try
+    if(Status == midi::TIMING_CLOCK)
     {
-        // Create new header
-        Header = new CMIDIInHeader(m_DevHandle, Buffer, BufferLength);
+        // Only this thread writes the count, so there is no need for
+        // an atomic increment
+        m_ClockCount.store(m_ClockCount.load(std::memory_order_relaxed)
+                           + 1, std::memory_order_relaxed);
+
+        if(m_ClockProc != NULL)
+        {
+            m_ClockProc(m_ClockContext, TimeStamp);
+        }
     }
-    // If memory allocation failed, throw exception
-    catch(const std::bad_alloc &)
+
+    bool Pass = ((m_StatusFilter.load(std::memory_order_relaxed) >> 
+                  GetFilterBit(Status)) & 1) == 0;
+
+    // System messages have no channel
+    if(Status < midi::SYSTEM_EXCLUSIVE)
     {
-        throw CMIDIInMemFailure();
+        Pass = Pass && ((m_ChannelMask.load(std::memory_order_relaxed) 
+                         >> (Status & midi::SHORT_MSG_MASK)) & 1) != 0;
     }
-    // If preparation for the header failed, rethrow exception
-    catch(const CMIDIInDevice &)
+
+    return Pass;
+}
+
+
+// Gets the bit of the status filter for a status byte
+DWORD CMIDIInDevice::GetFilterBit(unsigned char Status)
+{
+    // Channel messages are filtered by command value, system messages
+    // by status byte
+    return (Status >= midi::SYSTEM_EXCLUSIVE) ? 
+           16 + (Status & midi::SHORT_MSG_MASK) : (Status >> 4);
+}
+
+
+// Queues or dispatches a message from the driver
+void CMIDIInDevice::ReceiveMsg(UINT Msg, DWORD_PTR Param1, 
+                               DWORD Param2)
+{
+    LONGLONG Counter = 0;
+
+    // Capture the time of arrival first thing
+    if(m_HighResTimeStamps.load(std::memory_order_relaxed))
     {
-        throw;
+        LARGE_INTEGER Now;
+
+        ::QueryPerformanceCounter(&Now);
+        Counter = Now.QuadPart;
     }
 
-    try
+    // Either queue the message or dispatch it right here
+    if(m_DispatchQueue != NULL)
     {
-        // Add header to queue
-        Header->AddSysExBuffer();
-        m_HdrQueue.AddHeader(Header);
+        QueueMsg(Msg, Param1, Param2, Counter);
     }
-    // If we are unable to add the buffer to the queue, delete header
-    // and throw exception
-    catch(const CMIDIInDevice &)
+    else
     {
-        delete Header;
-        throw;
+        DWORD Slot;
+        CMIDIReceiver *Receiver = AcquireReceiver(Slot);
+
+        DispatchMsg(Receiver, Msg, Param1, Param2, Counter);
+
+        ReleaseReceiver(Slot);
     }
 }
 
 
-// Starts the recording process
-void CMIDIInDevice::StartRecording()
+// Passes message on to the receiver
+void CMIDIInDevice::DispatchMsg(CMIDIReceiver *Receiver, UINT Msg, 
+                                DWORD_PTR Param1, DWORD Param2, 
+                                LONGLONG Counter)
 {
-    // Only begin recording if the MIDI input device has been opened
-    if(m_State == OPENED)
+    bool Timed = m_Stats.IsEnabled();
+    LONGLONG Start = Timed ? CMIDIStats::GetCounter() : 0;
+
+    switch(Msg)
     {
-        DWORD Dummy;
+    case MIM_DATA:      // Short message received
+        if(m_HighResTimeStamps.load(std::memory_order_relaxed))
+        {
+            midi::CMIDITimeStamp TimeStamp = { Param2, Counter };
 
-        // If we are unable to create worker thread for handling the 
-        // headers, throw exception
-        if((::CreateThread(NULL, 0, HeaderProc, this, 0, &Dummy)) ==
-            NULL)
+            Receiver->ReceiveMsg(static_cast<DWORD>(Param1), 
+                                 TimeStamp);
+        }
+        else
         {
-            throw CMIDIInThreadFailure();
+            Receiver->ReceiveMsg(static_cast<DWORD>(Param1), Param2);
         }
 
-        // Change state
-        m_State = RECORDING;
+        if(Timed)
+        {
+            m_Stats.AddShortMsg(static_cast<DWORD>(Param1));
+            m_Stats.AddShortMsgTime(CMIDIStats::GetCounter() - Start);
+        }
+        break;
 
-        // Start recording
-        MMRESULT Result = ::midiInStart(m_DevHandle);
+    case MIM_ERROR:     // Invalid short message received
+        m_Stats.AddError();
+        Receiver->OnError(static_cast<DWORD>(Param1), Param2);
+        break;
 
-        // If recording attempt failed...
-        if(Result != MMSYSERR_NOERROR)
+    case MIM_LONGDATA:  // System exclusive message received
+        if(m_State == RECORDING)
         {
-            // Revert back to opened state
-            m_State = OPENED;
+            // Retrieve data, send it to receiver, and notify header
+            // thread that we are done with the system exclusive 
+            // message
+            MIDIHDR *MidiHdr = reinterpret_cast<MIDIHDR *>(Param1);
+            Receiver->ReceiveMsg(MidiHdr->lpData, 
+                                 MidiHdr->dwBytesRecorded, Param2);
 
-            // Signal the worker thread to finish
+            // The header may be reused as soon as it is done
+            if(Timed)
+            {
+                m_Stats.AddLongMsg(MidiHdr->dwBytesRecorded);
+                m_Stats.AddLongMsgTime(CMIDIStats::GetCounter() - Start);
+            }
+
+            CMIDIInHeader::FromMIDIHdr(MidiHdr)->SetDone();
             ::SetEvent(m_Event);
+        }
+        break;
 
-            // Throw exception
-            throw CMIDIInException(Result);
+    case MIM_LONGERROR: // Invalid system exclusive message received
+        if(m_State == RECORDING)
+        {
+            m_Stats.AddLongError();
+
+            // Retrieve data, send it to receiver, and notify header
+            // thread that we are done with the system exclusive 
+            // message
+            MIDIHDR *MidiHdr = reinterpret_cast<MIDIHDR *>(Param1);
+            Receiver->OnError(MidiHdr->lpData, 
+                              MidiHdr->dwBytesRecorded, Param2);
+            CMIDIInHeader::FromMIDIHdr(MidiHdr)->SetDone();
+            ::SetEvent(m_Event);
         }
+        break;
     }
 }
 
 
-// Stops the recording process
-void CMIDIInDevice::StopRecording()
+// Passes a batch of short messages on to the receiver
+void CMIDIInDevice::DispatchBatch(midi::CMIDIBatchReceiver *Receiver,
+                                  const midi::CTimedMsg *Batch,
+                                  std::size_t Count)
 {
-    // If the device is in fact recording...
-    if(m_State == RECORDING)
-    {
-        // Change state
-        m_State = OPENED;
+    bool Timed = m_Stats.IsEnabled();
+    LONGLONG Start = Timed ? CMIDIStats::GetCounter() : 0;
 
-        // Signal the worker thread to finish
-        ::SetEvent(m_Event);
+    Receiver->ReceiveMsgs(Batch, Count);
 
-        // Reset the MIDI input device
-        ::midiInReset(m_DevHandle);
+    // The whole batch counts as one call
+    if(Timed)
+    {
+        for(std::size_t i = 0; i < Count; i++)
+        {
+            m_Stats.AddShortMsg(Batch[i].Msg);
+        }
 
-        // Empty header queue
-        m_HdrQueue.RemoveAll();
+        m_Stats.AddShortMsgTime(CMIDIStats::GetCounter() - Start);
     }
 }
 
 
-// Registers the MIDI receiver. Returns the previous receiver.
-CMIDIReceiver *CMIDIInDevice::SetReceiver(CMIDIReceiver &Receiver)
+// Gets the current receiver and counts the caller as using it
+CMIDIReceiver *CMIDIInDevice::AcquireReceiver(DWORD &Slot)
 {
-    CMIDIReceiver *PrevReceiver = m_Receiver;
-
-    m_Receiver = &Receiver;
+    // Count ourselves before reading the receiver, so that 
+    // SetReceiver cannot miss us if we get the previous one
+    Slot = m_ReceiverEpoch.load() & 1;
+    m_ReceiverUsers[Slot].fetch_add(1);
 
-    return PrevReceiver;
+    return m_Receiver.load();
 }
 
 
-// Determines if the MIDI input device is opened
-bool CMIDIInDevice::IsOpen() const
+// Counts the caller as finished with the receiver
+void CMIDIInDevice::ReleaseReceiver(DWORD Slot)
 {
-    return ((m_State == OPENED) || (m_State == RECORDING));
+    m_ReceiverUsers[Slot].fetch_sub(1);
 }
 
 
-// Determines if the MIDI input device is recording
-bool CMIDIInDevice::IsRecording() const
+// Queues message for dispatching later
+void CMIDIInDevice::QueueMsg(UINT Msg, DWORD_PTR Param1, DWORD Param2,
+                             LONGLONG Counter)
 {
-    return (m_State == RECORDING);
-}
+    bool IsLong = (Msg == MIM_LONGDATA || Msg == MIM_LONGERROR);
 
+    // System exclusive buffers returned after recording has stopped
+    // are of no interest to the receiver
+    if(IsLong && m_State != RECORDING)
+    {
+        return;
+    }
 
-// Gets the capabilities of a particular MIDI input device
-void CMIDIInDevice::GetDevCaps(UINT DeviceId, MIDIINCAPS &Caps)
-{
-    MMRESULT Result = ::midiInGetDevCaps(DeviceId, &Caps, 
-                                         sizeof Caps);
+    CQueuedMsg Queued = { Msg, Param1, Param2, Counter };
 
-    // If we are not able to retrieve device capabilities, throw 
-    // exception
-    if(Result != MMSYSERR_NOERROR)
+    // If the queue is full, drop the message
+    if(!m_DispatchQueue->Push(Queued))
     {
-        throw CMIDIInException(Result);
+        m_DroppedCount.fetch_add(1, std::memory_order_relaxed);
+        m_Stats.AddDropped();
+
+        // A dropped system exclusive buffer is finished with
+        if(IsLong)
+        {
+            MIDIHDR *MidiHdr = reinterpret_cast<MIDIHDR *>(Param1);
+            CMIDIInHeader::FromMIDIHdr(MidiHdr)->SetDone();
+            ::SetEvent(m_Event);
+        }
+
+        return;
     }
-}
 
+    m_Stats.AddQueueDepth(m_DispatchQueue->GetSize());
 
-// Unpacks short message
-void CMIDIInDevice::UnpackShortMsg(DWORD Msg, unsigned char &Status,
-                                   unsigned char &DataByte1,
-                                   unsigned char &DataByte2)
-{
-    Status = static_cast<unsigned char>(Msg);
-    DataByte1 = static_cast<unsigned char>
-                                   (Msg >> midi::SHORT_MSG_SHIFT);
-    DataByte2 = static_cast<unsigned char>
-                                   (Msg >> midi::SHORT_MSG_SHIFT * 2);
+    // Only wake the dispatching thread if it is waiting. The fence 
+    // pairs with the one in WaitForQueue, so that either we see the
+    // waiting flag or the dispatching thread sees the message.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if(m_DispatchWaiting.load(std::memory_order_relaxed) &&
+       m_DispatchWaiting.exchange(false))
+    {
+        ::SetEvent(m_DispatchEvent);
+    }
 }
 
 
-// Unpacks short channel message
-void CMIDIInDevice::UnpackShortMsg(DWORD Msg, unsigned char &Command,
-                                   unsigned char &Channel,
-                                   unsigned char &DataByte1,
-                                   unsigned char &DataByte2)
+// Waits for messages to be queued
+bool CMIDIInDevice::WaitForQueue(DWORD Timeout)
 {
-    Command = static_cast<unsigned char>(Msg & ~midi::SHORT_MSG_MASK);
-    Channel = static_cast<unsigned char>(Msg & midi::SHORT_MSG_MASK);
-    DataByte1 = static_cast<unsigned char>
-                                   (Msg >> midi::SHORT_MSG_SHIFT);
-    DataByte2 = static_cast<unsigned char>
-                                   (Msg >> midi::SHORT_MSG_SHIFT * 2);
+    // Let the callback know we are about to wait, then check the 
+    // queue again in case a message arrived in between
+    m_DispatchWaiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if(m_DispatchQueue->IsEmpty() && m_State == RECORDING)
+    {
+        ::WaitForSingleObject(m_DispatchEvent, Timeout);
+    }
+
+    m_DispatchWaiting.store(false, std::memory_order_relaxed);
+
+    return !m_DispatchQueue->IsEmpty();
 }
 
 
-// Creates event for signalling header thread
-bool CMIDIInDevice::CreateEvent()
+// Creates the dispatch queue and thread, if needed
+void CMIDIInDevice::StartDispatching()
 {
-    bool Result = true;
+    // Get rid of the queue from the last time we were recording
+    delete m_DispatchQueue;
+    m_DispatchQueue = NULL;
 
-    m_Event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(m_DispatchMode != DISPATCH_DIRECT)
+    {
+        try
+        {
+            m_DispatchQueue = 
+                   new CSPSCRing<CQueuedMsg>(m_DispatchQueueCapacity);
+        }
+        // If memory allocation failed, throw exception
+        catch(const std::bad_alloc &)
+        {
+            throw CMIDIInMemFailure();
+        }
+
+        m_DispatchWaiting.store(false, std::memory_order_relaxed);
+
+        if(m_DispatchMode == DISPATCH_THREAD)
+        {
+            DWORD Dummy;
+
+            m_DispatchThread = ::CreateThread(NULL, 0, DispatchProc, 
+                                              this, 0, &Dummy);
 
-    // If event creation failed, record failure
-    if(m_Event == NULL)
+            // If we are unable to create the dispatch thread, throw 
+            // exception
+            if(m_DispatchThread == NULL)
+            {
+                throw CMIDIInThreadFailure();
+            }
+        }
+    }
+}
+
+
+// Stops the dispatch thread, if any, and empties the dispatch queue
+void CMIDIInDevice::StopDispatching()
+{
+    if(m_DispatchThread != NULL)
     {
-        Result = false;
+        ::SetEvent(m_DispatchEvent);
+        ::WaitForSingleObject(m_DispatchThread, INFINITE);
+        ::CloseHandle(m_DispatchThread);
+        m_DispatchThread = NULL;
     }
 
-    return Result;
+    if(m_DispatchQueue != NULL)
+    {
+        CQueuedMsg Queued;
+
+        while(m_DispatchQueue->Pop(Queued))
+        {
+        }
+    }
 }
 
 // Called by Windows when a MIDI input event occurs
@@ -445,49 +2031,72 @@ void CALLBACK CMIDIInDevice::MidiInProc(HMIDIIN MidiIn, UINT Msg,
     
     Device = reinterpret_cast<CMIDIInDevice *>(Instance);
 
-    switch(Msg)
-    {
-    case MIM_DATA:      // Short message received
-        Device->m_Receiver->ReceiveMsg(Param1, Param2);
-        break;
+    CMIDICapture *Capture = 
+        Device->m_Capture.load(std::memory_order_acquire);
 
-    case MIM_ERROR:     // Invalid short message received
-        Device->m_Receiver->OnError(Param1, Param2);
-        break;
+    // Record what the driver delivers before anything is filtered
+    if(Capture != NULL)
+    {
+        WORD Port = 
+            Device->m_CapturePort.load(std::memory_order_relaxed);
 
-    case MIM_LONGDATA:  // System exclusive message received
-        if(Device->m_State == RECORDING)
+        if(Msg == MIM_DATA)
+        {
+            Capture->RecordMsg(CMIDICapture::CAPTURE_IN, Port, Param1);
+        }
+        else if(Msg == MIM_LONGDATA)
         {
-            // Retrieve data, send it to receiver, and notify header
-            // thread that we are done with the system exclusive 
-            // message
             MIDIHDR *MidiHdr = reinterpret_cast<MIDIHDR *>(Param1);
-            Device->m_Receiver->ReceiveMsg(MidiHdr->lpData, 
-                                           MidiHdr->dwBytesRecorded, 
-                                           Param2);
-            ::SetEvent(Device->m_Event);
+
+            // Empty buffers are only being handed back
+            if(MidiHdr->dwBytesRecorded > 0)
+            {
+                Capture->RecordLongMsg(CMIDICapture::CAPTURE_IN, Port,
+                                       MidiHdr->dwBytesRecorded);
+            }
         }
-        break;
+    }
 
-    case MIM_LONGERROR: // Invalid system exclusive message received
-        if(Device->m_State == RECORDING)
+    switch(Msg)
+    {
+    case MIM_DATA:      // Short message received
+        // Filtered messages go no further
+        if(Device->PassMsg(Param1, Param2))
         {
-            // Retrieve data, send it to receiver, and notify header
-            // thread that we are done with the system exclusive 
-            // message
-            MIDIHDR *MidiHdr = reinterpret_cast<MIDIHDR *>(Param1);
-            Device->m_Receiver->OnError(MidiHdr->lpData,
-                                        MidiHdr->dwBytesRecorded,
-                                        Param2);
-            ::SetEvent(Device->m_Event);
+            Device->ReceiveMsg(Msg, Param1, Param2);
         }
         break;
+
+    case MIM_ERROR:     // Invalid short message received
+    case MIM_LONGDATA:  // System exclusive message received
+    case MIM_LONGERROR: // Invalid system exclusive message received
+        Device->ReceiveMsg(Msg, Param1, Param2);
+        break;
+    }
+}
+
+
+// Manages headers on the worker thread
+void CMIDIInDevice::HeaderProc(void *Parameter)
+{
+    CMIDIInDevice *Device; 
+    
+    Device = reinterpret_cast<CMIDIInDevice *>(Parameter);
+
+    // Remove the finished headers
+    Device->m_HdrQueue.RemoveDone();
+
+    // Put the pool's finished buffers back to work, unless recording
+    // is being stopped
+    if(Device->m_State == RECORDING)
+    {
+        Device->m_Stats.AddPooledHeaders(Device->m_HdrPool.Recycle());
     }
 }
 
 
-// Header worker thread
-DWORD CMIDIInDevice::HeaderProc(LPVOID Parameter)
+// Dispatch worker thread
+DWORD CMIDIInDevice::DispatchProc(LPVOID Parameter)
 {
     CMIDIInDevice *Device; 
     
@@ -496,14 +2105,8 @@ DWORD CMIDIInDevice::HeaderProc(LPVOID Parameter)
     // Continue while the MIDI input device is recording
     while(Device->m_State == RECORDING)
     {
-        ::WaitForSingleObject(Device->m_Event, INFINITE);
-
-        // Make sure we are still recording
-        if(Device->m_State == RECORDING)
-        {
-            // Remove the finished header
-            Device->m_HdrQueue.RemoveHeader();
-        }
+        Device->DispatchMsgs();
+        Device->WaitForQueue(INFINITE);
     }
 
     return 0;
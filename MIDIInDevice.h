@@ -28,8 +28,23 @@
 // Necessary for exception classes derived from std::exception
 #include <exception> 
 
-// Necessary for header queue used by CHeaderQueue
-#include <queue>
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the header done flag
+#include <atomic>
+
+// Necessary for header ring used by CHeaderQueue
+#include "SPSCRing.h"
+
+// Necessary for CTimedMsg
+#include "midi.h"
+
+// Necessary for the thread managing headers
+#include "MIDIWorker.h"
+
+// Necessary for CMIDIStats
+#include "MIDIStats.h"
 
 
 namespace midi
@@ -39,6 +54,32 @@ namespace midi
     //----------------------------------------------------------------
 
 
+    class CMIDICapture;
+
+
+    //----------------------------------------------------------------
+    // CMIDITimeStamp
+    //
+    // A high resolution time stamp for messages received by 
+    // CMIDIInDevice objects.
+    //----------------------------------------------------------------
+
+
+    struct CMIDITimeStamp
+    {
+        // Milliseconds since recording started, as reported by the 
+        // driver
+        DWORD MilliSeconds;
+
+        // QueryPerformanceCounter value captured when the message
+        // reached the CMIDIInDevice object
+        LONGLONG Counter;
+    };
+
+
+    class CMIDIBatchReceiver;
+
+
     //----------------------------------------------------------------
     // CMIDIReceiver
     //
@@ -57,6 +98,14 @@ namespace midi
         // Receives short messages
         virtual void ReceiveMsg(DWORD Msg, DWORD TimeStamp) = 0;
 
+        // Receives short messages with high resolution time stamps. 
+        // Only called when the CMIDIInDevice object has high 
+        // resolution time stamps turned on. By default the message is
+        // passed on to ReceiveMsg(DWORD, DWORD).
+        virtual void ReceiveMsg(DWORD Msg, 
+                                const CMIDITimeStamp &TimeStamp)
+        { ReceiveMsg(Msg, TimeStamp.MilliSeconds); }
+
         // Receives long messages
         virtual void ReceiveMsg(LPSTR Msg, DWORD BytesRecorded,
                                 DWORD TimeStamp) = 0;
@@ -67,6 +116,44 @@ namespace midi
         // Called when an invalid long message is received
         virtual void OnError(LPSTR Msg, DWORD BytesRecorded,
                              DWORD TimeStamp) = 0;
+
+        // Gets the batch interface of the receiver, or NULL if it
+        // only takes one message at a time
+        virtual CMIDIBatchReceiver *GetBatchReceiver() { return NULL; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIBatchReceiver
+    //
+    // A CMIDIReceiver that can take many short messages in one call.
+    // When a CMIDIInDevice object dispatches queued messages, runs of
+    // short messages are passed to ReceiveMsgs as a contiguous array 
+    // instead of one ReceiveMsg call each. Batches carry millisecond
+    // time stamps, so they are only used while high resolution time
+    // stamps are turned off. Messages dispatched straight from the 
+    // driver's callback arrive as batches of one.
+    //----------------------------------------------------------------
+
+
+    class CMIDIBatchReceiver : public CMIDIReceiver
+    {
+    public:
+        // Receives Count short messages, oldest first
+        virtual void ReceiveMsgs(const CTimedMsg *Msgs, 
+                                 std::size_t Count) = 0;
+
+        // Receives short messages as batches of one
+        void ReceiveMsg(DWORD Msg, DWORD TimeStamp)
+        {
+            CTimedMsg Timed = { Msg, TimeStamp };
+            ReceiveMsgs(&Timed, 1);
+        }
+
+        // Keep the other ReceiveMsg overloads visible
+        using CMIDIReceiver::ReceiveMsg;
+
+        CMIDIBatchReceiver *GetBatchReceiver() { return this; }
     };
 
 
@@ -111,6 +198,17 @@ namespace midi
     };
 
 
+    // Thrown when a CMIDIInDevice header queue has no room for another
+    // header
+    class CMIDIInQueueFull : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "The header queue for CMIDIInDevice object is "
+                 "full."; }
+    };
+
+
     // Thrown when a CMIDIInDevice is unable to create a worker thread
     class CMIDIInThreadFailure : public std::exception
     {
@@ -131,11 +229,46 @@ namespace midi
     class CMIDIInDevice
     {
     public:
-        // For constructing a CMIDIInDevice object in an closed state
-        CMIDIInDevice(CMIDIReceiver &Receiver);
+        // Default number of system exclusive buffers that can be added
+        // at the same time
+        enum { DEFAULT_HDR_QUEUE_CAPACITY = 64 };
+
+        // Default number of messages that can wait to be dispatched
+        enum { DEFAULT_DISPATCH_QUEUE_CAPACITY = 4096 };
+
+        // Function called for every TIMING_CLOCK message
+        typedef void (*ClockProc)(void *Context, DWORD TimeStamp);
+
+        // Largest batch of short messages passed to a 
+        // CMIDIBatchReceiver at once
+        enum { MAX_BATCH_SIZE = 256 };
+
+        // How received messages are passed on to the receiver
+        enum DispatchMode
+        {
+            // Straight from the driver's callback thread
+            DISPATCH_DIRECT,
+
+            // From a thread owned by the device. The callback only 
+            // queues the message.
+            DISPATCH_THREAD,
+
+            // From whichever thread calls DispatchMsgs. The callback 
+            // only queues the message.
+            DISPATCH_MANUAL
+        };
+
+        // For constructing a CMIDIInDevice object in an closed state.
+        // HdrQueueCapacity is the number of system exclusive buffers
+        // that can be added at the same time.
+        CMIDIInDevice(CMIDIReceiver &Receiver, 
+                      std::size_t HdrQueueCapacity = 
+                                          DEFAULT_HDR_QUEUE_CAPACITY);
 
         // For constructing a CMIDIInDevice object in an opened state
-        CMIDIInDevice(UINT DeviceId, CMIDIReceiver &Receiver);
+        CMIDIInDevice(UINT DeviceId, CMIDIReceiver &Receiver,
+                      std::size_t HdrQueueCapacity = 
+                                          DEFAULT_HDR_QUEUE_CAPACITY);
 
         // Destruction
         ~CMIDIInDevice();
@@ -149,6 +282,40 @@ namespace midi
         // Adds a buffer to receive system exclusive messages
         void AddSysExBuffer(LPSTR Buffer, DWORD BufferLength);
 
+        // Adds a buffer without throwing or allocating, for threads 
+        // that may do neither, such as an audio callback. The header
+        // is taken from the reserve set up with SetSysExHeaderReserve.
+        // Returns MMSYSERR_INVALHANDLE if the device is closed, 
+        // MIDIERR_NOTREADY if too many buffers have been added, 
+        // MMSYSERR_NOMEM if the reserve has no header left, or the 
+        // driver's error.
+        MMRESULT TryAddSysExBuffer(LPSTR Buffer, 
+                                   DWORD BufferLength) noexcept;
+
+        // Sets up a reserve of HeaderCount headers for 
+        // TryAddSysExBuffer. The headers are created when the device
+        // is opened and go back to the reserve once the receiver has
+        // been given their buffer's contents. Takes effect the next 
+        // time the device is opened. A HeaderCount of zero, the 
+        // default, disables the reserve.
+        void SetSysExHeaderReserve(DWORD HeaderCount);
+
+        // Sets up a pool of BufferCount buffers of BufferSize bytes 
+        // each for receiving system exclusive messages. The buffers 
+        // are prepared once when the device is opened and added when
+        // recording starts. After the receiver has been given a 
+        // buffer's contents, the buffer is added again straight away,
+        // so there is no need to keep calling AddSysExBuffer. Takes 
+        // effect the next time the device is opened. A BufferCount of
+        // zero disables the pool.
+        void SetSysExBufferPool(DWORD BufferCount, DWORD BufferSize);
+
+        // Sets the worker whose thread manages the device's headers,
+        // such as CMIDIWorker::GetShared(). The worker must outlive 
+        // the device. NULL, the default, gives the device a thread of
+        // its own. Takes effect the next time recording starts.
+        void SetWorker(CMIDIWorker *Worker);
+
         // Starts the recording process
         void StartRecording();
 
@@ -156,15 +323,101 @@ namespace midi
         void StopRecording();
 
         // Sets the current MIDI receiver. Returns the previous 
-        // receiver.
+        // receiver. Can be called while recording: messages being 
+        // dispatched when it is called finish with the previous 
+        // receiver and the rest go to the new one. Once it returns,
+        // the previous receiver is no longer in use and may be 
+        // destroyed. Only from one thread at a time, and not from 
+        // the receiver's own methods.
         CMIDIReceiver *SetReceiver(CMIDIReceiver &Receiver);
 
+        // Sets a capture to record every message the driver delivers,
+        // before filtering, with Port to tell this device's messages
+        // apart. The capture must outlive the device. Can be called at
+        // any time. NULL, the default, turns recording off.
+        void SetCapture(CMIDICapture *Capture, WORD Port = 0);
+
         // Returns true if the device is open
         bool IsOpen() const;
 
         // Returns true if the device is recording
         bool IsRecording() const;
 
+        // Turns high resolution time stamps on or off. When on, a 
+        // QueryPerformanceCounter value is captured as each short 
+        // message arrives and the receiver's 
+        // ReceiveMsg(DWORD, const CMIDITimeStamp &) is called.
+        void SetHighResTimeStamps(bool Enable);
+
+        // Gets the frequency of the counter used for high resolution
+        // time stamps, in counts per second
+        static LONGLONG GetCounterFrequency();
+
+        // Sets how received messages are passed on to the receiver.
+        // For the queued modes, QueueCapacity is the number of 
+        // messages that can wait to be dispatched; messages arriving
+        // while the queue is full are dropped. Takes effect the next 
+        // time recording starts.
+        void SetDispatchMode(DispatchMode Mode, 
+                             std::size_t QueueCapacity = 
+                                     DEFAULT_DISPATCH_QUEUE_CAPACITY);
+
+        // Passes all queued messages on to the receiver and returns 
+        // how many there were. Only for DISPATCH_MANUAL, and only 
+        // from one thread at a time. Must not be called while 
+        // recording is being stopped.
+        std::size_t DispatchMsgs();
+
+        // Waits up to Timeout milliseconds for messages to be queued.
+        // Returns true if there are messages to dispatch. Only for 
+        // DISPATCH_MANUAL, from the thread calling DispatchMsgs.
+        bool WaitForMsgs(DWORD Timeout);
+
+        // Gets the number of messages dropped because the dispatch 
+        // queue was full
+        DWORD GetDroppedCount() const;
+
+        // Turns statistics on or off. They are off by default, and cost
+        // two QueryPerformanceCounter calls per receiver call when on.
+        void EnableStats(bool Enable);
+
+        // Takes a snapshot of the statistics
+        void GetStats(CMIDIStatsSnapshot &Stats) const;
+
+        // Sets the statistics back to zero
+        void ResetStats();
+
+        // Stops short messages with the given status from reaching 
+        // the receiver, or lets them through again. For channel 
+        // messages Status is a command value, such as NOTE_ON, and 
+        // covers every channel; other status bytes, such as 
+        // ACTIVE_SENSING, are matched exactly. Filtered messages are
+        // thrown away in the driver's callback, before they are 
+        // queued or dispatched.
+        void SetStatusFilter(unsigned char Status, bool Filter);
+
+        // Only lets channel messages through on the channels whose 
+        // bits are set in Mask, bit 0 being the first channel. Every
+        // channel is let through by default.
+        void SetChannelMask(WORD Mask);
+
+        // Sets a function to be called straight from the driver's 
+        // callback for every TIMING_CLOCK message, without going 
+        // through the receiver or the dispatch queue. It is called 
+        // whether or not TIMING_CLOCK is filtered, so filtering it 
+        // leaves the clocks to this function alone. It is bound by 
+        // the same rules as direct dispatch. NULL, the default, turns
+        // it off. Must not be called while recording.
+        void SetClockProc(ClockProc Proc, void *Context);
+
+        // Gets the number of TIMING_CLOCK messages received since 
+        // the count was last reset. Counted whether or not 
+        // TIMING_CLOCK is filtered.
+        DWORD GetClockCount() const;
+
+        // Sets the TIMING_CLOCK count back to zero
+        void ResetClockCount();
+
         // Gets the number of MIDI input devices on this system
         static UINT GetNumDevs() { return midiInGetNumDevs(); }
 
@@ -183,66 +436,313 @@ namespace midi
                                    unsigned char &DataByte1,
                                    unsigned char &DataByte2);
 
+        // Destination for UnpackShortMsgs. Each plane gets one byte 
+        // per message and must have room for all of them. Channel is
+        // the low four bits of the status byte, which only means 
+        // something for channel messages.
+        struct CShortMsgPlanes
+        {
+            unsigned char *Status;
+            unsigned char *Channel;
+            unsigned char *DataByte1;
+            unsigned char *DataByte2;
+        };
+
+        // Unpacks Count short messages into separate planes of status
+        // bytes, channels and data bytes. Uses AVX2 or SSE2 when the
+        // processor has them.
+        static void UnpackShortMsgs(const DWORD *Msgs, std::size_t Count,
+                                    const CShortMsgPlanes &Planes);
+
+        // Sets Mask[i] to 0xFF if Status[i] is a message with the 
+        // given command value, such as NOTE_ON, and to zero otherwise.
+        // Returns the number of matches. Uses AVX2 or SSE2 when the
+        // processor has them.
+        static std::size_t MatchCommand(const unsigned char *Status,
+                                        std::size_t Count,
+                                        unsigned char Command,
+                                        unsigned char *Mask);
+
     // Private methods
     private:
         // Copying and assignment not allowed
         CMIDIInDevice(const CMIDIInDevice &);
         CMIDIInDevice &operator = (const CMIDIInDevice &);
 
-        // Creates an event for signalling the header thread
+        // Passes messages through the callback with no driver, for
+        // testing and timing the dispatch paths. It is defined by the
+        // programs that use it.
+        friend class CMIDIInDeviceInjector;
+
+        // Creates the events for signalling the header thread and
+        // the dispatch thread
         bool CreateEvent();
 
+        // Counts clocks and applies the filters to a short message 
+        // from the driver. Returns true if the message should go on 
+        // to the receiver.
+        bool PassMsg(DWORD Msg, DWORD TimeStamp);
+
+        // Gets the bit of the status filter for a status byte
+        static DWORD GetFilterBit(unsigned char Status);
+
+        // Queues or dispatches a message from the driver
+        void ReceiveMsg(UINT Msg, DWORD_PTR Param1, DWORD Param2);
+
+        // Passes a message on to the receiver
+        void DispatchMsg(CMIDIReceiver *Receiver, UINT Msg, 
+                         DWORD_PTR Param1, DWORD Param2, 
+                         LONGLONG Counter);
+
+        // Gets the current receiver and counts the caller as using 
+        // it. Slot must be given back to ReleaseReceiver.
+        CMIDIReceiver *AcquireReceiver(DWORD &Slot);
+
+        // Counts the caller as finished with the receiver
+        void ReleaseReceiver(DWORD Slot);
+
+        // Passes a batch of short messages on to the receiver
+        void DispatchBatch(CMIDIBatchReceiver *Receiver,
+                           const CTimedMsg *Batch, std::size_t Count);
+
+        // Queues a message for dispatching later
+        void QueueMsg(UINT Msg, DWORD_PTR Param1, DWORD Param2,
+                      LONGLONG Counter);
+
+        // Waits for messages to be queued
+        bool WaitForQueue(DWORD Timeout);
+
+        // Creates and destroys the dispatch thread, if needed
+        void StartDispatching();
+        void StopDispatching();
+
         // Called by Windows when a MIDI input event occurs
         static void CALLBACK MidiInProc(HMIDIIN MidiIn, UINT Msg,
                                         DWORD Instance, DWORD Param1, 
                                         DWORD Param2);
 
-        // Thread function for managing headers
-        static DWORD WINAPI HeaderProc(LPVOID Parameter);
+        // Called by the worker thread for managing headers
+        static void HeaderProc(void *Parameter);
+
+        // Thread function for dispatching queued messages
+        static DWORD WINAPI DispatchProc(LPVOID Parameter);
 
     // Private class declarations
     private:
+        // A message waiting to be dispatched. The fields are those 
+        // passed to MidiInProc, plus the high resolution counter.
+        struct CQueuedMsg
+        {
+            UINT      Msg;
+            DWORD_PTR Param1;
+            DWORD     Param2;
+            LONGLONG  Counter;
+        };
+
+
+        class CHeaderReserve;
+
+
         // Encapsulates the MIDIHDR structure for MIDI input
         class CMIDIInHeader
         {
         public:
+            // For headers that point at the caller's buffer
             CMIDIInHeader(HMIDIIN DevHandle, LPSTR Buffer, 
                           DWORD BufferLength);
+
+            // For headers that own their buffer
+            CMIDIInHeader(HMIDIIN DevHandle, DWORD BufferLength);
+
+            // For headers that belong to a reserve and are given the
+            // caller's buffer with Attach
+            CMIDIInHeader(HMIDIIN DevHandle, CHeaderReserve *Reserve);
+
             ~CMIDIInHeader();
 
+            // Points the header at the caller's buffer and prepares 
+            // it, returning the driver's error
+            MMRESULT Attach(LPSTR Buffer, DWORD BufferLength);
+
+            // Unprepares the header so that it can be attached again
+            void Detach();
+
             // Add the buffer for receiving system exclusive messages
             void AddSysExBuffer();
 
+            // Adds the buffer, returning the driver's error rather 
+            // than throwing it
+            MMRESULT TryAddSysExBuffer();
+
+            // Gets the reserve the header belongs to, if any
+            CHeaderReserve *GetReserve() const { return m_Reserve; }
+
+            // Marks the header as finished once its data has been 
+            // passed on to the receiver
+            void SetDone();
+
+            // Returns true if the header is finished
+            bool IsDone() const;
+
+            // Gets the header object that owns a MIDIHDR structure
+            static CMIDIInHeader *FromMIDIHdr(MIDIHDR *MidiHdr);
+
+        private:
+            // Copying and assignment not allowed
+            CMIDIInHeader(const CMIDIInHeader &);
+            CMIDIInHeader &operator = (const CMIDIInHeader &);
+
+            void Prepare();
+
         private:
             HMIDIIN m_DevHandle;
             MIDIHDR m_MIDIHdr;
+            char   *m_Buffer;
+            CHeaderReserve *m_Reserve;
+            std::atomic<bool> m_Done;
         };
 
 
-        // Thread safe queue for storing CMIDIInHeader objects
+        // Lock-free queue for storing CMIDIInHeader objects. Headers 
+        // are added by the thread adding buffers and removed by the 
+        // header thread.
         class CHeaderQueue
         {
         public:
-            CHeaderQueue();
+            CHeaderQueue(std::size_t Capacity);
             ~CHeaderQueue();
 
             void AddHeader(CMIDIInHeader *Header);
             void RemoveHeader();
+            void RemoveDone();
             void RemoveAll();
             bool IsEmpty();
+            bool IsFull();
+
+        private:
+            // Deletes the header or gives it back to its reserve
+            static void ReleaseHeader(CMIDIInHeader *Header);
+
+        private:
+            CSPSCRing<CMIDIInHeader *> m_HdrQueue;
+        };
+
+
+        // Pool of prepared CMIDIInHeader objects that are added to the
+        // device again as soon as they are finished. Apart from 
+        // AddAll, only the header thread uses the pool while 
+        // recording.
+        class CHeaderPool
+        {
+        public:
+            CHeaderPool();
+            ~CHeaderPool();
+
+            void Create(HMIDIIN DevHandle, DWORD HeaderCount,
+                        DWORD BufferSize);
+            void Destroy();
+
+            // Adds every buffer in the pool to the device
+            void AddAll();
+
+            // Adds finished buffers to the device again. Returns the
+            // number of buffers added.
+            DWORD Recycle();
+
+        private:
+            // Copying and assignment not allowed
+            CHeaderPool(const CHeaderPool &);
+            CHeaderPool &operator = (const CHeaderPool &);
+
+        private:
+            CMIDIInHeader            **m_Headers;
+            DWORD                      m_HeaderCount;
+            CSPSCRing<CMIDIInHeader *> *m_AddedHeaders;
+        };
+
+
+        // Headers created ahead of time for TryAddSysExBuffer. Headers
+        // are taken by the thread adding buffers and given back by the
+        // header thread.
+        class CHeaderReserve
+        {
+        public:
+            CHeaderReserve();
+            ~CHeaderReserve();
+
+            void Create(HMIDIIN DevHandle, DWORD HeaderCount);
+            void Destroy();
+
+            // Gets a free header, or NULL if there is none
+            CMIDIInHeader *AcquireHeader();
+
+            // Gives back a header the device is finished with
+            void ReturnHeader(CMIDIInHeader *Header);
+
+            // Gives back a header that could not be added. Only 
+            // called by the thread adding buffers.
+            void CancelHeader(CMIDIInHeader *Header);
+
+        private:
+            // Copying and assignment not allowed
+            CHeaderReserve(const CHeaderReserve &);
+            CHeaderReserve &operator = (const CHeaderReserve &);
 
         private:
-            std::queue<CMIDIInHeader *> m_HdrQueue;
-            CRITICAL_SECTION m_CriticalSection;
+            CMIDIInHeader            **m_Headers;
+            DWORD                      m_HeaderCount;
+            CSPSCRing<CMIDIInHeader *> *m_FreeHeaders;
+            CMIDIInHeader             *m_Spare;
         };
 
     // Private attributes and constants
     private:
         HMIDIIN        m_DevHandle;
         HANDLE         m_Event;
-        CMIDIReceiver *m_Receiver;
+        CMIDIWorker    m_OwnWorker;
+        CMIDIWorker   *m_Worker;
+        CMIDIWorker   *m_ActiveWorker;
+        std::atomic<CMIDIReceiver *> m_Receiver;
+
+        // Dispatchers count themselves in the slot of the current 
+        // epoch while using the receiver. SetReceiver moves the epoch
+        // on and waits for the old slot to empty.
+        std::atomic<DWORD> m_ReceiverEpoch;
+        std::atomic<DWORD> m_ReceiverUsers[2];
+
+        std::atomic<bool> m_HighResTimeStamps;
         CHeaderQueue   m_HdrQueue;
-        enum State { CLOSED, OPENED, RECORDING } m_State;
+        CHeaderPool    m_HdrPool;
+        DWORD          m_PoolHeaderCount;
+        DWORD          m_PoolBufferSize;
+        CHeaderReserve m_HdrReserve;
+        DWORD          m_ReserveHeaderCount;
+        DispatchMode   m_DispatchMode;
+        std::size_t    m_DispatchQueueCapacity;
+        HANDLE         m_DispatchEvent;
+        HANDLE         m_DispatchThread;
+        CSPSCRing<CQueuedMsg> *m_DispatchQueue;
+        std::atomic<bool>      m_DispatchWaiting;
+        std::atomic<DWORD>     m_DroppedCount;
+        CMIDIStats             m_Stats;
+
+        // One bit per command value, then one per system status byte;
+        // set bits are filtered
+        std::atomic<DWORD>     m_StatusFilter;
+        std::atomic<DWORD>     m_ChannelMask;
+
+        // Clock count, written only by the driver's callback, and the
+        // count at the last reset
+        std::atomic<DWORD>     m_ClockCount;
+        std::atomic<DWORD>     m_ClockBase;
+        ClockProc              m_ClockProc;
+        void                  *m_ClockContext;
+
+        std::atomic<CMIDICapture *> m_Capture;
+        std::atomic<WORD>      m_CapturePort;
+
+        enum State { CLOSED, OPENED, RECORDING };
+        std::atomic<State> m_State;
     };
 }
 
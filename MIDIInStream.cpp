@@ -0,0 +1,218 @@
+/*********************************************************************
+ * MIDIInStream.cpp - Implementation for CMIDIInStream.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIInStream.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIInStream;
+
+
+//--------------------------------------------------------------------
+// CMIDIInStream implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIInStream::CMIDIInStream(std::size_t Capacity) :
+m_Capacity(Capacity),
+m_Closed(false),
+m_DroppedCount(0)
+{
+#ifdef MIDI_HAS_COROUTINES
+    m_Executor = NULL;
+    m_ExecutorContext = NULL;
+#endif
+
+    // Reserve room up front so that the dispatch thread does not
+    // allocate
+    m_Msgs.reserve(Capacity);
+
+    ::InitializeCriticalSection(&m_Lock);
+}
+
+
+// Destructor
+CMIDIInStream::~CMIDIInStream()
+{
+    ::DeleteCriticalSection(&m_Lock);
+}
+
+
+// Takes every message that arrived since the last batch
+std::size_t CMIDIInStream::TakeBatch(
+                                   std::vector<midi::CTimedMsg> &Msgs)
+{
+    Msgs.clear();
+
+    // The caller's buffer takes the place of ours, so it needs the 
+    // same room. It is made here, outside the lock, so that the 
+    // dispatch thread never allocates or waits for an allocation.
+    Msgs.reserve(m_Capacity);
+
+    ::EnterCriticalSection(&m_Lock);
+
+    // Hand over the messages and keep the caller's buffer for the
+    // next ones
+    m_Msgs.swap(Msgs);
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Msgs.size();
+}
+
+
+// Ends the stream
+void CMIDIInStream::Close()
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    m_Closed = true;
+
+#ifdef MIDI_HAS_COROUTINES
+    std::coroutine_handle<> Waiter = TakeWaiter();
+#endif
+
+    ::LeaveCriticalSection(&m_Lock);
+
+#ifdef MIDI_HAS_COROUTINES
+    Resume(Waiter);
+#endif
+}
+
+
+// Starts the stream again
+void CMIDIInStream::Reopen()
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    m_Closed = false;
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Determines if the stream has been closed
+bool CMIDIInStream::IsClosed() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    bool Closed = m_Closed;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Closed;
+}
+
+
+// Gets the number of messages dropped
+DWORD CMIDIInStream::GetDroppedCount() const
+{
+    return m_DroppedCount.load(std::memory_order_relaxed);
+}
+
+
+// Takes short messages from the device
+void CMIDIInStream::ReceiveMsgs(const midi::CTimedMsg *Msgs,
+                                std::size_t Count)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    // Once closed, the stream takes nothing more
+    std::size_t Room = m_Closed ? 0 : m_Capacity - m_Msgs.size();
+
+    // Keep the oldest messages and drop the rest
+    if(Count > Room)
+    {
+        m_DroppedCount.fetch_add(static_cast<DWORD>(Count - Room),
+                                 std::memory_order_relaxed);
+        Count = Room;
+    }
+
+    m_Msgs.insert(m_Msgs.end(), Msgs, Msgs + Count);
+
+#ifdef MIDI_HAS_COROUTINES
+    std::coroutine_handle<> Waiter;
+
+    if(!m_Msgs.empty())
+    {
+        Waiter = TakeWaiter();
+    }
+#endif
+
+    ::LeaveCriticalSection(&m_Lock);
+
+#ifdef MIDI_HAS_COROUTINES
+    Resume(Waiter);
+#endif
+}
+
+
+#ifdef MIDI_HAS_COROUTINES
+// Sets the function waiting coroutines are handed to
+void CMIDIInStream::SetExecutor(ExecutorProc Executor, void *Context)
+{
+    m_Executor = Executor;
+    m_ExecutorContext = Context;
+}
+
+
+// Keeps a coroutine waiting until messages arrive
+bool CMIDIInStream::Suspend(std::coroutine_handle<> Handle)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    // Messages that arrived while the coroutine was busy are taken
+    // straight away
+    bool Wait = m_Msgs.empty() && !m_Closed;
+
+    if(Wait)
+    {
+        m_Waiter = Handle;
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Wait;
+}
+
+
+// Takes the waiting coroutine
+std::coroutine_handle<> CMIDIInStream::TakeWaiter()
+{
+    std::coroutine_handle<> Waiter = m_Waiter;
+
+    m_Waiter = std::coroutine_handle<>();
+
+    return Waiter;
+}
+
+
+// Resumes a coroutine taken with TakeWaiter. The lock is not held,
+// so the coroutine can await the next batch straight away.
+void CMIDIInStream::Resume(std::coroutine_handle<> Handle)
+{
+    if(Handle)
+    {
+        if(m_Executor != NULL)
+        {
+            m_Executor(m_ExecutorContext, Handle);
+        }
+        else
+        {
+            Handle.resume();
+        }
+    }
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,199 @@
+#ifndef MIDI_IN_STREAM_H
+#define MIDI_IN_STREAM_H
+
+
+/*********************************************************************
+ * MIDIInStream.h - Interface for CMIDIInStream.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the messages waiting to be taken
+#include <vector>
+
+// Necessary for the dropped count read from any thread
+#include <atomic>
+
+// Necessary for CTimedMsg
+#include "midi.h"
+
+// Necessary for CMIDIBatchReceiver
+#include "MIDIInDevice.h"
+
+
+// Coroutine support needs a C++20 compiler. It can be turned off by
+// defining MIDI_NO_COROUTINES.
+#if defined(__cpp_impl_coroutine) && !defined(MIDI_NO_COROUTINES)
+#define MIDI_HAS_COROUTINES
+#endif
+
+#ifdef MIDI_HAS_COROUTINES
+#include <coroutine>
+#endif
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIInStream
+    //
+    // Turns the messages from a CMIDIInDevice into a stream of
+    // batches to be taken rather than a receiver to be called. Make
+    // it the device's receiver, preferably with DISPATCH_THREAD so
+    // that the driver's callback only queues messages, then take
+    // everything that arrived since the last batch with TakeBatch or,
+    // with C++20, with
+    //
+    //     while(co_await Stream.NextBatch(Msgs) > 0) { ... }
+    //
+    // A waiting coroutine is resumed once, however many messages
+    // arrive before it gets to run, so high rate input costs one
+    // resume per batch rather than one per message. It is resumed on
+    // the dispatch thread, or handed to the executor set with
+    // SetExecutor.
+    //
+    // Only short messages are streamed. Long messages and invalid
+    // messages are ignored; use a receiver of their own for those.
+    // If the messages waiting to be taken reach the capacity, new
+    // ones are dropped and counted.
+    //
+    // Only one batch can be taken, or awaited, at a time.
+    //----------------------------------------------------------------
+
+
+    class CMIDIInStream : public CMIDIBatchReceiver
+    {
+    public:
+        // Default number of messages that can wait to be taken
+        enum { DEFAULT_CAPACITY = 4096 };
+
+        // Construction
+        explicit CMIDIInStream(std::size_t Capacity = DEFAULT_CAPACITY);
+
+        // Destruction. Nothing may be waiting for a batch.
+        ~CMIDIInStream();
+
+        // Replaces the contents of Msgs with every message that
+        // arrived since the last batch, oldest first. The vectors are
+        // swapped, so reusing Msgs for every batch avoids allocation;
+        // Msgs is given room for a full batch before the swap.
+        // Returns the number of messages.
+        std::size_t TakeBatch(std::vector<CTimedMsg> &Msgs);
+
+        // Ends the stream. Whatever is waiting for a batch gets the
+        // messages left, then every batch is empty. Messages that
+        // arrive after Close are dropped.
+        void Close();
+
+        // Starts the stream again after Close
+        void Reopen();
+
+        // Returns true if the stream has been closed
+        bool IsClosed() const;
+
+        // Gets the number of messages dropped because the stream was
+        // full or closed
+        DWORD GetDroppedCount() const;
+
+        // Takes short messages from the device
+        void ReceiveMsgs(const CTimedMsg *Msgs, std::size_t Count);
+
+        // Long and invalid messages are not streamed
+        void ReceiveMsg(LPSTR, DWORD, DWORD) {}
+        void OnError(DWORD, DWORD) {}
+        void OnError(LPSTR, DWORD, DWORD) {}
+
+        // Keep the other ReceiveMsg overloads visible
+        using CMIDIBatchReceiver::ReceiveMsg;
+
+#ifdef MIDI_HAS_COROUTINES
+        // Function given a waiting coroutine to resume, such as by
+        // posting it to a thread pool
+        typedef void (*ExecutorProc)(void *Context,
+                                     std::coroutine_handle<> Handle);
+
+        // What co_await on NextBatch waits with. Resumes with the
+        // number of messages put in the caller's vector, which is
+        // only zero once the stream has been closed.
+        class CBatchAwaiter
+        {
+        public:
+            CBatchAwaiter(CMIDIInStream &Stream,
+                          std::vector<CTimedMsg> &Msgs) :
+            m_Stream(&Stream),
+            m_Msgs(&Msgs)
+            {}
+
+            bool await_ready() const { return false; }
+
+            bool await_suspend(std::coroutine_handle<> Handle)
+            { return m_Stream->Suspend(Handle); }
+
+            std::size_t await_resume()
+            { return m_Stream->TakeBatch(*m_Msgs); }
+
+        private:
+            CMIDIInStream          *m_Stream;
+            std::vector<CTimedMsg> *m_Msgs;
+        };
+
+        // Sets the function waiting coroutines are handed to. NULL,
+        // the default, resumes them on the thread the messages
+        // arrive on. Set it before anything waits for a batch.
+        void SetExecutor(ExecutorProc Executor, void *Context);
+
+        // Waits for messages, then puts them in Msgs as TakeBatch
+        // does. Does not wait if messages are already there or the
+        // stream is closed.
+        CBatchAwaiter NextBatch(std::vector<CTimedMsg> &Msgs)
+        { return CBatchAwaiter(*this, Msgs); }
+#endif
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIInStream(const CMIDIInStream &);
+        CMIDIInStream &operator = (const CMIDIInStream &);
+
+#ifdef MIDI_HAS_COROUTINES
+        // Keeps a coroutine waiting until messages arrive. Returns
+        // false if there is no need to wait.
+        bool Suspend(std::coroutine_handle<> Handle);
+
+        // Takes the waiting coroutine, if any. Must be called with
+        // the lock held.
+        std::coroutine_handle<> TakeWaiter();
+
+        // Resumes a coroutine taken with TakeWaiter
+        void Resume(std::coroutine_handle<> Handle);
+#endif
+
+    // Private attributes and constants
+    private:
+        std::vector<CTimedMsg> m_Msgs;
+        std::size_t            m_Capacity;
+        bool                   m_Closed;
+        std::atomic<DWORD>     m_DroppedCount;
+
+#ifdef MIDI_HAS_COROUTINES
+        std::coroutine_handle<> m_Waiter;
+        ExecutorProc            m_Executor;
+        void                   *m_ExecutorContext;
+#endif
+
+        mutable CRITICAL_SECTION m_Lock;
+    };
+}
+
+
+#endif
\ No newline at end of file
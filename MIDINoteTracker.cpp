@@ -0,0 +1,379 @@
+/*********************************************************************
+ * MIDINoteTracker.cpp - Implementation for CMIDINoteTracker.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDINoteTracker.h"
+
+// Necessary for std::memset
+#include <cstring>
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDINoteTracker;
+using midi::CShortMsg;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Number of channels
+const unsigned char CHANNEL_COUNT = 16;
+
+// Pitch bend with no bend
+const WORD PITCH_BEND_CENTRE = 8192;
+
+// Lowest pedal value that counts as down
+const unsigned char PEDAL_DOWN = 64;
+
+
+namespace
+{
+    // Gets where a reset all controllers leaves a controller, or
+    // NO_VALUE if it leaves the controller alone
+    unsigned char GetResetValue(unsigned char Controller)
+    {
+        if(Controller == midi::CC_MODULATION ||
+           (Controller >= midi::CC_SUSTAIN &&
+            Controller <= midi::CC_HOLD_2))
+        {
+            return 0;
+        }
+        else if(Controller == midi::CC_EXPRESSION)
+        {
+            return 127;
+        }
+
+        return CMIDINoteTracker::NO_VALUE;
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDINoteTracker implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDINoteTracker::CMIDINoteTracker()
+{
+    Reset();
+}
+
+
+// Updates the state from a short message
+void CMIDINoteTracker::TrackMsg(DWORD Msg)
+{
+    unsigned char Status = static_cast<unsigned char>(Msg);
+    unsigned char Channel = Status & midi::SHORT_MSG_MASK;
+    unsigned char Data1 = static_cast<unsigned char>(
+        (Msg >> midi::SHORT_MSG_SHIFT) & midi::DATA_BYTE_MASK);
+    unsigned char Data2 = static_cast<unsigned char>(
+        (Msg >> midi::SHORT_MSG_SHIFT * 2) & midi::DATA_BYTE_MASK);
+    DWORD NoteBit = 1UL << (Data1 & 31);
+
+    switch(Status & ~midi::SHORT_MSG_MASK)
+    {
+    case midi::NOTE_OFF:
+        m_Notes[Channel][Data1 >> 5] &= ~NoteBit;
+        break;
+
+    // A note on with no velocity is a note off
+    case midi::NOTE_ON:
+        if(Data2 > 0)
+        {
+            m_Notes[Channel][Data1 >> 5] |= NoteBit;
+        }
+        else
+        {
+            m_Notes[Channel][Data1 >> 5] &= ~NoteBit;
+        }
+        break;
+
+    case midi::POLY_PRESSURE:
+        if(Data2 > 0)
+        {
+            m_Moved |= 1 << Channel;
+        }
+        break;
+
+    case midi::CONTROL_CHANGE:
+        TrackController(Channel, Data1, Data2);
+        break;
+
+    case midi::PROGRAM_CHANGE:
+        m_Programs[Channel] = Data1;
+        break;
+
+    case midi::CHANNEL_PRESSURE:
+        m_Pressures[Channel] = Data1;
+
+        if(Data1 > 0)
+        {
+            m_Moved |= 1 << Channel;
+        }
+        break;
+
+    case midi::PITCH_BEND:
+        m_PitchBends[Channel] = static_cast<WORD>(Data1 | (Data2 << 7));
+
+        if(m_PitchBends[Channel] != PITCH_BEND_CENTRE)
+        {
+            m_Moved |= 1 << Channel;
+        }
+        break;
+
+    // A system reset puts the whole device back the way it started
+    default:
+        if(Status == midi::SYSTEM_RESET)
+        {
+            Reset();
+        }
+        break;
+    }
+}
+
+
+// Updates the state from several short messages
+void CMIDINoteTracker::TrackMsgs(const DWORD *Msgs, std::size_t Count)
+{
+    for(std::size_t i = 0; i < Count; i++)
+    {
+        TrackMsg(Msgs[i]);
+    }
+}
+
+
+// Forgets everything
+void CMIDINoteTracker::Reset()
+{
+    std::memset(m_Notes, 0, sizeof m_Notes);
+    std::memset(m_Controllers, NO_VALUE, sizeof m_Controllers);
+    std::memset(m_Programs, NO_VALUE, sizeof m_Programs);
+    std::memset(m_Pressures, NO_VALUE, sizeof m_Pressures);
+
+    for(unsigned char Channel = 0; Channel < CHANNEL_COUNT; Channel++)
+    {
+        m_PitchBends[Channel] = PITCH_BEND_CENTRE;
+    }
+
+    m_Moved = 0;
+}
+
+
+// Gets the messages that release everything held
+std::size_t CMIDINoteTracker::GetReleaseMsgs(DWORD *Msgs) const
+{
+    std::size_t Count = 0;
+
+    // Notes first, so that the pedals let go of them afterwards
+    for(unsigned char Channel = 0; Channel < CHANNEL_COUNT; Channel++)
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            DWORD Bits = m_Notes[Channel][i];
+
+            for(unsigned char Note = i * 32; Bits != 0; Note++)
+            {
+                if(Bits & 1)
+                {
+                    Msgs[Count] = CShortMsg::NoteOff(Channel,
+                                                     Note).GetMsg();
+                    Count++;
+                }
+
+                Bits >>= 1;
+            }
+        }
+    }
+
+    for(unsigned char Channel = 0; Channel < CHANNEL_COUNT; Channel++)
+    {
+        // Not every device understands reset all controllers, so
+        // pedals and pitch bend are released one by one as well
+        const unsigned char Pedals[] =
+        {
+            midi::CC_SUSTAIN, midi::CC_SOSTENUTO, midi::CC_SOFT_PEDAL
+        };
+
+        for(int i = 0; i < 3; i++)
+        {
+            unsigned char Value = m_Controllers[Channel][Pedals[i]];
+
+            if(Value != NO_VALUE && Value >= PEDAL_DOWN)
+            {
+                Msgs[Count] = CShortMsg::ControlChange(Channel,
+                                                       Pedals[i],
+                                                       0).GetMsg();
+                Count++;
+            }
+        }
+
+        if(m_PitchBends[Channel] != PITCH_BEND_CENTRE)
+        {
+            Msgs[Count] = CShortMsg::PitchBend(Channel,
+                                               PITCH_BEND_CENTRE).GetMsg();
+            Count++;
+        }
+
+        if(m_Moved & (1 << Channel))
+        {
+            Msgs[Count] = CShortMsg::ControlChange(Channel,
+                              midi::CC_RESET_ALL_CONTROLLERS, 0).GetMsg();
+            Count++;
+        }
+    }
+
+    return Count;
+}
+
+
+// Determines if a note is held
+bool CMIDINoteTracker::IsNoteOn(unsigned char Channel,
+                                unsigned char Note) const
+{
+    Channel &= midi::SHORT_MSG_MASK;
+    Note &= midi::DATA_BYTE_MASK;
+
+    return (m_Notes[Channel][Note >> 5] & (1UL << (Note & 31))) != 0;
+}
+
+
+// Gets the number of notes held
+std::size_t CMIDINoteTracker::GetNoteCount() const
+{
+    std::size_t Count = 0;
+
+    for(unsigned char Channel = 0; Channel < CHANNEL_COUNT; Channel++)
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            // Clear the lowest bit until none are left
+            for(DWORD Bits = m_Notes[Channel][i]; Bits != 0;
+                Bits &= Bits - 1)
+            {
+                Count++;
+            }
+        }
+    }
+
+    return Count;
+}
+
+
+// Gets the last value of a controller
+unsigned char CMIDINoteTracker::GetController(
+                                        unsigned char Channel,
+                                        unsigned char Controller) const
+{
+    return m_Controllers[Channel & midi::SHORT_MSG_MASK]
+                        [Controller & midi::DATA_BYTE_MASK];
+}
+
+
+// Gets the last program
+unsigned char CMIDINoteTracker::GetProgram(unsigned char Channel) const
+{
+    return m_Programs[Channel & midi::SHORT_MSG_MASK];
+}
+
+
+// Gets the last channel pressure
+unsigned char CMIDINoteTracker::GetPressure(unsigned char Channel) const
+{
+    return m_Pressures[Channel & midi::SHORT_MSG_MASK];
+}
+
+
+// Gets the pitch bend
+WORD CMIDINoteTracker::GetPitchBend(unsigned char Channel) const
+{
+    return m_PitchBends[Channel & midi::SHORT_MSG_MASK];
+}
+
+
+// Tracks received short messages
+void CMIDINoteTracker::ReceiveMsgs(const midi::CTimedMsg *Msgs,
+                                   std::size_t Count)
+{
+    for(std::size_t i = 0; i < Count; i++)
+    {
+        TrackMsg(Msgs[i].Msg);
+    }
+}
+
+
+// Updates the state from a control change
+void CMIDINoteTracker::TrackController(unsigned char Channel,
+                                       unsigned char Controller,
+                                       unsigned char Value)
+{
+    // All sound off, all notes off and the mode messages release
+    // every note
+    if(Controller == midi::CC_ALL_SOUND_OFF ||
+       Controller >= midi::CC_ALL_NOTES_OFF)
+    {
+        ClearNotes(Channel);
+    }
+    else if(Controller == midi::CC_RESET_ALL_CONTROLLERS)
+    {
+        ClearControllers(Channel);
+    }
+    else
+    {
+        m_Controllers[Channel][Controller] = Value;
+
+        unsigned char ResetValue = GetResetValue(Controller);
+
+        if(ResetValue != NO_VALUE && Value != ResetValue)
+        {
+            m_Moved |= 1 << Channel;
+        }
+    }
+}
+
+
+// Releases every note on a channel
+void CMIDINoteTracker::ClearNotes(unsigned char Channel)
+{
+    for(int i = 0; i < 4; i++)
+    {
+        m_Notes[Channel][i] = 0;
+    }
+}
+
+
+// Puts back what a reset all controllers puts back
+void CMIDINoteTracker::ClearControllers(unsigned char Channel)
+{
+    for(int Controller = 0; Controller < 128; Controller++)
+    {
+        unsigned char ResetValue = GetResetValue(
+                                    static_cast<unsigned char>(Controller));
+
+        if(ResetValue != NO_VALUE &&
+           m_Controllers[Channel][Controller] != NO_VALUE)
+        {
+            m_Controllers[Channel][Controller] = ResetValue;
+        }
+    }
+
+    if(m_Pressures[Channel] != NO_VALUE)
+    {
+        m_Pressures[Channel] = 0;
+    }
+
+    m_PitchBends[Channel] = PITCH_BEND_CENTRE;
+    m_Moved &= ~(1 << Channel);
+}
\ No newline at end of file
@@ -0,0 +1,149 @@
+#ifndef MIDI_NOTE_TRACKER_H
+#define MIDI_NOTE_TRACKER_H
+
+
+/*********************************************************************
+ * MIDINoteTracker.h - Interface for CMIDINoteTracker.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for CTimedMsg
+#include "midi.h"
+
+// Necessary for CMIDIBatchReceiver
+#include "MIDIInDevice.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDINoteTracker
+    //
+    // Keeps track of the notes held and the controllers moved on each
+    // channel, so that they can all be released in one batch when
+    // playing stops, a panic button is pressed or the output moves
+    // to another device. Give it the messages sent to a
+    // CMIDIOutDevice with SetNoteTracker, or register it as the
+    // receiver of a CMIDIInDevice.
+    //
+    // Held notes are a bitset of 128 notes per channel. Controller,
+    // program, pressure and pitch bend values are kept in flat
+    // per-channel arrays.
+    //
+    // The tracker does no locking. Feed it from one thread at a
+    // time, and only read it from that thread or while nothing is
+    // feeding it.
+    //----------------------------------------------------------------
+
+
+    class CMIDINoteTracker : public CMIDIBatchReceiver
+    {
+    public:
+        // Value of anything not yet seen
+        enum { NO_VALUE = 0xFF };
+
+        // Largest number of messages GetReleaseMsgs can produce: a
+        // note off for every note, then up to three pedals, a pitch
+        // bend and a controller reset for every channel
+        enum { MAX_RELEASE_MSGS = 16 * 128 + 16 * 5 };
+
+        // Construction
+        CMIDINoteTracker();
+
+        // Updates the state from a short message
+        void TrackMsg(DWORD Msg);
+
+        // Updates the state from Count short messages
+        void TrackMsgs(const DWORD *Msgs, std::size_t Count);
+
+        // Forgets every note and controller, without sending anything
+        void Reset();
+
+        // Fills Msgs with the messages that release everything held:
+        // a note off for each held note, a pedal release for each
+        // pedal held down, a centred pitch bend for each bent
+        // channel and a reset all controllers for each channel with
+        // controllers moved. Msgs must have room for MAX_RELEASE_MSGS
+        // messages. Returns the number of messages. The state is not
+        // changed; it changes when the messages are tracked, such as
+        // when they are sent to a device using this tracker.
+        std::size_t GetReleaseMsgs(DWORD *Msgs) const;
+
+        // Returns true if the note is held
+        bool IsNoteOn(unsigned char Channel, unsigned char Note) const;
+
+        // Gets the number of notes held on every channel
+        std::size_t GetNoteCount() const;
+
+        // Gets the last value of a controller, or NO_VALUE
+        unsigned char GetController(unsigned char Channel,
+                                    unsigned char Controller) const;
+
+        // Gets the last program, or NO_VALUE
+        unsigned char GetProgram(unsigned char Channel) const;
+
+        // Gets the last channel pressure, or NO_VALUE
+        unsigned char GetPressure(unsigned char Channel) const;
+
+        // Gets the pitch bend, from 0 to 16383. Reads 8192, the
+        // centre, if never seen.
+        WORD GetPitchBend(unsigned char Channel) const;
+
+        // Tracks received short messages
+        void ReceiveMsgs(const CTimedMsg *Msgs, std::size_t Count);
+
+        // Long and invalid messages change nothing
+        void ReceiveMsg(LPSTR, DWORD, DWORD) {}
+        void OnError(DWORD, DWORD) {}
+        void OnError(LPSTR, DWORD, DWORD) {}
+
+        // Keep the other ReceiveMsg overloads visible
+        using CMIDIBatchReceiver::ReceiveMsg;
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDINoteTracker(const CMIDINoteTracker &);
+        CMIDINoteTracker &operator = (const CMIDINoteTracker &);
+
+        // Updates the state from a control change
+        void TrackController(unsigned char Channel,
+                             unsigned char Controller,
+                             unsigned char Value);
+
+        // Releases every note on a channel
+        void ClearNotes(unsigned char Channel);
+
+        // Sets the controllers of a channel back to how they were
+        void ClearControllers(unsigned char Channel);
+
+    // Private attributes and constants
+    private:
+        // Held notes, one bit per note
+        DWORD         m_Notes[16][4];
+
+        unsigned char m_Controllers[16][128];
+        unsigned char m_Programs[16];
+        unsigned char m_Pressures[16];
+        WORD          m_PitchBends[16];
+
+        // Channels with controllers, pressure or pitch bend moved
+        // from where a reset all controllers leaves them, one bit per
+        // channel
+        WORD          m_Moved;
+    };
+}
+
+
+#endif
\ No newline at end of file
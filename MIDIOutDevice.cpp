@@ -14,8 +14,14 @@
 
 
 #include "MIDIOutDevice.h"
+#include "MIDINoteTracker.h"
+#include "MIDICapture.h"
+#include "MIDIParser.h"
 #include "midi.h"
 
+// Necessary for copying messages into pool buffers
+#include <cstring>
+
 
 //--------------------------------------------------------------------
 // Using declarations
@@ -24,6 +30,10 @@
 
 using midi::CMIDIOutDevice;
 using midi::CMIDIOutException;
+using midi::CMIDINoteTracker;
+using midi::CMIDICapture;
+using midi::CMIDIParser;
+using midi::CSPSCRing;
 
 
 //--------------------------------------------------------------------
@@ -31,25 +41,50 @@ using midi::CMIDIOutException;
 //--------------------------------------------------------------------
 
 
-// Constructor
+// Constructor for headers pointing at the caller's message
 CMIDIOutDevice::CMIDIOutHeader::CMIDIOutHeader(HMIDIOUT DevHandle,
                                                LPSTR Msg, 
                                                DWORD MsgLength) :
-m_DevHandle(DevHandle)
+m_DevHandle(DevHandle),
+m_Pool(NULL),
+m_Buffer(NULL),
+m_BufferSize(0),
+m_Callback(NULL)
 {
     // Initialize header
     m_MIDIHdr.lpData         = Msg;
     m_MIDIHdr.dwBufferLength = MsgLength;
     m_MIDIHdr.dwFlags        = 0;
 
-    // Prepare header
-    MMRESULT Result = ::midiOutPrepareHeader(DevHandle, &m_MIDIHdr,
-                                             sizeof m_MIDIHdr);
+    Prepare();
+}
 
-    // If an error occurred, throw exception
-    if(Result != MMSYSERR_NOERROR)
+
+// Constructor for headers owning a buffer
+CMIDIOutDevice::CMIDIOutHeader::CMIDIOutHeader(HMIDIOUT DevHandle,
+                                               DWORD BufferSize,
+                                               CHeaderPool *Pool) :
+m_DevHandle(DevHandle),
+m_Pool(Pool),
+m_Buffer(new char[BufferSize]),
+m_BufferSize(BufferSize),
+m_Callback(NULL)
+{
+    // Initialize header
+    m_MIDIHdr.lpData         = m_Buffer;
+    m_MIDIHdr.dwBufferLength = BufferSize;
+    m_MIDIHdr.dwFlags        = 0;
+
+    try
     {
-        throw CMIDIOutException(Result);
+        Prepare();
+    }
+    // If preparing the header failed, release the buffer and 
+    // rethrow exception
+    catch(const CMIDIOutException &)
+    {
+        delete [] m_Buffer;
+        throw;
     }
 }
 
@@ -59,14 +94,29 @@ CMIDIOutDevice::CMIDIOutHeader::~CMIDIOutHeader()
 {
     ::midiOutUnprepareHeader(m_DevHandle, &m_MIDIHdr, 
                              sizeof m_MIDIHdr);
+
+    delete [] m_Buffer;
+}
+
+
+// Prepares header
+void CMIDIOutDevice::CMIDIOutHeader::Prepare()
+{
+    MMRESULT Result = ::midiOutPrepareHeader(m_DevHandle, &m_MIDIHdr,
+                                             sizeof m_MIDIHdr);
+
+    // If an error occurred, throw exception
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIOutException(Result);
+    }
 }
 
 
 // Sends long message
 void CMIDIOutDevice::CMIDIOutHeader::SendMsg()
 {
-    MMRESULT Result = ::midiOutLongMsg(m_DevHandle, &m_MIDIHdr,
-                                       sizeof m_MIDIHdr);
+    MMRESULT Result = TrySendMsg();
 
     if(Result != MMSYSERR_NOERROR)
     {
@@ -75,15 +125,165 @@ void CMIDIOutDevice::CMIDIOutHeader::SendMsg()
 }
 
 
+// Sends long message without throwing
+MMRESULT CMIDIOutDevice::CMIDIOutHeader::TrySendMsg()
+{
+    return ::midiOutLongMsg(m_DevHandle, &m_MIDIHdr, sizeof m_MIDIHdr);
+}
+
+
+// Copies message into the header's own buffer. The message must fit
+// in the buffer.
+void CMIDIOutDevice::CMIDIOutHeader::SetMsg(LPSTR Msg, DWORD MsgLength)
+{
+    std::memcpy(m_Buffer, Msg, MsgLength);
+
+    // The header was prepared for the whole buffer, so only the 
+    // length of the message being sent changes
+    m_MIDIHdr.dwBufferLength = MsgLength;
+}
+
+
+// Determines if the device is finished with the header
+bool CMIDIOutDevice::CMIDIOutHeader::IsDone() const
+{
+    return ((m_MIDIHdr.dwFlags & MHDR_DONE) == MHDR_DONE);
+}
+
+
+//--------------------------------------------------------------------
+// CHeaderPool implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIOutDevice::CHeaderPool::CHeaderPool() :
+m_Headers(NULL),
+m_HeaderCount(0),
+m_BufferSize(0),
+m_FreeHeaders(NULL),
+m_Spare(NULL)
+{
+}
+
+
+// Destructor
+CMIDIOutDevice::CHeaderPool::~CHeaderPool()
+{
+    Destroy();
+}
+
+
+// Creates and prepares the pool's headers
+void CMIDIOutDevice::CHeaderPool::Create(HMIDIOUT DevHandle,
+                                         DWORD HeaderCount,
+                                         DWORD BufferSize)
+{
+    // Get rid of any previous headers
+    Destroy();
+
+    try
+    {
+        m_FreeHeaders = new CSPSCRing<CMIDIOutHeader *>(HeaderCount);
+        m_Headers = new CMIDIOutHeader *[HeaderCount];
+        m_BufferSize = BufferSize;
+
+        // Create headers, making them available as we go so that 
+        // Destroy can clean up after a failure
+        for(m_HeaderCount = 0; m_HeaderCount < HeaderCount; 
+            m_HeaderCount++)
+        {
+            m_Headers[m_HeaderCount] = new CMIDIOutHeader(DevHandle,
+                                                          BufferSize,
+                                                          this);
+            m_FreeHeaders->Push(m_Headers[m_HeaderCount]);
+        }
+    }
+    // If memory allocation failed, clean up and throw exception
+    catch(const std::bad_alloc &)
+    {
+        Destroy();
+        throw CMIDIOutMemFailure();
+    }
+    // If preparing a header failed, clean up and rethrow exception
+    catch(const CMIDIOutException &)
+    {
+        Destroy();
+        throw;
+    }
+}
+
+
+// Destroys the pool's headers. The device must be finished with all 
+// of them.
+void CMIDIOutDevice::CHeaderPool::Destroy()
+{
+    for(DWORD i = 0; i < m_HeaderCount; i++)
+    {
+        delete m_Headers[i];
+    }
+
+    delete [] m_Headers;
+    delete m_FreeHeaders;
+
+    m_Headers = NULL;
+    m_HeaderCount = 0;
+    m_BufferSize = 0;
+    m_FreeHeaders = NULL;
+    m_Spare = NULL;
+}
+
+
+// Gets a free header
+CMIDIOutDevice::CMIDIOutHeader *
+CMIDIOutDevice::CHeaderPool::AcquireHeader(DWORD MsgLength)
+{
+    CMIDIOutHeader *Header = NULL;
+
+    // Only messages that fit in a pool buffer can use the pool
+    if(m_FreeHeaders != NULL && MsgLength <= m_BufferSize)
+    {
+        // A header that could not be sent earlier comes first
+        if(m_Spare != NULL)
+        {
+            Header = m_Spare;
+            m_Spare = NULL;
+        }
+        else
+        {
+            m_FreeHeaders->Pop(Header);
+        }
+    }
+
+    return Header;
+}
+
+
+// Gives back a header the device is finished with
+void CMIDIOutDevice::CHeaderPool::ReturnHeader(CMIDIOutHeader *Header)
+{
+    m_FreeHeaders->Push(Header);
+}
+
+
+// Gives back a header that could not be sent
+void CMIDIOutDevice::CHeaderPool::CancelHeader(CMIDIOutHeader *Header)
+{
+    // The free header ring only takes headers from the header thread,
+    // so keep this one aside for the next message
+    m_Spare = Header;
+}
+
+
 //--------------------------------------------------------------------
 // CHeaderQueue implementation
 //--------------------------------------------------------------------
 
 
 // Constructor
-CMIDIOutDevice::CHeaderQueue::CHeaderQueue()
+CMIDIOutDevice::CHeaderQueue::CHeaderQueue(std::size_t Capacity) :
+m_HdrQueue(Capacity)
 {
-    ::InitializeCriticalSection(&m_CriticalSection);
 }
 
 
@@ -91,65 +291,104 @@ CMIDIOutDevice::CHeaderQueue::CHeaderQueue()
 CMIDIOutDevice::CHeaderQueue::~CHeaderQueue()
 {
     RemoveAll();
-
-    ::DeleteCriticalSection(&m_CriticalSection);
 }
 
 
-// Add header to queue
+// Add header to queue. The caller must make sure the queue is not 
+// full.
 void CMIDIOutDevice::CHeaderQueue::AddHeader(
                                CMIDIOutDevice::CMIDIOutHeader *Header)
 {
-    ::EnterCriticalSection(&m_CriticalSection);
-
-    m_HdrQueue.push(Header);
-
-    ::LeaveCriticalSection(&m_CriticalSection);
+    m_HdrQueue.Push(Header);
 }
 
 
 // Remove header from queue
 void CMIDIOutDevice::CHeaderQueue::RemoveHeader()
 {
-    ::EnterCriticalSection(&m_CriticalSection);
+    CMIDIOutHeader *Header;
 
-    if(!m_HdrQueue.empty())
+    if(m_HdrQueue.Pop(Header))
     {
-        delete m_HdrQueue.front();
-        m_HdrQueue.pop();
+        ReleaseHeader(Header);
     }
+}
+
+
+// Remove finished headers from the front of the queue
+void CMIDIOutDevice::CHeaderQueue::RemoveDone()
+{
+    CMIDIOutHeader **Header = m_HdrQueue.Front();
+
+    // Several headers may have finished for a single wake up of the 
+    // header thread, so keep going until we reach one that is still
+    // in use
+    while(Header != NULL && (*Header)->IsDone())
+    {
+        ReleaseHeader(*Header);
+        m_HdrQueue.PopFront();
 
-    ::LeaveCriticalSection(&m_CriticalSection);
+        Header = m_HdrQueue.Front();
+    }
 }
 
 
 // Empty header queue
 void CMIDIOutDevice::CHeaderQueue::RemoveAll()
 {
-    ::EnterCriticalSection(&m_CriticalSection);
+    CMIDIOutHeader *Header;
 
-    while(!m_HdrQueue.empty())
+    while(m_HdrQueue.Pop(Header))
     {
-        delete m_HdrQueue.front();
-        m_HdrQueue.pop();
+        ReleaseHeader(Header);
     }
-
-    ::LeaveCriticalSection(&m_CriticalSection);
 }
 
 
 // Determines if the header queue is empty
 bool CMIDIOutDevice::CHeaderQueue::IsEmpty()
 {
-    bool Result;
+    return m_HdrQueue.IsEmpty();
+}
 
-    ::EnterCriticalSection(&m_CriticalSection);
 
-    Result = m_HdrQueue.empty();
+// Determines if the header queue is full
+bool CMIDIOutDevice::CHeaderQueue::IsFull()
+{
+    return m_HdrQueue.IsFull();
+}
 
-    ::LeaveCriticalSection(&m_CriticalSection);
 
-    return Result;
+// Gets the number of headers in the queue
+std::size_t CMIDIOutDevice::CHeaderQueue::GetSize()
+{
+    return m_HdrQueue.GetSize();
+}
+
+
+// Deletes header or gives it back to its pool
+void CMIDIOutDevice::CHeaderQueue::ReleaseHeader(
+                               CMIDIOutDevice::CMIDIOutHeader *Header)
+{
+    if(Header->GetPool() != NULL)
+    {
+        Header->GetPool()->ReturnHeader(Header);
+    }
+    else
+    {
+        midi::CMIDIOutCallback *Callback = Header->GetCallback();
+        LPSTR Msg = Header->GetMsg();
+        DWORD MsgLength = Header->GetMsgLength();
+
+        // The caller's message is only free once its header has been
+        // unprepared
+        delete Header;
+
+        if(Callback != NULL)
+        {
+            Callback->OnLongMsgDone(Msg, MsgLength);
+        }
+    }
 }
 
 
@@ -160,6 +399,27 @@ bool CMIDIOutDevice::CHeaderQueue::IsEmpty()
 
 // Constructs CMIDIOutDevice object in an closed state
 CMIDIOutDevice::CMIDIOutDevice() :
+m_Worker(NULL),
+m_ActiveWorker(NULL),
+m_HdrQueue(DEFAULT_HDR_QUEUE_CAPACITY),
+m_PoolHeaderCount(0),
+m_PoolBufferSize(0),
+m_NoteTracker(NULL),
+m_Capture(NULL),
+m_CapturePort(0),
+m_PacingRate(0),
+m_PacingQueueCapacity(DEFAULT_PACING_QUEUE_CAPACITY),
+m_PacingBufferSize(DEFAULT_PACING_BUFFER_SIZE),
+m_PacedMsgs(NULL),
+m_PacedBytes(NULL),
+m_PacingEvent(NULL),
+m_PacingThread(NULL),
+m_Pacing(false),
+m_RoomEvent(NULL),
+m_RoomWaiting(false),
+m_WireTime(0),
+m_CounterFrequency(0),
+m_InSysEx(false),
 m_State(CLOSED)
 {
     // If we are unable to create signalling event, throw exception
@@ -170,22 +430,90 @@ m_State(CLOSED)
 }
 
 
-// Constructs CMIDIOutDevice object in an opened state
-CMIDIOutDevice::CMIDIOutDevice(UINT DeviceId) :
+// Constructs CMIDIOutDevice object in an closed state with the given
+// header queue and pool
+CMIDIOutDevice::CMIDIOutDevice(std::size_t HdrQueueCapacity,
+                               DWORD PoolHeaderCount, 
+                               DWORD PoolBufferSize) :
+m_Worker(NULL),
+m_ActiveWorker(NULL),
+m_HdrQueue(HdrQueueCapacity),
+m_PoolHeaderCount(PoolHeaderCount),
+m_PoolBufferSize(PoolBufferSize),
+m_NoteTracker(NULL),
+m_Capture(NULL),
+m_CapturePort(0),
+m_PacingRate(0),
+m_PacingQueueCapacity(DEFAULT_PACING_QUEUE_CAPACITY),
+m_PacingBufferSize(DEFAULT_PACING_BUFFER_SIZE),
+m_PacedMsgs(NULL),
+m_PacedBytes(NULL),
+m_PacingEvent(NULL),
+m_PacingThread(NULL),
+m_Pacing(false),
+m_RoomEvent(NULL),
+m_RoomWaiting(false),
+m_WireTime(0),
+m_CounterFrequency(0),
+m_InSysEx(false),
 m_State(CLOSED)
 {
-    // Open device
-    Open(DeviceId);
-
     // If we are unable to create signalling event, throw exception
     if(!CreateEvent())
     {
-        Close();
         throw CMIDIOutEventFailure();
     }
 }
 
 
+// Constructs CMIDIOutDevice object in an opened state
+CMIDIOutDevice::CMIDIOutDevice(UINT DeviceId, 
+                               std::size_t HdrQueueCapacity) :
+m_Worker(NULL),
+m_ActiveWorker(NULL),
+m_HdrQueue(HdrQueueCapacity),
+m_PoolHeaderCount(0),
+m_PoolBufferSize(0),
+m_NoteTracker(NULL),
+m_Capture(NULL),
+m_CapturePort(0),
+m_PacingRate(0),
+m_PacingQueueCapacity(DEFAULT_PACING_QUEUE_CAPACITY),
+m_PacingBufferSize(DEFAULT_PACING_BUFFER_SIZE),
+m_PacedMsgs(NULL),
+m_PacedBytes(NULL),
+m_PacingEvent(NULL),
+m_PacingThread(NULL),
+m_Pacing(false),
+m_RoomEvent(NULL),
+m_RoomWaiting(false),
+m_WireTime(0),
+m_CounterFrequency(0),
+m_InSysEx(false),
+m_State(CLOSED)
+{
+    // If we are unable to create signalling event, throw exception.
+    // The event has to exist before the device is opened.
+    if(!CreateEvent())
+    {
+        throw CMIDIOutEventFailure();
+    }
+
+    try
+    {
+        // Open device
+        Open(DeviceId);
+    }
+    // If the device could not be opened, the destructor will not 
+    // run, so close the event here and rethrow exception
+    catch(...)
+    {
+        ::CloseHandle(m_Event);
+        throw;
+    }
+}
+
+
 // Destruction
 CMIDIOutDevice::~CMIDIOutDevice()
 {
@@ -204,32 +532,74 @@ void CMIDIOutDevice::Open(UINT DeviceId)
     // opening another one
     Close();
 
-    DWORD Dummy;
-
-    // If we are unable to create worker thread for handling the 
-    // headers, throw exception
-    if((::CreateThread(NULL, 0, HeaderProc, this, 0, &Dummy)) == NULL)
-    {
-        throw CMIDIOutThreadFailure();
-    }
-
     // Open MIDI output device
     MMRESULT Result = ::midiOutOpen(&m_DevHandle, DeviceId, 
                                  reinterpret_cast<DWORD>(MidiOutProc),
                                  reinterpret_cast<DWORD>(this),
                                  CALLBACK_FUNCTION);
 
-    // If we are able to open the device, change state
-    if(Result == MMSYSERR_NOERROR)
+    // If opening failed, throw exception
+    if(Result != MMSYSERR_NOERROR)
     {
-        m_State = OPENED;
+        throw CMIDIOutException(Result);
     }
-    // Else opening failed, throw exception
-    else
+
+    // Prepare the header pool, if one has been set up
+    if(m_PoolHeaderCount > 0)
     {
-        ::SetEvent(m_Event);
-        throw CMIDIOutException(Result);
+        try
+        {
+            m_HdrPool.Create(m_DevHandle, m_PoolHeaderCount, 
+                             m_PoolBufferSize);
+        }
+        // If the pool could not be created, close the device and 
+        // rethrow exception
+        catch(...)
+        {
+            ::midiOutClose(m_DevHandle);
+            throw;
+        }
+    }
+
+    m_ActiveWorker = (m_Worker != NULL) ? m_Worker : &m_OwnWorker;
+
+    try
+    {
+        // Have the worker thread manage our headers
+        m_ActiveWorker->Add(m_Event, HeaderProc, this);
+    }
+    // If the worker could not take the device, close the device and
+    // rethrow exception
+    catch(...)
+    {
+        m_HdrPool.Destroy();
+        ::midiOutClose(m_DevHandle);
+        throw;
+    }
+
+    // Start pacing, if it has been turned on
+    if(m_PacingRate > 0)
+    {
+        try
+        {
+            StartPacing();
+        }
+        // If pacing could not be started, undo the rest of opening 
+        // and rethrow exception
+        catch(...)
+        {
+            StopPacing();
+            m_FragmentPool.Destroy();
+            m_ActiveWorker->Remove(m_Event);
+            m_ActiveWorker = NULL;
+            m_HdrPool.Destroy();
+            ::midiOutClose(m_DevHandle);
+            throw;
+        }
     }
+
+    // Change state
+    m_State = OPENED;
 }
 
 
@@ -239,14 +609,41 @@ void CMIDIOutDevice::Close()
     // Only close an already opened device
     if(m_State == OPENED)
     {
+        // Stop the pacing thread, if any. The short messages it had
+        // not got to yet are sent straight away, and so is anything 
+        // sent from here on.
+        StopPacing();
+
+        // Release anything still held while the device can take 
+        // messages. The device may already be gone, so failures are
+        // ignored.
+        if(m_NoteTracker != NULL)
+        {
+            try
+            {
+                ReleaseNotes();
+            }
+            catch(const CMIDIOutException &)
+            {
+            }
+        }
+
         // Change state
         m_State = CLOSED;
 
-        // Notify our worker thread to finish
-        ::SetEvent(m_Event);
+        // Return any headers the device is still using
+        ::midiOutReset(m_DevHandle);
+
+        // Take the device away from the worker thread. Once this 
+        // returns, the worker is finished with the header queue, 
+        // which may only be emptied by one thread at a time.
+        m_ActiveWorker->Remove(m_Event);
+        m_ActiveWorker = NULL;
 
         // Empty header queue - we're finished with the headers
         m_HdrQueue.RemoveAll();
+        m_HdrPool.Destroy();
+        m_FragmentPool.Destroy();
 
         // Close the MIDI output device
         ::midiOutClose(m_DevHandle);
@@ -259,77 +656,371 @@ void CMIDIOutDevice::SendMsg(DWORD Msg)
 {
     if(m_State == OPENED)
     {
-        MMRESULT Result = ::midiOutShortMsg(m_DevHandle, Msg);
+        MMRESULT Result = TrySendMsg(Msg);
 
+        // While pacing, the only way to fail is to find the queue 
+        // full
         if(Result != MMSYSERR_NOERROR)
         {
+            if(m_PacedMsgs != NULL)
+            {
+                throw CMIDIOutQueueFull();
+            }
+
             throw CMIDIOutException(Result);
         }
     }
 }
 
 
-// Sends long message
-void CMIDIOutDevice::SendMsg(LPSTR Msg, DWORD MsgLength)
+// Sends short message without throwing
+MMRESULT CMIDIOutDevice::TrySendMsg(DWORD Msg) noexcept
 {
-    if(m_State == OPENED)
-    {  
-        CMIDIOutHeader *Header;
+    if(m_State != OPENED)
+    {
+        return MMSYSERR_INVALHANDLE;
+    }
 
-        try
+    // While pacing, the pacing thread does the sending
+    if(m_PacedMsgs != NULL)
+    {
+        return TryQueueMsg(Msg) ? MMSYSERR_NOERROR : MIDIERR_NOTREADY;
+    }
+
+    bool Timed = m_Stats.IsEnabled();
+    LONGLONG Start = Timed ? CMIDIStats::GetCounter() : 0;
+
+    MMRESULT Result = ::midiOutShortMsg(m_DevHandle, Msg);
+
+    if(Timed)
+    {
+        m_Stats.AddShortMsg(Msg);
+        m_Stats.AddShortMsgTime(CMIDIStats::GetCounter() - Start);
+    }
+
+    if(Result != MMSYSERR_NOERROR)
+    {
+        m_Stats.AddError();
+        return Result;
+    }
+
+    CaptureMsgs(&Msg, 1);
+
+    if(m_NoteTracker != NULL)
+    {
+        m_NoteTracker->TrackMsg(Msg);
+    }
+
+    return MMSYSERR_NOERROR;
+}
+
+
+// Sends several short messages
+void CMIDIOutDevice::SendMsgs(const DWORD *Msgs, std::size_t Count)
+{
+    if(m_State == OPENED)
+    {
+        // While pacing, queue the messages, stopping at the first 
+        // one there is no room for
+        if(m_PacedMsgs != NULL)
         {
-            // Create new header to send system exclusive message
-            Header = new CMIDIOutHeader(m_DevHandle, Msg, MsgLength);
+            for(std::size_t i = 0; i < Count; i++)
+            {
+                QueueMsg(Msgs[i]);
+            }
+
+            return;
         }
-        // If memory allocation failed, throw exception
-        catch(const std::bad_alloc &)
+
+        bool Timed = m_Stats.IsEnabled();
+        LONGLONG Start = Timed ? CMIDIStats::GetCounter() : 0;
+
+        for(std::size_t i = 0; i < Count; i++)
         {
-            throw CMIDIOutMemFailure();
+            MMRESULT Result = ::midiOutShortMsg(m_DevHandle, Msgs[i]);
+
+            // Each message ends where the next one starts, so one
+            // counter reading per message is enough
+            if(Timed)
+            {
+                LONGLONG End = CMIDIStats::GetCounter();
+
+                m_Stats.AddShortMsg(Msgs[i]);
+                m_Stats.AddShortMsgTime(End - Start);
+                Start = End;
+            }
+
+            // Stop at the first message that fails, keeping the ones
+            // before it
+            if(Result != MMSYSERR_NOERROR)
+            {
+                m_Stats.AddError();
+                CaptureMsgs(Msgs, i);
+                throw CMIDIOutException(Result);
+            }
+
+            if(m_NoteTracker != NULL)
+            {
+                m_NoteTracker->TrackMsg(Msgs[i]);
+            }
         }
-        // If preparing the header failed, rethrow exception
-        catch(const CMIDIOutException &)
+
+        CaptureMsgs(Msgs, Count);
+    }
+}
+
+
+// Sends long message
+void CMIDIOutDevice::SendMsg(LPSTR Msg, DWORD MsgLength)
+{
+    if(m_State == OPENED)
+    {  
+        // While pacing, the pacing thread sends the message in 
+        // fragments
+        if(m_PacedBytes != NULL)
         {
-            throw;
+            QueueMsg(Msg, MsgLength);
+            return;
         }
 
-        try
+        // If too many long messages are still in progress, throw 
+        // exception
+        if(m_HdrQueue.IsFull())
         {
-            // Send system exclusive data
-            Header->SendMsg();
+            m_Stats.AddDropped();
+            throw CMIDIOutQueueFull();
+        }
+
+        // Use a pooled header if one is free
+        CMIDIOutHeader *Header = m_HdrPool.AcquireHeader(MsgLength);
 
-            // Add header to queue
-            m_HdrQueue.AddHeader(Header);
+        if(Header != NULL)
+        {
+            Header->SetMsg(Msg, MsgLength);
+            m_Stats.AddPooledHeaders(1);
         }
-        // If sending system exclusive msg failed, release header
-        // and rethrow exception
-        catch(const CMIDIOutException &)
+        else
         {
-            delete Header;
+            Header = CreateHeader(Msg, MsgLength);
         }
+
+        SendHeader(Header, MsgLength);
+        CaptureLongMsg(MsgLength);
     }
 }
 
 
-// Determines if the MIDI output device is opened
-bool CMIDIOutDevice::IsOpen() const
+// Sends long message without throwing or allocating
+MMRESULT CMIDIOutDevice::TrySendMsg(LPSTR Msg, 
+                                    DWORD MsgLength) noexcept
 {
-    return (m_State == OPENED);
-}
+    if(m_State != OPENED)
+    {
+        return MMSYSERR_INVALHANDLE;
+    }
 
+    // While pacing, the message is copied into the pacing buffer
+    if(m_PacedBytes != NULL)
+    {
+        return TryQueueMsg(Msg, MsgLength) ? MMSYSERR_NOERROR : 
+                                             MIDIERR_NOTREADY;
+    }
 
-// Gets the capabilities of a particular MIDI output device
-void CMIDIOutDevice::GetDevCaps(UINT DeviceId, MIDIOUTCAPS &Caps)
-{
-    MMRESULT Result = ::midiOutGetDevCaps(DeviceId, &Caps, 
-                                          sizeof Caps);
+    // Without a pooled header the message would have to be allocated
+    if(MsgLength > m_HdrPool.GetBufferSize())
+    {
+        return MMSYSERR_INVALPARAM;
+    }
 
-    // If we are not able to retrieve device capabilities, throw 
-    // exception
-    if(Result != MMSYSERR_NOERROR)
+    if(m_HdrQueue.IsFull())
     {
-        throw CMIDIOutException(Result);
+        m_Stats.AddDropped();
+        return MIDIERR_NOTREADY;
     }
-}
+
+    CMIDIOutHeader *Header = m_HdrPool.AcquireHeader(MsgLength);
+
+    if(Header == NULL)
+    {
+        m_Stats.AddDropped();
+        return MIDIERR_NOTREADY;
+    }
+
+    Header->SetMsg(Msg, MsgLength);
+    m_Stats.AddPooledHeaders(1);
+
+    MMRESULT Result = TrySendHeader(Header, MsgLength);
+
+    if(Result == MMSYSERR_NOERROR)
+    {
+        CaptureLongMsg(MsgLength);
+    }
+
+    return Result;
+}
+
+
+// Sends long message without copying it
+void CMIDIOutDevice::SendMsgAsync(LPSTR Msg, DWORD MsgLength,
+                                  midi::CMIDIOutCallback &Callback)
+{
+    if(m_State == OPENED && m_PacedBytes == NULL)
+    {
+        // If too many long messages are still in progress, throw 
+        // exception
+        if(m_HdrQueue.IsFull())
+        {
+            m_Stats.AddDropped();
+            throw CMIDIOutQueueFull();
+        }
+
+        // The header points at the caller's message, and tells the
+        // callback when it is released
+        CMIDIOutHeader *Header = CreateHeader(Msg, MsgLength);
+
+        Header->SetCallback(&Callback);
+
+        SendHeader(Header, MsgLength);
+        CaptureLongMsg(MsgLength);
+    }
+    // Either nothing is sent or the message is copied for the pacing
+    // thread, so the caller can have the buffer back now
+    else
+    {
+        if(m_State == OPENED)
+        {
+            QueueMsg(Msg, MsgLength);
+        }
+
+        Callback.OnLongMsgDone(Msg, MsgLength);
+    }
+}
+
+
+// Sets up the header pool used for long messages
+void CMIDIOutDevice::SetHeaderPool(DWORD HeaderCount, DWORD BufferSize)
+{
+    m_PoolHeaderCount = HeaderCount;
+    m_PoolBufferSize = BufferSize;
+}
+
+
+// Sets the worker used for managing headers
+void CMIDIOutDevice::SetWorker(midi::CMIDIWorker *Worker)
+{
+    m_Worker = Worker;
+}
+
+
+// Sets up pacing
+void CMIDIOutDevice::SetPacing(DWORD BytesPerSecond, 
+                               std::size_t QueueCapacity,
+                               DWORD BufferSize)
+{
+    m_PacingRate = BytesPerSecond;
+    m_PacingQueueCapacity = QueueCapacity;
+    m_PacingBufferSize = BufferSize;
+}
+
+
+// Determines if the MIDI output device is opened
+bool CMIDIOutDevice::IsOpen() const
+{
+    return (m_State == OPENED);
+}
+
+
+// Sets the note tracker
+void CMIDIOutDevice::SetNoteTracker(CMIDINoteTracker *Tracker)
+{
+    m_NoteTracker = Tracker;
+}
+
+
+// Sets the capture recording messages sent
+void CMIDIOutDevice::SetCapture(CMIDICapture *Capture, WORD Port)
+{
+    // The port is set first so that it goes with the new capture
+    m_CapturePort.store(Port, std::memory_order_relaxed);
+    m_Capture.store(Capture, std::memory_order_release);
+}
+
+
+// Releases everything the note tracker has seen held
+void CMIDIOutDevice::ReleaseNotes()
+{
+    if(m_NoteTracker != NULL)
+    {
+        DWORD Msgs[CMIDINoteTracker::MAX_RELEASE_MSGS];
+        std::size_t Count = m_NoteTracker->GetReleaseMsgs(Msgs);
+        std::size_t Sent = 0;
+
+        // While pacing, the batch may be larger than the pacing 
+        // queue, so it is queued as the pacing thread makes room for
+        // it. Sending around the queue would let notes still waiting
+        // in it start after their release.
+        while(m_PacedMsgs != NULL && Sent < Count)
+        {
+            // The pacing thread only ever makes more room
+            std::size_t Room = m_PacedMsgs->GetCapacity() - 
+                               m_PacedMsgs->GetSize();
+
+            if(Room == 0)
+            {
+                WaitForRoom();
+                continue;
+            }
+
+            if(Room > Count - Sent)
+            {
+                Room = Count - Sent;
+            }
+
+            SendMsgs(Msgs + Sent, Room);
+            Sent += Room;
+        }
+
+        // Sending the messages updates the tracker, so whatever is
+        // sent successfully is no longer held
+        SendMsgs(Msgs + Sent, Count - Sent);
+    }
+}
+
+
+// Turns statistics on or off
+void CMIDIOutDevice::EnableStats(bool Enable)
+{
+    m_Stats.Enable(Enable);
+}
+
+
+// Takes a snapshot of the statistics
+void CMIDIOutDevice::GetStats(midi::CMIDIStatsSnapshot &Stats) const
+{
+    m_Stats.GetSnapshot(Stats);
+}
+
+
+// Sets the statistics back to zero
+void CMIDIOutDevice::ResetStats()
+{
+    m_Stats.Reset();
+}
+
+
+// Gets the capabilities of a particular MIDI output device
+void CMIDIOutDevice::GetDevCaps(UINT DeviceId, MIDIOUTCAPS &Caps)
+{
+    MMRESULT Result = ::midiOutGetDevCaps(DeviceId, &Caps, 
+                                          sizeof Caps);
+
+    // If we are not able to retrieve device capabilities, throw 
+    // exception
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIOutException(Result);
+    }
+}
 
 
 // Packs data into short message
@@ -337,9 +1028,7 @@ void CMIDIOutDevice::PackShortMsg(DWORD &Msg, unsigned char Status,
                                   unsigned char DataByte1,
                                   unsigned char DataByte2)
 {
-    Msg = Status;
-    Msg |= DataByte1 << midi::SHORT_MSG_SHIFT;
-    Msg |= DataByte2 << midi::SHORT_MSG_SHIFT;
+    Msg = midi::CShortMsg(Status, DataByte1, DataByte2).GetMsg();
 }
 
 
@@ -349,9 +1038,8 @@ void CMIDIOutDevice::PackShortMsg(DWORD &Msg, unsigned char Command,
                                   unsigned char DataByte1,
                                   unsigned char DataByte2)
 {
-    Msg = Command | Channel;
-    Msg |= DataByte1 << midi::SHORT_MSG_SHIFT;
-    Msg |= DataByte2 << midi::SHORT_MSG_SHIFT * 2;
+    Msg = midi::CShortMsg::ChannelMsg(Command, Channel, DataByte1,
+                                      DataByte2).GetMsg();
 }
 
 
@@ -387,28 +1075,517 @@ void CALLBACK CMIDIOutDevice::MidiOutProc(HMIDIOUT MidiOut, UINT Msg,
 }
 
 
-// Header worker thread
-DWORD CMIDIOutDevice::HeaderProc(LPVOID Parameter)
+// Manages headers on the worker thread
+void CMIDIOutDevice::HeaderProc(void *Parameter)
 {
     CMIDIOutDevice *Device; 
     
     Device = reinterpret_cast<CMIDIOutDevice *>(Parameter);
 
-    // Continue while the MIDI output device is open
-    while(Device->m_State == OPENED)
+    // Remove the finished headers
+    Device->m_HdrQueue.RemoveDone();
+}
+
+
+// Creates a header pointing at the caller's message
+CMIDIOutDevice::CMIDIOutHeader *
+CMIDIOutDevice::CreateHeader(LPSTR Msg, DWORD MsgLength)
+{
+    CMIDIOutHeader *Header;
+
+    m_Stats.AddHeaderAlloc();
+
+    try
+    {
+        // Create new header to send system exclusive message
+        Header = new CMIDIOutHeader(m_DevHandle, Msg, MsgLength);
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDIOutMemFailure();
+    }
+    // If preparing the header failed, rethrow exception
+    catch(const CMIDIOutException &)
+    {
+        throw;
+    }
+
+    return Header;
+}
+
+
+// Records short messages sent
+void CMIDIOutDevice::CaptureMsgs(const DWORD *Msgs, std::size_t Count)
+{
+    CMIDICapture *Capture = m_Capture.load(std::memory_order_acquire);
+
+    if(Capture != NULL)
+    {
+        WORD Port = m_CapturePort.load(std::memory_order_relaxed);
+
+        Capture->RecordMsgs(CMIDICapture::CAPTURE_OUT, Port, Msgs, 
+                            Count);
+    }
+}
+
+
+// Records a long message sent
+void CMIDIOutDevice::CaptureLongMsg(DWORD MsgLength)
+{
+    CMIDICapture *Capture = m_Capture.load(std::memory_order_acquire);
+
+    if(Capture != NULL)
     {
-        ::WaitForSingleObject(Device->m_Event, INFINITE);
+        WORD Port = m_CapturePort.load(std::memory_order_relaxed);
 
-        // Make sure the device is still open
-        if(Device->m_State == OPENED)
+        Capture->RecordLongMsg(CMIDICapture::CAPTURE_OUT, Port, 
+                               MsgLength);
+    }
+}
+
+
+// Sends a long message and queues its header
+void CMIDIOutDevice::SendHeader(CMIDIOutHeader *Header, 
+                                DWORD MsgLength)
+{
+    MMRESULT Result = TrySendHeader(Header, MsgLength);
+
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIOutException(Result);
+    }
+}
+
+
+// Sends a long message and queues its header without throwing
+MMRESULT CMIDIOutDevice::TrySendHeader(CMIDIOutHeader *Header, 
+                                       DWORD MsgLength)
+{
+    bool Timed = m_Stats.IsEnabled();
+    LONGLONG Start = Timed ? CMIDIStats::GetCounter() : 0;
+
+    // Send system exclusive data
+    MMRESULT Result = Header->TrySendMsg();
+
+    // If sending system exclusive msg failed, release header
+    if(Result != MMSYSERR_NOERROR)
+    {
+        m_Stats.AddLongError();
+
+        if(Header->GetPool() != NULL)
         {
-            // Remove the finished header
-            Device->m_HdrQueue.RemoveHeader();
+            Header->GetPool()->CancelHeader(Header);
         }
+        else
+        {
+            delete Header;
+        }
+
+        return Result;
     }
 
-    return 0;
+    if(Timed)
+    {
+        m_Stats.AddLongMsg(MsgLength);
+        m_Stats.AddLongMsgTime(CMIDIStats::GetCounter() - Start);
+    }
+
+    // Add header to queue
+    m_HdrQueue.AddHeader(Header);
+    m_Stats.AddQueueDepth(m_HdrQueue.GetSize());
+
+    // If the device finished with the header before it was queued,
+    // make sure the header thread gets to it
+    if(Header->IsDone())
+    {
+        ::SetEvent(m_Event);
+    }
+
+    return MMSYSERR_NOERROR;
 }
 
 
+// Creates the queues and the thread for pacing
+void CMIDIOutDevice::StartPacing()
+{
+    try
+    {
+        m_PacedMsgs = new CSPSCRing<DWORD>(m_PacingQueueCapacity);
+        m_PacedBytes = new CSPSCRing<char>(m_PacingBufferSize);
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDIOutMemFailure();
+    }
+
+    // Long messages are copied into fragment headers of their own
+    m_FragmentPool.Create(m_DevHandle, PACING_FRAGMENT_COUNT, 
+                          PACING_FRAGMENT_SIZE);
+
+    m_PacingEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_RoomEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
 
+    // If we are unable to create signalling events, throw exception
+    if(m_PacingEvent == NULL || m_RoomEvent == NULL)
+    {
+        throw CMIDIOutEventFailure();
+    }
+
+    m_RoomWaiting.store(false, std::memory_order_relaxed);
+
+    LARGE_INTEGER Frequency;
+
+    ::QueryPerformanceFrequency(&Frequency);
+
+    m_CounterFrequency = Frequency.QuadPart;
+    m_WireTime = 0;
+    m_InSysEx = false;
+
+    // The thread waits a millisecond or two at a time
+    ::timeBeginPeriod(1);
+
+    // Change state before the thread starts checking it
+    m_Pacing.store(true);
+
+    DWORD Dummy;
+
+    m_PacingThread = ::CreateThread(NULL, 0, PacingProc, this, 0, 
+                                    &Dummy);
+
+    // If we are unable to create the pacing thread, throw exception
+    if(m_PacingThread == NULL)
+    {
+        m_Pacing.store(false);
+        ::timeEndPeriod(1);
+        throw CMIDIOutThreadFailure();
+    }
+
+    ::SetThreadPriority(m_PacingThread, THREAD_PRIORITY_TIME_CRITICAL);
+}
+
+
+// Stops the pacing thread, if any, and destroys the queues
+void CMIDIOutDevice::StopPacing()
+{
+    if(m_PacingThread != NULL)
+    {
+        // Notify the thread to finish and wait for it
+        m_Pacing.store(false);
+        ::SetEvent(m_PacingEvent);
+        ::WaitForSingleObject(m_PacingThread, INFINITE);
+        ::CloseHandle(m_PacingThread);
+        m_PacingThread = NULL;
+
+        ::timeEndPeriod(1);
+    }
+
+    // Send the short messages still waiting without pacing, so that
+    // note offs are not lost. Long messages still waiting are thrown
+    // away.
+    if(m_PacedMsgs != NULL)
+    {
+        DWORD Msg;
+
+        while(m_PacedMsgs->Pop(Msg))
+        {
+            if(::midiOutShortMsg(m_DevHandle, Msg) != MMSYSERR_NOERROR)
+            {
+                m_Stats.AddError();
+            }
+        }
+    }
+
+    delete m_PacedMsgs;
+    delete m_PacedBytes;
+
+    m_PacedMsgs = NULL;
+    m_PacedBytes = NULL;
+
+    if(m_PacingEvent != NULL)
+    {
+        ::CloseHandle(m_PacingEvent);
+        m_PacingEvent = NULL;
+    }
+
+    if(m_RoomEvent != NULL)
+    {
+        ::CloseHandle(m_RoomEvent);
+        m_RoomEvent = NULL;
+    }
+}
+
+
+// Queues a short message for the pacing thread
+void CMIDIOutDevice::QueueMsg(DWORD Msg)
+{
+    // If there is no room for the message, throw exception
+    if(!TryQueueMsg(Msg))
+    {
+        throw CMIDIOutQueueFull();
+    }
+}
+
+
+// Queues a long message for the pacing thread
+void CMIDIOutDevice::QueueMsg(LPSTR Msg, DWORD MsgLength)
+{
+    // If there is no room for the message, throw exception
+    if(!TryQueueMsg(Msg, MsgLength))
+    {
+        throw CMIDIOutQueueFull();
+    }
+}
+
+
+// Queues a short message for the pacing thread without throwing
+bool CMIDIOutDevice::TryQueueMsg(DWORD Msg)
+{
+    if(!m_PacedMsgs->Push(Msg))
+    {
+        m_Stats.AddDropped();
+        return false;
+    }
+
+    // Only messages that made it into the queue are recorded
+    CaptureMsgs(&Msg, 1);
+
+    // The message will be sent, so it is tracked on the caller's 
+    // thread now rather than on the pacing thread later
+    if(m_NoteTracker != NULL)
+    {
+        m_NoteTracker->TrackMsg(Msg);
+    }
+
+    ::SetEvent(m_PacingEvent);
+
+    return true;
+}
+
+
+// Queues a long message for the pacing thread without throwing
+bool CMIDIOutDevice::TryQueueMsg(LPSTR Msg, DWORD MsgLength)
+{
+    // The message is queued whole or not at all
+    if(MsgLength > m_PacedBytes->GetCapacity() - m_PacedBytes->GetSize())
+    {
+        m_Stats.AddDropped();
+        return false;
+    }
+
+    for(DWORD i = 0; i < MsgLength; i++)
+    {
+        m_PacedBytes->Push(Msg[i]);
+    }
+
+    CaptureLongMsg(MsgLength);
+
+    ::SetEvent(m_PacingEvent);
+
+    return true;
+}
+
+
+// Waits for room in the short message queue
+void CMIDIOutDevice::WaitForRoom()
+{
+    // Let the pacing thread know we are about to wait, then check
+    // the queue again in case it made room in between
+    m_RoomWaiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if(m_PacedMsgs->GetSize() == m_PacedMsgs->GetCapacity())
+    {
+        ::WaitForSingleObject(m_RoomEvent, INFINITE);
+    }
+
+    m_RoomWaiting.store(false, std::memory_order_relaxed);
+}
+
+
+// Sends whatever the wire has time for
+DWORD CMIDIOutDevice::Pace()
+{
+    LONGLONG Now = CMIDIStats::GetCounter();
+
+    // Time the wire spent idle cannot be saved up for later
+    if(m_WireTime < Now)
+    {
+        m_WireTime = Now;
+    }
+
+    // Let the driver have up to a millisecond's worth of bytes ahead
+    // of the wire, since we only wake up about once a millisecond
+    LONGLONG Limit = Now + m_CounterFrequency / 1000;
+
+    while(m_WireTime <= Limit)
+    {
+        DWORD *Front = m_PacedMsgs->Front();
+        DWORD Bytes = 0;
+
+        // Short messages go ahead of long messages. Inside a system 
+        // exclusive message only realtime messages may go on the 
+        // wire, so the others wait for the end of it, unless the 
+        // rest of it has not been queued.
+        if(Front != NULL &&
+           (!m_InSysEx || m_PacedBytes->IsEmpty() ||
+            static_cast<unsigned char>(*Front) >= midi::TIMING_CLOCK))
+        {
+            DWORD Msg = *Front;
+
+            m_PacedMsgs->PopFront();
+
+            // Wake up the sender waiting for room, if any. The fence
+            // makes sure that either we see the waiting flag or the
+            // sender sees the room.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if(m_RoomWaiting.load(std::memory_order_relaxed) &&
+               m_RoomWaiting.exchange(false))
+            {
+                ::SetEvent(m_RoomEvent);
+            }
+
+            bool Timed = m_Stats.IsEnabled();
+            LONGLONG Start = Timed ? CMIDIStats::GetCounter() : 0;
+
+            MMRESULT Result = ::midiOutShortMsg(m_DevHandle, Msg);
+
+            if(Timed)
+            {
+                m_Stats.AddShortMsg(Msg);
+                m_Stats.AddShortMsgTime(CMIDIStats::GetCounter() - 
+                                        Start);
+            }
+
+            // The caller is not here to be told, so failures are 
+            // counted
+            if(Result != MMSYSERR_NOERROR)
+            {
+                m_Stats.AddError();
+            }
+
+            unsigned char Status = static_cast<unsigned char>(Msg);
+
+            Bytes = 1 + CMIDIParser::GetDataLength(Status);
+        }
+        else if(!m_PacedBytes->IsEmpty())
+        {
+            Bytes = SendFragment();
+
+            // Try again once the device has given a header back
+            if(Bytes == 0)
+            {
+                return 1;
+            }
+        }
+        // Nothing left to send
+        else
+        {
+            return INFINITE;
+        }
+
+        m_WireTime += Bytes * m_CounterFrequency / m_PacingRate;
+    }
+
+    // Wait until the wire has room again, rounding up
+    return static_cast<DWORD>((m_WireTime - Limit) * 1000 / 
+                              m_CounterFrequency) + 1;
+}
+
+
+// Sends the next fragment of the queued long messages
+DWORD CMIDIOutDevice::SendFragment()
+{
+    if(m_HdrQueue.IsFull())
+    {
+        return 0;
+    }
+
+    CMIDIOutHeader *Header = 
+                   m_FragmentPool.AcquireHeader(PACING_FRAGMENT_SIZE);
+
+    if(Header == NULL)
+    {
+        return 0;
+    }
+
+    char Fragment[PACING_FRAGMENT_SIZE];
+    DWORD Length = 0;
+
+    // A fragment ends early at the end of a system exclusive message,
+    // so that waiting short messages can go before the next one
+    while(Length < PACING_FRAGMENT_SIZE && 
+          m_PacedBytes->Pop(Fragment[Length]))
+    {
+        Length++;
+
+        if(static_cast<unsigned char>(Fragment[Length - 1]) == 
+           midi::END_OF_EXCLUSIVE)
+        {
+            break;
+        }
+    }
+
+    m_InSysEx = (static_cast<unsigned char>(Fragment[Length - 1]) != 
+                 midi::END_OF_EXCLUSIVE);
+
+    Header->SetMsg(Fragment, Length);
+    m_Stats.AddPooledHeaders(1);
+
+    try
+    {
+        bool Timed = m_Stats.IsEnabled();
+        LONGLONG Start = Timed ? CMIDIStats::GetCounter() : 0;
+
+        Header->SendMsg();
+
+        if(Timed)
+        {
+            m_Stats.AddLongMsg(Length);
+            m_Stats.AddLongMsgTime(CMIDIStats::GetCounter() - Start);
+        }
+
+        m_HdrQueue.AddHeader(Header);
+        m_Stats.AddQueueDepth(m_HdrQueue.GetSize());
+
+        // If the device finished with the header before it was 
+        // queued, make sure the header thread gets to it
+        if(Header->IsDone())
+        {
+            ::SetEvent(m_Event);
+        }
+    }
+    // If sending the fragment failed, count the failure. The rest of
+    // the message is still sent.
+    catch(const CMIDIOutException &)
+    {
+        m_Stats.AddLongError();
+        m_FragmentPool.CancelHeader(Header);
+    }
+
+    return Length;
+}
+
+
+// Thread function for pacing
+DWORD WINAPI CMIDIOutDevice::PacingProc(LPVOID Parameter)
+{
+    CMIDIOutDevice *Device; 
+    
+    Device = reinterpret_cast<CMIDIOutDevice *>(Parameter);
+
+    DWORD Timeout = INFINITE;
+
+    // Wait for messages, or for the wire to have room, until the 
+    // device is closed
+    while(Device->m_Pacing.load())
+    {
+        ::WaitForSingleObject(Device->m_PacingEvent, Timeout);
+
+        Timeout = Device->Pace();
+    }
+
+    return 0;
+}
\ No newline at end of file
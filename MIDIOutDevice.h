@@ -28,8 +28,20 @@
 // Necessary for exception classes derived from std::exception
 #include <exception> 
 
-// Necessary for header queue used by CHeaderQueue
-#include <queue>
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the state shared with the header thread
+#include <atomic>
+
+// Necessary for header ring used by CHeaderQueue
+#include "SPSCRing.h"
+
+// Necessary for the thread managing headers
+#include "MIDIWorker.h"
+
+// Necessary for CMIDIStats
+#include "MIDIStats.h"
 
 
 namespace midi
@@ -39,6 +51,10 @@ namespace midi
     //----------------------------------------------------------------
 
 
+    class CMIDINoteTracker;
+    class CMIDICapture;
+
+
     //----------------------------------------------------------------
     // CMIDIOutDevice exception classes
     //----------------------------------------------------------------
@@ -80,6 +96,24 @@ namespace midi
     };
 
 
+    // Thrown when a CMIDIOutDevice header queue has no room for 
+    // another header, or when a paced CMIDIOutDevice has no room for
+    // another message. It is a CMIDIOutException, with the error
+    // TrySendMsg returns for it, so that callers counting send 
+    // failures count it too.
+    class CMIDIOutQueueFull : public CMIDIOutException
+    {
+    public:
+        CMIDIOutQueueFull() throw() : 
+        CMIDIOutException(MIDIERR_NOTREADY)
+        {}
+
+        const char *what() const throw()
+        { return "The header queue for CMIDIOutDevice object is "
+                 "full."; }
+    };
+
+
     // Thrown when a CMIDIOutDevice is unable to create a worker 
     // thread
     class CMIDIOutThreadFailure : public std::exception
@@ -91,21 +125,74 @@ namespace midi
     };
 
 
+    //----------------------------------------------------------------
+    // CMIDIOutCallback
+    //
+    // Told when a CMIDIOutDevice is finished with a long message sent
+    // with SendMsgAsync, so that the caller's buffer can be reused or
+    // freed.
+    //----------------------------------------------------------------
+
+
+    class CMIDIOutCallback
+    {
+    public:
+        virtual ~CMIDIOutCallback() {}
+
+        // Called once the device is finished with Msg. Called on the
+        // worker thread managing the device's headers, or on the 
+        // thread closing the device for messages still in progress. 
+        // Must not throw.
+        virtual void OnLongMsgDone(LPSTR Msg, DWORD MsgLength) = 0;
+    };
+
+
     //----------------------------------------------------------------
     // CMIDIOutDevice
     //
     // This class represents MIDI output devices.
+    //
+    // Long messages, whether sent with SendMsg, SendMsgAsync or 
+    // TrySendMsg, go through a lock-free header queue and header pool
+    // with room for one sending thread only, so they must be sent 
+    // from one thread at a time. The same goes for short messages 
+    // while the device is paced. Callers sending from several threads,
+    // such as the callbacks of several input devices, must serialize
+    // their sends.
     //----------------------------------------------------------------
 
 
     class CMIDIOutDevice
     {
     public:
+        // Default number of long messages that can be in progress at
+        // the same time
+        enum { DEFAULT_HDR_QUEUE_CAPACITY = 64 };
+
+        // Bytes per second a standard MIDI port carries: 31250 baud
+        // with ten bits to a byte
+        enum { DIN_BYTES_PER_SECOND = 3125 };
+
+        // Defaults for the queues of a paced device: the number of 
+        // short messages and the bytes of long messages that can wait
+        // to be sent
+        enum { DEFAULT_PACING_QUEUE_CAPACITY = 1024 };
+        enum { DEFAULT_PACING_BUFFER_SIZE = 65536 };
+
         // For constructing a CMIDIOutDevice in an closed state
         CMIDIOutDevice();
 
-        // For constructing a CMIDIOutDevice in an opened state
-        CMIDIOutDevice(UINT DeviceId);
+        // For constructing a CMIDIOutDevice in a closed state with 
+        // room for HdrQueueCapacity long messages in progress at the
+        // same time, and a header pool as set up by SetHeaderPool
+        CMIDIOutDevice(std::size_t HdrQueueCapacity, 
+                       DWORD PoolHeaderCount, DWORD PoolBufferSize);
+
+        // For constructing a CMIDIOutDevice in an opened state. 
+        // HdrQueueCapacity is the number of long messages that can be
+        // in progress at the same time.
+        CMIDIOutDevice(UINT DeviceId, std::size_t HdrQueueCapacity =
+                                      DEFAULT_HDR_QUEUE_CAPACITY);
 
         // Destruction
         ~CMIDIOutDevice();
@@ -119,12 +206,108 @@ namespace midi
         // Sends short message
         void SendMsg(DWORD Msg);
 
-        // Sends long message
+        // Sends long message. Only from one thread at a time.
         void SendMsg(LPSTR Msg, DWORD MsgLength);
 
+        // Sends long message without copying it. Msg must stay 
+        // untouched until Callback is told the device is finished 
+        // with it, which may happen before this returns. Several 
+        // messages can be in progress at once. If sending fails, 
+        // the exception is thrown and Callback is not called. If the
+        // device is closed, or paced so that Msg is copied, Callback
+        // is called straight away.
+        void SendMsgAsync(LPSTR Msg, DWORD MsgLength, 
+                          CMIDIOutCallback &Callback);
+
+        // Sends Count short messages in order, straight away. Use
+        // CMIDIStreamOutDevice for messages to be played at their
+        // time stamps.
+        void SendMsgs(const DWORD *Msgs, std::size_t Count);
+
+        // Sends short message without throwing or allocating, for
+        // threads that may do neither, such as an audio callback.
+        // Returns MMSYSERR_INVALHANDLE if the device is closed,
+        // MIDIERR_NOTREADY if the pacing queue is full, or the
+        // driver's error.
+        MMRESULT TrySendMsg(DWORD Msg) noexcept;
+
+        // Sends long message without throwing or allocating. Only 
+        // the header pool set up with SetHeaderPool is used, so the
+        // message is copied into a pool buffer and never into a new
+        // header. 
+        // Returns MMSYSERR_INVALHANDLE if the device is closed, 
+        // MMSYSERR_INVALPARAM if the message does not fit in a pool 
+        // buffer, MIDIERR_NOTREADY if there is no room to queue it or
+        // no pooled header is free, or the driver's error.
+        MMRESULT TrySendMsg(LPSTR Msg, DWORD MsgLength) noexcept;
+
+        // Sets up a pool of HeaderCount headers, each with its own 
+        // buffer of BufferSize bytes, for sending long messages. The
+        // headers are prepared once when the device is opened and 
+        // reused as the device finishes with them, so long messages
+        // that fit in a pool buffer are copied rather than allocated
+        // and prepared. Takes effect the next time the device is 
+        // opened. A HeaderCount of zero disables the pool.
+        void SetHeaderPool(DWORD HeaderCount, DWORD BufferSize);
+
+        // Sets the worker whose thread manages the device's headers,
+        // such as CMIDIWorker::GetShared(). The worker must outlive 
+        // the device. NULL, the default, gives the device a thread of
+        // its own. Takes effect the next time the device is opened.
+        void SetWorker(CMIDIWorker *Worker);
+
+        // Paces messages to BytesPerSecond, the rate of the wire, so 
+        // that the driver of a slow port is never given more than it
+        // can send and sending never blocks. Messages are queued and
+        // sent by a thread of the device's own: up to QueueCapacity 
+        // short messages, and up to BufferSize bytes of long 
+        // messages. When there is no room, CMIDIOutQueueFull is 
+        // thrown. Long messages are sent in small fragments. Waiting
+        // short messages go ahead of queued long messages, between 
+        // one system exclusive message and the next; realtime 
+        // messages, which may appear anywhere, also go between 
+        // fragments. While pacing, send from one thread at a time.
+        // Takes effect the next time the device is opened. A 
+        // BytesPerSecond of zero, the default, turns pacing off.
+        void SetPacing(DWORD BytesPerSecond, 
+                       std::size_t QueueCapacity = 
+                                    DEFAULT_PACING_QUEUE_CAPACITY,
+                       DWORD BufferSize = DEFAULT_PACING_BUFFER_SIZE);
+
         // Returns true if the device is open
         bool IsOpen() const;
 
+        // Sets a tracker to be given every short message sent, so
+        // that held notes and moved controllers can be released with
+        // ReleaseNotes. The tracker must outlive the device. If a
+        // tracker is set, Close releases everything first. NULL, the
+        // default, turns tracking off.
+        void SetNoteTracker(CMIDINoteTracker *Tracker);
+
+        // Sets a capture to record every message sent, once the
+        // driver or the pacing queue has taken it, with Port to tell
+        // this device's messages apart. The capture must outlive the
+        // device. Can be called at any time. NULL, the default,
+        // turns recording off.
+        void SetCapture(CMIDICapture *Capture, WORD Port = 0);
+
+        // Sends the tracker's release messages as one batch, so that
+        // no notes are left hanging. While pacing, waits for room in 
+        // the pacing queue as the batch goes in, since it can be 
+        // larger than the queue. Does nothing without a tracker.
+        void ReleaseNotes();
+
+        // Turns statistics on or off. They are off by default, and cost
+        // up to two QueryPerformanceCounter calls per message when
+        // on.
+        void EnableStats(bool Enable);
+
+        // Takes a snapshot of the statistics
+        void GetStats(CMIDIStatsSnapshot &Stats) const;
+
+        // Sets the statistics back to zero
+        void ResetStats();
+
         // Gets the number of MIDI output devices on this system
         static UINT GetNumDevs() { return midiOutGetNumDevs(); }
 
@@ -145,6 +328,8 @@ namespace midi
 
     // Private methods
     private:
+        class CMIDIOutHeader;
+
         // Copying and assignment not allowed
         CMIDIOutDevice(const CMIDIOutDevice &);
         CMIDIOutDevice &operator = (const CMIDIOutDevice &);
@@ -157,50 +342,233 @@ namespace midi
                                          DWORD Instance, DWORD Param1, 
                                          DWORD Param2);
 
-        // Thread function for managing headers
-        static DWORD WINAPI HeaderProc(LPVOID Parameter);
+        // Called by the worker thread for managing headers
+        static void HeaderProc(void *Parameter);
+
+        // Creates a header pointing at the caller's message
+        CMIDIOutHeader *CreateHeader(LPSTR Msg, DWORD MsgLength);
+
+        // Sends a long message and queues its header. If sending 
+        // fails, the header is released and the exception rethrown.
+        void SendHeader(CMIDIOutHeader *Header, DWORD MsgLength);
+
+        // Sends a long message and queues its header. If sending 
+        // fails, the header is released and the error returned.
+        MMRESULT TrySendHeader(CMIDIOutHeader *Header, 
+                               DWORD MsgLength);
+
+        // Records messages sent, if there is a capture
+        void CaptureMsgs(const DWORD *Msgs, std::size_t Count);
+        void CaptureLongMsg(DWORD MsgLength);
+
+        // Creates and destroys the queues and the thread for pacing
+        void StartPacing();
+        void StopPacing();
+
+        // Queues messages for the pacing thread
+        void QueueMsg(DWORD Msg);
+        void QueueMsg(LPSTR Msg, DWORD MsgLength);
+
+        // Queues messages for the pacing thread. Returns false if 
+        // there is no room.
+        bool TryQueueMsg(DWORD Msg);
+        bool TryQueueMsg(LPSTR Msg, DWORD MsgLength);
+
+        // Waits for the pacing thread to make room in the short
+        // message queue
+        void WaitForRoom();
+
+        // Sends whatever the wire has time for. Returns how many 
+        // milliseconds to wait before trying again.
+        DWORD Pace();
+
+        // Sends the next fragment of the queued long messages. 
+        // Returns the number of bytes, or zero if there is no header
+        // for it.
+        DWORD SendFragment();
+
+        // Thread function for pacing
+        static DWORD WINAPI PacingProc(LPVOID Parameter);
 
     // Private class declarations
     private:
+        class CHeaderPool;
+
+
         // Encapsulates the MIDIHDR structure for MIDI output
         class CMIDIOutHeader
         {
         public:
+            // For headers that point at the caller's message
             CMIDIOutHeader(HMIDIOUT DevHandle, LPSTR Msg, 
                            DWORD MsgLength);
+
+            // For headers that own a buffer and belong to a pool
+            CMIDIOutHeader(HMIDIOUT DevHandle, DWORD BufferSize,
+                           CHeaderPool *Pool);
+
             ~CMIDIOutHeader();
 
             void SendMsg();
 
+            // Sends long message, returning the driver's error rather
+            // than throwing it
+            MMRESULT TrySendMsg();
+
+            // Copies the message into the header's own buffer
+            void SetMsg(LPSTR Msg, DWORD MsgLength);
+
+            // Returns true if the device is finished with the header
+            bool IsDone() const;
+
+            // Gets the pool the header belongs to, if any
+            CHeaderPool *GetPool() const { return m_Pool; }
+
+            // Gets the message the header points at
+            LPSTR GetMsg() const { return m_MIDIHdr.lpData; }
+            DWORD GetMsgLength() const 
+            { return m_MIDIHdr.dwBufferLength; }
+
+            // Sets the callback told when the header is released, for
+            // headers pointing at the caller's message
+            void SetCallback(CMIDIOutCallback *Callback)
+            { m_Callback = Callback; }
+
+            CMIDIOutCallback *GetCallback() const 
+            { return m_Callback; }
+
+        private:
+            // Copying and assignment not allowed
+            CMIDIOutHeader(const CMIDIOutHeader &);
+            CMIDIOutHeader &operator = (const CMIDIOutHeader &);
+
+            void Prepare();
+
+        private:
+            HMIDIOUT     m_DevHandle;
+            MIDIHDR      m_MIDIHdr;
+            CHeaderPool *m_Pool;
+            char        *m_Buffer;
+            DWORD        m_BufferSize;
+            CMIDIOutCallback *m_Callback;
+        };
+
+
+        // Pool of prepared CMIDIOutHeader objects. Headers are taken
+        // by the thread sending long messages and given back by the 
+        // header thread.
+        class CHeaderPool
+        {
+        public:
+            CHeaderPool();
+            ~CHeaderPool();
+
+            void Create(HMIDIOUT DevHandle, DWORD HeaderCount,
+                        DWORD BufferSize);
+            void Destroy();
+
+            // Gets a free header with room for MsgLength bytes, or 
+            // NULL if there is none
+            CMIDIOutHeader *AcquireHeader(DWORD MsgLength);
+
+            // Gets the size of each buffer, or zero if there is no 
+            // pool
+            DWORD GetBufferSize() const
+            { return m_FreeHeaders != NULL ? m_BufferSize : 0; }
+
+            // Gives back a header the device is finished with
+            void ReturnHeader(CMIDIOutHeader *Header);
+
+            // Gives back a header that could not be sent. Only called
+            // by the thread sending long messages.
+            void CancelHeader(CMIDIOutHeader *Header);
+
         private:
-            HMIDIOUT m_DevHandle;
-            MIDIHDR  m_MIDIHdr;
+            // Copying and assignment not allowed
+            CHeaderPool(const CHeaderPool &);
+            CHeaderPool &operator = (const CHeaderPool &);
+
+        private:
+            CMIDIOutHeader            **m_Headers;
+            DWORD                       m_HeaderCount;
+            DWORD                       m_BufferSize;
+            CSPSCRing<CMIDIOutHeader *> *m_FreeHeaders;
+            CMIDIOutHeader             *m_Spare;
         };
 
 
-        // Thread safe queue for storing CMIDIOutHeader objects
+        // Lock-free queue for storing CMIDIOutHeader objects. Headers
+        // are added by the thread sending long messages and removed 
+        // by the header thread.
         class CHeaderQueue
         {
         public:
-            CHeaderQueue();
+            CHeaderQueue(std::size_t Capacity);
             ~CHeaderQueue();
 
             void AddHeader(CMIDIOutHeader *Header);
             void RemoveHeader();
+            void RemoveDone();
             void RemoveAll();
             bool IsEmpty();
+            bool IsFull();
+            std::size_t GetSize();
+
+        private:
+            // Deletes the header or gives it back to its pool
+            static void ReleaseHeader(CMIDIOutHeader *Header);
 
         private:
-            std::queue<CMIDIOutHeader *> m_HdrQueue;
-            CRITICAL_SECTION m_CriticalSection;
+            CSPSCRing<CMIDIOutHeader *> m_HdrQueue;
         };
 
     // Private attributes and constants
     private:
         HMIDIOUT       m_DevHandle;
         HANDLE         m_Event;
+        CMIDIWorker    m_OwnWorker;
+        CMIDIWorker   *m_Worker;
+        CMIDIWorker   *m_ActiveWorker;
         CHeaderQueue   m_HdrQueue;
-        enum State { CLOSED, OPENED } m_State;
+        CHeaderPool    m_HdrPool;
+        DWORD          m_PoolHeaderCount;
+        DWORD          m_PoolBufferSize;
+        CMIDIStats     m_Stats;
+        CMIDINoteTracker *m_NoteTracker;
+        std::atomic<CMIDICapture *> m_Capture;
+        std::atomic<WORD> m_CapturePort;
+
+        // Size and number of the fragments long messages are sent in
+        // while pacing
+        enum { PACING_FRAGMENT_SIZE = 32 };
+        enum { PACING_FRAGMENT_COUNT = 8 };
+
+        // Pacing settings, and the queues and thread while pacing. 
+        // The queues only exist while the device is open and paced.
+        DWORD          m_PacingRate;
+        std::size_t    m_PacingQueueCapacity;
+        DWORD          m_PacingBufferSize;
+        CSPSCRing<DWORD> *m_PacedMsgs;
+        CSPSCRing<char>  *m_PacedBytes;
+        CHeaderPool    m_FragmentPool;
+        HANDLE         m_PacingEvent;
+        HANDLE         m_PacingThread;
+        std::atomic<bool> m_Pacing;
+
+        // Set by the pacing thread when it makes room in the short
+        // message queue for a sender waiting in WaitForRoom
+        HANDLE         m_RoomEvent;
+        std::atomic<bool> m_RoomWaiting;
+
+        // Only used by the pacing thread: when the wire will be free,
+        // in counter ticks, and whether a system exclusive message has
+        // been started but not finished
+        LONGLONG       m_WireTime;
+        LONGLONG       m_CounterFrequency;
+        bool           m_InSysEx;
+
+        enum State { CLOSED, OPENED };
+        std::atomic<State> m_State;
     };
 }
 
@@ -0,0 +1,515 @@
+/*********************************************************************
+ * MIDIOutDeviceGroup.cpp - Implementation for CMIDIOutDeviceGroup and
+ *                          related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIOutDeviceGroup.h"
+#include <new>
+#include <cstring>
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIOutDeviceGroup;
+using midi::CMIDIOutDevice;
+using midi::CMIDIOutMemFailure;
+using midi::CMIDIOutQueueFull;
+using midi::CMIDIOutEventFailure;
+using midi::CMIDIOutThreadFailure;
+
+
+//--------------------------------------------------------------------
+// CSharedMsg implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIOutDeviceGroup::CSharedMsg::CSharedMsg(LPSTR Msg, DWORD MsgLength,
+                                            LONG UserCount,
+                                            CMIDIOutCallback *Callback) :
+m_Msg(Msg),
+m_MsgLength(MsgLength),
+m_UserCount(UserCount),
+m_Callback(Callback)
+{}
+
+
+// Destructor
+CMIDIOutDeviceGroup::CSharedMsg::~CSharedMsg()
+{
+    if(m_Callback != NULL)
+    {
+        m_Callback->OnLongMsgDone(m_Msg, m_MsgLength);
+    }
+    else
+    {
+        delete [] m_Msg;
+    }
+}
+
+
+// Counts a device as finished with the message
+void CMIDIOutDeviceGroup::CSharedMsg::Release()
+{
+    // The last device to finish gives the message back
+    if(m_UserCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        delete this;
+    }
+}
+
+
+// Called by a device when it is finished with the message
+void CMIDIOutDeviceGroup::CSharedMsg::OnLongMsgDone(LPSTR, DWORD)
+{
+    Release();
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIOutDeviceGroup implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIOutDeviceGroup::CMIDIOutDeviceGroup(std::size_t Capacity) :
+m_Entries(NULL),
+m_Mask(0),
+m_Tail(0),
+m_MemberCount(0),
+m_Running(false)
+{
+    std::size_t Size = 1;
+
+    while(Size < Capacity)
+    {
+        Size <<= 1;
+    }
+
+    try
+    {
+        m_Entries = new CEntry[Size];
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDIOutMemFailure();
+    }
+
+    m_Mask = Size - 1;
+
+    for(std::size_t i = 0; i < MAX_DEVICES; i++)
+    {
+        m_Members[i].Group = this;
+        m_Members[i].Device = NULL;
+        m_Members[i].Event = NULL;
+        m_Members[i].Thread = NULL;
+        m_Members[i].Head.store(0);
+        m_Members[i].Waiting.store(false);
+        m_Members[i].ErrorCount.store(0);
+    }
+}
+
+
+// Destructor
+CMIDIOutDeviceGroup::~CMIDIOutDeviceGroup()
+{
+    Stop();
+
+    delete [] m_Entries;
+}
+
+
+// Adds a device
+void CMIDIOutDeviceGroup::AddDevice(CMIDIOutDevice &Device)
+{
+    // Devices cannot join while the threads are taking from the 
+    // ring, so throw exception
+    if(IsRunning())
+    {
+        throw CMIDIOutDeviceGroupRunning();
+    }
+
+    // If there is no room for another device, throw exception
+    if(m_MemberCount == MAX_DEVICES)
+    {
+        throw CMIDIOutDeviceGroupFull();
+    }
+
+    CMember &Member = m_Members[m_MemberCount];
+
+    Member.Device = &Device;
+    Member.Head.store(m_Tail.load());
+    Member.ErrorCount.store(0);
+
+    m_MemberCount++;
+}
+
+
+// Gets the number of devices
+std::size_t CMIDIOutDeviceGroup::GetDeviceCount() const
+{
+    return m_MemberCount;
+}
+
+
+// Starts a thread for each device
+void CMIDIOutDeviceGroup::Start()
+{
+    if(IsRunning())
+    {
+        return;
+    }
+
+    // Change state before the threads start checking it
+    m_Running.store(true);
+
+    for(std::size_t i = 0; i < m_MemberCount; i++)
+    {
+        CMember &Member = m_Members[i];
+
+        Member.Waiting.store(false);
+        Member.Event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+        // If we are unable to create signalling event, stop the
+        // threads already started and throw exception
+        if(Member.Event == NULL)
+        {
+            Stop();
+            throw CMIDIOutEventFailure();
+        }
+
+        DWORD Dummy;
+
+        Member.Thread = ::CreateThread(NULL, 0, MemberProc, &Member, 0,
+                                       &Dummy);
+
+        // If we are unable to create the thread, stop the threads
+        // already started and throw exception
+        if(Member.Thread == NULL)
+        {
+            Stop();
+            throw CMIDIOutThreadFailure();
+        }
+
+        ::SetThreadPriority(Member.Thread,
+                            THREAD_PRIORITY_TIME_CRITICAL);
+    }
+}
+
+
+// Stops the device threads
+void CMIDIOutDeviceGroup::Stop()
+{
+    m_Running.store(false);
+
+    // Make sure every thread sees the change before it waits again
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for(std::size_t i = 0; i < m_MemberCount; i++)
+    {
+        CMember &Member = m_Members[i];
+
+        if(Member.Thread != NULL)
+        {
+            // Notify the thread to finish and wait for it
+            ::SetEvent(Member.Event);
+            ::WaitForSingleObject(Member.Thread, INFINITE);
+            ::CloseHandle(Member.Thread);
+            Member.Thread = NULL;
+        }
+
+        if(Member.Event != NULL)
+        {
+            ::CloseHandle(Member.Event);
+            Member.Event = NULL;
+        }
+    }
+}
+
+
+// Determines if the group has been started
+bool CMIDIOutDeviceGroup::IsRunning() const
+{
+    return m_Running.load();
+}
+
+
+// Sends a short message to every device
+void CMIDIOutDeviceGroup::SendMsg(DWORD Msg)
+{
+    SendMsgs(&Msg, 1);
+}
+
+
+// Sends several short messages to every device
+void CMIDIOutDeviceGroup::SendMsgs(const DWORD *Msgs, std::size_t Count)
+{
+    if(!IsRunning() || Count == 0)
+    {
+        return;
+    }
+
+    // If there is no room for all of them, throw exception
+    if(Count > GetRoom())
+    {
+        throw CMIDIOutQueueFull();
+    }
+
+    std::size_t Tail = m_Tail.load(std::memory_order_relaxed);
+
+    for(std::size_t i = 0; i < Count; i++)
+    {
+        CEntry &Entry = m_Entries[(Tail + i) & m_Mask];
+
+        Entry.Msg = Msgs[i];
+        Entry.Shared = NULL;
+    }
+
+    Publish(Tail + Count);
+}
+
+
+// Sends a long message to every device
+void CMIDIOutDeviceGroup::SendMsg(LPSTR Msg, DWORD MsgLength)
+{
+    if(!IsRunning() || m_MemberCount == 0)
+    {
+        return;
+    }
+
+    // If there is no room, throw exception before copying
+    if(GetRoom() == 0)
+    {
+        throw CMIDIOutQueueFull();
+    }
+
+    char *Copy;
+    CSharedMsg *Shared;
+
+    try
+    {
+        Copy = new char[MsgLength];
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDIOutMemFailure();
+    }
+
+    std::memcpy(Copy, Msg, MsgLength);
+
+    try
+    {
+        // The copy is deleted with the shared message
+        Shared = new CSharedMsg(Copy, MsgLength,
+                                static_cast<LONG>(m_MemberCount), NULL);
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        delete [] Copy;
+        throw CMIDIOutMemFailure();
+    }
+
+    std::size_t Tail = m_Tail.load(std::memory_order_relaxed);
+    CEntry &Entry = m_Entries[Tail & m_Mask];
+
+    Entry.Msg = 0;
+    Entry.Shared = Shared;
+
+    Publish(Tail + 1);
+}
+
+
+// Sends a long message to every device without copying it
+void CMIDIOutDeviceGroup::SendMsgAsync(LPSTR Msg, DWORD MsgLength,
+                                       midi::CMIDIOutCallback &Callback)
+{
+    // Nothing will use the message, so the caller can have it back now
+    if(!IsRunning() || m_MemberCount == 0)
+    {
+        Callback.OnLongMsgDone(Msg, MsgLength);
+        return;
+    }
+
+    // If there is no room, throw exception
+    if(GetRoom() == 0)
+    {
+        throw CMIDIOutQueueFull();
+    }
+
+    CSharedMsg *Shared;
+
+    try
+    {
+        Shared = new CSharedMsg(Msg, MsgLength,
+                                static_cast<LONG>(m_MemberCount),
+                                &Callback);
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDIOutMemFailure();
+    }
+
+    std::size_t Tail = m_Tail.load(std::memory_order_relaxed);
+    CEntry &Entry = m_Entries[Tail & m_Mask];
+
+    Entry.Msg = 0;
+    Entry.Shared = Shared;
+
+    Publish(Tail + 1);
+}
+
+
+// Gets the number of messages waiting for a device
+std::size_t CMIDIOutDeviceGroup::GetPendingCount(
+                                               std::size_t Index) const
+{
+    return m_Tail.load() - m_Members[Index].Head.load();
+}
+
+
+// Gets the number of messages a device failed to send
+DWORD CMIDIOutDeviceGroup::GetErrorCount(std::size_t Index) const
+{
+    return m_Members[Index].ErrorCount.load(std::memory_order_relaxed);
+}
+
+
+// Gets the number of entries free in the ring
+std::size_t CMIDIOutDeviceGroup::GetRoom() const
+{
+    std::size_t Tail = m_Tail.load(std::memory_order_relaxed);
+    std::size_t Used = 0;
+
+    // The slowest device decides how much room there is
+    for(std::size_t i = 0; i < m_MemberCount; i++)
+    {
+        std::size_t Pending = Tail - m_Members[i].Head.load(
+                                            std::memory_order_acquire);
+
+        if(Pending > Used)
+        {
+            Used = Pending;
+        }
+    }
+
+    return m_Mask + 1 - Used;
+}
+
+
+// Makes the entries written so far visible to the device threads
+void CMIDIOutDeviceGroup::Publish(std::size_t Tail)
+{
+    m_Tail.store(Tail, std::memory_order_release);
+
+    // Pairs with the fence in SendAll, so that either the thread sees
+    // the new entries or we see that it is waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for(std::size_t i = 0; i < m_MemberCount; i++)
+    {
+        if(m_Members[i].Waiting.load(std::memory_order_relaxed))
+        {
+            ::SetEvent(m_Members[i].Event);
+        }
+    }
+}
+
+
+// Takes and sends the entries for a device
+void CMIDIOutDeviceGroup::SendAll(CMember &Member)
+{
+    std::size_t Head = Member.Head.load(std::memory_order_relaxed);
+
+    for(;;)
+    {
+        std::size_t Tail = m_Tail.load(std::memory_order_acquire);
+
+        while(Head != Tail)
+        {
+            CEntry Entry = m_Entries[Head & m_Mask];
+
+            // The entry has been copied, so the sender can reuse it
+            // once every device is past it
+            Head++;
+            Member.Head.store(Head, std::memory_order_release);
+
+            if(Entry.Shared == NULL)
+            {
+                try
+                {
+                    Member.Device->SendMsg(Entry.Msg);
+                }
+                // If sending failed, count it. The other devices are
+                // not affected.
+                catch(const std::exception &)
+                {
+                    Member.ErrorCount.fetch_add(1,
+                                            std::memory_order_relaxed);
+                }
+            }
+            else
+            {
+                try
+                {
+                    // The device tells the shared message when it is
+                    // finished with it
+                    Member.Device->SendMsgAsync(
+                        Entry.Shared->GetMsg(),
+                        Entry.Shared->GetMsgLength(), *Entry.Shared);
+                }
+                // If sending failed, the device is finished with the
+                // message already
+                catch(const std::exception &)
+                {
+                    Member.ErrorCount.fetch_add(1,
+                                            std::memory_order_relaxed);
+                    Entry.Shared->Release();
+                }
+            }
+        }
+
+        Member.Waiting.store(true, std::memory_order_relaxed);
+
+        // Pairs with the fence in Publish and Stop
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // Check again now that the sender knows we may be waiting
+        if(m_Tail.load(std::memory_order_relaxed) == Head)
+        {
+            // The ring is empty, so it is safe to finish
+            if(!m_Running.load(std::memory_order_relaxed))
+            {
+                Member.Waiting.store(false, std::memory_order_relaxed);
+                return;
+            }
+
+            ::WaitForSingleObject(Member.Event, INFINITE);
+        }
+
+        Member.Waiting.store(false, std::memory_order_relaxed);
+    }
+}
+
+
+// Thread function for a device
+DWORD WINAPI CMIDIOutDeviceGroup::MemberProc(LPVOID Parameter)
+{
+    CMember *Member = reinterpret_cast<CMember *>(Parameter);
+
+    Member->Group->SendAll(*Member);
+
+    return 0;
+}
\ No newline at end of file
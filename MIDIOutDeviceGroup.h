@@ -0,0 +1,246 @@
+#ifndef MIDI_OUT_DEVICE_GROUP_H
+#define MIDI_OUT_DEVICE_GROUP_H
+
+
+/*********************************************************************
+ * MIDIOutDeviceGroup.h - Interface for CMIDIOutDeviceGroup and
+ *                        related classes.
+ *
+ * Note: You must link to the winmm.lib to use these classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the ring positions shared between threads
+#include <atomic>
+
+// Necessary for CMIDIOutDevice and CMIDIOutCallback
+#include "MIDIOutDevice.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIOutDeviceGroup exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when a CMIDIOutDeviceGroup has no room for another
+    // device
+    class CMIDIOutDeviceGroupFull : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "CMIDIOutDeviceGroup object has no room for any more "
+                 "devices."; }
+    };
+
+
+    // Thrown when a device is added to a CMIDIOutDeviceGroup that is
+    // running
+    class CMIDIOutDeviceGroupRunning : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Devices cannot be added to a CMIDIOutDeviceGroup "
+                 "object while it is running."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIOutDeviceGroup
+    //
+    // Sends the same messages to several output devices at once, such
+    // as a main synth, a backup and a recorder. Each device has a
+    // thread of its own that takes messages from one shared ring, so
+    // a slow device only holds up itself and the ports stay as far
+    // apart as their own drivers make them, rather than each waiting
+    // for the ones before it.
+    //
+    // Long messages are copied once, or not at all with SendMsgAsync,
+    // and the one buffer is sent to every device. It is released when
+    // the last device is finished with it.
+    //
+    // A message stays in the ring until every device has taken it.
+    // When the slowest device is a whole ring behind, sending throws
+    // CMIDIOutQueueFull. Errors from the devices are counted per
+    // device, since they happen on the device threads.
+    //
+    // Add devices while the group is stopped. Send from one thread at
+    // a time. While the group is running, its devices must be open
+    // and must not be sent to other than through the group. Messages
+    // sent while it is stopped go nowhere.
+    //----------------------------------------------------------------
+
+
+    class CMIDIOutDeviceGroup
+    {
+    public:
+        // Largest number of devices in a group
+        enum { MAX_DEVICES = 16 };
+
+        // Default number of messages the ring holds
+        enum { DEFAULT_CAPACITY = 1024 };
+
+        // Construction. Capacity is rounded up to a power of two.
+        explicit CMIDIOutDeviceGroup(std::size_t Capacity =
+                                                    DEFAULT_CAPACITY);
+
+        // Destruction. Stops the group.
+        ~CMIDIOutDeviceGroup();
+
+        // Adds a device. The device must outlive the group. Throws
+        // CMIDIOutDeviceGroupRunning while the group is running.
+        void AddDevice(CMIDIOutDevice &Device);
+
+        // Gets the number of devices
+        std::size_t GetDeviceCount() const;
+
+        // Starts a thread for each device. Throws CMIDIOutEventFailure
+        // or CMIDIOutThreadFailure if it cannot.
+        void Start();
+
+        // Stops the device threads once they have sent everything
+        // already in the ring
+        void Stop();
+
+        // Returns true if the group has been started
+        bool IsRunning() const;
+
+        // Sends a short message to every device
+        void SendMsg(DWORD Msg);
+
+        // Sends Count short messages to every device. Either all of
+        // them are queued or, if there is no room, none are.
+        void SendMsgs(const DWORD *Msgs, std::size_t Count);
+
+        // Sends a long message to every device. The message is copied
+        // once, so Msg can be reused straight away.
+        void SendMsg(LPSTR Msg, DWORD MsgLength);
+
+        // Sends a long message to every device without copying it.
+        // Callback is told once every device is finished with Msg. If
+        // the message cannot be queued, the exception is thrown and
+        // Callback is not called. If the group is not running,
+        // Callback is called straight away.
+        void SendMsgAsync(LPSTR Msg, DWORD MsgLength,
+                          CMIDIOutCallback &Callback);
+
+        // Gets the number of messages waiting for a device
+        std::size_t GetPendingCount(std::size_t Index) const;
+
+        // Gets the number of messages a device failed to send
+        DWORD GetErrorCount(std::size_t Index) const;
+
+    // Private methods
+    private:
+        struct CMember;
+
+        // Copying and assignment not allowed
+        CMIDIOutDeviceGroup(const CMIDIOutDeviceGroup &);
+        CMIDIOutDeviceGroup &operator = (const CMIDIOutDeviceGroup &);
+
+        // Gets the number of entries free in the ring
+        std::size_t GetRoom() const;
+
+        // Makes the entries written so far visible to the device
+        // threads and wakes any that are waiting
+        void Publish(std::size_t Tail);
+
+        // Takes and sends the entries for a device, then waits for
+        // more. Returns when the group is stopped and the device has
+        // caught up.
+        void SendAll(CMember &Member);
+
+        // Thread function for a device
+        static DWORD WINAPI MemberProc(LPVOID Parameter);
+
+    // Private class declarations
+    private:
+        // A long message shared by every device, released by the last
+        // one finished with it
+        class CSharedMsg : public CMIDIOutCallback
+        {
+        public:
+            // Msg is owned if Callback is NULL
+            CSharedMsg(LPSTR Msg, DWORD MsgLength, LONG UserCount,
+                       CMIDIOutCallback *Callback);
+
+            // Counts a device as finished with the message
+            void Release();
+
+            // Called by a device when it is finished with the message
+            void OnLongMsgDone(LPSTR Msg, DWORD MsgLength);
+
+            LPSTR GetMsg() const { return m_Msg; }
+            DWORD GetMsgLength() const { return m_MsgLength; }
+
+        private:
+            // Copying and assignment not allowed
+            CSharedMsg(const CSharedMsg &);
+            CSharedMsg &operator = (const CSharedMsg &);
+
+            ~CSharedMsg();
+
+        private:
+            LPSTR             m_Msg;
+            DWORD             m_MsgLength;
+            std::atomic<LONG> m_UserCount;
+            CMIDIOutCallback *m_Callback;
+        };
+
+
+        // A message in the ring. A short message if Shared is NULL.
+        struct CEntry
+        {
+            DWORD       Msg;
+            CSharedMsg *Shared;
+        };
+
+
+        // A device and the thread sending to it
+        struct CMember
+        {
+            CMIDIOutDeviceGroup *Group;
+            CMIDIOutDevice      *Device;
+            HANDLE               Event;
+            HANDLE               Thread;
+
+            // Position of the next entry the device will take
+            std::atomic<std::size_t> Head;
+
+            // Set while the thread is waiting for entries
+            std::atomic<bool>        Waiting;
+
+            std::atomic<DWORD>       ErrorCount;
+        };
+
+    // Private attributes and constants
+    private:
+        CEntry                  *m_Entries;
+        std::size_t              m_Mask;
+
+        // Position of the next entry to be written
+        std::atomic<std::size_t> m_Tail;
+
+        CMember                  m_Members[MAX_DEVICES];
+        std::size_t              m_MemberCount;
+        std::atomic<bool>        m_Running;
+    };
+}
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,266 @@
+/*********************************************************************
+ * MIDIParser.cpp - Implementation for CMIDIParser.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIParser.h"
+#include "midi.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIParser;
+using midi::CMIDIReceiver;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Lowest status byte
+const unsigned char FIRST_STATUS = 0x80;
+
+// Undefined system common status bytes
+const unsigned char UNDEFINED_COMMON_1 = 0xF4;
+const unsigned char UNDEFINED_COMMON_2 = 0xF5;
+
+// Undefined realtime status bytes
+const unsigned char UNDEFINED_REALTIME_1 = 0xF9;
+const unsigned char UNDEFINED_REALTIME_2 = 0xFD;
+
+
+//--------------------------------------------------------------------
+// CMIDIParser implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIParser::CMIDIParser(CMIDIReceiver &Receiver) :
+m_Receiver(&Receiver)
+{
+    Reset();
+}
+
+
+// Parses bytes
+void CMIDIParser::Parse(LPSTR Data, DWORD Length, DWORD TimeStamp)
+{
+    const unsigned char *Bytes =
+                           reinterpret_cast<const unsigned char *>(Data);
+
+    // Where the system exclusive data in this buffer starts. If a
+    // message is continued from the last buffer, that is right at the
+    // beginning.
+    DWORD SegmentStart = 0;
+
+    for(DWORD i = 0; i < Length; i++)
+    {
+        unsigned char Byte = Bytes[i];
+
+        // System exclusive data is skipped over quickly and passed on
+        // in place later
+        if(m_InSysEx && Byte < FIRST_STATUS)
+        {
+            continue;
+        }
+
+        // Realtime bytes can interrupt anything
+        if(Byte >= midi::TIMING_CLOCK)
+        {
+            // Pass on the system exclusive data before this byte
+            if(m_InSysEx && i > SegmentStart)
+            {
+                m_Receiver->ReceiveMsg(Data + SegmentStart,
+                                       i - SegmentStart, TimeStamp);
+            }
+
+            SegmentStart = i + 1;
+
+            if(Byte != UNDEFINED_REALTIME_1 &&
+               Byte != UNDEFINED_REALTIME_2)
+            {
+                m_Receiver->ReceiveMsg(static_cast<DWORD>(Byte),
+                                       TimeStamp);
+            }
+        }
+        // The end of system exclusive data
+        else if(m_InSysEx && Byte == midi::END_OF_EXCLUSIVE)
+        {
+            m_Receiver->ReceiveMsg(Data + SegmentStart,
+                                   i + 1 - SegmentStart, TimeStamp);
+            m_InSysEx = false;
+        }
+        // Any other status byte
+        else if(Byte >= FIRST_STATUS)
+        {
+            // A status byte inside system exclusive data cuts the
+            // message short
+            if(m_InSysEx)
+            {
+                m_Receiver->OnError(Data + SegmentStart,
+                                    i - SegmentStart, TimeStamp);
+                m_InSysEx = false;
+            }
+
+            ParseStatus(Byte, TimeStamp);
+
+            // System exclusive data starts here
+            if(Byte == midi::SYSTEM_EXCLUSIVE)
+            {
+                m_InSysEx = true;
+                SegmentStart = i;
+            }
+        }
+        else
+        {
+            ParseData(Byte, TimeStamp);
+        }
+    }
+
+    // Pass on the system exclusive data so far; the rest comes with
+    // the next buffer
+    if(m_InSysEx && Length > SegmentStart)
+    {
+        m_Receiver->ReceiveMsg(Data + SegmentStart,
+                               Length - SegmentStart, TimeStamp);
+    }
+}
+
+
+// Forgets any message in progress
+void CMIDIParser::Reset()
+{
+    m_Status = 0;
+    m_DataNeeded = 0;
+    m_DataCount = 0;
+    m_Data[0] = 0;
+    m_Data[1] = 0;
+    m_InSysEx = false;
+}
+
+
+// Sets the receiver
+CMIDIReceiver *CMIDIParser::SetReceiver(CMIDIReceiver &Receiver)
+{
+    CMIDIReceiver *PrevReceiver = m_Receiver;
+
+    m_Receiver = &Receiver;
+
+    return PrevReceiver;
+}
+
+
+// Gets the number of data bytes following a status byte
+DWORD CMIDIParser::GetDataLength(unsigned char Status)
+{
+    // Channel messages, by command value from NOTE_OFF up; the last
+    // entry stands for the system messages
+    static const unsigned char ChannelLengths[8] =
+    {
+        2, 2, 2, 2, 1, 1, 2, 0
+    };
+
+    // System messages, from SYSTEM_EXCLUSIVE up
+    static const unsigned char SystemLengths[16] =
+    {
+        0, 1, 2, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    DWORD Length = 0;
+
+    if(Status >= midi::SYSTEM_EXCLUSIVE)
+    {
+        Length = SystemLengths[Status & midi::SHORT_MSG_MASK];
+    }
+    else if(Status >= FIRST_STATUS)
+    {
+        Length = ChannelLengths[(Status >> 4) & 7];
+    }
+
+    return Length;
+}
+
+
+// Handles a status byte
+void CMIDIParser::ParseStatus(unsigned char Status, DWORD TimeStamp)
+{
+    // If a short message was still waiting for data, report it
+    if(m_DataCount > 0)
+    {
+        m_Receiver->OnError(PackMsg(), TimeStamp);
+    }
+
+    m_DataCount = 0;
+    m_DataNeeded = static_cast<unsigned char>(GetDataLength(Status));
+
+    // System exclusive data is handled by Parse
+    if(Status == midi::SYSTEM_EXCLUSIVE)
+    {
+        m_Status = 0;
+    }
+    // Undefined status bytes and a stray END_OF_EXCLUSIVE are errors
+    else if(Status == UNDEFINED_COMMON_1 ||
+            Status == UNDEFINED_COMMON_2 ||
+            Status == midi::END_OF_EXCLUSIVE)
+    {
+        m_Status = 0;
+        m_Receiver->OnError(static_cast<DWORD>(Status), TimeStamp);
+    }
+    // Messages without data are complete already
+    else if(m_DataNeeded == 0)
+    {
+        m_Status = 0;
+        m_Receiver->ReceiveMsg(static_cast<DWORD>(Status), TimeStamp);
+    }
+    else
+    {
+        m_Status = Status;
+    }
+}
+
+
+// Handles a data byte
+void CMIDIParser::ParseData(unsigned char DataByte, DWORD TimeStamp)
+{
+    // A data byte without a status to go with it is an error
+    if(m_Status == 0)
+    {
+        m_Receiver->OnError(static_cast<DWORD>(DataByte), TimeStamp);
+        return;
+    }
+
+    m_Data[m_DataCount] = DataByte;
+    m_DataCount++;
+
+    if(m_DataCount == m_DataNeeded)
+    {
+        m_Receiver->ReceiveMsg(PackMsg(), TimeStamp);
+        m_DataCount = 0;
+
+        // Only channel messages have running status
+        if(m_Status >= midi::SYSTEM_EXCLUSIVE)
+        {
+            m_Status = 0;
+        }
+    }
+}
+
+
+// Packs the short message in progress
+DWORD CMIDIParser::PackMsg() const
+{
+    // Data bytes not received yet are left as zero
+    unsigned char DataByte1 = (m_DataCount > 0) ? m_Data[0] : 0;
+    unsigned char DataByte2 = (m_DataCount > 1) ? m_Data[1] : 0;
+
+    return midi::CShortMsg(m_Status, DataByte1, DataByte2).GetMsg();
+}
\ No newline at end of file
@@ -0,0 +1,107 @@
+#ifndef MIDI_PARSER_H
+#define MIDI_PARSER_H
+
+
+/*********************************************************************
+ * MIDIParser.h - Interface for CMIDIParser.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for CMIDIReceiver
+#include "MIDIInDevice.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIParser
+    //
+    // Turns a raw stream of MIDI bytes into messages for a
+    // CMIDIReceiver, the same way a CMIDIInDevice object would. The
+    // stream can be fed in pieces of any size; messages split across
+    // pieces are put back together.
+    //
+    // Running status is understood. Realtime bytes may appear
+    // anywhere, even inside other messages, and are passed on as
+    // short messages straight away without disturbing the message
+    // they interrupt.
+    //
+    // System exclusive data is never copied. The receiver is given
+    // pointers into the buffer passed to Parse, so a system
+    // exclusive message can arrive in several segments: when it is
+    // split across calls to Parse, or is interrupted by realtime
+    // bytes. The first segment starts with SYSTEM_EXCLUSIVE and the
+    // last ends with END_OF_EXCLUSIVE. A message cut short by another
+    // status byte ends with a call to OnError, which may be given no
+    // bytes at all.
+    //
+    // Stray data bytes, undefined status bytes and short messages cut
+    // short by another status byte are passed to OnError as short
+    // messages.
+    //----------------------------------------------------------------
+
+
+    class CMIDIParser
+    {
+    public:
+        explicit CMIDIParser(CMIDIReceiver &Receiver);
+
+        // Parses Length bytes. Every message completed in Data is
+        // given TimeStamp.
+        void Parse(LPSTR Data, DWORD Length, DWORD TimeStamp);
+
+        // Forgets any message in progress and the running status
+        void Reset();
+
+        // Sets the receiver. Returns the previous receiver.
+        CMIDIReceiver *SetReceiver(CMIDIReceiver &Receiver);
+
+        // Gets the number of data bytes that follow a status byte, or
+        // zero for status bytes that take no data
+        static DWORD GetDataLength(unsigned char Status);
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIParser(const CMIDIParser &);
+        CMIDIParser &operator = (const CMIDIParser &);
+
+        // Handles a status byte other than a realtime or system
+        // exclusive one
+        void ParseStatus(unsigned char Status, DWORD TimeStamp);
+
+        // Handles a data byte outside of system exclusive data
+        void ParseData(unsigned char DataByte, DWORD TimeStamp);
+
+        // Packs the short message in progress
+        DWORD PackMsg() const;
+
+    // Private attributes and constants
+    private:
+        CMIDIReceiver *m_Receiver;
+
+        // Status of the short message in progress, or zero if there
+        // is no running status
+        unsigned char m_Status;
+
+        // Data bytes needed for, and gathered so far for, the short
+        // message in progress
+        unsigned char m_DataNeeded;
+        unsigned char m_DataCount;
+        unsigned char m_Data[2];
+
+        // True while inside system exclusive data
+        bool m_InSysEx;
+    };
+}
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,476 @@
+/*********************************************************************
+ * MIDIRecorder.cpp - Implementation for CMIDIRecorder and related
+ *                    classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIRecorder.h"
+#include "midi.h"
+
+// Necessary for std::memcpy
+#include <cstring>
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIRecorder;
+using midi::CMIDITrackWriter;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Most bytes a variable length quantity takes
+const DWORD MAX_NUMBER_SIZE = CMIDITrackWriter::MAX_NUMBER_SIZE;
+
+// Most bytes a short message takes once encoded, with its time
+const DWORD MAX_SHORT_MSG_SIZE = MAX_NUMBER_SIZE + 
+                                 CMIDITrackWriter::MAX_SHORT_MSG_SIZE;
+
+
+//--------------------------------------------------------------------
+// CMIDIRecorder implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIRecorder::CMIDIRecorder() :
+m_Current(0),
+m_File(INVALID_HANDLE_VALUE),
+m_FileLength(0),
+m_LostCount(0),
+m_WriteFailed(false),
+m_Recording(false)
+{
+    for(int i = 0; i < 2; i++)
+    {
+        m_Blocks[i].Data = NULL;
+        m_Blocks[i].Count = 0;
+        m_Blocks[i].Overlapped.hEvent = NULL;
+        m_Blocks[i].Writing = false;
+    }
+
+    try
+    {
+        m_Blocks[0].Data = new unsigned char[BLOCK_SIZE];
+        m_Blocks[1].Data = new unsigned char[BLOCK_SIZE];
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        delete [] m_Blocks[0].Data;
+        throw CMIDIRecorderMemFailure();
+    }
+
+    ::InitializeCriticalSection(&m_Lock);
+}
+
+
+// Destructor
+CMIDIRecorder::~CMIDIRecorder()
+{
+    // Write errors cannot be reported from here
+    try
+    {
+        Stop();
+    }
+    catch(const CMIDIRecorderWriteFailure &)
+    {}
+
+    ::DeleteCriticalSection(&m_Lock);
+
+    delete [] m_Blocks[0].Data;
+    delete [] m_Blocks[1].Data;
+}
+
+
+// Starts recording into a file
+void CMIDIRecorder::Start(LPCSTR FileName)
+{
+    Stop();
+
+    ::EnterCriticalSection(&m_Lock);
+
+    // Each block has its own event so that both can be written at once
+    for(int i = 0; i < 2; i++)
+    {
+        m_Blocks[i].Overlapped.hEvent = ::CreateEvent(NULL, TRUE, FALSE,
+                                                      NULL);
+
+        // If we are unable to create signalling event, throw exception
+        if(m_Blocks[i].Overlapped.hEvent == NULL)
+        {
+            Close();
+            ::LeaveCriticalSection(&m_Lock);
+            throw CMIDIRecorderEventFailure();
+        }
+    }
+
+    m_File = ::CreateFile(FileName, GENERIC_WRITE, 0, NULL,
+                          CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+                          NULL);
+
+    // If we are unable to create the file, throw exception
+    if(m_File == INVALID_HANDLE_VALUE)
+    {
+        Close();
+        ::LeaveCriticalSection(&m_Lock);
+        throw CMIDIRecorderOpenFailure();
+    }
+
+    m_Current = 0;
+    m_Blocks[0].Count = 0;
+    m_Blocks[1].Count = 0;
+    m_FileLength = 0;
+    m_Writer.Reset();
+    m_LostCount = 0;
+    m_WriteFailed = false;
+
+    // The header goes out with the first block. The track length is
+    // filled in by Stop.
+    Put(CMIDITrackWriter::FILE_HEADER, 
+        CMIDITrackWriter::FILE_HEADER_SIZE);
+
+    m_Recording = true;
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Stops recording
+void CMIDIRecorder::Stop()
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    if(!m_Recording)
+    {
+        ::LeaveCriticalSection(&m_Lock);
+        return;
+    }
+
+    m_Recording = false;
+
+    // There is always room to finish the track once the disk has
+    // caught up
+    Wait(m_Blocks[1 - m_Current]);
+
+    Put(CMIDITrackWriter::END_OF_TRACK, 
+        CMIDITrackWriter::END_OF_TRACK_SIZE);
+    Flush();
+
+    Wait(m_Blocks[0]);
+    Wait(m_Blocks[1]);
+
+    // Now that the length of the track is known, fill it in
+    DWORD TrackLength = m_FileLength - CMIDITrackWriter::TRACK_OFFSET;
+    unsigned char Length[4];
+
+    CMIDITrackWriter::PutLength(Length, TrackLength);
+
+    CBlock &Block = m_Blocks[m_Current];
+
+    Block.Overlapped.Internal = 0;
+    Block.Overlapped.InternalHigh = 0;
+    Block.Overlapped.Offset = CMIDITrackWriter::TRACK_LENGTH_OFFSET;
+    Block.Overlapped.OffsetHigh = 0;
+
+    if(::WriteFile(m_File, Length, sizeof(Length), NULL,
+                   &Block.Overlapped) ||
+       ::GetLastError() == ERROR_IO_PENDING)
+    {
+        Block.Writing = true;
+        Wait(Block);
+    }
+    else
+    {
+        m_WriteFailed = true;
+    }
+
+    bool WriteFailed = m_WriteFailed;
+
+    Close();
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    // If any part of the file was not written, throw exception
+    if(WriteFailed)
+    {
+        throw CMIDIRecorderWriteFailure();
+    }
+}
+
+
+// Determines if recording
+bool CMIDIRecorder::IsRecording() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    bool Recording = m_Recording;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Recording;
+}
+
+
+// Gets the number of messages dropped
+DWORD CMIDIRecorder::GetLostCount() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    DWORD LostCount = m_LostCount;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return LostCount;
+}
+
+
+// Receives short messages
+void CMIDIRecorder::ReceiveMsgs(const midi::CTimedMsg *Msgs,
+                                std::size_t Count)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    if(m_Recording)
+    {
+        for(std::size_t i = 0; i < Count; i++)
+        {
+            RecordMsg(Msgs[i].Msg, Msgs[i].TimeStamp);
+        }
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Receives long messages
+void CMIDIRecorder::ReceiveMsg(LPSTR Msg, DWORD BytesRecorded,
+                               DWORD TimeStamp)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    if(m_Recording && BytesRecorded > 0)
+    {
+        const unsigned char *Data =
+                            reinterpret_cast<const unsigned char *>(Msg);
+
+        // A message that starts with SYSTEM_EXCLUSIVE is stored
+        // without it; anything else continues an earlier message
+        unsigned char Status = midi::END_OF_EXCLUSIVE;
+
+        if(Data[0] == midi::SYSTEM_EXCLUSIVE)
+        {
+            Status = midi::SYSTEM_EXCLUSIVE;
+            Data++;
+            BytesRecorded--;
+        }
+
+        if(Reserve(MAX_NUMBER_SIZE * 2 + 1 + BytesRecorded))
+        {
+            PutDelta(TimeStamp);
+            Put(Status);
+            PutNumber(BytesRecorded);
+            Put(Data, BytesRecorded);
+
+            // System exclusive data cancels running status
+            m_Writer.CancelRunningStatus();
+        }
+        else
+        {
+            m_LostCount++;
+        }
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Encodes a short message
+void CMIDIRecorder::RecordMsg(DWORD Msg, DWORD TimeStamp)
+{
+    if(!Reserve(MAX_SHORT_MSG_SIZE))
+    {
+        m_LostCount++;
+        return;
+    }
+
+    PutDelta(TimeStamp);
+
+    unsigned char Data[CMIDITrackWriter::MAX_SHORT_MSG_SIZE];
+
+    Put(Data, m_Writer.PutShortMsg(Data, Msg));
+}
+
+
+// Makes sure there is room for some bytes
+bool CMIDIRecorder::Reserve(DWORD Size)
+{
+    DWORD Room = BLOCK_SIZE - m_Blocks[m_Current].Count;
+
+    // The other block can only take the rest once its write is done
+    if(Room < Size && IsFree(m_Blocks[1 - m_Current]))
+    {
+        Room += BLOCK_SIZE;
+    }
+
+    return Room >= Size;
+}
+
+
+// Adds a byte
+void CMIDIRecorder::Put(unsigned char Byte)
+{
+    Put(&Byte, 1);
+}
+
+
+// Adds bytes
+void CMIDIRecorder::Put(const unsigned char *Data, DWORD Size)
+{
+    while(Size > 0)
+    {
+        // Move on only when there is more to add, so that a block
+        // filled exactly is not given up before the other is free
+        if(m_Blocks[m_Current].Count == BLOCK_SIZE)
+        {
+            Flush();
+        }
+
+        CBlock &Block = m_Blocks[m_Current];
+        DWORD Count = BLOCK_SIZE - Block.Count;
+
+        if(Count > Size)
+        {
+            Count = Size;
+        }
+
+        std::memcpy(Block.Data + Block.Count, Data, Count);
+        Block.Count += Count;
+        Data += Count;
+        Size -= Count;
+    }
+}
+
+
+// Adds a variable length quantity
+void CMIDIRecorder::PutNumber(DWORD Number)
+{
+    unsigned char Bytes[MAX_NUMBER_SIZE];
+
+    Put(Bytes, CMIDITrackWriter::PutNumber(Bytes, Number));
+}
+
+
+// Adds the time since the last event
+void CMIDIRecorder::PutDelta(DWORD TimeStamp)
+{
+    unsigned char Bytes[MAX_NUMBER_SIZE];
+
+    Put(Bytes, m_Writer.PutDelta(Bytes, TimeStamp));
+}
+
+
+// Starts writing the current block
+void CMIDIRecorder::Flush()
+{
+    CBlock &Block = m_Blocks[m_Current];
+
+    if(Block.Count > 0)
+    {
+        Block.Overlapped.Internal = 0;
+        Block.Overlapped.InternalHigh = 0;
+        Block.Overlapped.Offset = m_FileLength;
+        Block.Overlapped.OffsetHigh = 0;
+
+        // The write usually goes on in the background
+        if(::WriteFile(m_File, Block.Data, Block.Count, NULL,
+                       &Block.Overlapped) ||
+           ::GetLastError() == ERROR_IO_PENDING)
+        {
+            Block.Writing = true;
+        }
+        else
+        {
+            m_WriteFailed = true;
+        }
+
+        m_FileLength += Block.Count;
+    }
+
+    m_Current = 1 - m_Current;
+    m_Blocks[m_Current].Count = 0;
+}
+
+
+// Determines if a block can take new events
+bool CMIDIRecorder::IsFree(CBlock &Block)
+{
+    if(Block.Writing)
+    {
+        DWORD Written;
+
+        if(::GetOverlappedResult(m_File, &Block.Overlapped, &Written,
+                                 FALSE))
+        {
+            Block.Writing = false;
+        }
+        // A failed write leaves a hole in the file, but frees the block
+        else if(::GetLastError() != ERROR_IO_INCOMPLETE)
+        {
+            Block.Writing = false;
+            m_WriteFailed = true;
+        }
+    }
+
+    return !Block.Writing;
+}
+
+
+// Waits for a block to be written
+void CMIDIRecorder::Wait(CBlock &Block)
+{
+    if(Block.Writing)
+    {
+        DWORD Written;
+
+        if(!::GetOverlappedResult(m_File, &Block.Overlapped, &Written,
+                                  TRUE))
+        {
+            m_WriteFailed = true;
+        }
+
+        Block.Writing = false;
+    }
+}
+
+
+// Closes the file and the events
+void CMIDIRecorder::Close()
+{
+    if(m_File != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_File);
+        m_File = INVALID_HANDLE_VALUE;
+    }
+
+    for(int i = 0; i < 2; i++)
+    {
+        if(m_Blocks[i].Overlapped.hEvent != NULL)
+        {
+            ::CloseHandle(m_Blocks[i].Overlapped.hEvent);
+            m_Blocks[i].Overlapped.hEvent = NULL;
+        }
+    }
+}
\ No newline at end of file
@@ -0,0 +1,216 @@
+#ifndef MIDI_RECORDER_H
+#define MIDI_RECORDER_H
+
+
+/*********************************************************************
+ * MIDIRecorder.h - Interface for CMIDIRecorder and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+
+// Necessary for std::bad_alloc
+#include <new>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for CMIDIBatchReceiver
+#include "MIDIInDevice.h"
+
+// Necessary for CMIDITrackWriter
+#include "MIDIFile.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIRecorder exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when memory allocation fails within a CMIDIRecorder
+    // object
+    class CMIDIRecorderMemFailure : public std::bad_alloc
+    {
+    public:
+        const char *what() const throw()
+        { return "Memory allocation within a CMIDIRecorder object "
+                 "failed."; }
+    };
+
+
+    // Thrown when a CMIDIRecorder is unable to create its file
+    class CMIDIRecorderOpenFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to create file for CMIDIRecorder object."; }
+    };
+
+
+    // Thrown when a CMIDIRecorder is unable to create a signalling
+    // event
+    class CMIDIRecorderEventFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to create a signalling event for "
+                 "CMIDIRecorder object."; }
+    };
+
+
+    // Thrown when writing to the file of a CMIDIRecorder failed
+    class CMIDIRecorderWriteFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to write file for CMIDIRecorder object."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIRecorder
+    //
+    // A receiver that records what it receives into a format 0
+    // Standard MIDI File. Register it with a CMIDIInDevice object
+    // like any other receiver.
+    //
+    // Events are encoded straight into one of two fixed blocks of
+    // memory. When a block fills up it is written to the file with
+    // overlapped I/O while the other block takes new events, so
+    // the receiving thread never waits on the disk and memory use
+    // does not grow however long the recording is. If the disk falls
+    // so far behind that both blocks are full, events are dropped
+    // and counted rather than held up.
+    //
+    // The file has 500 ticks per quarter note at 120 beats per
+    // minute, so one tick is one millisecond of time stamp. The
+    // track starts at the first event received. Short messages
+    // other than channel messages are kept as escaped data.
+    //----------------------------------------------------------------
+
+
+    class CMIDIRecorder : public CMIDIBatchReceiver
+    {
+    public:
+        // Size of each block of memory events are encoded into
+        enum { BLOCK_SIZE = 65536 };
+
+        // Construction
+        CMIDIRecorder();
+
+        // Destruction. Stops recording if it is still going.
+        ~CMIDIRecorder();
+
+        // Creates a file and starts recording into it. Replaces any
+        // file already there.
+        void Start(LPCSTR FileName);
+
+        // Finishes the track, waits for the writes to finish and
+        // closes the file. Stop the CMIDIInDevice object first so
+        // that nothing arrives afterwards. Throws
+        // CMIDIRecorderWriteFailure if any part of the file could not
+        // be written.
+        void Stop();
+
+        // Returns true if recording
+        bool IsRecording() const;
+
+        // Gets the number of messages dropped because the file could
+        // not keep up
+        DWORD GetLostCount() const;
+
+        // Receives short messages
+        void ReceiveMsgs(const CTimedMsg *Msgs, std::size_t Count);
+
+        // Receives long messages
+        void ReceiveMsg(LPSTR Msg, DWORD BytesRecorded,
+                        DWORD TimeStamp);
+
+        // Invalid messages are not recorded
+        void OnError(DWORD, DWORD) {}
+        void OnError(LPSTR, DWORD, DWORD) {}
+
+        // Keep the other ReceiveMsg overloads visible
+        using CMIDIBatchReceiver::ReceiveMsg;
+
+    // Private class declarations
+    private:
+        // A block of encoded events and the write that empties it
+        struct CBlock
+        {
+            unsigned char *Data;
+            DWORD          Count;
+            OVERLAPPED     Overlapped;
+            bool           Writing;
+        };
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIRecorder(const CMIDIRecorder &);
+        CMIDIRecorder &operator = (const CMIDIRecorder &);
+
+        // Encodes a short message
+        void RecordMsg(DWORD Msg, DWORD TimeStamp);
+
+        // Makes sure Size bytes can be added without waiting. Returns
+        // false if they cannot.
+        bool Reserve(DWORD Size);
+
+        // Adds bytes to the current block, moving on to the next
+        // block when it fills up. Room must have been reserved.
+        void Put(unsigned char Byte);
+        void Put(const unsigned char *Data, DWORD Size);
+
+        // Adds a variable length quantity
+        void PutNumber(DWORD Number);
+
+        // Adds the time since the last event
+        void PutDelta(DWORD TimeStamp);
+
+        // Starts writing the current block and moves on to the other
+        void Flush();
+
+        // Determines if a block can take new events, without waiting
+        bool IsFree(CBlock &Block);
+
+        // Waits for a block to be written
+        void Wait(CBlock &Block);
+
+        // Closes the file and the events
+        void Close();
+
+    // Private attributes and constants
+    private:
+        CBlock           m_Blocks[2];
+        int              m_Current;
+
+        HANDLE           m_File;
+
+        // Bytes handed to the file so far
+        DWORD            m_FileLength;
+
+        // Keeps the time of the last event and the running status
+        CMIDITrackWriter m_Writer;
+
+        DWORD            m_LostCount;
+        bool             m_WriteFailed;
+        bool             m_Recording;
+
+        mutable CRITICAL_SECTION m_Lock;
+    };
+}
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,446 @@
+/*********************************************************************
+ * MIDIRouter.cpp - Implementation for CMIDIRouteNode and related
+ *                  classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIRouter.h"
+#include "midi.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIRouteNode;
+using midi::CMIDIOutputNode;
+using midi::CMIDIFilterNode;
+using midi::CMIDITransposeNode;
+using midi::CMIDIChannelMapNode;
+using midi::CMIDIOutException;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Every bit of a table word set
+const DWORD ALL_BITS = 0xFFFFFFFF;
+
+// Number of notes
+const int NOTE_COUNT = 128;
+
+// Number of channels
+const unsigned char CHANNEL_COUNT = 16;
+
+// Lowest status byte
+const unsigned char FIRST_STATUS = 0x80;
+
+
+//--------------------------------------------------------------------
+// CMIDIRouteNode implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIRouteNode::CMIDIRouteNode() :
+m_ConnectionCount(0)
+{}
+
+
+// Connects a node
+void CMIDIRouteNode::Connect(CMIDIRouteNode &Node)
+{
+    // If there is no room for another connection, throw exception
+    if(m_ConnectionCount == MAX_CONNECTIONS)
+    {
+        throw CMIDIRouteNodeFull();
+    }
+
+    m_Connections[m_ConnectionCount] = &Node;
+    m_ConnectionCount++;
+}
+
+
+// Disconnects a node
+void CMIDIRouteNode::Disconnect(CMIDIRouteNode &Node)
+{
+    for(std::size_t i = 0; i < m_ConnectionCount; i++)
+    {
+        // Close the gap so that the remaining nodes keep their order
+        if(m_Connections[i] == &Node)
+        {
+            for(std::size_t j = i + 1; j < m_ConnectionCount; j++)
+            {
+                m_Connections[j - 1] = m_Connections[j];
+            }
+
+            m_ConnectionCount--;
+            break;
+        }
+    }
+}
+
+
+// Disconnects every node
+void CMIDIRouteNode::DisconnectAll()
+{
+    m_ConnectionCount = 0;
+}
+
+
+// Gets the number of connected nodes
+std::size_t CMIDIRouteNode::GetConnectionCount() const
+{
+    return m_ConnectionCount;
+}
+
+
+// Routes a long message
+void CMIDIRouteNode::RouteMsg(LPSTR Msg, DWORD BytesRecorded,
+                              DWORD TimeStamp)
+{
+    ForwardMsg(Msg, BytesRecorded, TimeStamp);
+}
+
+
+// Passes a short message on
+void CMIDIRouteNode::ForwardMsg(DWORD Msg, DWORD TimeStamp)
+{
+    for(std::size_t i = 0; i < m_ConnectionCount; i++)
+    {
+        m_Connections[i]->RouteMsg(Msg, TimeStamp);
+    }
+}
+
+
+// Passes a long message on
+void CMIDIRouteNode::ForwardMsg(LPSTR Msg, DWORD BytesRecorded,
+                                DWORD TimeStamp)
+{
+    for(std::size_t i = 0; i < m_ConnectionCount; i++)
+    {
+        m_Connections[i]->RouteMsg(Msg, BytesRecorded, TimeStamp);
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIOutputNode implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIOutputNode::CMIDIOutputNode(midi::CMIDIOutDevice &Device) :
+m_Device(&Device),
+m_ErrorCount(0)
+{
+    ::InitializeCriticalSection(&m_Lock);
+}
+
+
+// Destructor
+CMIDIOutputNode::~CMIDIOutputNode()
+{
+    ::DeleteCriticalSection(&m_Lock);
+}
+
+
+// Sends a short message
+void CMIDIOutputNode::RouteMsg(DWORD Msg, DWORD)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    try
+    {
+        m_Device->SendMsg(Msg);
+    }
+    catch(const CMIDIOutException &)
+    {
+        m_ErrorCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Sends a long message
+void CMIDIOutputNode::RouteMsg(LPSTR Msg, DWORD BytesRecorded, DWORD)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    try
+    {
+        m_Device->SendMsg(Msg, BytesRecorded);
+    }
+    catch(const std::exception &)
+    {
+        m_ErrorCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Gets the number of messages that failed
+DWORD CMIDIOutputNode::GetErrorCount() const
+{
+    return m_ErrorCount.load(std::memory_order_relaxed);
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIFilterNode implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIFilterNode::CMIDIFilterNode()
+{
+    PassAll();
+}
+
+
+// Lets a status byte through or not
+void CMIDIFilterNode::SetStatus(unsigned char Status, bool Pass)
+{
+    DWORD Bit = 1UL << (Status & 31);
+
+    if(Pass)
+    {
+        m_Pass[Status >> 5].fetch_or(Bit, std::memory_order_relaxed);
+    }
+    else
+    {
+        m_Pass[Status >> 5].fetch_and(~Bit, std::memory_order_relaxed);
+    }
+}
+
+
+// Lets a command through or not
+void CMIDIFilterNode::SetCommand(unsigned char Command, bool Pass)
+{
+    unsigned char Status = Command & ~midi::SHORT_MSG_MASK;
+
+    // System messages have no channels
+    if(Status >= FIRST_STATUS && Status < midi::SYSTEM_EXCLUSIVE)
+    {
+        for(unsigned char i = 0; i < CHANNEL_COUNT; i++)
+        {
+            SetStatus(Status | i, Pass);
+        }
+    }
+}
+
+
+// Lets a channel through or not
+void CMIDIFilterNode::SetChannel(unsigned char Channel, bool Pass)
+{
+    Channel &= midi::SHORT_MSG_MASK;
+
+    for(unsigned char Command = midi::NOTE_OFF;
+        Command < midi::SYSTEM_EXCLUSIVE; Command += CHANNEL_COUNT)
+    {
+        SetStatus(Command | Channel, Pass);
+    }
+}
+
+
+// Lets system exclusive messages through or not
+void CMIDIFilterNode::SetSysEx(bool Pass)
+{
+    m_PassSysEx.store(Pass, std::memory_order_relaxed);
+}
+
+
+// Lets everything through
+void CMIDIFilterNode::PassAll()
+{
+    for(int i = 0; i < 8; i++)
+    {
+        m_Pass[i].store(ALL_BITS, std::memory_order_relaxed);
+    }
+
+    m_PassSysEx.store(true, std::memory_order_relaxed);
+}
+
+
+// Filters a short message
+void CMIDIFilterNode::RouteMsg(DWORD Msg, DWORD TimeStamp)
+{
+    if(IsPassed(static_cast<unsigned char>(Msg)))
+    {
+        ForwardMsg(Msg, TimeStamp);
+    }
+}
+
+
+// Filters a long message
+void CMIDIFilterNode::RouteMsg(LPSTR Msg, DWORD BytesRecorded,
+                               DWORD TimeStamp)
+{
+    if(m_PassSysEx.load(std::memory_order_relaxed))
+    {
+        ForwardMsg(Msg, BytesRecorded, TimeStamp);
+    }
+}
+
+
+//--------------------------------------------------------------------
+// CMIDITransposeNode implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDITransposeNode::CMIDITransposeNode(int Semitones,
+                                       WORD ChannelMask)
+{
+    for(int i = 0; i < 8; i++)
+    {
+        m_Transposed[i] = 0;
+    }
+
+    // Only messages that carry a note are transposed
+    const unsigned char Commands[] =
+    {
+        midi::NOTE_OFF, midi::NOTE_ON, midi::POLY_PRESSURE
+    };
+
+    for(int i = 0; i < 3; i++)
+    {
+        for(unsigned char Channel = 0; Channel < CHANNEL_COUNT; Channel++)
+        {
+            if(ChannelMask & (1 << Channel))
+            {
+                unsigned char Status = Commands[i] | Channel;
+
+                m_Transposed[Status >> 5] |= 1UL << (Status & 31);
+            }
+        }
+    }
+
+    SetTranspose(Semitones);
+}
+
+
+// Sets the transposition
+void CMIDITransposeNode::SetTranspose(int Semitones)
+{
+    m_Semitones = Semitones;
+
+    for(int Note = 0; Note < NOTE_COUNT; Note++)
+    {
+        int NewNote = Note + Semitones;
+
+        if(NewNote >= 0 && NewNote < NOTE_COUNT)
+        {
+            m_Notes[Note] = static_cast<unsigned char>(NewNote);
+        }
+        else
+        {
+            m_Notes[Note] = NO_NOTE;
+        }
+    }
+}
+
+
+// Gets the transposition
+int CMIDITransposeNode::GetTranspose() const
+{
+    return m_Semitones;
+}
+
+
+// Transposes a message
+void CMIDITransposeNode::RouteMsg(DWORD Msg, DWORD TimeStamp)
+{
+    unsigned char Status = static_cast<unsigned char>(Msg);
+
+    if(m_Transposed[Status >> 5] & (1UL << (Status & 31)))
+    {
+        unsigned char Note = m_Notes[(Msg >> midi::SHORT_MSG_SHIFT) &
+                                     midi::DATA_BYTE_MASK];
+
+        // Notes moved out of range are dropped
+        if(Note == NO_NOTE)
+        {
+            return;
+        }
+
+        Msg = (Msg & ~(0xFFUL << midi::SHORT_MSG_SHIFT)) |
+              (static_cast<DWORD>(Note) << midi::SHORT_MSG_SHIFT);
+    }
+
+    ForwardMsg(Msg, TimeStamp);
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIChannelMapNode implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIChannelMapNode::CMIDIChannelMapNode()
+{
+    Reset();
+}
+
+
+// Maps one channel to another
+void CMIDIChannelMapNode::SetChannel(unsigned char From,
+                                     unsigned char To)
+{
+    From &= midi::SHORT_MSG_MASK;
+    To &= midi::SHORT_MSG_MASK;
+
+    for(unsigned char Command = midi::NOTE_OFF;
+        Command < midi::SYSTEM_EXCLUSIVE; Command += CHANNEL_COUNT)
+    {
+        m_Status[Command | From] = Command | To;
+    }
+}
+
+
+// Drops a channel
+void CMIDIChannelMapNode::DropChannel(unsigned char Channel)
+{
+    Channel &= midi::SHORT_MSG_MASK;
+
+    for(unsigned char Command = midi::NOTE_OFF;
+        Command < midi::SYSTEM_EXCLUSIVE; Command += CHANNEL_COUNT)
+    {
+        m_Status[Command | Channel] = DROP;
+    }
+}
+
+
+// Maps every channel to itself
+void CMIDIChannelMapNode::Reset()
+{
+    for(int i = 0; i < 256; i++)
+    {
+        m_Status[i] = static_cast<unsigned char>(i);
+    }
+}
+
+
+// Moves a message
+void CMIDIChannelMapNode::RouteMsg(DWORD Msg, DWORD TimeStamp)
+{
+    unsigned char Status = m_Status[Msg & 0xFF];
+
+    // System messages map to themselves, so only channel messages can
+    // be dropped
+    if(Status != DROP)
+    {
+        ForwardMsg((Msg & ~0xFFUL) | Status, TimeStamp);
+    }
+}
\ No newline at end of file
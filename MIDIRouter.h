@@ -0,0 +1,325 @@
+#ifndef MIDI_ROUTER_H
+#define MIDI_ROUTER_H
+
+
+/*********************************************************************
+ * MIDIRouter.h - Interface for CMIDIRouteNode and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+
+// Necessary for the tables read on the callback thread
+#include <atomic>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for CMIDIReceiver
+#include "MIDIInDevice.h"
+
+// Necessary for CMIDIOutDevice
+#include "MIDIOutDevice.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIRouteNode exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when a CMIDIRouteNode has no room for another connection
+    class CMIDIRouteNodeFull : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "CMIDIRouteNode object has no room for any more "
+                 "connections."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIRouteNode
+    //
+    // A node in a routing graph. Each node passes the messages it is
+    // given on to the nodes connected to it, changing or dropping
+    // them on the way. Messages are passed on by direct calls on the
+    // thread that delivered them, usually the input device callback,
+    // and nothing is allocated or copied on the way.
+    //
+    // Connect and disconnect nodes while no messages are flowing. The
+    // graph must not have cycles.
+    //----------------------------------------------------------------
+
+
+    class CMIDIRouteNode
+    {
+    public:
+        // Largest number of nodes one node can be connected to
+        enum { MAX_CONNECTIONS = 16 };
+
+        // Construction/Destruction
+        CMIDIRouteNode();
+        virtual ~CMIDIRouteNode() {}
+
+        // Passes messages from this node on to another node
+        void Connect(CMIDIRouteNode &Node);
+
+        // Stops passing messages to a node
+        void Disconnect(CMIDIRouteNode &Node);
+
+        // Stops passing messages to any node
+        void DisconnectAll();
+
+        // Gets the number of nodes this node passes messages to
+        std::size_t GetConnectionCount() const;
+
+        // Routes a short message
+        virtual void RouteMsg(DWORD Msg, DWORD TimeStamp) = 0;
+
+        // Routes a long message. By default it is passed on unchanged.
+        virtual void RouteMsg(LPSTR Msg, DWORD BytesRecorded,
+                              DWORD TimeStamp);
+
+    protected:
+        // Passes a message on to every connected node
+        void ForwardMsg(DWORD Msg, DWORD TimeStamp);
+        void ForwardMsg(LPSTR Msg, DWORD BytesRecorded,
+                        DWORD TimeStamp);
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIRouteNode(const CMIDIRouteNode &);
+        CMIDIRouteNode &operator = (const CMIDIRouteNode &);
+
+    // Private attributes and constants
+    private:
+        CMIDIRouteNode *m_Connections[MAX_CONNECTIONS];
+        std::size_t     m_ConnectionCount;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIInputNode
+    //
+    // Where messages from a CMIDIInDevice enter the graph. Register
+    // the node as the receiver of the device.
+    //----------------------------------------------------------------
+
+
+    class CMIDIInputNode : public CMIDIRouteNode, public CMIDIReceiver
+    {
+    public:
+        // Passes received messages into the graph
+        void ReceiveMsg(DWORD Msg, DWORD TimeStamp)
+        { ForwardMsg(Msg, TimeStamp); }
+
+        void ReceiveMsg(LPSTR Msg, DWORD BytesRecorded, DWORD TimeStamp)
+        { ForwardMsg(Msg, BytesRecorded, TimeStamp); }
+
+        // Keep the other ReceiveMsg overloads visible
+        using CMIDIReceiver::ReceiveMsg;
+
+        // Invalid messages are not routed
+        void OnError(DWORD, DWORD) {}
+        void OnError(LPSTR, DWORD, DWORD) {}
+
+        // Messages can also be fed in directly
+        void RouteMsg(DWORD Msg, DWORD TimeStamp)
+        { ForwardMsg(Msg, TimeStamp); }
+
+        // Keep the other RouteMsg overload visible
+        using CMIDIRouteNode::RouteMsg;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIOutputNode
+    //
+    // Where messages leave the graph for a CMIDIOutDevice. Errors
+    // from the device are counted, since there is no one to report
+    // them to on the callback thread.
+    //
+    // Several input devices may feed the same output node, each from
+    // its own callback thread, while a CMIDIOutDevice takes long 
+    // messages, and short messages while paced, from one thread at a
+    // time. The node holds a lock while sending, so the device sees
+    // one sender.
+    //----------------------------------------------------------------
+
+
+    class CMIDIOutputNode : public CMIDIRouteNode
+    {
+    public:
+        explicit CMIDIOutputNode(CMIDIOutDevice &Device);
+        ~CMIDIOutputNode();
+
+        // Sends messages to the device
+        void RouteMsg(DWORD Msg, DWORD TimeStamp);
+        void RouteMsg(LPSTR Msg, DWORD BytesRecorded, DWORD TimeStamp);
+
+        // Gets the number of messages the device failed to send
+        DWORD GetErrorCount() const;
+
+    // Private attributes and constants
+    private:
+        CMIDIOutDevice    *m_Device;
+        std::atomic<DWORD> m_ErrorCount;
+
+        // Held while sending to the device
+        CRITICAL_SECTION   m_Lock;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIFilterNode
+    //
+    // Passes on only the messages whose status bytes are let through.
+    // Everything is let through to begin with. The filter is a table
+    // of one bit per status byte, so each message costs one lookup.
+    // The filter can be changed while messages are flowing.
+    //----------------------------------------------------------------
+
+
+    class CMIDIFilterNode : public CMIDIRouteNode
+    {
+    public:
+        CMIDIFilterNode();
+
+        // Lets a status byte through or not
+        void SetStatus(unsigned char Status, bool Pass);
+
+        // Lets a channel message command through or not, on every
+        // channel
+        void SetCommand(unsigned char Command, bool Pass);
+
+        // Lets the channel messages on a channel through or not
+        void SetChannel(unsigned char Channel, bool Pass);
+
+        // Lets system exclusive messages through or not
+        void SetSysEx(bool Pass);
+
+        // Lets everything through
+        void PassAll();
+
+        // Determines if a status byte is let through
+        bool IsPassed(unsigned char Status) const
+        {
+            return (m_Pass[Status >> 5].load(std::memory_order_relaxed) &
+                    (1UL << (Status & 31))) != 0;
+        }
+
+        // Filters messages
+        void RouteMsg(DWORD Msg, DWORD TimeStamp);
+        void RouteMsg(LPSTR Msg, DWORD BytesRecorded, DWORD TimeStamp);
+
+    // Private attributes and constants
+    private:
+        // One bit per status byte
+        std::atomic<DWORD> m_Pass[8];
+        std::atomic<bool>  m_PassSysEx;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDITransposeNode
+    //
+    // Moves the notes of note on, note off and polyphonic pressure
+    // messages up or down. Notes moved out of range are dropped. The
+    // change is worked out in advance into a table of 128 notes.
+    //
+    // Change the transposition only while no notes are held, or the
+    // note off messages will not match the notes they end.
+    //----------------------------------------------------------------
+
+
+    class CMIDITransposeNode : public CMIDIRouteNode
+    {
+    public:
+        // Construction. Only the channels whose bits are set in
+        // ChannelMask are transposed.
+        explicit CMIDITransposeNode(int Semitones = 0,
+                                    WORD ChannelMask = 0xFFFF);
+
+        // Sets the transposition in semitones
+        void SetTranspose(int Semitones);
+
+        // Gets the transposition in semitones
+        int GetTranspose() const;
+
+        // Transposes messages
+        void RouteMsg(DWORD Msg, DWORD TimeStamp);
+
+        // Keep the other RouteMsg overload visible
+        using CMIDIRouteNode::RouteMsg;
+
+    // Private attributes and constants
+    private:
+        // Marks notes that are moved out of range
+        enum { NO_NOTE = 0xFF };
+
+        unsigned char m_Notes[128];
+
+        // Status bytes of the messages that get transposed, one bit
+        // per status byte
+        DWORD         m_Transposed[8];
+
+        int           m_Semitones;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIChannelMapNode
+    //
+    // Moves channel messages from one channel to another, or drops
+    // them. Every channel maps to itself to begin with. The map is
+    // worked out in advance into a table of new status bytes, so
+    // each message costs one lookup.
+    //
+    // Change the map only while no notes are held.
+    //----------------------------------------------------------------
+
+
+    class CMIDIChannelMapNode : public CMIDIRouteNode
+    {
+    public:
+        CMIDIChannelMapNode();
+
+        // Sends the messages on channel From to channel To
+        void SetChannel(unsigned char From, unsigned char To);
+
+        // Drops the messages on a channel
+        void DropChannel(unsigned char Channel);
+
+        // Maps every channel to itself
+        void Reset();
+
+        // Moves messages
+        void RouteMsg(DWORD Msg, DWORD TimeStamp);
+
+        // Keep the other RouteMsg overload visible
+        using CMIDIRouteNode::RouteMsg;
+
+    // Private attributes and constants
+    private:
+        // Marks dropped messages
+        enum { DROP = 0 };
+
+        // New status byte for each status byte
+        unsigned char m_Status[256];
+    };
+}
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,544 @@
+/*********************************************************************
+ * MIDISequencer.cpp - Implementation for CMIDISequencer and related
+ *                     classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDISequencer.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDISequencer;
+using midi::CMIDIOutException;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Period of the multimedia timer in milliseconds
+const UINT TIMER_PERIOD = 1;
+
+
+//--------------------------------------------------------------------
+// CMIDISequencer implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDISequencer::CMIDISequencer(std::size_t Capacity) :
+m_Events(NULL),
+m_FreeEvents(NULL),
+m_EventCount(0),
+m_Capacity(Capacity),
+m_OutputCount(0),
+m_Now(0),
+m_StartTime(0),
+m_ErrorCount(0),
+m_Event(NULL),
+m_Thread(NULL),
+m_TimerId(0),
+m_Running(false)
+{
+    try
+    {
+        m_Events = new CEvent[Capacity];
+    }
+    // If memory allocation failed, throw exception
+    catch(const std::bad_alloc &)
+    {
+        throw CMIDISequencerMemFailure();
+    }
+
+    m_Event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    // If we are unable to create signalling event, throw exception
+    if(m_Event == NULL)
+    {
+        delete [] m_Events;
+        throw CMIDISequencerEventFailure();
+    }
+
+    ::InitializeCriticalSection(&m_Lock);
+
+    // Put every event in the pool
+    for(std::size_t i = 0; i < Capacity; i++)
+    {
+        m_Events[i].Next = m_FreeEvents;
+        m_FreeEvents = &m_Events[i];
+    }
+
+    for(int Level = 0; Level < LEVEL_COUNT; Level++)
+    {
+        for(int i = 0; i < SLOT_COUNT; i++)
+        {
+            m_Wheel[Level][i].Head = NULL;
+            m_Wheel[Level][i].Tail = NULL;
+        }
+    }
+}
+
+
+// Destructor
+CMIDISequencer::~CMIDISequencer()
+{
+    Stop();
+
+    ::DeleteCriticalSection(&m_Lock);
+    ::CloseHandle(m_Event);
+
+    delete [] m_Events;
+}
+
+
+// Adds an output device
+std::size_t CMIDISequencer::AddOutput(midi::CMIDIOutDevice &Device)
+{
+    // If the playback thread is running, throw exception
+    if(m_Running)
+    {
+        throw CMIDISequencerRunning();
+    }
+
+    ::EnterCriticalSection(&m_Lock);
+
+    // If there is no room for another output, throw exception
+    if(m_OutputCount == MAX_OUTPUTS)
+    {
+        ::LeaveCriticalSection(&m_Lock);
+        throw CMIDISequencerFull();
+    }
+
+    std::size_t Output = m_OutputCount;
+
+    m_Outputs[Output].Device = &Device;
+    m_Outputs[Output].Count = 0;
+
+    // Events can only be scheduled for the output from now on
+    m_OutputCount++;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Output;
+}
+
+
+// Schedules a short message
+void CMIDISequencer::ScheduleMsg(DWORD Time, DWORD Msg,
+                                 std::size_t Output)
+{
+    midi::CTimedMsg TimedMsg = { Msg, Time };
+
+    ScheduleMsgs(&TimedMsg, 1, Output);
+}
+
+
+// Schedules several short messages
+void CMIDISequencer::ScheduleMsgs(const midi::CTimedMsg *Msgs,
+                                  std::size_t Count, std::size_t Output)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    // If the output does not exist, throw exception
+    if(Output >= m_OutputCount)
+    {
+        ::LeaveCriticalSection(&m_Lock);
+        throw CMIDISequencerBadOutput();
+    }
+
+    for(std::size_t i = 0; i < Count; i++)
+    {
+        // If the pool is empty, throw exception
+        if(m_FreeEvents == NULL)
+        {
+            ::LeaveCriticalSection(&m_Lock);
+            throw CMIDISequencerFull();
+        }
+
+        CEvent *Event = m_FreeEvents;
+
+        m_FreeEvents = Event->Next;
+        m_EventCount++;
+
+        Event->Time = Msgs[i].TimeStamp;
+        Event->Msg = Msgs[i].Msg;
+        Event->Output = static_cast<DWORD>(Output);
+
+        Insert(Event);
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Starts playback
+void CMIDISequencer::Start()
+{
+    if(!m_Running)
+    {
+        // Carry on from where we stopped
+        m_StartTime = ::timeGetTime() - m_Now.load();
+
+        ::timeBeginPeriod(TIMER_PERIOD);
+
+        // Change state before the thread starts checking it
+        m_Running = true;
+
+        DWORD Dummy;
+
+        m_Thread = ::CreateThread(NULL, 0, SequencerProc, this, 0,
+                                  &Dummy);
+
+        // If we are unable to create the thread, throw exception
+        if(m_Thread == NULL)
+        {
+            m_Running = false;
+            ::timeEndPeriod(TIMER_PERIOD);
+            throw CMIDISequencerThreadFailure();
+        }
+
+        ::SetThreadPriority(m_Thread, THREAD_PRIORITY_TIME_CRITICAL);
+
+        // Have the timer signal the thread every millisecond
+        m_TimerId = ::timeSetEvent(TIMER_PERIOD, 0,
+                            reinterpret_cast<LPTIMECALLBACK>(m_Event),
+                            0, TIME_PERIODIC | TIME_CALLBACK_EVENT_SET);
+
+        // If we are unable to start the timer, stop the thread and
+        // throw exception
+        if(m_TimerId == 0)
+        {
+            Stop();
+            throw CMIDISequencerThreadFailure();
+        }
+    }
+}
+
+
+// Stops playback
+void CMIDISequencer::Stop()
+{
+    if(m_Running)
+    {
+        if(m_TimerId != 0)
+        {
+            ::timeKillEvent(m_TimerId);
+            m_TimerId = 0;
+        }
+
+        // Notify the thread to finish and wait for it
+        m_Running = false;
+        ::SetEvent(m_Event);
+        ::WaitForSingleObject(m_Thread, INFINITE);
+        ::CloseHandle(m_Thread);
+        m_Thread = NULL;
+
+        ::timeEndPeriod(TIMER_PERIOD);
+    }
+}
+
+
+// Throws away every waiting event
+void CMIDISequencer::Clear()
+{
+    if(!m_Running)
+    {
+        ::EnterCriticalSection(&m_Lock);
+
+        // Give every list in the wheel back to the pool
+        for(int Level = 0; Level < LEVEL_COUNT; Level++)
+        {
+            for(int i = 0; i < SLOT_COUNT; i++)
+            {
+                CSlot &Slot = m_Wheel[Level][i];
+
+                if(Slot.Head != NULL)
+                {
+                    Slot.Tail->Next = m_FreeEvents;
+                    m_FreeEvents = Slot.Head;
+                }
+
+                Slot.Head = NULL;
+                Slot.Tail = NULL;
+            }
+        }
+
+        m_EventCount = 0;
+        m_Now = 0;
+
+        ::LeaveCriticalSection(&m_Lock);
+    }
+}
+
+
+// Gets the current time
+DWORD CMIDISequencer::GetTime() const
+{
+    return m_Now.load(std::memory_order_relaxed);
+}
+
+
+// Gets the number of events waiting
+std::size_t CMIDISequencer::GetEventCount() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    std::size_t Count = m_EventCount;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Count;
+}
+
+
+// Gets the number of events that can still be scheduled
+std::size_t CMIDISequencer::GetFreeCount() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    std::size_t Count = m_Capacity - m_EventCount;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Count;
+}
+
+
+// Gets the number of messages that could not be sent
+DWORD CMIDISequencer::GetErrorCount() const
+{
+    return m_ErrorCount.load(std::memory_order_relaxed);
+}
+
+
+// Determines if the sequencer is playing
+bool CMIDISequencer::IsRunning() const
+{
+    return m_Running;
+}
+
+
+// Puts an event in the wheel
+void CMIDISequencer::Insert(CEvent *Event)
+{
+    DWORD Now = m_Now.load(std::memory_order_relaxed);
+
+    // Events that are late go out with the next millisecond
+    if(Event->Time < Now)
+    {
+        Event->Time = Now;
+    }
+
+    // The highest bit that differs from the current time picks the
+    // level: an event in the same 256 ms as now goes in level zero,
+    // one in the same 65536 ms in level one, and so on
+    DWORD Diff = Event->Time ^ Now;
+    int Level = 0;
+
+    while(Level < LEVEL_COUNT - 1 &&
+          (Diff >> ((Level + 1) * SLOT_BITS)) != 0)
+    {
+        Level++;
+    }
+
+    CSlot &Slot = m_Wheel[Level][(Event->Time >> (Level * SLOT_BITS)) &
+                                 (SLOT_COUNT - 1)];
+
+    // Add to the end of the list to keep events in order
+    Event->Next = NULL;
+
+    if(Slot.Tail != NULL)
+    {
+        Slot.Tail->Next = Event;
+    }
+    else
+    {
+        Slot.Head = Event;
+    }
+
+    Slot.Tail = Event;
+}
+
+
+// Moves the events of the current slot of a level down
+void CMIDISequencer::Cascade(int Level)
+{
+    DWORD Now = m_Now.load(std::memory_order_relaxed);
+    CSlot &Slot = m_Wheel[Level][(Now >> (Level * SLOT_BITS)) &
+                                 (SLOT_COUNT - 1)];
+
+    CEvent *Event = Slot.Head;
+
+    Slot.Head = NULL;
+    Slot.Tail = NULL;
+
+    // The events are now close enough to go in lower levels. They are
+    // added in order, and before anything else is scheduled for that
+    // span of time, so the order of events is kept.
+    while(Event != NULL)
+    {
+        CEvent *Next = Event->Next;
+
+        Insert(Event);
+        Event = Next;
+    }
+}
+
+
+// Takes the events due now out of the wheel
+CMIDISequencer::CEvent *CMIDISequencer::Advance()
+{
+    DWORD Now = m_Now.load(std::memory_order_relaxed);
+    CSlot &Slot = m_Wheel[0][Now & (SLOT_COUNT - 1)];
+
+    CEvent *Due = Slot.Head;
+
+    Slot.Head = NULL;
+    Slot.Tail = NULL;
+
+    Now++;
+    m_Now.store(Now, std::memory_order_relaxed);
+
+    // When a level wraps around, bring the next slot of the level
+    // above down, starting from the top so that events fall all the
+    // way to where they belong
+    if((Now & (SLOT_COUNT - 1)) == 0)
+    {
+        int Top = 1;
+
+        while(Top < LEVEL_COUNT - 1 &&
+              ((Now >> (Top * SLOT_BITS)) & (SLOT_COUNT - 1)) == 0)
+        {
+            Top++;
+        }
+
+        for(int Level = Top; Level > 0; Level--)
+        {
+            Cascade(Level);
+        }
+    }
+
+    return Due;
+}
+
+
+// Gives a list of events back to the pool
+void CMIDISequencer::Release(CEvent *First, CEvent *Last,
+                             std::size_t Count)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    Last->Next = m_FreeEvents;
+    m_FreeEvents = First;
+    m_EventCount -= Count;
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Sends a list of events
+void CMIDISequencer::Send(CEvent *Events)
+{
+    CEvent *Last = NULL;
+    std::size_t Count = 0;
+
+    // Gather the messages for each output
+    for(CEvent *Event = Events; Event != NULL; Event = Event->Next)
+    {
+        COutput &Output = m_Outputs[Event->Output];
+
+        Output.Batch[Output.Count] = Event->Msg;
+        Output.Count++;
+
+        if(Output.Count == BATCH_SIZE)
+        {
+            Flush(Output);
+        }
+
+        Last = Event;
+        Count++;
+    }
+
+    if(Count > 0)
+    {
+        for(std::size_t i = 0; i < m_OutputCount; i++)
+        {
+            if(m_Outputs[i].Count > 0)
+            {
+                Flush(m_Outputs[i]);
+            }
+        }
+
+        Release(Events, Last, Count);
+    }
+}
+
+
+// Sends the messages gathered for an output
+void CMIDISequencer::Flush(COutput &Output)
+{
+    try
+    {
+        Output.Device->SendMsgs(Output.Batch, Output.Count);
+    }
+    // If the device reported an error, count the messages as lost;
+    // there is no one to throw to on this thread
+    catch(const CMIDIOutException &)
+    {
+        m_ErrorCount.fetch_add(static_cast<DWORD>(Output.Count),
+                               std::memory_order_relaxed);
+    }
+
+    Output.Count = 0;
+}
+
+
+// Plays the events due up to the current time
+void CMIDISequencer::Play()
+{
+    DWORD Target = ::timeGetTime() - m_StartTime;
+
+    // Catch up on every millisecond up to now, in case the thread was
+    // held up
+    while(m_Running &&
+          static_cast<LONG>(Target - m_Now.load(
+                                    std::memory_order_relaxed)) >= 0)
+    {
+        ::EnterCriticalSection(&m_Lock);
+
+        CEvent *Due = Advance();
+
+        ::LeaveCriticalSection(&m_Lock);
+
+        Send(Due);
+    }
+}
+
+
+// Sequencer thread
+DWORD CMIDISequencer::SequencerProc(LPVOID Parameter)
+{
+    CMIDISequencer *Sequencer;
+
+    Sequencer = reinterpret_cast<CMIDISequencer *>(Parameter);
+
+    // Continue while the sequencer is playing
+    while(Sequencer->m_Running)
+    {
+        ::WaitForSingleObject(Sequencer->m_Event, INFINITE);
+
+        Sequencer->Play();
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,285 @@
+#ifndef MIDI_SEQUENCER_H
+#define MIDI_SEQUENCER_H
+
+
+/*********************************************************************
+ * MIDISequencer.h - Interface for CMIDISequencer and related classes.
+ *
+ * Note: You must link to the winmm.lib to use these classes.
+ ********************************************************************/
+
+
+#pragma warning(disable:4786) // Disable annoying template warnings
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+#include <mmsystem.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+
+// Necessary for the state shared with the sequencer thread
+#include <atomic>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for CMIDIOutDevice
+#include "MIDIOutDevice.h"
+
+// Necessary for CTimedMsg
+#include "midi.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDISequencer exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when memory allocation fails within a CMIDISequencer
+    // object
+    class CMIDISequencerMemFailure : public std::bad_alloc
+    {
+    public:
+        const char *what() const throw()
+        { return "Memory allocation within a CMIDISequencer object "
+                 "failed."; }
+    };
+
+
+    // Thrown when a CMIDISequencer has no room for another event or
+    // output
+    class CMIDISequencerFull : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "CMIDISequencer object has no room for any more "
+                 "events or outputs."; }
+    };
+
+
+    // Thrown when an event is scheduled for an output that was never
+    // added to a CMIDISequencer
+    class CMIDISequencerBadOutput : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "No such output in CMIDISequencer object."; }
+    };
+
+
+    // Thrown when an output is added to a CMIDISequencer while it is
+    // playing
+    class CMIDISequencerRunning : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Outputs cannot be added to a CMIDISequencer object "
+                 "while it is playing."; }
+    };
+
+
+    // Thrown when a CMIDISequencer is unable to create a signalling
+    // event
+    class CMIDISequencerEventFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to create a signalling event for "
+                 "CMIDISequencer object."; }
+    };
+
+
+    // Thrown when a CMIDISequencer is unable to start its timer or
+    // thread
+    class CMIDISequencerThreadFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to start timer or worker thread for "
+                 "CMIDISequencer object."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDISequencer
+    //
+    // Sends short messages to one or more CMIDIOutDevice objects at
+    // scheduled times. Times are in milliseconds from the start of
+    // the sequence.
+    //
+    // Events are kept in a hierarchical timer wheel: four levels of
+    // 256 slots, covering 256 ms, 65 s, 4.6 hours and 49 days. Adding
+    // an event and sending it both take constant time, however many
+    // events are waiting. Events come from a pool allocated at
+    // construction, so nothing is allocated while playing.
+    //
+    // A multimedia timer wakes a time critical thread every
+    // millisecond. Each time, the events that have become due are
+    // sent in one batch per output using CMIDIOutDevice::SendMsgs.
+    // Events due at the same time on the same output are sent in
+    // the order they were scheduled.
+    //----------------------------------------------------------------
+
+
+    class CMIDISequencer
+    {
+    public:
+        // Default number of events that can be waiting at once
+        enum { DEFAULT_CAPACITY = 65536 };
+
+        // Largest number of outputs
+        enum { MAX_OUTPUTS = 16 };
+
+        // Construction. Capacity is the number of events that can be
+        // waiting at once.
+        explicit CMIDISequencer(std::size_t Capacity = DEFAULT_CAPACITY);
+
+        // Destruction
+        ~CMIDISequencer();
+
+        // Adds an output device and returns its number, for passing
+        // to ScheduleMsg. The device must outlive the sequencer, and
+        // should be open before playback starts. Only while stopped,
+        // since the playback thread reads the outputs without the
+        // lock.
+        std::size_t AddOutput(CMIDIOutDevice &Device);
+
+        // Schedules a short message to be sent to an output Time
+        // milliseconds after the start of the sequence. Messages
+        // scheduled for times that have passed are sent straight
+        // away.
+        void ScheduleMsg(DWORD Time, DWORD Msg, std::size_t Output = 0);
+
+        // Schedules Count short messages, using their time stamps as
+        // times. If the sequencer fills up part way through, the
+        // messages before that stay scheduled.
+        void ScheduleMsgs(const CTimedMsg *Msgs, std::size_t Count,
+                          std::size_t Output = 0);
+
+        // Starts or resumes playback from the current time
+        void Start();
+
+        // Pauses playback. Waiting events stay scheduled.
+        void Stop();
+
+        // Throws away every waiting event and goes back to time zero.
+        // Only while stopped.
+        void Clear();
+
+        // Gets the current time in milliseconds
+        DWORD GetTime() const;
+
+        // Gets the number of events waiting to be sent
+        std::size_t GetEventCount() const;
+
+        // Gets the number of events that can still be scheduled
+        std::size_t GetFreeCount() const;
+
+        // Gets the number of messages that could not be sent because
+        // an output reported an error
+        DWORD GetErrorCount() const;
+
+        // Returns true if the sequencer is playing
+        bool IsRunning() const;
+
+    // Private class declarations
+    private:
+        enum { LEVEL_COUNT = 4,
+               SLOT_BITS   = 8,
+               SLOT_COUNT  = 1 << SLOT_BITS,
+               BATCH_SIZE  = 256 };
+
+        // A scheduled message
+        struct CEvent
+        {
+            DWORD   Time;
+            DWORD   Msg;
+            DWORD   Output;
+            CEvent *Next;
+        };
+
+        // A list of events, in the order they were added
+        struct CSlot
+        {
+            CEvent *Head;
+            CEvent *Tail;
+        };
+
+        // Messages gathered for an output during one tick
+        struct COutput
+        {
+            CMIDIOutDevice *Device;
+            DWORD           Batch[BATCH_SIZE];
+            std::size_t     Count;
+        };
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDISequencer(const CMIDISequencer &);
+        CMIDISequencer &operator = (const CMIDISequencer &);
+
+        // Puts an event in the wheel slot for its time
+        void Insert(CEvent *Event);
+
+        // Moves the events of the current slot of a level down to the
+        // levels below
+        void Cascade(int Level);
+
+        // Takes the events due at the current time out of the wheel
+        // and moves on to the next millisecond. Returns the events.
+        CEvent *Advance();
+
+        // Gives a list of events back to the pool
+        void Release(CEvent *First, CEvent *Last, std::size_t Count);
+
+        // Sends a list of events and gives them back to the pool
+        void Send(CEvent *Events);
+
+        // Sends the messages gathered for an output
+        void Flush(COutput &Output);
+
+        // Plays the events due up to the current time
+        void Play();
+
+        // Thread function
+        static DWORD WINAPI SequencerProc(LPVOID Parameter);
+
+    // Private attributes and constants
+    private:
+        // Guards the wheel and the pool
+        mutable CRITICAL_SECTION m_Lock;
+
+        CSlot       m_Wheel[LEVEL_COUNT][SLOT_COUNT];
+        CEvent     *m_Events;
+        CEvent     *m_FreeEvents;
+        std::size_t m_EventCount;
+        std::size_t m_Capacity;
+
+        COutput     m_Outputs[MAX_OUTPUTS];
+        std::size_t m_OutputCount;
+
+        // The next millisecond to play, and timeGetTime at time zero
+        std::atomic<DWORD> m_Now;
+        DWORD              m_StartTime;
+
+        std::atomic<DWORD> m_ErrorCount;
+
+        HANDLE             m_Event;
+        HANDLE             m_Thread;
+        UINT               m_TimerId;
+        std::atomic<bool>  m_Running;
+    };
+}
+
+
+#endif
\ No newline at end of file
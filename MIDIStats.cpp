@@ -0,0 +1,297 @@
+/*********************************************************************
+ * MIDIStats.cpp - Implementation for CMIDIStats and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIStats.h"
+#include "MIDIParser.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIStats;
+using midi::CMIDIStatsSnapshot;
+using midi::CMIDIParser;
+
+
+//--------------------------------------------------------------------
+// CMIDIStatsSnapshot implementation
+//--------------------------------------------------------------------
+
+
+namespace
+{
+    // Asks for the QueryPerformanceCounter frequency
+    LONGLONG QueryFrequency()
+    {
+        LARGE_INTEGER Frequency;
+
+        ::QueryPerformanceFrequency(&Frequency);
+
+        return Frequency.QuadPart;
+    }
+
+
+    // Gets the QueryPerformanceCounter frequency. It is fixed at
+    // boot, so it is only asked for once.
+    LONGLONG GetFrequency()
+    {
+        static const LONGLONG Frequency = QueryFrequency();
+
+        return Frequency;
+    }
+
+
+    // Gets the number of seconds between two snapshots
+    double GetSeconds(const CMIDIStatsSnapshot &Earlier,
+                      const CMIDIStatsSnapshot &Later)
+    {
+        return static_cast<double>(Later.Counter - Earlier.Counter) /
+               static_cast<double>(GetFrequency());
+    }
+}
+
+
+// Gets the number of messages per second
+double CMIDIStatsSnapshot::GetMsgRate(
+                               const CMIDIStatsSnapshot &Earlier) const
+{
+    double Seconds = GetSeconds(Earlier, *this);
+
+    // Counts wrap around, so the difference is still right
+    return (Seconds > 0) ? (MsgCount - Earlier.MsgCount) / Seconds : 0;
+}
+
+
+// Gets the number of bytes per second
+double CMIDIStatsSnapshot::GetByteRate(
+                               const CMIDIStatsSnapshot &Earlier) const
+{
+    double Seconds = GetSeconds(Earlier, *this);
+
+    return (Seconds > 0) ? (ByteCount - Earlier.ByteCount) / Seconds : 0;
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIStats implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIStats::CMIDIStats() :
+m_Enabled(false)
+{
+    Reset();
+}
+
+
+// Turns counting on or off
+void CMIDIStats::Enable(bool Enable)
+{
+    m_Enabled.store(Enable, std::memory_order_relaxed);
+}
+
+
+// Sets every count back to zero
+void CMIDIStats::Reset()
+{
+    m_MsgCount.store(0, std::memory_order_relaxed);
+    m_ByteCount.store(0, std::memory_order_relaxed);
+    m_ErrorCount.store(0, std::memory_order_relaxed);
+    m_LongErrorCount.store(0, std::memory_order_relaxed);
+    m_DroppedCount.store(0, std::memory_order_relaxed);
+    m_HeaderAllocCount.store(0, std::memory_order_relaxed);
+    m_PooledHeaderCount.store(0, std::memory_order_relaxed);
+    m_PeakQueueDepth.store(0, std::memory_order_relaxed);
+
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        m_ShortMsgTimes[i].store(0, std::memory_order_relaxed);
+        m_LongMsgTimes[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+
+// Copies the counts
+void CMIDIStats::GetSnapshot(midi::CMIDIStatsSnapshot &Snapshot) const
+{
+    Snapshot.Counter = GetCounter();
+
+    // The counts are read one at a time, so a snapshot taken while
+    // messages are flowing may be off by a message or two between
+    // counts
+    Snapshot.MsgCount = m_MsgCount.load(std::memory_order_relaxed);
+    Snapshot.ByteCount = m_ByteCount.load(std::memory_order_relaxed);
+    Snapshot.ErrorCount = m_ErrorCount.load(std::memory_order_relaxed);
+    Snapshot.LongErrorCount =
+                      m_LongErrorCount.load(std::memory_order_relaxed);
+    Snapshot.DroppedCount =
+                        m_DroppedCount.load(std::memory_order_relaxed);
+    Snapshot.HeaderAllocCount =
+                    m_HeaderAllocCount.load(std::memory_order_relaxed);
+    Snapshot.PooledHeaderCount =
+                   m_PooledHeaderCount.load(std::memory_order_relaxed);
+    Snapshot.PeakQueueDepth =
+                      m_PeakQueueDepth.load(std::memory_order_relaxed);
+
+    for(int i = 0; i < BUCKET_COUNT; i++)
+    {
+        Snapshot.ShortMsgTimes[i] =
+                      m_ShortMsgTimes[i].load(std::memory_order_relaxed);
+        Snapshot.LongMsgTimes[i] =
+                       m_LongMsgTimes[i].load(std::memory_order_relaxed);
+    }
+}
+
+
+// Counts a short message
+void CMIDIStats::AddShortMsg(DWORD Msg)
+{
+    if(IsEnabled())
+    {
+        unsigned char Status = static_cast<unsigned char>(Msg);
+
+        Increment(m_MsgCount);
+        m_ByteCount.fetch_add(1 + CMIDIParser::GetDataLength(Status),
+                              std::memory_order_relaxed);
+    }
+}
+
+
+// Counts a long message
+void CMIDIStats::AddLongMsg(DWORD Length)
+{
+    if(IsEnabled())
+    {
+        Increment(m_MsgCount);
+        m_ByteCount.fetch_add(Length, std::memory_order_relaxed);
+    }
+}
+
+
+// Counts the time taken by a call handling short messages
+void CMIDIStats::AddShortMsgTime(LONGLONG Ticks)
+{
+    if(IsEnabled())
+    {
+        AddTime(m_ShortMsgTimes, Ticks);
+    }
+}
+
+
+// Counts the time taken by a call handling long messages
+void CMIDIStats::AddLongMsgTime(LONGLONG Ticks)
+{
+    if(IsEnabled())
+    {
+        AddTime(m_LongMsgTimes, Ticks);
+    }
+}
+
+
+// Counts a failed short message
+void CMIDIStats::AddError()
+{
+    if(IsEnabled())
+    {
+        Increment(m_ErrorCount);
+    }
+}
+
+
+// Counts a failed long message
+void CMIDIStats::AddLongError()
+{
+    if(IsEnabled())
+    {
+        Increment(m_LongErrorCount);
+    }
+}
+
+
+// Counts a dropped message
+void CMIDIStats::AddDropped()
+{
+    if(IsEnabled())
+    {
+        Increment(m_DroppedCount);
+    }
+}
+
+
+// Counts an allocated header
+void CMIDIStats::AddHeaderAlloc()
+{
+    if(IsEnabled())
+    {
+        Increment(m_HeaderAllocCount);
+    }
+}
+
+
+// Counts headers taken from a pool
+void CMIDIStats::AddPooledHeaders(DWORD Count)
+{
+    if(IsEnabled())
+    {
+        m_PooledHeaderCount.fetch_add(Count, std::memory_order_relaxed);
+    }
+}
+
+
+// Records the depth of a queue
+void CMIDIStats::AddQueueDepth(std::size_t Depth)
+{
+    if(IsEnabled())
+    {
+        DWORD Peak = m_PeakQueueDepth.load(std::memory_order_relaxed);
+
+        // Only ever raise the peak, even if another thread is raising
+        // it at the same time
+        while(Depth > Peak &&
+              !m_PeakQueueDepth.compare_exchange_weak(Peak,
+                                       static_cast<DWORD>(Depth),
+                                       std::memory_order_relaxed))
+        {
+        }
+    }
+}
+
+
+// Gets the current counter value
+LONGLONG CMIDIStats::GetCounter()
+{
+    LARGE_INTEGER Counter;
+
+    ::QueryPerformanceCounter(&Counter);
+
+    return Counter.QuadPart;
+}
+
+
+// Adds a time to a histogram
+void CMIDIStats::AddTime(std::atomic<DWORD> *Histogram, LONGLONG Ticks)
+{
+    LONGLONG MicroSeconds = (Ticks > 0) ?
+                            Ticks * 1000000 / GetFrequency() : 0;
+
+    // The bucket is the number of bits in the time
+    int Bucket = 0;
+
+    while(MicroSeconds > 0 && Bucket < BUCKET_COUNT - 1)
+    {
+        MicroSeconds >>= 1;
+        Bucket++;
+    }
+
+    Increment(Histogram[Bucket]);
+}
\ No newline at end of file
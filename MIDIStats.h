@@ -0,0 +1,171 @@
+#ifndef MIDI_STATS_H
+#define MIDI_STATS_H
+
+
+/*********************************************************************
+ * MIDIStats.h - Interface for CMIDIStats and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for the counters shared between threads
+#include <atomic>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIStatsSnapshot
+    //
+    // A copy of the statistics of a device at one moment. Counts
+    // wrap around, so rates should be worked out from the difference
+    // between two snapshots.
+    //
+    // The time histograms count calls by how long they took: bucket 0
+    // for under a microsecond, and bucket i for 2^(i-1) up to 2^i
+    // microseconds. The last bucket also counts anything longer.
+    //----------------------------------------------------------------
+
+
+    struct CMIDIStatsSnapshot
+    {
+        enum { BUCKET_COUNT = 24 };
+
+        // QueryPerformanceCounter value when the snapshot was taken
+        LONGLONG Counter;
+
+        // Messages and bytes sent or received
+        DWORD MsgCount;
+        DWORD ByteCount;
+
+        // Failed short and long messages: for input devices, MIM_ERROR
+        // and MIM_LONGERROR; for output devices, calls that failed
+        DWORD ErrorCount;
+        DWORD LongErrorCount;
+
+        // Messages dropped because a queue was full
+        DWORD DroppedCount;
+
+        // Headers allocated for long messages, and long messages that
+        // used a header from a pool instead
+        DWORD HeaderAllocCount;
+        DWORD PooledHeaderCount;
+
+        // Largest number of entries seen in the dispatch queue of an
+        // input device, or the header queue of an output device
+        DWORD PeakQueueDepth;
+
+        // For output devices, how long midiOutShortMsg and
+        // midiOutLongMsg took. For input devices, how long the
+        // receiver took with short and long messages.
+        DWORD ShortMsgTimes[BUCKET_COUNT];
+        DWORD LongMsgTimes[BUCKET_COUNT];
+
+        // Gets the number of messages per second since an earlier
+        // snapshot
+        double GetMsgRate(const CMIDIStatsSnapshot &Earlier) const;
+
+        // Gets the number of bytes per second since an earlier
+        // snapshot
+        double GetByteRate(const CMIDIStatsSnapshot &Earlier) const;
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIStats
+    //
+    // Statistics kept by a device. Nothing is counted until the
+    // statistics are turned on. Every counter is updated with
+    // relaxed atomic operations, so any thread may add to them and
+    // take snapshots without locking.
+    //----------------------------------------------------------------
+
+
+    class CMIDIStats
+    {
+    public:
+        enum { BUCKET_COUNT = CMIDIStatsSnapshot::BUCKET_COUNT };
+
+        CMIDIStats();
+
+        // Turns counting on or off
+        void Enable(bool Enable);
+
+        // Returns true if counting
+        bool IsEnabled() const
+        { return m_Enabled.load(std::memory_order_relaxed); }
+
+        // Sets every count back to zero
+        void Reset();
+
+        // Copies the counts
+        void GetSnapshot(CMIDIStatsSnapshot &Snapshot) const;
+
+        // Counts messages
+        void AddShortMsg(DWORD Msg);
+        void AddLongMsg(DWORD Length);
+
+        // Counts how long a call handling messages took, in counter
+        // ticks
+        void AddShortMsgTime(LONGLONG Ticks);
+        void AddLongMsgTime(LONGLONG Ticks);
+
+        // Counts failures
+        void AddError();
+        void AddLongError();
+        void AddDropped();
+
+        // Counts where the header for a long message came from
+        void AddHeaderAlloc();
+        void AddPooledHeaders(DWORD Count);
+
+        // Records the depth of a queue, keeping the largest
+        void AddQueueDepth(std::size_t Depth);
+
+        // Gets the current counter value
+        static LONGLONG GetCounter();
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIStats(const CMIDIStats &);
+        CMIDIStats &operator = (const CMIDIStats &);
+
+        // Adds a time to a histogram
+        static void AddTime(std::atomic<DWORD> *Histogram,
+                            LONGLONG Ticks);
+
+        // Adds one to a counter
+        static void Increment(std::atomic<DWORD> &Counter)
+        { Counter.fetch_add(1, std::memory_order_relaxed); }
+
+    // Private attributes and constants
+    private:
+        std::atomic<bool>  m_Enabled;
+
+        std::atomic<DWORD> m_MsgCount;
+        std::atomic<DWORD> m_ByteCount;
+        std::atomic<DWORD> m_ErrorCount;
+        std::atomic<DWORD> m_LongErrorCount;
+        std::atomic<DWORD> m_DroppedCount;
+        std::atomic<DWORD> m_HeaderAllocCount;
+        std::atomic<DWORD> m_PooledHeaderCount;
+        std::atomic<DWORD> m_PeakQueueDepth;
+
+        std::atomic<DWORD> m_ShortMsgTimes[BUCKET_COUNT];
+        std::atomic<DWORD> m_LongMsgTimes[BUCKET_COUNT];
+    };
+}
+
+
+#endif
\ No newline at end of file
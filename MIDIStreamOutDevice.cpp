@@ -0,0 +1,693 @@
+/*********************************************************************
+ * MIDIStreamOutDevice.cpp - Implementation for CMIDIStreamOutDevice
+ *                           and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIStreamOutDevice.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIStreamOutDevice;
+using midi::CMIDIOutException;
+using midi::CMIDIOutMemFailure;
+using midi::CMIDIOutEventFailure;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Number of DWORDs taken up by a short MIDIEVENT: delta time, stream
+// ID and event
+const DWORD SHORT_EVENT_SIZE = 3;
+
+
+//--------------------------------------------------------------------
+// CMIDIStreamHeader implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIStreamOutDevice::CMIDIStreamHeader::CMIDIStreamHeader(
+                                                HMIDISTRM DevHandle,
+                                                DWORD EventCount) :
+m_DevHandle(DevHandle),
+m_Events(new DWORD[EventCount * SHORT_EVENT_SIZE]),
+m_EventCount(EventCount),
+m_Used(0)
+{
+    // Initialize header
+    m_MIDIHdr.lpData          = reinterpret_cast<LPSTR>(m_Events);
+    m_MIDIHdr.dwBufferLength  = EventCount * SHORT_EVENT_SIZE *
+                                sizeof(DWORD);
+    m_MIDIHdr.dwBytesRecorded = 0;
+    m_MIDIHdr.dwFlags         = 0;
+
+    // Prepare header
+    MMRESULT Result = ::midiOutPrepareHeader(
+                                reinterpret_cast<HMIDIOUT>(DevHandle),
+                                &m_MIDIHdr, sizeof m_MIDIHdr);
+
+    // If an error occurred, release the buffer and throw exception
+    if(Result != MMSYSERR_NOERROR)
+    {
+        delete [] m_Events;
+        throw CMIDIOutException(Result);
+    }
+}
+
+
+// Destructor
+CMIDIStreamOutDevice::CMIDIStreamHeader::~CMIDIStreamHeader()
+{
+    ::midiOutUnprepareHeader(reinterpret_cast<HMIDIOUT>(m_DevHandle),
+                             &m_MIDIHdr, sizeof m_MIDIHdr);
+
+    delete [] m_Events;
+}
+
+
+// Empties the buffer
+void CMIDIStreamOutDevice::CMIDIStreamHeader::Clear()
+{
+    m_Used = 0;
+}
+
+
+// Adds a short message event to the buffer
+bool CMIDIStreamOutDevice::CMIDIStreamHeader::AddEvent(DWORD DeltaTime,
+                                                       DWORD Msg)
+{
+    // If the buffer is full, the event cannot be added
+    if(m_Used == m_EventCount)
+    {
+        return false;
+    }
+
+    DWORD *Event = m_Events + m_Used * SHORT_EVENT_SIZE;
+
+    Event[0] = DeltaTime;
+    Event[1] = 0;
+    Event[2] = (static_cast<DWORD>(MEVT_SHORTMSG) << 24) |
+               (Msg & 0x00FFFFFF);
+
+    m_Used++;
+
+    return true;
+}
+
+
+// Determines if the buffer is empty
+bool CMIDIStreamOutDevice::CMIDIStreamHeader::IsEmpty() const
+{
+    return (m_Used == 0);
+}
+
+
+// Hands the buffer to the driver
+void CMIDIStreamOutDevice::CMIDIStreamHeader::StreamOut()
+{
+    m_MIDIHdr.dwBytesRecorded = m_Used * SHORT_EVENT_SIZE *
+                                sizeof(DWORD);
+
+    MMRESULT Result = ::midiStreamOut(m_DevHandle, &m_MIDIHdr,
+                                      sizeof m_MIDIHdr);
+
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIOutException(Result);
+    }
+}
+
+
+// Determines if the device is finished with the header
+bool CMIDIStreamOutDevice::CMIDIStreamHeader::IsDone() const
+{
+    return ((m_MIDIHdr.dwFlags & MHDR_DONE) == MHDR_DONE);
+}
+
+
+//--------------------------------------------------------------------
+// CMIDIStreamOutDevice implementation
+//--------------------------------------------------------------------
+
+
+// Constructs CMIDIStreamOutDevice object in a closed state
+CMIDIStreamOutDevice::CMIDIStreamOutDevice(DWORD BufferCount,
+                                           DWORD BufferEvents) :
+m_Event(NULL),
+m_FreeEvent(NULL),
+m_Worker(NULL),
+m_ActiveWorker(NULL),
+m_Headers(NULL),
+m_HeaderCount(BufferCount),
+m_BufferEvents(BufferEvents),
+m_Current(NULL),
+m_LastTime(0),
+m_TimeDiv(DEFAULT_TIME_DIV),
+m_Tempo(DEFAULT_TEMPO),
+m_FreeHeaders(BufferCount),
+m_QueuedHeaders(BufferCount),
+m_SenderCount(0),
+m_State(CLOSED)
+{
+    // Keep buffers within the size midiStreamOut accepts
+    if(m_BufferEvents == 0)
+    {
+        m_BufferEvents = 1;
+    }
+    else if(m_BufferEvents > MAX_BUFFER_EVENTS)
+    {
+        m_BufferEvents = MAX_BUFFER_EVENTS;
+    }
+
+    // If we are unable to create signalling events, throw exception
+    if(!CreateEvents())
+    {
+        throw CMIDIOutEventFailure();
+    }
+}
+
+
+// Destruction
+CMIDIStreamOutDevice::~CMIDIStreamOutDevice()
+{
+    // Close device
+    Close();
+
+    // Close handles to signalling events
+    ::CloseHandle(m_Event);
+    ::CloseHandle(m_FreeEvent);
+}
+
+
+// Opens the MIDI output device as a stream
+void CMIDIStreamOutDevice::Open(UINT DeviceId)
+{
+    // Makes sure the previous device, if any, is closed before
+    // opening another one
+    Close();
+
+    // Open MIDI output stream
+    MMRESULT Result = ::midiStreamOpen(&m_DevHandle, &DeviceId, 1,
+                                 reinterpret_cast<DWORD>(MidiOutProc),
+                                 reinterpret_cast<DWORD>(this),
+                                 CALLBACK_FUNCTION);
+
+    // If opening failed, throw exception
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIOutException(Result);
+    }
+
+    try
+    {
+        CreateHeaders();
+
+        MIDIPROPTIMEDIV TimeDiv = { sizeof TimeDiv, m_TimeDiv };
+        MIDIPROPTEMPO Tempo = { sizeof Tempo, m_Tempo };
+
+        SetProperty(MIDIPROP_TIMEDIV,
+                    reinterpret_cast<LPBYTE>(&TimeDiv));
+        SetProperty(MIDIPROP_TEMPO, reinterpret_cast<LPBYTE>(&Tempo));
+    }
+    // If memory allocation failed, close the device and throw
+    // exception
+    catch(const std::bad_alloc &)
+    {
+        DestroyHeaders();
+        ::midiStreamClose(m_DevHandle);
+        throw CMIDIOutMemFailure();
+    }
+    // If preparing a header or setting a property failed, close the
+    // device and rethrow exception
+    catch(const CMIDIOutException &)
+    {
+        DestroyHeaders();
+        ::midiStreamClose(m_DevHandle);
+        throw;
+    }
+
+    m_ActiveWorker = (m_Worker != NULL) ? m_Worker : &m_OwnWorker;
+
+    try
+    {
+        // Have the worker thread manage our headers
+        m_ActiveWorker->Add(m_Event, HeaderProc, this);
+    }
+    // If the worker could not take the device, close the device and
+    // rethrow exception
+    catch(...)
+    {
+        DestroyHeaders();
+        ::midiStreamClose(m_DevHandle);
+        throw;
+    }
+
+    // Change state
+    m_State = OPENED;
+    m_LastTime = 0;
+}
+
+
+// Closes the MIDI output device
+void CMIDIStreamOutDevice::Close()
+{
+    // Only close an already opened device
+    if(m_State == OPENED)
+    {
+        // Change state
+        m_State = CLOSED;
+
+        // Wait for the sending thread, if any, to give up. It may be
+        // waiting for a free buffer, so keep waking it up. Once it is
+        // gone, nothing else will be handed to the driver.
+        while(m_SenderCount.load() != 0)
+        {
+            ::SetEvent(m_FreeEvent);
+            ::SwitchToThread();
+        }
+
+        // Return all buffers the device is still using
+        ::midiStreamStop(m_DevHandle);
+
+        // Take the device away from the worker thread. Once this
+        // returns, the worker is finished with the headers.
+        m_ActiveWorker->Remove(m_Event);
+        m_ActiveWorker = NULL;
+
+        // We're finished with the headers
+        DestroyHeaders();
+
+        // Close the MIDI output stream
+        ::midiStreamClose(m_DevHandle);
+    }
+}
+
+
+// Starts or resumes playback
+void CMIDIStreamOutDevice::Start()
+{
+    if(m_State == OPENED)
+    {
+        MMRESULT Result = ::midiStreamRestart(m_DevHandle);
+
+        if(Result != MMSYSERR_NOERROR)
+        {
+            throw CMIDIOutException(Result);
+        }
+    }
+}
+
+
+// Pauses playback
+void CMIDIStreamOutDevice::Pause()
+{
+    if(m_State == OPENED)
+    {
+        MMRESULT Result = ::midiStreamPause(m_DevHandle);
+
+        if(Result != MMSYSERR_NOERROR)
+        {
+            throw CMIDIOutException(Result);
+        }
+    }
+}
+
+
+// Stops playback
+void CMIDIStreamOutDevice::Stop()
+{
+    if(m_State == OPENED)
+    {
+        // The device returns every queued buffer once stopped
+        MMRESULT Result = ::midiStreamStop(m_DevHandle);
+
+        if(Result != MMSYSERR_NOERROR)
+        {
+            throw CMIDIOutException(Result);
+        }
+
+        // The stream position goes back to zero, so events in the
+        // buffer being filled are out of date
+        m_LastTime = 0;
+
+        if(m_Current != NULL)
+        {
+            m_Current->Clear();
+        }
+    }
+}
+
+
+// Sets the number of ticks per quarter note
+void CMIDIStreamOutDevice::SetTimeDiv(DWORD TimeDiv)
+{
+    m_TimeDiv = TimeDiv;
+
+    if(m_State == OPENED)
+    {
+        MIDIPROPTIMEDIV Prop = { sizeof Prop, TimeDiv };
+
+        SetProperty(MIDIPROP_TIMEDIV, reinterpret_cast<LPBYTE>(&Prop));
+    }
+}
+
+
+// Sets the number of microseconds per quarter note
+void CMIDIStreamOutDevice::SetTempo(DWORD Tempo)
+{
+    m_Tempo = Tempo;
+
+    if(m_State == OPENED)
+    {
+        MIDIPROPTEMPO Prop = { sizeof Prop, Tempo };
+
+        SetProperty(MIDIPROP_TEMPO, reinterpret_cast<LPBYTE>(&Prop));
+    }
+}
+
+
+// Sends short message straight away
+void CMIDIStreamOutDevice::SendMsg(DWORD Msg)
+{
+    if(m_State == OPENED)
+    {
+        MMRESULT Result = ::midiOutShortMsg(
+                              reinterpret_cast<HMIDIOUT>(m_DevHandle),
+                              Msg);
+
+        if(Result != MMSYSERR_NOERROR)
+        {
+            throw CMIDIOutException(Result);
+        }
+    }
+}
+
+
+// Queues short messages to be played together
+void CMIDIStreamOutDevice::SendMsgs(const DWORD *Msgs,
+                                    std::size_t Count)
+{
+    // Let Close know the headers are in use
+    m_SenderCount.fetch_add(1);
+
+    try
+    {
+        for(std::size_t i = 0; i < Count && m_State == OPENED; i++)
+        {
+            QueueEvent(0, Msgs[i]);
+        }
+
+        Flush();
+    }
+    catch(...)
+    {
+        m_SenderCount.fetch_sub(1);
+        throw;
+    }
+
+    m_SenderCount.fetch_sub(1);
+}
+
+
+// Queues time stamped short messages
+void CMIDIStreamOutDevice::SendMsgs(const midi::CTimedMsg *Msgs,
+                                    std::size_t Count)
+{
+    // Let Close know the headers are in use
+    m_SenderCount.fetch_add(1);
+
+    try
+    {
+        for(std::size_t i = 0; i < Count && m_State == OPENED; i++)
+        {
+            DWORD DeltaTime = 0;
+
+            // Events out of order are played as soon as possible
+            if(Msgs[i].TimeStamp > m_LastTime)
+            {
+                DeltaTime = Msgs[i].TimeStamp - m_LastTime;
+                m_LastTime = Msgs[i].TimeStamp;
+            }
+
+            QueueEvent(DeltaTime, Msgs[i].Msg);
+        }
+
+        Flush();
+    }
+    catch(...)
+    {
+        m_SenderCount.fetch_sub(1);
+        throw;
+    }
+
+    m_SenderCount.fetch_sub(1);
+}
+
+
+// Gets the current stream position in ticks
+DWORD CMIDIStreamOutDevice::GetPosition()
+{
+    MMTIME Time;
+
+    Time.wType = TIME_TICKS;
+    Time.u.ticks = 0;
+
+    if(m_State == OPENED)
+    {
+        MMRESULT Result = ::midiStreamPosition(m_DevHandle, &Time,
+                                               sizeof Time);
+
+        if(Result != MMSYSERR_NOERROR)
+        {
+            throw CMIDIOutException(Result);
+        }
+    }
+
+    return Time.u.ticks;
+}
+
+
+// Sets the worker used for managing headers
+void CMIDIStreamOutDevice::SetWorker(midi::CMIDIWorker *Worker)
+{
+    m_Worker = Worker;
+}
+
+
+// Determines if the MIDI output device is opened
+bool CMIDIStreamOutDevice::IsOpen() const
+{
+    return (m_State == OPENED);
+}
+
+
+// Creates events for signalling header thread and sending thread
+bool CMIDIStreamOutDevice::CreateEvents()
+{
+    m_Event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_FreeEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    // If event creation failed, record failure
+    if(m_Event == NULL || m_FreeEvent == NULL)
+    {
+        if(m_Event != NULL)
+        {
+            ::CloseHandle(m_Event);
+        }
+
+        if(m_FreeEvent != NULL)
+        {
+            ::CloseHandle(m_FreeEvent);
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+
+// Creates and prepares the buffers. They are reused for as long as
+// the device is open.
+void CMIDIStreamOutDevice::CreateHeaders()
+{
+    m_Headers = new CMIDIStreamHeader *[m_HeaderCount];
+
+    for(DWORD i = 0; i < m_HeaderCount; i++)
+    {
+        m_Headers[i] = NULL;
+    }
+
+    for(DWORD i = 0; i < m_HeaderCount; i++)
+    {
+        m_Headers[i] = new CMIDIStreamHeader(m_DevHandle,
+                                             m_BufferEvents);
+        m_FreeHeaders.Push(m_Headers[i]);
+    }
+}
+
+
+// Destroys the buffers. The device must be finished with all of them.
+void CMIDIStreamOutDevice::DestroyHeaders()
+{
+    CMIDIStreamHeader *Header;
+
+    while(m_FreeHeaders.Pop(Header))
+    {
+    }
+
+    while(m_QueuedHeaders.Pop(Header))
+    {
+    }
+
+    if(m_Headers != NULL)
+    {
+        for(DWORD i = 0; i < m_HeaderCount; i++)
+        {
+            delete m_Headers[i];
+        }
+
+        delete [] m_Headers;
+        m_Headers = NULL;
+    }
+
+    m_Current = NULL;
+}
+
+
+// Sets a stream property
+void CMIDIStreamOutDevice::SetProperty(DWORD Property, LPBYTE Data)
+{
+    MMRESULT Result = ::midiStreamProperty(m_DevHandle, Data,
+                                           MIDIPROP_SET | Property);
+
+    if(Result != MMSYSERR_NOERROR)
+    {
+        throw CMIDIOutException(Result);
+    }
+}
+
+
+// Queues a single event
+void CMIDIStreamOutDevice::QueueEvent(DWORD DeltaTime, DWORD Msg)
+{
+    // If the buffer being filled is full, hand it to the driver
+    if(m_Current != NULL && !m_Current->AddEvent(DeltaTime, Msg))
+    {
+        Flush();
+    }
+
+    // Get a free buffer, waiting for the driver to finish with one if
+    // necessary
+    while(m_Current == NULL)
+    {
+        // Give up if the device has been closed while we wait
+        if(m_State != OPENED)
+        {
+            return;
+        }
+
+        if(!m_FreeHeaders.Pop(m_Current))
+        {
+            ::WaitForSingleObject(m_FreeEvent, INFINITE);
+        }
+        else
+        {
+            m_Current->AddEvent(DeltaTime, Msg);
+        }
+    }
+}
+
+
+// Hands the buffer being filled to the driver
+void CMIDIStreamOutDevice::Flush()
+{
+    // Once the device is closing, nothing more goes to the driver
+    if(m_State == OPENED && m_Current != NULL &&
+       !m_Current->IsEmpty())
+    {
+        try
+        {
+            m_Current->StreamOut();
+        }
+        // If the driver refused the buffer, empty it and keep it for
+        // the next events
+        catch(const CMIDIOutException &)
+        {
+            m_Current->Clear();
+            throw;
+        }
+
+        CMIDIStreamHeader *Header = m_Current;
+
+        m_QueuedHeaders.Push(Header);
+        m_Current = NULL;
+
+        // If the device finished with the buffer before it was
+        // queued, make sure the header thread gets to it
+        if(Header->IsDone())
+        {
+            ::SetEvent(m_Event);
+        }
+    }
+}
+
+
+// Called by Windows when a MIDI output event occurs
+void CALLBACK CMIDIStreamOutDevice::MidiOutProc(HMIDIOUT MidiOut,
+                                                UINT Msg,
+                                                DWORD Instance,
+                                                DWORD Param1,
+                                                DWORD Param2)
+{
+    CMIDIStreamOutDevice *Device;
+
+    Device = reinterpret_cast<CMIDIStreamOutDevice *>(Instance);
+
+    if(Msg == MOM_DONE)
+    {
+        ::SetEvent(Device->m_Event);
+    }
+}
+
+
+// Manages headers on the worker thread
+void CMIDIStreamOutDevice::HeaderProc(void *Parameter)
+{
+    CMIDIStreamOutDevice *Device;
+
+    Device = reinterpret_cast<CMIDIStreamOutDevice *>(Parameter);
+
+    CMIDIStreamHeader **Header = Device->m_QueuedHeaders.Front();
+    bool Freed = false;
+
+    // Give finished buffers back to the sending thread, in the order
+    // they were queued
+    while(Header != NULL && (*Header)->IsDone())
+    {
+        (*Header)->Clear();
+        Device->m_FreeHeaders.Push(*Header);
+        Device->m_QueuedHeaders.PopFront();
+        Freed = true;
+
+        Header = Device->m_QueuedHeaders.Front();
+    }
+
+    if(Freed)
+    {
+        ::SetEvent(Device->m_FreeEvent);
+    }
+}
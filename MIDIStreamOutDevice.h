@@ -0,0 +1,244 @@
+#ifndef MIDI_STREAM_OUT_DEVICE_H
+#define MIDI_STREAM_OUT_DEVICE_H
+
+
+/*********************************************************************
+ * MIDIStreamOutDevice.h - Interface for CMIDIStreamOutDevice and
+ *                         related classes.
+ *
+ * Note: You must link to the winmm.lib to use these classes.
+ ********************************************************************/
+
+
+#pragma warning(disable:4786) // Disable annoying template warnings
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+#include <mmsystem.h>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the state shared with the header thread
+#include <atomic>
+
+// Necessary for the CMIDIOutDevice exception classes
+#include "MIDIOutDevice.h"
+
+// Necessary for header rings
+#include "SPSCRing.h"
+
+// Necessary for CTimedMsg
+#include "midi.h"
+
+// Necessary for the thread managing headers
+#include "MIDIWorker.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIStreamOutDevice
+    //
+    // This class represents MIDI output devices opened as streams.
+    // Messages are packed into MIDIEVENT buffers and handed to the
+    // driver, which plays them at their time stamps. Several buffers
+    // are used in turn, so one can be filled while the others play.
+    //
+    // Time stamps are in ticks from the start of the stream. The
+    // length of a tick is set with SetTimeDiv and SetTempo. The
+    // stream is paused when opened; call Start to begin playback.
+    //
+    // Errors are reported with the CMIDIOutDevice exception classes.
+    //----------------------------------------------------------------
+
+
+    class CMIDIStreamOutDevice
+    {
+    public:
+        // Default buffer count and number of events per buffer
+        enum { DEFAULT_BUFFER_COUNT  = 3,
+               DEFAULT_BUFFER_EVENTS = 512 };
+
+        // Largest number of events per buffer. midiStreamOut takes
+        // buffers of up to 64K bytes, and each event is 12 bytes.
+        enum { MAX_BUFFER_EVENTS = 0x10000 / (3 * sizeof(DWORD)) };
+
+        // Default ticks per quarter note and microseconds per
+        // quarter note
+        enum { DEFAULT_TIME_DIV = 96,
+               DEFAULT_TEMPO    = 500000 };
+
+        // For constructing a CMIDIStreamOutDevice in a closed state.
+        // BufferCount buffers of BufferEvents events each are used
+        // for passing events to the driver. BufferEvents is kept
+        // between 1 and MAX_BUFFER_EVENTS.
+        CMIDIStreamOutDevice(DWORD BufferCount = DEFAULT_BUFFER_COUNT,
+                             DWORD BufferEvents =
+                                             DEFAULT_BUFFER_EVENTS);
+
+        // Destruction
+        ~CMIDIStreamOutDevice();
+
+        // Opens the MIDI output device as a stream
+        void Open(UINT DeviceId);
+
+        // Closes the MIDI output device. Can be called from another
+        // thread while messages are being sent; waits for the
+        // sending thread to give up.
+        void Close();
+
+        // Starts or resumes playback
+        void Start();
+
+        // Pauses playback. Queued events stay queued.
+        void Pause();
+
+        // Stops playback, throws away queued events and resets the
+        // stream position to zero. Events not yet handed to the
+        // driver are thrown away too, so call this from the thread
+        // sending messages.
+        void Stop();
+
+        // Sets the number of ticks per quarter note
+        void SetTimeDiv(DWORD TimeDiv);
+
+        // Sets the number of microseconds per quarter note
+        void SetTempo(DWORD Tempo);
+
+        // Sends short message straight away, bypassing the stream
+        void SendMsg(DWORD Msg);
+
+        // Queues Count short messages to be played together, right
+        // after the events already queued
+        void SendMsgs(const DWORD *Msgs, std::size_t Count);
+
+        // Queues Count short messages to be played at their time
+        // stamps. Time stamps must not be earlier than those of
+        // events already queued. If every buffer is in use, waits
+        // for the driver to finish with one.
+        void SendMsgs(const CTimedMsg *Msgs, std::size_t Count);
+
+        // Gets the current stream position in ticks
+        DWORD GetPosition();
+
+        // Sets the worker whose thread manages the device's buffers,
+        // such as CMIDIWorker::GetShared(). The worker must outlive 
+        // the device. NULL, the default, gives the device a thread of
+        // its own. Takes effect the next time the device is opened.
+        void SetWorker(CMIDIWorker *Worker);
+
+        // Returns true if the device is open
+        bool IsOpen() const;
+
+        // Gets the number of MIDI output devices on this system
+        static UINT GetNumDevs() { return midiOutGetNumDevs(); }
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIStreamOutDevice(const CMIDIStreamOutDevice &);
+        CMIDIStreamOutDevice &operator = (const CMIDIStreamOutDevice &);
+
+        // Creates the events for signalling the header thread and
+        // the sending thread
+        bool CreateEvents();
+
+        // Creates and destroys the buffers
+        void CreateHeaders();
+        void DestroyHeaders();
+
+        // Sets a stream property
+        void SetProperty(DWORD Property, LPBYTE Data);
+
+        // Queues a single event
+        void QueueEvent(DWORD DeltaTime, DWORD Msg);
+
+        // Hands the buffer being filled, if any, to the driver
+        void Flush();
+
+        // Called by Windows when a MIDI output event occurs
+        static void CALLBACK MidiOutProc(HMIDIOUT MidiOut, UINT Msg,
+                                         DWORD Instance, DWORD Param1,
+                                         DWORD Param2);
+
+        // Called by the worker thread for managing headers
+        static void HeaderProc(void *Parameter);
+
+    // Private class declarations
+    private:
+        // Encapsulates the MIDIHDR structure and event buffer for
+        // MIDI stream output
+        class CMIDIStreamHeader
+        {
+        public:
+            CMIDIStreamHeader(HMIDISTRM DevHandle, DWORD EventCount);
+            ~CMIDIStreamHeader();
+
+            // Empties the buffer
+            void Clear();
+
+            // Adds an event; returns false if the buffer is full
+            bool AddEvent(DWORD DeltaTime, DWORD Msg);
+
+            // Returns true if the buffer holds no events
+            bool IsEmpty() const;
+
+            // Hands the buffer to the driver
+            void StreamOut();
+
+            // Returns true if the device is finished with the header
+            bool IsDone() const;
+
+        private:
+            // Copying and assignment not allowed
+            CMIDIStreamHeader(const CMIDIStreamHeader &);
+            CMIDIStreamHeader &operator = (const CMIDIStreamHeader &);
+
+        private:
+            HMIDISTRM m_DevHandle;
+            MIDIHDR   m_MIDIHdr;
+            DWORD    *m_Events;
+            DWORD     m_EventCount;
+            DWORD     m_Used;
+        };
+
+    // Private attributes and constants
+    private:
+        HMIDISTRM           m_DevHandle;
+        HANDLE              m_Event;
+        HANDLE              m_FreeEvent;
+        CMIDIWorker         m_OwnWorker;
+        CMIDIWorker        *m_Worker;
+        CMIDIWorker        *m_ActiveWorker;
+        CMIDIStreamHeader **m_Headers;
+        DWORD               m_HeaderCount;
+        DWORD               m_BufferEvents;
+        CMIDIStreamHeader  *m_Current;
+        DWORD               m_LastTime;
+        DWORD               m_TimeDiv;
+        DWORD               m_Tempo;
+
+        // Free headers, given back by the header thread
+        CSPSCRing<CMIDIStreamHeader *> m_FreeHeaders;
+
+        // Headers handed to the driver, in order
+        CSPSCRing<CMIDIStreamHeader *> m_QueuedHeaders;
+
+        // Number of threads inside SendMsgs. Close waits for this to
+        // drop to zero before destroying the headers.
+        std::atomic<LONG> m_SenderCount;
+
+        enum State { CLOSED, OPENED };
+        std::atomic<State> m_State;
+    };
+}
+
+
+#endif
@@ -0,0 +1,452 @@
+/*********************************************************************
+ * MIDIThinner.cpp - Implementation for CMIDIThinner and related
+ *                   classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIThinner.h"
+#include "midi.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIThinner;
+using midi::CMIDIOutException;
+
+
+//--------------------------------------------------------------------
+// Constants
+//--------------------------------------------------------------------
+
+
+// Bytes of a packed short message
+const DWORD SHORT_MSG_BYTES = 0xFFFFFF;
+
+// Controllers whose order matters
+const unsigned char ORDERED_CONTROLLERS[] =
+{
+    midi::CC_BANK_SELECT, midi::CC_BANK_SELECT_LSB,
+    midi::CC_DATA_ENTRY, midi::CC_DATA_ENTRY_LSB,
+    midi::CC_DATA_INCREMENT, midi::CC_DATA_DECREMENT,
+    midi::CC_NRPN_LSB, midi::CC_NRPN_MSB,
+    midi::CC_RPN_LSB, midi::CC_RPN_MSB
+};
+
+
+//--------------------------------------------------------------------
+// CMIDIThinner implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIThinner::CMIDIThinner(midi::CMIDIOutDevice &Device, DWORD Window) :
+m_Device(&Device),
+m_Window(Window),
+m_HeldCount(0),
+m_DroppedCount(0),
+m_ErrorCount(0),
+m_TimerId(0)
+{
+    for(std::size_t i = 0; i < SLOT_COUNT; i++)
+    {
+        m_Sent[i] = 0;
+        m_SentTime[i] = 0;
+        m_Held[i] = 0;
+    }
+
+    for(int i = 0; i < 16; i++)
+    {
+        m_ChannelHeldCount[i] = 0;
+    }
+
+    // Continuous controllers are thinned, switches only lose their
+    // duplicates, and the rest are left alone
+    for(int i = 0; i < 128; i++)
+    {
+        if(i >= midi::CC_ALL_SOUND_OFF)
+        {
+            m_Modes[i] = THIN_NONE;
+        }
+        else if(i >= midi::CC_SUSTAIN && i <= midi::CC_HOLD_2)
+        {
+            m_Modes[i] = THIN_DUPLICATES;
+        }
+        else
+        {
+            m_Modes[i] = THIN_BURSTS;
+        }
+    }
+
+    for(std::size_t i = 0; i < sizeof ORDERED_CONTROLLERS; i++)
+    {
+        m_Modes[ORDERED_CONTROLLERS[i]] = THIN_NONE;
+    }
+
+    m_Event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    // If we are unable to create signalling event, throw exception
+    if(m_Event == NULL)
+    {
+        throw CMIDIThinnerEventFailure();
+    }
+
+    ::InitializeCriticalSection(&m_Lock);
+
+    try
+    {
+        // Have the worker thread send held values when the timer
+        // fires
+        m_Worker.Add(m_Event, TimerProc, this);
+    }
+    // If the worker could not take the event, the destructor will
+    // not run, so clean up here and rethrow exception
+    catch(...)
+    {
+        ::DeleteCriticalSection(&m_Lock);
+        ::CloseHandle(m_Event);
+        throw;
+    }
+}
+
+
+// Destructor
+CMIDIThinner::~CMIDIThinner()
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    // Sending the held values also stops the timer
+    SendHeld(ALL_CHANNELS, false);
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    m_Worker.Remove(m_Event);
+
+    ::DeleteCriticalSection(&m_Lock);
+    ::CloseHandle(m_Event);
+}
+
+
+// Sends a short message
+void CMIDIThinner::SendMsg(DWORD Msg)
+{
+    Msg &= SHORT_MSG_BYTES;
+
+    unsigned char Status = static_cast<unsigned char>(Msg);
+    unsigned char Command = Status & ~midi::SHORT_MSG_MASK;
+    unsigned char Channel = Status & midi::SHORT_MSG_MASK;
+    unsigned char Data1 = static_cast<unsigned char>(
+        (Msg >> midi::SHORT_MSG_SHIFT) & midi::DATA_BYTE_MASK);
+    std::size_t Slot = Channel * SLOTS_PER_CHANNEL;
+
+    ::EnterCriticalSection(&m_Lock);
+
+    ControllerMode Mode = THIN_NONE;
+
+    if(Command == midi::CONTROL_CHANGE)
+    {
+        Slot += Data1;
+        Mode = static_cast<ControllerMode>(m_Modes[Data1]);
+    }
+    else if(Command == midi::PITCH_BEND)
+    {
+        Slot += PITCH_BEND_SLOT;
+        Mode = THIN_BURSTS;
+    }
+    else if(Command == midi::CHANNEL_PRESSURE)
+    {
+        Slot += PRESSURE_SLOT;
+        Mode = THIN_BURSTS;
+    }
+
+    try
+    {
+        if(Mode != THIN_NONE)
+        {
+            ThinMsg(Slot, Msg, Mode);
+        }
+        // Anything else goes straight on, after the values held on
+        // its channel
+        else if(Status < midi::SYSTEM_EXCLUSIVE)
+        {
+            if(m_ChannelHeldCount[Channel] > 0)
+            {
+                SendHeld(Channel, false);
+            }
+
+            m_Device->SendMsg(Msg);
+
+            if(Command == midi::CONTROL_CHANGE &&
+               Data1 == midi::CC_RESET_ALL_CONTROLLERS)
+            {
+                ForgetChannel(Channel);
+            }
+        }
+        // A system reset puts every controller back, so what was
+        // sent before it no longer counts
+        else if(Status == midi::SYSTEM_RESET)
+        {
+            SendHeld(ALL_CHANNELS, false);
+            m_Device->SendMsg(Msg);
+
+            for(unsigned char i = 0; i < 16; i++)
+            {
+                ForgetChannel(i);
+            }
+        }
+        else
+        {
+            m_Device->SendMsg(Msg);
+        }
+    }
+    // If sending failed, release the lock and rethrow exception
+    catch(...)
+    {
+        ::LeaveCriticalSection(&m_Lock);
+        throw;
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Sends several short messages
+void CMIDIThinner::SendMsgs(const DWORD *Msgs, std::size_t Count)
+{
+    for(std::size_t i = 0; i < Count; i++)
+    {
+        SendMsg(Msgs[i]);
+    }
+}
+
+
+// Sends every held value
+void CMIDIThinner::Flush()
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    SendHeld(ALL_CHANNELS, false);
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Forgets the values sent
+void CMIDIThinner::Reset()
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    SendHeld(ALL_CHANNELS, false);
+
+    for(unsigned char i = 0; i < 16; i++)
+    {
+        ForgetChannel(i);
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Sets the window
+void CMIDIThinner::SetWindow(DWORD Window)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    m_Window = Window;
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Sets what is done to a controller
+void CMIDIThinner::SetControllerMode(unsigned char Controller,
+                                     ControllerMode Mode)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    m_Modes[Controller & midi::DATA_BYTE_MASK] =
+        static_cast<unsigned char>(Mode);
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Gets the number of messages dropped or replaced
+DWORD CMIDIThinner::GetDroppedCount() const
+{
+    return m_DroppedCount.load(std::memory_order_relaxed);
+}
+
+
+// Gets the number of held values that failed
+DWORD CMIDIThinner::GetErrorCount() const
+{
+    return m_ErrorCount.load(std::memory_order_relaxed);
+}
+
+
+// Thins a message
+void CMIDIThinner::ThinMsg(std::size_t Slot, DWORD Msg,
+                           ControllerMode Mode)
+{
+    // If a value is already held back, the new one replaces it. If
+    // the new one is the value last sent, it is dropped when the
+    // window is over.
+    if(m_Held[Slot] != 0)
+    {
+        m_Held[Slot] = Msg;
+        m_DroppedCount.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // Drop duplicates
+    if(Msg == m_Sent[Slot])
+    {
+        m_DroppedCount.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    DWORD Now = ::timeGetTime();
+
+    // Hold the value back if this controller was sent too recently
+    if(Mode == THIN_BURSTS && m_Window > 0 && m_Sent[Slot] != 0 &&
+       Now - m_SentTime[Slot] < m_Window)
+    {
+        HoldSlot(Slot, Msg);
+    }
+    else
+    {
+        std::size_t Channel = Slot / SLOTS_PER_CHANNEL;
+
+        // Values held on the channel go first
+        if(m_ChannelHeldCount[Channel] > 0)
+        {
+            SendHeld(static_cast<unsigned char>(Channel), false);
+        }
+
+        SendSlot(Slot, Msg, Now);
+    }
+}
+
+
+// Sends a message and remembers it
+void CMIDIThinner::SendSlot(std::size_t Slot, DWORD Msg, DWORD Now)
+{
+    m_Device->SendMsg(Msg);
+
+    m_Sent[Slot] = Msg;
+    m_SentTime[Slot] = Now;
+}
+
+
+// Holds a message back
+void CMIDIThinner::HoldSlot(std::size_t Slot, DWORD Msg)
+{
+    // Make sure the held value will be sent
+    if(m_TimerId == 0)
+    {
+        UINT Period = m_Window / 2 > 0 ? m_Window / 2 : 1;
+
+        m_TimerId = ::timeSetEvent(Period, 1,
+                            reinterpret_cast<LPTIMECALLBACK>(m_Event),
+                            0, TIME_PERIODIC | TIME_CALLBACK_EVENT_SET);
+
+        // If we are unable to start the timer, throw exception
+        if(m_TimerId == 0)
+        {
+            throw CMIDIThinnerTimerFailure();
+        }
+    }
+
+    m_Held[Slot] = Msg;
+    m_HeldSlots[m_HeldCount] = static_cast<WORD>(Slot);
+    m_HeldCount++;
+    m_ChannelHeldCount[Slot / SLOTS_PER_CHANNEL]++;
+}
+
+
+// Sends held values
+void CMIDIThinner::SendHeld(unsigned char Channel, bool Due)
+{
+    DWORD Now = ::timeGetTime();
+    std::size_t Kept = 0;
+
+    for(std::size_t i = 0; i < m_HeldCount; i++)
+    {
+        std::size_t Slot = m_HeldSlots[i];
+        std::size_t SlotChannel = Slot / SLOTS_PER_CHANNEL;
+
+        // Keep the values that are not to be sent yet, in order
+        if((Channel != ALL_CHANNELS && SlotChannel != Channel) ||
+           (Due && Now - m_SentTime[Slot] < m_Window))
+        {
+            m_HeldSlots[Kept] = m_HeldSlots[i];
+            Kept++;
+            continue;
+        }
+
+        DWORD Msg = m_Held[Slot];
+
+        m_Held[Slot] = 0;
+        m_ChannelHeldCount[SlotChannel]--;
+
+        // The controller went back to the value last sent
+        if(Msg == m_Sent[Slot])
+        {
+            m_DroppedCount.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        // The caller may not be the one that sent the value, so
+        // failures are counted
+        try
+        {
+            SendSlot(Slot, Msg, Now);
+        }
+        catch(const CMIDIOutException &)
+        {
+            m_ErrorCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    m_HeldCount = Kept;
+
+    // Nothing left to wait for
+    if(m_HeldCount == 0 && m_TimerId != 0)
+    {
+        ::timeKillEvent(m_TimerId);
+        m_TimerId = 0;
+    }
+}
+
+
+// Forgets the values sent on a channel
+void CMIDIThinner::ForgetChannel(unsigned char Channel)
+{
+    std::size_t First = Channel * SLOTS_PER_CHANNEL;
+
+    for(std::size_t i = First; i < First + SLOTS_PER_CHANNEL; i++)
+    {
+        m_Sent[i] = 0;
+    }
+}
+
+
+// Called by the worker thread when the timer fires
+void CMIDIThinner::TimerProc(void *Parameter)
+{
+    CMIDIThinner *Thinner = static_cast<CMIDIThinner *>(Parameter);
+
+    ::EnterCriticalSection(&Thinner->m_Lock);
+
+    Thinner->SendHeld(ALL_CHANNELS, true);
+
+    ::LeaveCriticalSection(&Thinner->m_Lock);
+}
\ No newline at end of file
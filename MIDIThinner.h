@@ -0,0 +1,221 @@
+#ifndef MIDI_THINNER_H
+#define MIDI_THINNER_H
+
+
+/*********************************************************************
+ * MIDIThinner.h - Interface for CMIDIThinner and related classes.
+ *
+ * Note: You must link to the winmm.lib to use these classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+#include <mmsystem.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+// Necessary for the counts read from any thread
+#include <atomic>
+
+// Necessary for CMIDIOutDevice
+#include "MIDIOutDevice.h"
+
+// Necessary for the thread sending held values
+#include "MIDIWorker.h"
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIThinner exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when a CMIDIThinner is unable to create a signalling
+    // event
+    class CMIDIThinnerEventFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to create a signalling event for "
+                 "CMIDIThinner object."; }
+    };
+
+
+    // Thrown when a CMIDIThinner is unable to start its timer
+    class CMIDIThinnerTimerFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to start timer for CMIDIThinner object."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIThinner
+    //
+    // Sits in front of a CMIDIOutDevice and keeps dense controller
+    // data from flooding a slow port. Send short messages through it
+    // instead of straight to the device.
+    //
+    // The last control change, pitch bend and channel pressure sent
+    // on each channel are remembered, and a message that would set
+    // the same value again is dropped. When the same controller
+    // changes again within the window of the last time it was sent,
+    // the new value is held back, replacing any value already held,
+    // and sent when the window is over. So each controller is sent at
+    // most once per window, and the last value of a burst is always
+    // sent. Held values on a channel are sent before any other
+    // message on that channel, so they never arrive after the notes
+    // that follow them.
+    //
+    // Switch controllers such as the sustain pedal only have their
+    // duplicates dropped, and controllers whose order matters, such
+    // as bank select and the parameter numbers, are passed straight
+    // on. SetControllerMode changes this.
+    //
+    // Held values are sent from a worker thread, so any errors there
+    // are counted rather than thrown.
+    //----------------------------------------------------------------
+
+
+    class CMIDIThinner
+    {
+    public:
+        // What is done to a controller
+        enum ControllerMode
+        {
+            // Passed straight on
+            THIN_NONE,
+
+            // Values the same as the last one sent are dropped
+            THIN_DUPLICATES,
+
+            // Duplicates are dropped, and values changing within the
+            // window are held back and only the last one sent
+            THIN_BURSTS
+        };
+
+        // Default window in milliseconds
+        enum { DEFAULT_WINDOW = 10 };
+
+        // Construction. Window is in milliseconds; zero only drops
+        // duplicates. The device must outlive the thinner.
+        explicit CMIDIThinner(CMIDIOutDevice &Device,
+                              DWORD Window = DEFAULT_WINDOW);
+
+        // Destruction. Sends any values still held.
+        ~CMIDIThinner();
+
+        // Sends a short message, or drops or holds it back
+        void SendMsg(DWORD Msg);
+
+        // Sends Count short messages in order
+        void SendMsgs(const DWORD *Msgs, std::size_t Count);
+
+        // Sends every value held back
+        void Flush();
+
+        // Forgets the values sent, so that the next value of every
+        // controller is sent whatever it is. Held values are sent
+        // first. Call it after the device has been reopened or reset.
+        void Reset();
+
+        // Sets the window in milliseconds
+        void SetWindow(DWORD Window);
+
+        // Sets what is done to a controller. Pitch bend and channel
+        // pressure are always thinned like THIN_BURSTS controllers.
+        void SetControllerMode(unsigned char Controller,
+                               ControllerMode Mode);
+
+        // Gets the number of messages dropped or replaced
+        DWORD GetDroppedCount() const;
+
+        // Gets the number of held values the device failed to send
+        DWORD GetErrorCount() const;
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIThinner(const CMIDIThinner &);
+        CMIDIThinner &operator = (const CMIDIThinner &);
+
+        // Thins a control change, pitch bend or channel pressure
+        void ThinMsg(std::size_t Slot, DWORD Msg, ControllerMode Mode);
+
+        // Sends a message and remembers it
+        void SendSlot(std::size_t Slot, DWORD Msg, DWORD Now);
+
+        // Holds a message back
+        void HoldSlot(std::size_t Slot, DWORD Msg);
+
+        // Sends the held values of a channel, or of every channel if
+        // Channel is ALL_CHANNELS. If Due is true, only values whose
+        // window is over are sent.
+        void SendHeld(unsigned char Channel, bool Due);
+
+        // Forgets the values sent on a channel
+        void ForgetChannel(unsigned char Channel);
+
+        // Called by the worker thread when the timer fires
+        static void TimerProc(void *Parameter);
+
+    // Private attributes and constants
+    private:
+        // Each channel has a slot for every controller, then one
+        // for pitch bend and one for channel pressure
+        enum
+        {
+            PITCH_BEND_SLOT = 128,
+            PRESSURE_SLOT = 129,
+            SLOTS_PER_CHANNEL = 130,
+            SLOT_COUNT = 16 * SLOTS_PER_CHANNEL
+        };
+
+        // Means every channel to SendHeld
+        enum { ALL_CHANNELS = 16 };
+
+        CMIDIOutDevice *m_Device;
+        DWORD           m_Window;
+
+        // Last message sent for each slot, or zero, and when
+        DWORD           m_Sent[SLOT_COUNT];
+        DWORD           m_SentTime[SLOT_COUNT];
+
+        // Message held back for each slot, or zero
+        DWORD           m_Held[SLOT_COUNT];
+
+        // Slots with a message held back, in the order they were
+        // first held, and the number held on each channel
+        WORD            m_HeldSlots[SLOT_COUNT];
+        std::size_t     m_HeldCount;
+        WORD            m_ChannelHeldCount[16];
+
+        unsigned char   m_Modes[128];
+
+        std::atomic<DWORD> m_DroppedCount;
+        std::atomic<DWORD> m_ErrorCount;
+
+        // Periodic timer running while values are held, the event it
+        // signals, and the worker that waits for it
+        UINT            m_TimerId;
+        HANDLE          m_Event;
+        CMIDIWorker     m_Worker;
+
+        CRITICAL_SECTION m_Lock;
+    };
+}
+
+
+#endif
\ No newline at end of file
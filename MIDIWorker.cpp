@@ -0,0 +1,276 @@
+/*********************************************************************
+ * MIDIWorker.cpp - Implementation for CMIDIWorker.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+#include "MIDIWorker.h"
+
+
+//--------------------------------------------------------------------
+// Using declarations
+//--------------------------------------------------------------------
+
+
+using midi::CMIDIWorker;
+
+
+//--------------------------------------------------------------------
+// CMIDIWorker implementation
+//--------------------------------------------------------------------
+
+
+// Constructor
+CMIDIWorker::CMIDIWorker() :
+m_Thread(NULL),
+m_Stop(false),
+m_ClientCount(0)
+{
+    m_Control = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    // If we are unable to create signalling event, throw exception
+    if(m_Control == NULL)
+    {
+        throw CMIDIWorkerEventFailure();
+    }
+
+    ::InitializeCriticalSection(&m_Lock);
+    ::InitializeCriticalSection(&m_ChangeLock);
+}
+
+
+// Destructor
+CMIDIWorker::~CMIDIWorker()
+{
+    // Every event should have been removed by now, but make sure the
+    // thread does not outlive us
+    if(m_Thread != NULL)
+    {
+        Stop();
+    }
+
+    ::DeleteCriticalSection(&m_ChangeLock);
+    ::DeleteCriticalSection(&m_Lock);
+    ::CloseHandle(m_Control);
+}
+
+
+// Adds an event to wait for
+void CMIDIWorker::Add(HANDLE Event, Handler Func, void *Context)
+{
+    ::EnterCriticalSection(&m_ChangeLock);
+    ::EnterCriticalSection(&m_Lock);
+
+    // If there is no room for another event, throw exception
+    if(m_ClientCount == MAX_EVENTS)
+    {
+        ::LeaveCriticalSection(&m_Lock);
+        ::LeaveCriticalSection(&m_ChangeLock);
+        throw CMIDIWorkerFull();
+    }
+
+    CClient Client = { Event, Func, Context };
+
+    m_Clients[m_ClientCount] = Client;
+    m_ClientCount++;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    if(m_Thread == NULL)
+    {
+        try
+        {
+            Start();
+        }
+        // If the thread could not be started, forget the event and
+        // rethrow exception
+        catch(const CMIDIWorkerThreadFailure &)
+        {
+            m_ClientCount--;
+            ::LeaveCriticalSection(&m_ChangeLock);
+            throw;
+        }
+    }
+    else
+    {
+        // Have the thread start waiting for the new event
+        ::SetEvent(m_Control);
+    }
+
+    ::LeaveCriticalSection(&m_ChangeLock);
+}
+
+
+// Removes an event
+void CMIDIWorker::Remove(HANDLE Event)
+{
+    ::EnterCriticalSection(&m_ChangeLock);
+
+    // Taking the lock waits for a handler that is running to finish
+    ::EnterCriticalSection(&m_Lock);
+
+    for(DWORD i = 0; i < m_ClientCount; i++)
+    {
+        if(m_Clients[i].Event == Event)
+        {
+            m_ClientCount--;
+            m_Clients[i] = m_Clients[m_ClientCount];
+            break;
+        }
+    }
+
+    bool IsIdle = (m_ClientCount == 0);
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    // Stop the thread once there is nothing left to wait for,
+    // otherwise have it stop waiting for the event
+    if(IsIdle && m_Thread != NULL)
+    {
+        Stop();
+    }
+    else
+    {
+        ::SetEvent(m_Control);
+    }
+
+    ::LeaveCriticalSection(&m_ChangeLock);
+}
+
+
+// Gets the number of events being waited for
+std::size_t CMIDIWorker::GetEventCount() const
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    std::size_t Count = m_ClientCount;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Count;
+}
+
+
+// Gets the shared worker
+CMIDIWorker &CMIDIWorker::GetShared()
+{
+    static CMIDIWorker Shared;
+
+    return Shared;
+}
+
+
+// Starts the worker thread
+void CMIDIWorker::Start()
+{
+    m_Stop.store(false, std::memory_order_relaxed);
+
+    DWORD Dummy;
+
+    m_Thread = ::CreateThread(NULL, 0, WorkerProc, this, 0, &Dummy);
+
+    // If we are unable to create the thread, throw exception
+    if(m_Thread == NULL)
+    {
+        throw CMIDIWorkerThreadFailure();
+    }
+}
+
+
+// Stops the worker thread and waits for it to finish
+void CMIDIWorker::Stop()
+{
+    m_Stop.store(true, std::memory_order_release);
+    ::SetEvent(m_Control);
+
+    ::WaitForSingleObject(m_Thread, INFINITE);
+    ::CloseHandle(m_Thread);
+    m_Thread = NULL;
+}
+
+
+// Copies the handles to wait for
+DWORD CMIDIWorker::GetHandles(HANDLE *Handles)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    // The control event comes first so that changes are never held
+    // up by busy devices
+    Handles[0] = m_Control;
+
+    for(DWORD i = 0; i < m_ClientCount; i++)
+    {
+        Handles[i + 1] = m_Clients[i].Event;
+    }
+
+    DWORD Count = m_ClientCount + 1;
+
+    ::LeaveCriticalSection(&m_Lock);
+
+    return Count;
+}
+
+
+// Calls the handler for an event
+void CMIDIWorker::Service(HANDLE Event)
+{
+    ::EnterCriticalSection(&m_Lock);
+
+    // The event may have been removed since the handles were copied
+    for(DWORD i = 0; i < m_ClientCount; i++)
+    {
+        if(m_Clients[i].Event == Event)
+        {
+            m_Clients[i].Func(m_Clients[i].Context);
+            break;
+        }
+    }
+
+    ::LeaveCriticalSection(&m_Lock);
+}
+
+
+// Worker thread
+DWORD CMIDIWorker::WorkerProc(LPVOID Parameter)
+{
+    CMIDIWorker *Worker;
+
+    Worker = reinterpret_cast<CMIDIWorker *>(Parameter);
+
+    HANDLE Handles[MAXIMUM_WAIT_OBJECTS];
+
+    // Continue until asked to stop
+    while(!Worker->m_Stop.load(std::memory_order_acquire))
+    {
+        DWORD Count = Worker->GetHandles(Handles);
+
+        DWORD Result = ::WaitForMultipleObjects(Count, Handles, FALSE,
+                                                INFINITE);
+
+        // Anything but the control event is a client's event
+        if(Result > WAIT_OBJECT_0 && Result < WAIT_OBJECT_0 + Count)
+        {
+            DWORD First = Result - WAIT_OBJECT_0;
+
+            Worker->Service(Handles[First]);
+
+            // The wait only reports the first signalled event, so
+            // check the ones after it too. This serves every ready
+            // client in one wake up and keeps busy clients early in
+            // the list from starving the rest.
+            for(DWORD i = First + 1; i < Count; i++)
+            {
+                if(::WaitForSingleObject(Handles[i], 0) == WAIT_OBJECT_0)
+                {
+                    Worker->Service(Handles[i]);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,159 @@
+#ifndef MIDI_WORKER_H
+#define MIDI_WORKER_H
+
+
+/*********************************************************************
+ * MIDIWorker.h - Interface for CMIDIWorker and related classes.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for Windows data types
+#include <windows.h>
+
+// Necessary for exception classes derived from std::exception
+#include <exception>
+
+// Necessary for the stop flag shared with the worker thread
+#include <atomic>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // CMIDIWorker exception classes
+    //----------------------------------------------------------------
+
+
+    // Thrown when a CMIDIWorker is unable to create a signalling
+    // event
+    class CMIDIWorkerEventFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to create a signalling event for "
+                 "CMIDIWorker object."; }
+    };
+
+
+    // Thrown when a CMIDIWorker is unable to create its thread
+    class CMIDIWorkerThreadFailure : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "Unable to create worker thread for CMIDIWorker "
+                 "object."; }
+    };
+
+
+    // Thrown when a CMIDIWorker is already waiting for as many events
+    // as it can
+    class CMIDIWorkerFull : public std::exception
+    {
+    public:
+        const char *what() const throw()
+        { return "CMIDIWorker object cannot wait for any more "
+                 "events."; }
+    };
+
+
+    //----------------------------------------------------------------
+    // CMIDIWorker
+    //
+    // A thread that waits for a set of events and calls a handler
+    // each time one of them is signalled. The MIDI device classes use
+    // one to manage their headers. By default each device has a
+    // worker of its own, but one worker can serve many devices; see
+    // GetShared.
+    //
+    // The thread is started when the first event is added and is
+    // stopped and joined when the last one is removed. Handlers are
+    // called on the worker thread, one at a time.
+    //----------------------------------------------------------------
+
+
+    class CMIDIWorker
+    {
+    public:
+        // Function called when an event is signalled
+        typedef void (*Handler)(void *Context);
+
+        // Largest number of events one worker can wait for
+        enum { MAX_EVENTS = MAXIMUM_WAIT_OBJECTS - 1 };
+
+        CMIDIWorker();
+        ~CMIDIWorker();
+
+        // Calls Func with Context each time Event is signalled. Event
+        // should be an auto-reset event.
+        void Add(HANDLE Event, Handler Func, void *Context);
+
+        // Stops waiting for Event. Once this returns, its handler is
+        // not running and will not be called again. Must not be
+        // called from a handler.
+        void Remove(HANDLE Event);
+
+        // Gets the number of events being waited for
+        std::size_t GetEventCount() const;
+
+        // Gets a worker shared by every device asked to use it
+        static CMIDIWorker &GetShared();
+
+    // Private methods
+    private:
+        // Copying and assignment not allowed
+        CMIDIWorker(const CMIDIWorker &);
+        CMIDIWorker &operator = (const CMIDIWorker &);
+
+        // Starts and stops the worker thread
+        void Start();
+        void Stop();
+
+        // Copies the handles to wait for. Returns the handle count.
+        DWORD GetHandles(HANDLE *Handles);
+
+        // Calls the handler for Event, if it is still being waited for
+        void Service(HANDLE Event);
+
+        // Thread function
+        static DWORD WINAPI WorkerProc(LPVOID Parameter);
+
+    // Private class declarations
+    private:
+        // An event and its handler
+        struct CClient
+        {
+            HANDLE   Event;
+            Handler  Func;
+            void    *Context;
+        };
+
+    // Private attributes and constants
+    private:
+        // Wakes the thread when the set of events changes
+        HANDLE m_Control;
+
+        HANDLE m_Thread;
+        std::atomic<bool> m_Stop;
+
+        // Guards the clients; held while a handler runs
+        mutable CRITICAL_SECTION m_Lock;
+
+        // Serializes Add and Remove, including starting and stopping
+        // the thread
+        CRITICAL_SECTION m_ChangeLock;
+
+        CClient m_Clients[MAX_EVENTS];
+        DWORD   m_ClientCount;
+    };
+}
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,238 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+
+/*********************************************************************
+ * SPSCRing.h - Interface and implementation for CSPSCRing.
+ *
+ * Note: CSPSCRing is a template, so its implementation lives here
+ *       rather than in a separate .cpp file.
+ ********************************************************************/
+
+
+//--------------------------------------------------------------------
+// Dependencies
+//--------------------------------------------------------------------
+
+
+// Necessary for the indices shared between producer and consumer
+#include <atomic>
+
+// Necessary for std::size_t
+#include <cstddef>
+
+
+namespace midi
+{
+    //----------------------------------------------------------------
+    // Constants
+    //----------------------------------------------------------------
+
+
+    // Size of a processor cache line. Used for keeping data written
+    // by different threads on different cache lines.
+    const std::size_t CACHE_LINE_SIZE = 64;
+
+
+    //----------------------------------------------------------------
+    // CSPSCRing
+    //
+    // A fixed capacity, lock-free ring buffer for passing items from
+    // exactly one producer thread to exactly one consumer thread.
+    // The capacity is rounded up to the next power of two. Storage is
+    // allocated once at construction; Push and Pop never allocate or
+    // block.
+    //
+    // Push and IsFull may only be called by the producer. Pop, Front
+    // and PopFront may only be called by the consumer. IsEmpty and
+    // GetSize may be called by either, but are only exact when called
+    // by the consumer.
+    //----------------------------------------------------------------
+
+
+    template<class T>
+    class CSPSCRing
+    {
+    public:
+        explicit CSPSCRing(std::size_t Capacity);
+        ~CSPSCRing();
+
+        // Adds an item to the ring. Returns false if the ring is full.
+        bool Push(const T &Item);
+
+        // Removes an item from the ring. Returns false if the ring is
+        // empty.
+        bool Pop(T &Item);
+
+        // Returns the oldest item in the ring without removing it, or
+        // NULL if the ring is empty
+        T *Front();
+
+        // Discards the oldest item in the ring. The ring must not be
+        // empty.
+        void PopFront();
+
+        bool IsEmpty() const;
+        bool IsFull() const;
+
+        // Gets the number of items currently in the ring
+        std::size_t GetSize() const;
+
+        // Gets the number of items the ring can hold
+        std::size_t GetCapacity() const { return m_Mask + 1; }
+
+    private:
+        // Copying and assignment not allowed
+        CSPSCRing(const CSPSCRing &);
+        CSPSCRing &operator = (const CSPSCRing &);
+
+        // Rounds Capacity up to the next power of two
+        static std::size_t RoundCapacity(std::size_t Capacity);
+
+    private:
+        // Written by the consumer
+        std::atomic<std::size_t> m_Head;
+        char m_HeadPad[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+
+        // Written by the producer
+        std::atomic<std::size_t> m_Tail;
+        char m_TailPad[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+
+        // Read-only after construction
+        const std::size_t m_Mask;
+        T *m_Items;
+    };
+
+
+    //----------------------------------------------------------------
+    // CSPSCRing implementation
+    //----------------------------------------------------------------
+
+
+    // Constructor
+    template<class T>
+    CSPSCRing<T>::CSPSCRing(std::size_t Capacity) :
+    m_Head(0),
+    m_Tail(0),
+    m_Mask(RoundCapacity(Capacity) - 1),
+    m_Items(new T[m_Mask + 1])
+    {
+    }
+
+
+    // Destructor
+    template<class T>
+    CSPSCRing<T>::~CSPSCRing()
+    {
+        delete [] m_Items;
+    }
+
+
+    // Adds an item to the ring
+    template<class T>
+    bool CSPSCRing<T>::Push(const T &Item)
+    {
+        const std::size_t Tail = m_Tail.load(std::memory_order_relaxed);
+
+        // If the ring is full, the item cannot be added
+        if(Tail - m_Head.load(std::memory_order_acquire) > m_Mask)
+        {
+            return false;
+        }
+
+        m_Items[Tail & m_Mask] = Item;
+
+        // Publish the item to the consumer
+        m_Tail.store(Tail + 1, std::memory_order_release);
+
+        return true;
+    }
+
+
+    // Removes an item from the ring
+    template<class T>
+    bool CSPSCRing<T>::Pop(T &Item)
+    {
+        T *Oldest = Front();
+
+        // If the ring is empty, there is nothing to remove
+        if(Oldest == NULL)
+        {
+            return false;
+        }
+
+        Item = *Oldest;
+        PopFront();
+
+        return true;
+    }
+
+
+    // Gets the oldest item in the ring
+    template<class T>
+    T *CSPSCRing<T>::Front()
+    {
+        const std::size_t Head = m_Head.load(std::memory_order_relaxed);
+
+        if(Head == m_Tail.load(std::memory_order_acquire))
+        {
+            return NULL;
+        }
+
+        return &m_Items[Head & m_Mask];
+    }
+
+
+    // Discards the oldest item in the ring
+    template<class T>
+    void CSPSCRing<T>::PopFront()
+    {
+        const std::size_t Head = m_Head.load(std::memory_order_relaxed);
+
+        // Hand the slot back to the producer
+        m_Head.store(Head + 1, std::memory_order_release);
+    }
+
+
+    // Determines if the ring is empty
+    template<class T>
+    bool CSPSCRing<T>::IsEmpty() const
+    {
+        return (GetSize() == 0);
+    }
+
+
+    // Determines if the ring is full
+    template<class T>
+    bool CSPSCRing<T>::IsFull() const
+    {
+        return (GetSize() > m_Mask);
+    }
+
+
+    // Gets the number of items in the ring
+    template<class T>
+    std::size_t CSPSCRing<T>::GetSize() const
+    {
+        return m_Tail.load(std::memory_order_acquire) -
+               m_Head.load(std::memory_order_acquire);
+    }
+
+
+    // Rounds capacity up to the next power of two
+    template<class T>
+    std::size_t CSPSCRing<T>::RoundCapacity(std::size_t Capacity)
+    {
+        std::size_t Result = 1;
+
+        while(Result < Capacity)
+        {
+            Result <<= 1;
+        }
+
+        return Result;
+    }
+}
+
+
+#endif
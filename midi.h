@@ -80,6 +80,187 @@ namespace midi
     //
     const unsigned char SHORT_MSG_MASK = 15;
     const unsigned char SHORT_MSG_SHIFT = 8;
+
+    // Mask for the seven bits a data byte can use
+    const unsigned char DATA_BYTE_MASK = 0x7F;
+
+    //
+    // Controller numbers for Control Change messages
+    //
+    const unsigned char CC_BANK_SELECT = 0;
+    const unsigned char CC_MODULATION = 1;
+    const unsigned char CC_DATA_ENTRY = 6;
+    const unsigned char CC_EXPRESSION = 11;
+    const unsigned char CC_BANK_SELECT_LSB = 32;
+    const unsigned char CC_DATA_ENTRY_LSB = 38;
+    const unsigned char CC_SUSTAIN = 64;
+    const unsigned char CC_SOSTENUTO = 66;
+    const unsigned char CC_SOFT_PEDAL = 67;
+    const unsigned char CC_HOLD_2 = 69;
+    const unsigned char CC_DATA_INCREMENT = 96;
+    const unsigned char CC_DATA_DECREMENT = 97;
+    const unsigned char CC_NRPN_LSB = 98;
+    const unsigned char CC_NRPN_MSB = 99;
+    const unsigned char CC_RPN_LSB = 100;
+    const unsigned char CC_RPN_MSB = 101;
+    const unsigned char CC_ALL_SOUND_OFF = 120;
+    const unsigned char CC_RESET_ALL_CONTROLLERS = 121;
+    const unsigned char CC_ALL_NOTES_OFF = 123;
+
+
+    //----------------------------------------------------------------
+    // Types
+    //----------------------------------------------------------------
+
+
+    // A packed short message together with its time stamp. The units
+    // of the time stamp depend on where the message is used; for 
+    // CMIDIInDevice they are milliseconds since recording started.
+    struct CTimedMsg
+    {
+        unsigned long Msg;
+        unsigned long TimeStamp;
+    };
+
+
+    //----------------------------------------------------------------
+    // CShortMsg
+    //
+    // A packed short message, laid out the way midiOutShortMsg and 
+    // MIM_DATA expect: status in the low byte, then the first and 
+    // second data bytes. Everything is inline and constexpr, so 
+    // messages with constant parts are built at compile time, and 
+    // nothing branches. Data bytes are masked to seven bits and 
+    // channels to four, so a CShortMsg never carries a stray status 
+    // bit in its data.
+    //----------------------------------------------------------------
+
+
+    class CShortMsg
+    {
+    public:
+        // Constructs an empty message
+        constexpr CShortMsg() : m_Msg(0) {}
+
+        // Wraps an already packed message
+        explicit constexpr CShortMsg(unsigned long Msg) : m_Msg(Msg) {}
+
+        // Packs a status byte and its data bytes
+        constexpr CShortMsg(unsigned char Status, 
+                            unsigned char DataByte1,
+                            unsigned char DataByte2 = 0) :
+        m_Msg(Status | 
+              (static_cast<unsigned long>(DataByte1 & DATA_BYTE_MASK) 
+                                                 << SHORT_MSG_SHIFT) |
+              (static_cast<unsigned long>(DataByte2 & DATA_BYTE_MASK) 
+                                             << SHORT_MSG_SHIFT * 2))
+        {}
+
+        // Packs a channel message. Command is one of the command 
+        // values, such as NOTE_ON; Channel is 0 to 15.
+        static constexpr CShortMsg ChannelMsg(
+                                         unsigned char Command,
+                                         unsigned char Channel,
+                                         unsigned char DataByte1,
+                                         unsigned char DataByte2 = 0)
+        {
+            return CShortMsg(static_cast<unsigned char>(
+                                 (Command & ~SHORT_MSG_MASK) | 
+                                 (Channel & SHORT_MSG_MASK)),
+                             DataByte1, DataByte2);
+        }
+
+        static constexpr CShortMsg NoteOn(unsigned char Channel,
+                                          unsigned char Note,
+                                          unsigned char Velocity)
+        { return ChannelMsg(NOTE_ON, Channel, Note, Velocity); }
+
+        static constexpr CShortMsg NoteOff(unsigned char Channel,
+                                           unsigned char Note,
+                                           unsigned char Velocity = 0)
+        { return ChannelMsg(NOTE_OFF, Channel, Note, Velocity); }
+
+        static constexpr CShortMsg ControlChange(
+                                         unsigned char Channel,
+                                         unsigned char Controller,
+                                         unsigned char Value)
+        {
+            return ChannelMsg(CONTROL_CHANGE, Channel, Controller, 
+                              Value);
+        }
+
+        static constexpr CShortMsg ProgramChange(unsigned char Channel,
+                                                 unsigned char Program)
+        { return ChannelMsg(PROGRAM_CHANGE, Channel, Program); }
+
+        // Value is 0 to 16383, with 8192 meaning no bend
+        static constexpr CShortMsg PitchBend(unsigned char Channel,
+                                             unsigned short Value)
+        {
+            return ChannelMsg(PITCH_BEND, Channel,
+                              static_cast<unsigned char>(Value),
+                              static_cast<unsigned char>(Value >> 7));
+        }
+
+        // Gets the packed message
+        constexpr unsigned long GetMsg() const { return m_Msg; }
+
+        constexpr unsigned char GetStatus() const
+        { return static_cast<unsigned char>(m_Msg); }
+
+        // Gets the command value of a channel message
+        constexpr unsigned char GetCommand() const
+        {
+            return static_cast<unsigned char>(m_Msg & 0xFF & 
+                                              ~SHORT_MSG_MASK);
+        }
+
+        // Gets the channel of a channel message
+        constexpr unsigned char GetChannel() const
+        { return static_cast<unsigned char>(m_Msg & SHORT_MSG_MASK); }
+
+        constexpr unsigned char GetData1() const
+        { return static_cast<unsigned char>(m_Msg >> SHORT_MSG_SHIFT); }
+
+        constexpr unsigned char GetData2() const
+        {
+            return static_cast<unsigned char>(m_Msg >> 
+                                              SHORT_MSG_SHIFT * 2);
+        }
+
+        // Determines if this is a channel message, 0x80 to 0xEF
+        constexpr bool IsChannelMsg() const
+        {
+            return ((m_Msg & 0xF0) - NOTE_OFF) < 
+                   static_cast<unsigned long>(SYSTEM_EXCLUSIVE - 
+                                              NOTE_OFF);
+        }
+
+        constexpr bool operator == (CShortMsg Other) const
+        { return m_Msg == Other.m_Msg; }
+
+        constexpr bool operator != (CShortMsg Other) const
+        { return m_Msg != Other.m_Msg; }
+
+    private:
+        unsigned long m_Msg;
+    };
+
+
+    // A CShortMsg can stand in for a packed message anywhere
+    static_assert(sizeof(CShortMsg) == sizeof(unsigned long),
+                  "CShortMsg must be the size of a packed message");
+
+    // Check the layout at compile time
+    static_assert(CShortMsg::NoteOn(1, 60, 100).GetMsg() == 0x643C91,
+                  "CShortMsg packs bytes in the wrong order");
+    static_assert(CShortMsg(0x643C91UL).GetData2() == 100,
+                  "CShortMsg unpacks bytes in the wrong order");
+    static_assert(CShortMsg::PitchBend(0, 8192).GetMsg() == 0x4000E0,
+                  "CShortMsg packs pitch bend values wrongly");
+    static_assert(!CShortMsg(TIMING_CLOCK, 0).IsChannelMsg(),
+                  "CShortMsg mistakes system messages for channel "
+                  "messages");
 }
 
 